@@ -25,6 +25,378 @@
  #error C++ compiler is required
 #endif // __cplusplus
 
+#if (defined _MSC_VER && _MSC_VER >= 1900) || __cplusplus >= 201103L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Value returned by BTCountFormatArgs() for malformed format string.
+#define BTFORMAT_INVALID ((size_t)-1)
+
+/// Count {} placeholders in format string at compile time.
+constexpr size_t BTCountFormatArgs(const char* pszFormat, size_t nNumArgs = 0) {
+	return *pszFormat == '\0' ? nNumArgs :
+		*pszFormat == '{' ? (pszFormat[1] == '{' ? BTCountFormatArgs(pszFormat + 2, nNumArgs) :
+			pszFormat[1] == '}' ? BTCountFormatArgs(pszFormat + 2, nNumArgs + 1) : BTFORMAT_INVALID) :
+		*pszFormat == '}' ? (pszFormat[1] == '}' ? BTCountFormatArgs(pszFormat + 2, nNumArgs) : BTFORMAT_INVALID) :
+		BTCountFormatArgs(pszFormat + 1, nNumArgs);
+}
+
+/// Format string validated at compile time, use BT_FMT() to create it.
+template <size_t nNumArgs>
+class BTFormat {
+public:
+	/// Initialize the object.
+	explicit BTFormat(const char* pszFormat) : m_pszFormat(pszFormat) {
+		static_assert(nNumArgs != BTFORMAT_INVALID, "Malformed format string: use {} for arguments and {{ or }} for braces");
+	}
+
+	/// Get format string.
+	const char* GetFormat(void) const {
+		return m_pszFormat;
+	}
+
+private:
+	/// Format string.
+	const char* m_pszFormat;
+};
+
+/// Create format string validated at compile time.
+#define BT_FMT(pszFormat) BTFormat<BTCountFormatArgs(pszFormat)>(pszFormat)
+
+/// Serializes log entry arguments straight to UTF-8.
+class BTTraceWriter {
+public:
+	/// Initialize the object.
+	BTTraceWriter(void) {
+		m_pszBuffer = m_szStaticBuffer;
+		m_nLength = 0;
+		m_nSize = sizeof(m_szStaticBuffer);
+	}
+
+	/// Destroy the object.
+	~BTTraceWriter(void) {
+		if (m_pszBuffer != m_szStaticBuffer)
+			free(m_pszBuffer);
+	}
+
+	/// Get entry text.
+	const char* GetText(void) const {
+		return m_pszBuffer;
+	}
+
+	/// Get entry length in bytes.
+	DWORD GetLength(void) const {
+		return (DWORD)m_nLength;
+	}
+
+	/// Write UTF-8 text.
+	void WriteText(const char* pchText, size_t nLength) {
+		if (Reserve(nLength)) {
+			memcpy(m_pszBuffer + m_nLength, pchText, nLength);
+			m_nLength += nLength;
+		}
+	}
+
+	/// Write boolean value.
+	void WriteValue(bool bValue) {
+		if (bValue)
+			WriteText("true", 4);
+		else
+			WriteText("false", 5);
+	}
+
+	/// Write character.
+	void WriteValue(char chValue) {
+		WriteText(&chValue, 1);
+	}
+
+	/// Write character.
+	void WriteValue(wchar_t chValue) {
+		WriteValue(&chValue, 1);
+	}
+
+	/// Write number.
+	void WriteValue(signed char nValue) {
+		WriteSigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(unsigned char nValue) {
+		WriteUnsigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(short nValue) {
+		WriteSigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(unsigned short nValue) {
+		WriteUnsigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(int nValue) {
+		WriteSigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(unsigned int nValue) {
+		WriteUnsigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(long nValue) {
+		WriteSigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(unsigned long nValue) {
+		WriteUnsigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(long long nValue) {
+		WriteSigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(unsigned long long nValue) {
+		WriteUnsigned(nValue);
+	}
+
+	/// Write number.
+	void WriteValue(double dblValue) {
+		char szValue[32];
+		int nLength = sprintf_s(szValue, sizeof(szValue), "%g", dblValue);
+		if (nLength > 0)
+			WriteText(szValue, nLength);
+	}
+
+	/// Write UTF-8 string.
+	void WriteValue(const char* pszValue) {
+		if (pszValue != NULL)
+			WriteText(pszValue, strlen(pszValue));
+		else
+			WriteText("(null)", 6);
+	}
+
+	/// Write UTF-8 string.
+	void WriteValue(char* pszValue) {
+		WriteValue((const char*)pszValue);
+	}
+
+	/// Write Unicode string.
+	void WriteValue(const wchar_t* pszValue) {
+		if (pszValue != NULL)
+			WriteValue(pszValue, wcslen(pszValue));
+		else
+			WriteText("(null)", 6);
+	}
+
+	/// Write Unicode string.
+	void WriteValue(wchar_t* pszValue) {
+		WriteValue((const wchar_t*)pszValue);
+	}
+
+	/// Write pointer value.
+	void WriteValue(const void* pValue) {
+		char szValue[2 + sizeof(pValue) * 2];
+		char* pchValue = szValue + sizeof(szValue);
+		UINT_PTR uValue = (UINT_PTR)pValue;
+		for (size_t nDigit = 0; nDigit < sizeof(pValue) * 2; ++nDigit) {
+			*--pchValue = "0123456789ABCDEF"[uValue & 0xF];
+			uValue >>= 4;
+		}
+		*--pchValue = 'x';
+		*--pchValue = '0';
+		WriteText(szValue, sizeof(szValue));
+	}
+
+	/// Write pointer value.
+	template <typename TYPE>
+	void WriteValue(TYPE* pValue) {
+		WriteValue((const void*)pValue);
+	}
+
+	/// Write format string and arguments.
+	template <typename TYPE, typename... ARGS>
+	void WriteFormat(const char* pszFormat, const TYPE& rValue, const ARGS&... args) {
+		// Format string was validated by BT_FMT(), so every placeholder has an argument.
+		pszFormat = WriteLiteral(pszFormat);
+		WriteValue(rValue);
+		WriteFormat(pszFormat + 2, args...);
+	}
+
+	/// Write the rest of format string.
+	void WriteFormat(const char* pszFormat) {
+		WriteLiteral(pszFormat);
+	}
+
+private:
+	/// Prevent object from being accidentally copied.
+	BTTraceWriter(const BTTraceWriter& rWriter);
+	/// Prevent object from being accidentally copied.
+	BTTraceWriter& operator=(const BTTraceWriter& rWriter);
+
+	/// Write literal text up to the next placeholder.
+	const char* WriteLiteral(const char* pszFormat) {
+		for (;;) {
+			const char* pszStart = pszFormat;
+			while (*pszFormat != '\0' && *pszFormat != '{' && *pszFormat != '}')
+				++pszFormat;
+			WriteText(pszStart, pszFormat - pszStart);
+			if (*pszFormat == '\0' || pszFormat[1] != *pszFormat)
+				return pszFormat;
+			// Escaped brace.
+			WriteText(pszFormat, 1);
+			pszFormat += 2;
+		}
+	}
+
+	/// Write signed number.
+	void WriteSigned(long long nValue) {
+		if (nValue < 0) {
+			WriteText("-", 1);
+			WriteUnsigned(0ull - (unsigned long long)nValue);
+		} else {
+			WriteUnsigned((unsigned long long)nValue);
+		}
+	}
+
+	/// Write unsigned number.
+	void WriteUnsigned(unsigned long long nValue) {
+		char szValue[20];
+		char* pchValue = szValue + sizeof(szValue);
+		do {
+			*--pchValue = (char)('0' + nValue % 10);
+			nValue /= 10;
+		} while (nValue != 0);
+		WriteText(pchValue, szValue + sizeof(szValue) - pchValue);
+	}
+
+	/// Write Unicode characters.
+	void WriteValue(const wchar_t* pchValue, size_t nLength) {
+		if (! Reserve(nLength * 4))
+			return;
+		unsigned char* pbBuffer = (unsigned char*)m_pszBuffer + m_nLength;
+		for (size_t nPosition = 0; nPosition < nLength; ++nPosition) {
+			unsigned int uChar = (unsigned int)pchValue[nPosition];
+			if (uChar >= 0xD800 && uChar < 0xDC00 && nPosition + 1 < nLength) {
+				unsigned int uLowChar = (unsigned int)pchValue[nPosition + 1];
+				if (uLowChar >= 0xDC00 && uLowChar < 0xE000) {
+					uChar = 0x10000 + ((uChar - 0xD800) << 10) + (uLowChar - 0xDC00);
+					++nPosition;
+				}
+			}
+			if (uChar < 0x80) {
+				*pbBuffer++ = (unsigned char)uChar;
+			} else if (uChar < 0x800) {
+				*pbBuffer++ = (unsigned char)(0xC0 | (uChar >> 6));
+				*pbBuffer++ = (unsigned char)(0x80 | (uChar & 0x3F));
+			} else if (uChar < 0x10000) {
+				*pbBuffer++ = (unsigned char)(0xE0 | (uChar >> 12));
+				*pbBuffer++ = (unsigned char)(0x80 | ((uChar >> 6) & 0x3F));
+				*pbBuffer++ = (unsigned char)(0x80 | (uChar & 0x3F));
+			} else {
+				// Surrogate pair takes two input characters.
+				*pbBuffer++ = (unsigned char)(0xF0 | (uChar >> 18));
+				*pbBuffer++ = (unsigned char)(0x80 | ((uChar >> 12) & 0x3F));
+				*pbBuffer++ = (unsigned char)(0x80 | ((uChar >> 6) & 0x3F));
+				*pbBuffer++ = (unsigned char)(0x80 | (uChar & 0x3F));
+			}
+		}
+		m_nLength = (char*)pbBuffer - m_pszBuffer;
+	}
+
+	/// Make sure buffer can hold additional data.
+	bool Reserve(size_t nLength) {
+		if (m_nLength + nLength < m_nSize)
+			return true;
+		size_t nSize = m_nSize * 2;
+		while (nSize <= m_nLength + nLength)
+			nSize *= 2;
+		char* pszBuffer = (char*)malloc(nSize);
+		if (pszBuffer == NULL)
+			return false;
+		memcpy(pszBuffer, m_pszBuffer, m_nLength);
+		if (m_pszBuffer != m_szStaticBuffer)
+			free(m_pszBuffer);
+		m_pszBuffer = pszBuffer;
+		m_nSize = nSize;
+		return true;
+	}
+
+	/// Entry buffer.
+	char* m_pszBuffer;
+	/// Length of entry text.
+	size_t m_nLength;
+	/// Size of entry buffer.
+	size_t m_nSize;
+	/// Pre-allocated entry buffer.
+	char m_szStaticBuffer[512];
+};
+
+/// Log entry built with stream operators, the entry is written when the object is destroyed.
+class BTTraceEntry {
+public:
+	/// Initialize the object.
+	BTTraceEntry(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, bool bInsert) {
+		m_iHandle = iHandle;
+		m_dwCategory = dwCategory;
+		m_eLogLevel = eLogLevel;
+		m_bInsert = bInsert;
+	}
+
+	/// Take ownership of the entry that wasn't filled yet.
+	BTTraceEntry(BTTraceEntry&& rEntry) {
+		m_iHandle = rEntry.m_iHandle;
+		m_dwCategory = rEntry.m_dwCategory;
+		m_eLogLevel = rEntry.m_eLogLevel;
+		m_bInsert = rEntry.m_bInsert;
+		m_Writer.WriteText(rEntry.m_Writer.GetText(), rEntry.m_Writer.GetLength());
+		rEntry.m_iHandle = NULL;
+	}
+
+	/// Write the entry to the log.
+	~BTTraceEntry(void) {
+		if (m_iHandle != NULL) {
+			if (m_bInsert)
+				BT_InsLogEntryExUTF8(m_iHandle, m_dwCategory, m_eLogLevel, m_Writer.GetText(), m_Writer.GetLength());
+			else
+				BT_AppLogEntryExUTF8(m_iHandle, m_dwCategory, m_eLogLevel, m_Writer.GetText(), m_Writer.GetLength());
+		}
+	}
+
+	/// Add value to the entry, values of filtered entry are ignored.
+	template <typename TYPE>
+	BTTraceEntry& operator<<(const TYPE& rValue) {
+		if (m_iHandle != NULL)
+			m_Writer.WriteValue(rValue);
+		return *this;
+	}
+
+private:
+	/// Prevent object from being accidentally copied.
+	BTTraceEntry(const BTTraceEntry& rEntry);
+	/// Prevent object from being accidentally copied.
+	BTTraceEntry& operator=(const BTTraceEntry& rEntry);
+
+	/// Log file handle.
+	INT_PTR m_iHandle;
+	/// Entry category.
+	DWORD m_dwCategory;
+	/// Log level.
+	BUGTRAP_LOGLEVEL m_eLogLevel;
+	/// True if entry is inserted into the beginning of the log.
+	bool m_bInsert;
+	/// Entry text.
+	BTTraceWriter m_Writer;
+};
+
+#endif
+
 /// C++ wrapper for tracing API.
 class BTTrace {
 public:
@@ -36,12 +408,14 @@ public:
 	/// Initialize the object.
 	BTTrace(INT_PTR iHandle) {
 		m_eDefaultLogLevel = BTLL_INFO;
+		m_dwCategory = BTLC_NONE;
 		m_iHandle = iHandle;
 	}
 
 	/// Initialize the object.
 	BTTrace(LPCTSTR pszLogFileName, BUGTRAP_LOGFORMAT eLogFormat) {
 		m_eDefaultLogLevel = BTLL_INFO;
+		m_dwCategory = BTLC_NONE;
 		m_iHandle = BT_OpenLogFile(pszLogFileName, eLogFormat);
 	}
 
@@ -56,6 +430,23 @@ public:
 		return (m_iHandle = BT_OpenLogFile(pszLogFileName, eLogFormat));
 	}
 
+	/// Open log file with the given set of log flags.
+	INT_PTR Open(LPCTSTR pszLogFileName, BUGTRAP_LOGFORMAT eLogFormat, DWORD dwLogFlags) {
+		Close();
+		return (m_iHandle = BT_OpenLogFileEx(pszLogFileName, eLogFormat, dwLogFlags));
+	}
+
+	/// Open log tee that forwards entries to attached log files.
+	INT_PTR OpenTee(void) {
+		Close();
+		return (m_iHandle = BT_OpenLogTee());
+	}
+
+	/// Attach log file to the tee opened by this object.
+	BOOL AddTeeFile(INT_PTR iHandle) const {
+		return BT_AddLogTeeFile(m_iHandle, iHandle);
+	}
+
 	/// Attach log file handle.
 	void Attach(INT_PTR iHandle) {
 		m_iHandle = iHandle;
@@ -64,6 +455,7 @@ public:
 	/// Detach log file handle.
 	void Detach(void) {
 		m_eDefaultLogLevel = BTLL_INFO;
+		m_dwCategory = BTLC_NONE;
 		m_iHandle = NULL;
 	}
 
@@ -89,6 +481,17 @@ public:
 		m_eDefaultLogLevel = eDefaultLogLevel;
 	}
 
+	/// Get category of entries written by this object.
+	DWORD GetCategory(void) const {
+		return m_dwCategory;
+	}
+
+	/// Set category of entries written by this object, e.g. SetCategory(_T("net")).
+	BOOL SetCategory(LPCTSTR pszCategory) {
+		m_dwCategory = pszCategory != NULL ? BT_GetLogCategory(m_iHandle, pszCategory) : BTLC_NONE;
+		return (pszCategory == NULL || m_dwCategory != BTLC_NONE);
+	}
+
 	/// Flush contents of the log file.
 	BOOL Flush(void) const {
 		return BT_FlushLogFile(m_iHandle);
@@ -124,6 +527,66 @@ public:
 		return BT_SetLogSizeInBytes(m_iHandle, dwSize);
 	}
 
+	/// Get size of log buffer in bytes.
+	DWORD GetLogBufferSize(void) const {
+		return BT_GetLogBufferSize(m_iHandle);
+	}
+
+	/// Set size of log buffer in bytes.
+	BOOL SetLogBufferSize(DWORD dwSize) const {
+		return BT_SetLogBufferSize(m_iHandle, dwSize);
+	}
+
+	/// Get maximum age of log segment in minutes.
+	DWORD GetLogSegmentTime(void) const {
+		return BT_GetLogSegmentTime(m_iHandle);
+	}
+
+	/// Set maximum age of log segment in minutes.
+	BOOL SetLogSegmentTime(DWORD dwTime) const {
+		return BT_SetLogSegmentTime(m_iHandle, dwTime);
+	}
+
+	/// Get number of kept log segments.
+	DWORD GetLogSegmentCount(void) const {
+		return BT_GetLogSegmentCount(m_iHandle);
+	}
+
+	/// Set number of kept log segments.
+	BOOL SetLogSegmentCount(DWORD dwCount) const {
+		return BT_SetLogSegmentCount(m_iHandle, dwCount);
+	}
+
+	/// Get conditions of automatic flush.
+	BOOL GetLogFlushPolicy(PDWORD pdwEntries, PDWORD pdwDelay, PDWORD pdwBytes) const {
+		return BT_GetLogFlushPolicy(m_iHandle, pdwEntries, pdwDelay, pdwBytes);
+	}
+
+	/// Set conditions of automatic flush.
+	BOOL SetLogFlushPolicy(DWORD dwEntries, DWORD dwDelay, DWORD dwBytes) const {
+		return BT_SetLogFlushPolicy(m_iHandle, dwEntries, dwDelay, dwBytes);
+	}
+
+	/// Get maximum number of entries per second written from one call site.
+	DWORD GetLogRateLimit(void) const {
+		return BT_GetLogRateLimit(m_iHandle);
+	}
+
+	/// Set maximum number of entries per second written from one call site.
+	BOOL SetLogRateLimit(DWORD dwRateLimit) const {
+		return BT_SetLogRateLimit(m_iHandle, dwRateLimit);
+	}
+
+	/// Get sample rate of log entries.
+	DWORD GetLogSampleRate(void) const {
+		return BT_GetLogSampleRate(m_iHandle);
+	}
+
+	/// Set sample rate of log entries.
+	BOOL SetLogSampleRate(DWORD dwSampleRate) const {
+		return BT_SetLogSampleRate(m_iHandle, dwSampleRate);
+	}
+
 	/// Return current set of log flags.
 	DWORD GetLogFlags(void) const {
 		return BT_GetLogFlags(m_iHandle);
@@ -144,6 +607,21 @@ public:
 		return BT_SetLogLevel(m_iHandle, eLogLevel);
 	}
 
+	/// Assign levels to categories of log entries, e.g. "net=VERBOSE, db=WARNING".
+	BOOL SetCategoryLevels(LPCTSTR pszCategoryLevels) const {
+		return BT_SetLogCategoryLevels(m_iHandle, pszCategoryLevels);
+	}
+
+	/// Return true if entry of this level passes the log filter, the check doesn't lock the log.
+	bool IsLogLevelEnabled(BUGTRAP_LOGLEVEL eLogLevel) const {
+		return (BT_IsLogLevelEnabled(m_iHandle, m_dwCategory, eLogLevel) != FALSE);
+	}
+
+	/// Return true if default log level passes the log filter.
+	bool IsLogLevelEnabled(void) const {
+		return IsLogLevelEnabled(m_eDefaultLogLevel);
+	}
+
 	/// Get log echo mode.
 	DWORD GetLogEchoMode(void) const {
 		return BT_GetLogEchoMode(m_iHandle);
@@ -159,11 +637,21 @@ public:
 		return BT_ClearLog(m_iHandle);
 	}
 
+	/// Pass the newest entries that match the filter to the callback in chronological order.
+	BOOL Query(BUGTRAP_LOGLEVEL eMinLogLevel, BUGTRAP_LOGLEVEL eMaxLogLevel, DWORD dwMaxEntries, BT_LogEntryCallback pfnCallback, INT_PTR nQueryParam) const {
+		return BT_QueryLogEntries(m_iHandle, eMinLogLevel, eMaxLogLevel, NULL, NULL, dwMaxEntries, pfnCallback, nQueryParam);
+	}
+
+	/// Pass the newest entries of the time range that match the filter to the callback in chronological order.
+	BOOL Query(BUGTRAP_LOGLEVEL eMinLogLevel, BUGTRAP_LOGLEVEL eMaxLogLevel, const FILETIME* pftStartTime, const FILETIME* pftEndTime, DWORD dwMaxEntries, BT_LogEntryCallback pfnCallback, INT_PTR nQueryParam) const {
+		return BT_QueryLogEntries(m_iHandle, eMinLogLevel, eMaxLogLevel, pftStartTime, pftEndTime, dwMaxEntries, pfnCallback, nQueryParam);
+	}
+
 	/// Insert entry into the beginning of custom log file.
 	BOOL InsertF(BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszFormat, ...) const {
 		va_list argList;
 		va_start(argList, pszFormat);
-		BOOL bResult = BT_InsLogEntryV(m_iHandle, eLogLevel, pszFormat, argList);
+		BOOL bResult = BT_InsLogEntryExV(m_iHandle, m_dwCategory, eLogLevel, pszFormat, argList);
 		va_end(argList);
 		return bResult;
 	}
@@ -172,36 +660,36 @@ public:
 	BOOL InsertF(LPCTSTR pszFormat, ...) const {
 		va_list argList;
 		va_start(argList, pszFormat);
-		BOOL bResult = BT_InsLogEntryV(m_iHandle, m_eDefaultLogLevel, pszFormat, argList);
+		BOOL bResult = BT_InsLogEntryExV(m_iHandle, m_dwCategory, m_eDefaultLogLevel, pszFormat, argList);
 		va_end(argList);
 		return bResult;
 	}
 
 	/// Insert entry into the beginning of custom log file.
 	BOOL InsertV(BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszFormat, va_list argList) const {
-		return BT_InsLogEntryV(m_iHandle, eLogLevel, pszFormat, argList);
+		return BT_InsLogEntryExV(m_iHandle, m_dwCategory, eLogLevel, pszFormat, argList);
 	}
 
 	/// Insert entry into the beginning of custom log file.
 	BOOL InsertV(LPCTSTR pszFormat, va_list argList) const {
-		return BT_InsLogEntryV(m_iHandle, m_eDefaultLogLevel, pszFormat, argList);
+		return BT_InsLogEntryExV(m_iHandle, m_dwCategory, m_eDefaultLogLevel, pszFormat, argList);
 	}
 
 	/// Insert entry into the beginning of custom log file.
 	BOOL Insert(BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszEntry) const {
-		return BT_InsLogEntry(m_iHandle, eLogLevel, pszEntry);
+		return BT_InsLogEntryEx(m_iHandle, m_dwCategory, eLogLevel, pszEntry);
 	}
 
 	/// Insert entry into the beginning of custom log file.
 	BOOL Insert(LPCTSTR pszEntry) const {
-		return BT_InsLogEntry(m_iHandle, m_eDefaultLogLevel, pszEntry);
+		return BT_InsLogEntryEx(m_iHandle, m_dwCategory, m_eDefaultLogLevel, pszEntry);
 	}
 
 	/// Append entry to the end of custom log file.
 	BOOL AppendF(BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszFormat, ...) const {
 		va_list argList;
 		va_start(argList, pszFormat);
-		BOOL bResult = BT_AppLogEntryV(m_iHandle, eLogLevel, pszFormat, argList);
+		BOOL bResult = BT_AppLogEntryExV(m_iHandle, m_dwCategory, eLogLevel, pszFormat, argList);
 		va_end(argList);
 		return bResult;
 	}
@@ -210,31 +698,89 @@ public:
 	BOOL AppendF(LPCTSTR pszFormat, ...) const {
 		va_list argList;
 		va_start(argList, pszFormat);
-		BOOL bResult = BT_AppLogEntryV(m_iHandle, m_eDefaultLogLevel, pszFormat, argList);
+		BOOL bResult = BT_AppLogEntryExV(m_iHandle, m_dwCategory, m_eDefaultLogLevel, pszFormat, argList);
 		va_end(argList);
 		return bResult;
 	}
 
 	/// Append entry to the end of custom log file.
 	BOOL AppendV(BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszFormat, va_list argList) const {
-		return BT_AppLogEntryV(m_iHandle, eLogLevel, pszFormat, argList);
+		return BT_AppLogEntryExV(m_iHandle, m_dwCategory, eLogLevel, pszFormat, argList);
 	}
 
 	/// Append entry to the end of custom log file.
 	BOOL AppendV(LPCTSTR pszFormat, va_list argList) const {
-		return BT_AppLogEntryV(m_iHandle, m_eDefaultLogLevel, pszFormat, argList);
+		return BT_AppLogEntryExV(m_iHandle, m_dwCategory, m_eDefaultLogLevel, pszFormat, argList);
 	}
 
 	/// Append entry to the end of custom log file.
 	BOOL Append(BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszEntry) const {
-		return BT_AppLogEntry(m_iHandle, eLogLevel, pszEntry);
+		return BT_AppLogEntryEx(m_iHandle, m_dwCategory, eLogLevel, pszEntry);
 	}
 
 	/// Append entry to the end of custom log file.
 	BOOL Append(LPCTSTR pszEntry) const {
-		return BT_AppLogEntry(m_iHandle, m_eDefaultLogLevel, pszEntry);
+		return BT_AppLogEntryEx(m_iHandle, m_dwCategory, m_eDefaultLogLevel, pszEntry);
+	}
+
+#if (defined _MSC_VER && _MSC_VER >= 1900) || __cplusplus >= 201103L
+	/// Insert entry built from compile-time checked format string, e.g. Insert(BTLL_INFO, BT_FMT("x = {}"), x).
+	template <size_t nNumArgs, typename... ARGS>
+	BOOL Insert(BUGTRAP_LOGLEVEL eLogLevel, const BTFormat<nNumArgs>& rFormat, const ARGS&... args) const {
+		static_assert(nNumArgs == sizeof...(ARGS), "Number of arguments doesn't match format string");
+		// Arguments aren't serialized if the entry is filtered out.
+		if (! IsLogLevelEnabled(eLogLevel))
+			return TRUE;
+		BTTraceWriter Writer;
+		Writer.WriteFormat(rFormat.GetFormat(), args...);
+		return BT_InsLogEntryExUTF8(m_iHandle, m_dwCategory, eLogLevel, Writer.GetText(), Writer.GetLength());
+	}
+
+	/// Insert entry built from compile-time checked format string.
+	template <size_t nNumArgs, typename... ARGS>
+	BOOL Insert(const BTFormat<nNumArgs>& rFormat, const ARGS&... args) const {
+		return Insert(m_eDefaultLogLevel, rFormat, args...);
 	}
 
+	/// Append entry built from compile-time checked format string, e.g. Append(BTLL_INFO, BT_FMT("x = {}"), x).
+	template <size_t nNumArgs, typename... ARGS>
+	BOOL Append(BUGTRAP_LOGLEVEL eLogLevel, const BTFormat<nNumArgs>& rFormat, const ARGS&... args) const {
+		static_assert(nNumArgs == sizeof...(ARGS), "Number of arguments doesn't match format string");
+		// Arguments aren't serialized if the entry is filtered out.
+		if (! IsLogLevelEnabled(eLogLevel))
+			return TRUE;
+		BTTraceWriter Writer;
+		Writer.WriteFormat(rFormat.GetFormat(), args...);
+		return BT_AppLogEntryExUTF8(m_iHandle, m_dwCategory, eLogLevel, Writer.GetText(), Writer.GetLength());
+	}
+
+	/// Append entry built from compile-time checked format string.
+	template <size_t nNumArgs, typename... ARGS>
+	BOOL Append(const BTFormat<nNumArgs>& rFormat, const ARGS&... args) const {
+		return Append(m_eDefaultLogLevel, rFormat, args...);
+	}
+
+	/// Insert entry built with stream operators, e.g. InsertEntry(BTLL_INFO) << "x = " << x.
+	BTTraceEntry InsertEntry(BUGTRAP_LOGLEVEL eLogLevel) const {
+		return BTTraceEntry(IsLogLevelEnabled(eLogLevel) ? m_iHandle : NULL, m_dwCategory, eLogLevel, true);
+	}
+
+	/// Insert entry built with stream operators.
+	BTTraceEntry InsertEntry(void) const {
+		return BTTraceEntry(IsLogLevelEnabled(m_eDefaultLogLevel) ? m_iHandle : NULL, m_dwCategory, m_eDefaultLogLevel, true);
+	}
+
+	/// Append entry built with stream operators, e.g. AppendEntry(BTLL_INFO) << "x = " << x.
+	BTTraceEntry AppendEntry(BUGTRAP_LOGLEVEL eLogLevel) const {
+		return BTTraceEntry(IsLogLevelEnabled(eLogLevel) ? m_iHandle : NULL, m_dwCategory, eLogLevel, false);
+	}
+
+	/// Append entry built with stream operators.
+	BTTraceEntry AppendEntry(void) const {
+		return BTTraceEntry(IsLogLevelEnabled(m_eDefaultLogLevel) ? m_iHandle : NULL, m_dwCategory, m_eDefaultLogLevel, false);
+	}
+#endif
+
 private:
 	/// Prevent object from being accidentally copied.
 	BTTrace(const BTTrace& rTrace);
@@ -245,6 +791,44 @@ private:
 	INT_PTR m_iHandle;
 	/// Default log level.
 	BUGTRAP_LOGLEVEL m_eDefaultLogLevel;
+	/// Category of entries written by this object.
+	DWORD m_dwCategory;
 };
 
+/// Most verbose level written by BTTRACE macros, define it before including BTTrace.h to compile out other levels.
+#ifndef BTTRACE_MAX_LEVEL
+ #define BTTRACE_MAX_LEVEL BTLL_VERBOSE
+#endif
+
+/**
+ * @brief Append printf-style entry, e.g. BTTRACE(trace, BTLL_INFO, _T("x = %d"), x).
+ * Arguments aren't evaluated if the entry is filtered out, and the statement
+ * is removed by the compiler if the level is above @a BTTRACE_MAX_LEVEL.
+ */
+#define BTTRACE(rTrace, eLogLevel, ...) \
+	do { \
+		if ((eLogLevel) <= BTTRACE_MAX_LEVEL && (rTrace).IsLogLevelEnabled(eLogLevel)) \
+			(rTrace).AppendF((eLogLevel), __VA_ARGS__); \
+	} while (0)
+
+/// Append error entry.
+#define BTTRACE_ERROR(rTrace, ...)     BTTRACE(rTrace, BTLL_ERROR, __VA_ARGS__)
+/// Append warning entry.
+#define BTTRACE_WARNING(rTrace, ...)   BTTRACE(rTrace, BTLL_WARNING, __VA_ARGS__)
+/// Append important entry.
+#define BTTRACE_IMPORTANT(rTrace, ...) BTTRACE(rTrace, BTLL_IMPORTANT, __VA_ARGS__)
+/// Append information entry.
+#define BTTRACE_INFO(rTrace, ...)      BTTRACE(rTrace, BTLL_INFO, __VA_ARGS__)
+/// Append verbose entry.
+#define BTTRACE_VERBOSE(rTrace, ...)   BTTRACE(rTrace, BTLL_VERBOSE, __VA_ARGS__)
+
+#if (defined _MSC_VER && _MSC_VER >= 1900) || __cplusplus >= 201103L
+/// Append entry built from compile-time checked format string, e.g. BTTRACE_FMT(trace, BTLL_INFO, BT_FMT("x = {}"), x).
+#define BTTRACE_FMT(rTrace, eLogLevel, ...) \
+	do { \
+		if ((eLogLevel) <= BTTRACE_MAX_LEVEL) \
+			(rTrace).Append((eLogLevel), __VA_ARGS__); \
+	} while (0)
+#endif
+
 #endif // _BTTRACE_H_
@@ -0,0 +1,705 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Log file with deferred formatting.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "BinaryLogFile.h"
+#include "FileStream.h"
+#include "Encoding.h"
+#include "TextFormat.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+/**
+ * @param rFormatInfo - format description.
+ * @param eArgType - argument type.
+ * @return true if argument was added.
+ */
+BOOL CBinaryLogFile::AddArgType(CFormatInfo& rFormatInfo, ARG_TYPE eArgType)
+{
+	if (rFormatInfo.m_dwNumArgs >= MAX_ARGS)
+		return FALSE;
+	rFormatInfo.m_arrArgTypes[rFormatInfo.m_dwNumArgs++] = (BYTE)eArgType;
+	rFormatInfo.m_dwArgsSize += GetSlotSize(eArgType);
+	return TRUE;
+}
+
+/**
+ * @param pszFormat - format string.
+ * @param rFormatInfo - format description.
+ * @return true if arguments of this format may be stored in binary form.
+ */
+BOOL CBinaryLogFile::ParseFormat(PCTSTR pszFormat, CFormatInfo& rFormatInfo)
+{
+	enum ARG_SIZE { AS_DEFAULT, AS_SHORT, AS_LONG, AS_LONGDOUBLE, AS_INT64, AS_POINTER };
+	rFormatInfo.m_dwNumArgs = 0;
+	rFormatInfo.m_dwArgsSize = 0;
+	PCTSTR pszPosition = pszFormat;
+	for (;;)
+	{
+		TCHAR chValue = *pszPosition++;
+		if (chValue == _T('\0'))
+			return TRUE;
+		if (chValue != _T('%'))
+			continue;
+		if (*pszPosition == _T('%'))
+		{
+			++pszPosition;
+			continue;
+		}
+		PCTSTR pszSpec = pszPosition - 1;
+		while (*pszPosition != _T('\0') && _tcschr(_T("-+ #0"), *pszPosition) != NULL)
+			++pszPosition;
+		if (*pszPosition == _T('*'))
+		{
+			if (! AddArgType(rFormatInfo, AT_INT))
+				return FALSE;
+			++pszPosition;
+		}
+		else
+		{
+			while (_istdigit(*pszPosition))
+				++pszPosition;
+		}
+		if (*pszPosition == _T('.'))
+		{
+			++pszPosition;
+			if (*pszPosition == _T('*'))
+			{
+				if (! AddArgType(rFormatInfo, AT_INT))
+					return FALSE;
+				++pszPosition;
+			}
+			else
+			{
+				while (_istdigit(*pszPosition))
+					++pszPosition;
+			}
+		}
+		ARG_SIZE eArgSize = AS_DEFAULT;
+		switch (*pszPosition)
+		{
+		case _T('h'):
+			++pszPosition;
+			if (*pszPosition == _T('h'))
+				++pszPosition;
+			eArgSize = AS_SHORT;
+			break;
+		case _T('l'):
+			++pszPosition;
+			if (*pszPosition == _T('l'))
+			{
+				++pszPosition;
+				eArgSize = AS_INT64;
+			}
+			else
+				eArgSize = AS_LONG;
+			break;
+		case _T('w'):
+			++pszPosition;
+			eArgSize = AS_LONG;
+			break;
+		case _T('L'):
+			++pszPosition;
+			eArgSize = AS_LONGDOUBLE;
+			break;
+		case _T('j'):
+			++pszPosition;
+			eArgSize = AS_INT64;
+			break;
+		case _T('z'):
+		case _T('t'):
+			++pszPosition;
+			eArgSize = AS_POINTER;
+			break;
+		case _T('I'):
+			++pszPosition;
+			if (pszPosition[0] == _T('6') && pszPosition[1] == _T('4'))
+			{
+				pszPosition += 2;
+				eArgSize = AS_INT64;
+			}
+			else if (pszPosition[0] == _T('3') && pszPosition[1] == _T('2'))
+				pszPosition += 2;
+			else
+				eArgSize = AS_POINTER;
+			break;
+		}
+		ARG_TYPE eArgType;
+		switch (*pszPosition)
+		{
+		case _T('d'):
+		case _T('i'):
+		case _T('o'):
+		case _T('u'):
+		case _T('x'):
+		case _T('X'):
+			if (eArgSize == AS_LONGDOUBLE)
+				return FALSE;
+			eArgType = eArgSize == AS_INT64 ? AT_INT64 : eArgSize == AS_POINTER ? AT_POINTER : AT_INT;
+			break;
+		case _T('c'):
+		case _T('C'):
+			eArgType = AT_INT;
+			break;
+		case _T('e'):
+		case _T('E'):
+		case _T('f'):
+		case _T('F'):
+		case _T('g'):
+		case _T('G'):
+		case _T('a'):
+		case _T('A'):
+			// long double has the same size as double.
+			eArgType = AT_DOUBLE;
+			break;
+		case _T('p'):
+			eArgType = AT_POINTER;
+			break;
+		case _T('s'):
+		case _T('S'):
+			if (eArgSize == AS_SHORT)
+				eArgType = AT_STRINGA;
+			else if (eArgSize == AS_LONG)
+				eArgType = AT_STRINGW;
+			else if (eArgSize != AS_DEFAULT)
+				return FALSE;
+#ifdef _UNICODE
+			else
+				eArgType = *pszPosition == _T('s') ? AT_STRINGW : AT_STRINGA;
+#else
+			else
+				eArgType = *pszPosition == _T('s') ? AT_STRINGA : AT_STRINGW;
+#endif
+			break;
+		default:
+			// %n, %Z and malformed specifications are formatted immediately.
+			return FALSE;
+		}
+		++pszPosition;
+		// Specification is copied to fixed size buffer when entry is rendered.
+		if (pszPosition - pszSpec > MAX_SPEC_LENGTH)
+			return FALSE;
+		if (! AddArgType(rFormatInfo, eArgType))
+			return FALSE;
+	}
+}
+
+/**
+ * @param pszFormat - format string.
+ * @return format id or INVALID_FORMAT_ID if format string can't be registered.
+ */
+DWORD CBinaryLogFile::AddFormat(PCTSTR pszFormat)
+{
+	DWORD dwFormatId = (DWORD)m_arrFormats.GetCount();
+	if (dwFormatId >= MAX_FORMATS)
+		return INVALID_FORMAT_ID;
+	CFormatInfo FormatInfo;
+	size_t nFormatSize = _tcslen(pszFormat) + 1;
+	FormatInfo.m_pszFormat = new TCHAR[nFormatSize];
+	if (FormatInfo.m_pszFormat == NULL)
+		return INVALID_FORMAT_ID;
+	_tcscpy_s(FormatInfo.m_pszFormat, nFormatSize, pszFormat);
+	FormatInfo.m_bDeferred = ParseFormat(pszFormat, FormatInfo);
+	m_arrFormats.AddItem(FormatInfo);
+	return dwFormatId;
+}
+
+/**
+ * @param pszFormat - format string.
+ * @return format id or INVALID_FORMAT_ID if entry has to be formatted immediately.
+ */
+DWORD CBinaryLogFile::GetFormatId(PCTSTR pszFormat)
+{
+	// Format strings are usually literals, so they are looked up by address
+	// and compared to the stored copy in case the buffer was reused.
+	DWORD* pdwFormatId = m_hashFormatIds.Lookup((UINT_PTR)pszFormat);
+	if (pdwFormatId == NULL || _tcscmp(m_arrFormats[*pdwFormatId].m_pszFormat, pszFormat) != 0)
+	{
+		DWORD dwFormatId = AddFormat(pszFormat);
+		if (dwFormatId == INVALID_FORMAT_ID)
+			return INVALID_FORMAT_ID;
+		m_hashFormatIds.SetAt((UINT_PTR)pszFormat, dwFormatId);
+		pdwFormatId = m_hashFormatIds.Lookup((UINT_PTR)pszFormat);
+		_ASSERTE(pdwFormatId != NULL);
+	}
+	return (m_arrFormats[*pdwFormatId].m_bDeferred ? *pdwFormatId : INVALID_FORMAT_ID);
+}
+
+void CBinaryLogFile::FreeFormats(void)
+{
+	size_t nNumFormats = m_arrFormats.GetCount();
+	for (size_t nFormatPos = 0; nFormatPos < nNumFormats; ++nFormatPos)
+		delete[] m_arrFormats[nFormatPos].m_pszFormat;
+	m_arrFormats.DeleteAll();
+	m_hashFormatIds.DeleteAll();
+}
+
+void CBinaryLogFile::ResetFormats(void)
+{
+	FreeFormats();
+	CFormatInfo FormatInfo;
+	ZeroMemory(&FormatInfo, sizeof(FormatInfo));
+	m_arrFormats.AddItem(FormatInfo); // FORMAT_RAW
+	AddFormat(_T("%s")); // FORMAT_TEXT
+	_ASSERTE(m_arrFormats.GetCount() == FORMAT_TEXT + 1);
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param ullTime - entry time.
+ * @param dwFormatId - format string id.
+ * @param argList - variable argument list.
+ * @return true if entry was added.
+ */
+BOOL CBinaryLogFile::AddRecordV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, ULONGLONG ullTime, DWORD dwFormatId, va_list argList)
+{
+	const CFormatInfo& rFormatInfo = m_arrFormats[dwFormatId];
+	_ASSERTE(rFormatInfo.m_bDeferred);
+	CArgValue arrArgValues[MAX_ARGS];
+	DWORD dwStringsSize = 0;
+	for (DWORD dwArgPos = 0; dwArgPos < rFormatInfo.m_dwNumArgs; ++dwArgPos)
+	{
+		CArgValue& rArgValue = arrArgValues[dwArgPos];
+		switch (rFormatInfo.m_arrArgTypes[dwArgPos])
+		{
+		case AT_INT:
+			rArgValue.m_iValue = va_arg(argList, int);
+			break;
+		case AT_INT64:
+			rArgValue.m_i64Value = va_arg(argList, __int64);
+			break;
+		case AT_DOUBLE:
+			rArgValue.m_dblValue = va_arg(argList, double);
+			break;
+		case AT_POINTER:
+			rArgValue.m_pValue = va_arg(argList, const void*);
+			break;
+		case AT_STRINGA:
+			rArgValue.m_pValue = va_arg(argList, PCSTR);
+			if (rArgValue.m_pValue)
+				dwStringsSize += (DWORD)(strlen((PCSTR)rArgValue.m_pValue) + 1) * sizeof(CHAR);
+			break;
+		case AT_STRINGW:
+			rArgValue.m_pValue = va_arg(argList, PCWSTR);
+			if (rArgValue.m_pValue)
+				dwStringsSize += (DWORD)(wcslen((PCWSTR)rArgValue.m_pValue) + 1) * sizeof(WCHAR);
+			break;
+		}
+	}
+	DWORD dwDataSize = sizeof(CRecordHeader) + rFormatInfo.m_dwArgsSize + dwStringsSize;
+	CLogEntry* pLogEntry = AllocEntry(dwDataSize, eEntryMode);
+	if (pLogEntry == NULL)
+		return FALSE;
+	pLogEntry->m_dwSize = dwDataSize;
+	CRecordHeader RecordHeader;
+	RecordHeader.m_ullTime = ullTime;
+	RecordHeader.m_dwFormatId = dwFormatId;
+	RecordHeader.m_dwLogLevel = eLogLevel;
+	CopyMemory(pLogEntry->m_pbData, &RecordHeader, sizeof(RecordHeader));
+	PBYTE pbArgs = pLogEntry->m_pbData + sizeof(RecordHeader);
+	ZeroMemory(pbArgs, rFormatInfo.m_dwArgsSize);
+	PBYTE pbSlot = pbArgs;
+	DWORD dwStringOffset = rFormatInfo.m_dwArgsSize;
+	for (DWORD dwArgPos = 0; dwArgPos < rFormatInfo.m_dwNumArgs; ++dwArgPos)
+	{
+		const CArgValue& rArgValue = arrArgValues[dwArgPos];
+		ARG_TYPE eArgType = (ARG_TYPE)rFormatInfo.m_arrArgTypes[dwArgPos];
+		if (eArgType == AT_STRINGA || eArgType == AT_STRINGW)
+		{
+			// Strings are copied after argument list, slot keeps string offset.
+			UINT_PTR uStringOffset = 0;
+			if (rArgValue.m_pValue)
+			{
+				DWORD dwStringSize = eArgType == AT_STRINGA ?
+					(DWORD)(strlen((PCSTR)rArgValue.m_pValue) + 1) * sizeof(CHAR) :
+					(DWORD)(wcslen((PCWSTR)rArgValue.m_pValue) + 1) * sizeof(WCHAR);
+				CopyMemory(pbArgs + dwStringOffset, rArgValue.m_pValue, dwStringSize);
+				uStringOffset = dwStringOffset;
+				dwStringOffset += dwStringSize;
+			}
+			CopyMemory(pbSlot, &uStringOffset, sizeof(uStringOffset));
+		}
+		else
+			CopyMemory(pbSlot, &rArgValue, GetArgSize(eArgType));
+		pbSlot += GetSlotSize(eArgType);
+	}
+	_ASSERTE(dwStringOffset == rFormatInfo.m_dwArgsSize + dwStringsSize);
+	if (eEntryMode == EM_APPEND)
+		AddToTail(pLogEntry, eLogLevel, ullTime);
+	else
+		AddToHead(pLogEntry, eLogLevel, ullTime);
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param ullTime - entry time.
+ * @param dwFormatId - format string id.
+ * @return true if entry was added.
+ */
+BOOL CBinaryLogFile::AddRecordF(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, ULONGLONG ullTime, DWORD dwFormatId, ...)
+{
+	va_list argList;
+	va_start(argList, dwFormatId);
+	BOOL bResult = AddRecordV(eLogLevel, eEntryMode, ullTime, dwFormatId, argList);
+	va_end(argList);
+	return bResult;
+}
+
+/**
+ * @param pbData - line data.
+ * @param dwSize - data size.
+ * @return true if entry was added.
+ */
+BOOL CBinaryLogFile::AddRawLine(const BYTE* pbData, DWORD dwSize)
+{
+	DWORD dwDataSize = sizeof(CRecordHeader) + dwSize;
+	CLogEntry* pLogEntry = AllocEntry(dwDataSize, EM_APPEND);
+	if (pLogEntry == NULL)
+		return FALSE;
+	pLogEntry->m_dwSize = dwDataSize;
+	CRecordHeader RecordHeader;
+	ZeroMemory(&RecordHeader, sizeof(RecordHeader));
+	RecordHeader.m_dwFormatId = FORMAT_RAW;
+	CopyMemory(pLogEntry->m_pbData, &RecordHeader, sizeof(RecordHeader));
+	CopyMemory(pLogEntry->m_pbData + sizeof(RecordHeader), pbData, dwSize);
+	// Raw lines are rendered with prefix, so their level and time are recovered from it.
+	BUGTRAP_LOGLEVEL eLogLevel;
+	ULONGLONG ullTime;
+	CLogIndex::ParseEntryPrefix((PCSTR)pbData, dwSize, eLogLevel, ullTime);
+	AddToTail(pLogEntry, eLogLevel, ullTime);
+	return TRUE;
+}
+
+/**
+ * @param pbArgs - stored argument list.
+ * @param pbSlot - argument slot, moved to the next slot.
+ * @param eArgType - argument type.
+ * @param rArgValue - argument value.
+ */
+void CBinaryLogFile::ReadArgValue(const BYTE* pbArgs, const BYTE*& pbSlot, ARG_TYPE eArgType, CArgValue& rArgValue)
+{
+	if (eArgType == AT_STRINGA || eArgType == AT_STRINGW)
+	{
+		UINT_PTR uStringOffset;
+		CopyMemory(&uStringOffset, pbSlot, sizeof(uStringOffset));
+		rArgValue.m_pValue = uStringOffset ? pbArgs + uStringOffset : NULL;
+	}
+	else
+		CopyMemory(&rArgValue, pbSlot, GetArgSize(eArgType));
+	pbSlot += GetSlotSize(eArgType);
+}
+
+/**
+ * @param pszSpec - conversion specification without '*' fields.
+ * @param eArgType - argument type.
+ * @param rArgValue - argument value.
+ * @return true if value was formatted.
+ */
+BOOL CBinaryLogFile::FormatArgValue(PCTSTR pszSpec, ARG_TYPE eArgType, const CArgValue& rArgValue)
+{
+	switch (eArgType)
+	{
+	case AT_INT:
+		return FormatBufferF(pszSpec, rArgValue.m_iValue);
+	case AT_INT64:
+		return FormatBufferF(pszSpec, rArgValue.m_i64Value);
+	case AT_DOUBLE:
+		return FormatBufferF(pszSpec, rArgValue.m_dblValue);
+	case AT_POINTER:
+		return FormatBufferF(pszSpec, rArgValue.m_pValue);
+	case AT_STRINGA:
+		return FormatBufferF(pszSpec, (PCSTR)rArgValue.m_pValue);
+	case AT_STRINGW:
+		return FormatBufferF(pszSpec, (PCWSTR)rArgValue.m_pValue);
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * @param rRecordHeader - entry header.
+ * @param pbArgs - stored argument list.
+ * @return entry text or NULL.
+ */
+PCTSTR CBinaryLogFile::FormatRecord(const CRecordHeader& rRecordHeader, const BYTE* pbArgs)
+{
+	// Every conversion is formatted with its own decoded argument, so
+	// stored argument list doesn't depend on the layout of va_list.
+	const CFormatInfo& rFormatInfo = m_arrFormats[rRecordHeader.m_dwFormatId];
+	m_RecordText.Reset();
+	const BYTE* pbSlot = pbArgs;
+	DWORD dwArgPos = 0;
+	PCTSTR pszPosition = rFormatInfo.m_pszFormat;
+	for (;;)
+	{
+		TCHAR chValue = *pszPosition++;
+		if (chValue == _T('\0'))
+			break;
+		if (chValue != _T('%'))
+		{
+			m_RecordText << chValue;
+			continue;
+		}
+		if (*pszPosition == _T('%'))
+		{
+			m_RecordText << _T('%');
+			++pszPosition;
+			continue;
+		}
+		// Format strings were validated by ParseFormat(), so every specification ends with conversion type.
+		TCHAR szSpec[SPEC_BUFFER_SIZE];
+		DWORD dwSpecLength = 0;
+		szSpec[dwSpecLength++] = _T('%');
+		for (;;)
+		{
+			chValue = *pszPosition++;
+			_ASSERTE(chValue != _T('\0') && dwSpecLength < SPEC_BUFFER_SIZE - 1);
+			if (chValue == _T('*'))
+			{
+				_ASSERTE(dwArgPos < rFormatInfo.m_dwNumArgs && rFormatInfo.m_arrArgTypes[dwArgPos] == AT_INT);
+				CArgValue ArgValue;
+				ReadArgValue(pbArgs, pbSlot, AT_INT, ArgValue);
+				++dwArgPos;
+				// Negative precision is treated as if precision were omitted.
+				if (ArgValue.m_iValue < 0 && szSpec[dwSpecLength - 1] == _T('.'))
+					--dwSpecLength;
+				else
+					dwSpecLength += _stprintf_s(szSpec + dwSpecLength, countof(szSpec) - dwSpecLength, _T("%d"), ArgValue.m_iValue);
+				continue;
+			}
+			szSpec[dwSpecLength++] = chValue;
+			if (_tcschr(_T("diouxXcCeEfFgGaApsS"), chValue) != NULL)
+				break;
+		}
+		szSpec[dwSpecLength] = _T('\0');
+		_ASSERTE(dwArgPos < rFormatInfo.m_dwNumArgs);
+		ARG_TYPE eArgType = (ARG_TYPE)rFormatInfo.m_arrArgTypes[dwArgPos++];
+		CArgValue ArgValue;
+		ReadArgValue(pbArgs, pbSlot, eArgType, ArgValue);
+		if (! FormatArgValue(szSpec, eArgType, ArgValue))
+			return NULL;
+		m_RecordText << GetFormattedText();
+	}
+	return m_RecordText;
+}
+
+/**
+ * @param pbData - entry data.
+ * @param dwSize - size of entry data.
+ * @param rEntryView - view that receives entry text.
+ */
+void CBinaryLogFile::GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView)
+{
+	CRecordHeader RecordHeader;
+	CopyMemory(&RecordHeader, pbData, sizeof(RecordHeader));
+	const BYTE* pbArgs = pbData + sizeof(RecordHeader);
+	if (RecordHeader.m_dwFormatId == FORMAT_RAW)
+	{
+		rEntryView.pEntryText = pbArgs;
+		rEntryView.dwEntryTextSize = dwSize - sizeof(RecordHeader);
+		rEntryView.bUTF8Text = TRUE;
+		return;
+	}
+	// Text is rendered into format buffer, the entry itself is never copied.
+	PCTSTR pszEntryText = FormatRecord(RecordHeader, pbArgs);
+	if (pszEntryText == NULL)
+		pszEntryText = _T("");
+	rEntryView.pEntryText = pszEntryText;
+	rEntryView.dwEntryTextSize = (DWORD)(_tcslen(pszEntryText) * sizeof(TCHAR));
+	rEntryView.bUTF8Text = FALSE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszFormat - format string.
+ * @param argList - variable argument list.
+ * @return true if operation was completed successfully.
+ */
+BOOL CBinaryLogFile::WriteLogEntryV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return TRUE;
+	// Console echo needs entry text right away.
+	if (GetLogEchoMode() == BTLE_NONE)
+	{
+		DWORD dwFormatId = GetFormatId(pszFormat);
+		if (dwFormatId != INVALID_FORMAT_ID)
+		{
+			return AddRecordV(eLogLevel, eEntryMode, g_LogClock.GetLocalTime(), dwFormatId, argList);
+		}
+	}
+	return CLogFile::WriteLogEntryV(eLogLevel, eEntryMode, rcsConsoleAccess, pszFormat, argList);
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszFormat - format string.
+ * @param argList - variable argument list.
+ * @return true if entry was prepared and false if it has to be written under the lock.
+ */
+BOOL CBinaryLogFile::PrepareLogEntryV(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList)
+{
+	// Formatting is deferred until the log is read, there is nothing to prepare.
+	if (GetLogEchoMode() == BTLE_NONE)
+		return FALSE;
+	return CInMemLogFile::PrepareLogEntryV(rScratch, eLogLevel, rcsConsoleAccess, pszFormat, argList);
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text.
+ * @param ullTime - entry time or 0 for the current time.
+ * @return true if operation was completed successfully.
+ */
+BOOL CBinaryLogFile::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return TRUE;
+	if (ullTime == 0)
+		ullTime = g_LogClock.GetLocalTime();
+	if (GetLogEchoMode() != BTLE_NONE)
+		WriteLogEntryToConsole(eLogLevel, ullTime, rcsConsoleAccess, pszEntry);
+	switch (eEntryMode)
+	{
+	case EM_APPEND:
+	case EM_INSERT:
+		return AddRecordF(eLogLevel, eEntryMode, ullTime, FORMAT_TEXT, pszEntry);
+	default:
+		_ASSERT(FALSE);
+		return FALSE;
+	}
+}
+
+/**
+ * @param bCrash - true if crash has occurred.
+ * @return true if the log was saved successfully.
+ */
+BOOL CBinaryLogFile::SaveEntries(BOOL bCrash)
+{
+#ifdef _DEBUG
+	DWORD dwStartTime = GetTickCount();
+#endif
+	// Log of previous session that wasn't loaded is left intact.
+	if (! FinishDeferredLoad(TRUE, ! bCrash))
+		return FALSE;
+	PCTSTR pszLogFileName = GetLogFileName();
+	CFileStream FileStream(8 * 1024);
+	if (! FileStream.Open(pszLogFileName, CREATE_ALWAYS, GENERIC_WRITE))
+		return FALSE;
+	FileStream.WriteBytes(g_arrUTF8Preamble, sizeof(g_arrUTF8Preamble));
+	CUTF8EncStream EncStream(&FileStream);
+	CLogEntry* pLogEntry = GetFirstEntry();
+	while (pLogEntry)
+	{
+		CRecordHeader RecordHeader;
+		CopyMemory(&RecordHeader, pLogEntry->m_pbData, sizeof(RecordHeader));
+		const BYTE* pbRecordData = pLogEntry->m_pbData + sizeof(RecordHeader);
+		if (RecordHeader.m_dwFormatId == FORMAT_RAW)
+		{
+			// Lines loaded from the log file are already encoded.
+			FileStream.WriteBytes(pbRecordData, pLogEntry->m_dwDataSize - sizeof(RecordHeader));
+			FileStream.WriteBytes((const BYTE*)"\r\n", 2);
+		}
+		else
+		{
+			PCTSTR pszEntry = FormatRecord(RecordHeader, pbRecordData);
+			if (pszEntry)
+			{
+				FillEntryText((BUGTRAP_LOGLEVEL)RecordHeader.m_dwLogLevel, RecordHeader.m_ullTime, pszEntry);
+				EncStream.WriteUTF8Bin(GetEntryText());
+			}
+		}
+		pLogEntry = pLogEntry->m_pNextEntry;
+	}
+	FileStream.Close();
+#ifdef _DEBUG
+	DWORD dwEndTime = GetTickCount();
+	TCHAR szMessage[128];
+	_stprintf_s(szMessage, countof(szMessage), _T("CBinaryLogFile::SaveEntries(): %lu entries, %lu bytes, %lu milliseconds\r\n"), GetNumEntries(), GetNumBytes(), dwEndTime - dwStartTime);
+	OutputDebugString(szMessage);
+#endif
+	return TRUE;
+}
+
+/**
+ * @return true if the log was loaded successfully.
+ */
+BOOL CBinaryLogFile::LoadEntries(void)
+{
+	PCTSTR pszLogFileName = GetLogFileName();
+	HANDLE hFile = CreateFile(pszLogFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+	{
+		DWORD dwLastError = GetLastError();
+		// ignore missing files
+		return (dwLastError == ERROR_FILE_NOT_FOUND ||
+			dwLastError == ERROR_PATH_NOT_FOUND ||
+			GetFileAttributes(pszLogFileName) == INVALID_FILE_ATTRIBUTES);
+	}
+	BOOL bResult = FALSE;
+	DWORD dwFileSize = GetFileSize(hFile, NULL);
+	if (dwFileSize == INVALID_FILE_SIZE)
+	{
+		CloseHandle(hFile);
+		return FALSE;
+	}
+	if (dwFileSize == 0)
+	{
+		// ignore empty files
+		CloseHandle(hFile);
+		return TRUE;
+	}
+	// Previous session is kept as text, every line is rendered as is.
+	PBYTE pFileBuffer = new BYTE[dwFileSize];
+	if (pFileBuffer)
+	{
+		DWORD dwRead = 0;
+		if (ReadFile(hFile, pFileBuffer, dwFileSize, &dwRead, NULL) &&
+			dwRead >= sizeof(g_arrUTF8Preamble) && memcmp(pFileBuffer, g_arrUTF8Preamble, sizeof(g_arrUTF8Preamble)) == 0)
+		{
+			bResult = TRUE;
+			DWORD dwLineStart = sizeof(g_arrUTF8Preamble);
+			for (DWORD dwCurrentPos = dwLineStart; dwCurrentPos <= dwRead; ++dwCurrentPos)
+			{
+				if (dwCurrentPos == dwRead || pFileBuffer[dwCurrentPos] == '\r' || pFileBuffer[dwCurrentPos] == '\n')
+				{
+					if (dwLineStart < dwCurrentPos && ! AddRawLine(pFileBuffer + dwLineStart, dwCurrentPos - dwLineStart))
+					{
+						bResult = FALSE;
+						break;
+					}
+					dwLineStart = dwCurrentPos + 1;
+				}
+			}
+			if (! bResult)
+				FreeEntries();
+		}
+		delete[] pFileBuffer;
+	}
+	CloseHandle(hFile);
+	return bResult;
+}
@@ -0,0 +1,232 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Log file with deferred formatting.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "InMemLogFile.h"
+#include "Array.h"
+#include "Hash.h"
+
+/**
+ * @brief Log file that keeps entries in binary form.
+ * Entry stores format string id, raw argument values, log level and
+ * time stamp. Entry text is rendered only when the log is saved.
+ */
+class CBinaryLogFile : public CInMemLogFile
+{
+public:
+	/// Initialize the object.
+	CBinaryLogFile(void);
+	/// Destroy the object.
+	virtual ~CBinaryLogFile(void);
+	/// Load entries into memory.
+	virtual BOOL LoadEntries(void);
+	/// Save entries into disk.
+	virtual BOOL SaveEntries(BOOL bCrash);
+	/// Clear log entries.
+	virtual BOOL ClearEntries(void);
+	/// Add new log entry.
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0);
+	/// Add new log entry.
+	virtual BOOL WriteLogEntryV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList);
+	/// Format and prepare log entry before the log is locked.
+	virtual BOOL PrepareLogEntryV(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CBinaryLogFile(const CBinaryLogFile& rLogFile);
+	/// Protects the class from being accidentally copied.
+	CBinaryLogFile& operator=(const CBinaryLogFile& rLogFile);
+
+	/// Format table parameters.
+	enum
+	{
+		/// Id of raw text line loaded from the log file.
+		FORMAT_RAW = 0,
+		/// Id of plain text entry.
+		FORMAT_TEXT = 1,
+		/// Id of format string that can't be deferred.
+		INVALID_FORMAT_ID = MAXDWORD,
+		/// Maximum number of format strings.
+		MAX_FORMATS = 4096,
+		/// Maximum number of arguments in format string.
+		MAX_ARGS = 32,
+		/// Maximum length of conversion specification in format string.
+		MAX_SPEC_LENGTH = 32,
+		/// Size of buffer for conversion specification with expanded '*' values.
+		SPEC_BUFFER_SIZE = 64,
+		/// Initial size of format hash table.
+		FORMAT_HASH_SIZE = 257
+	};
+
+	/// Type of format argument.
+	enum ARG_TYPE
+	{
+		/// Integer value.
+		AT_INT,
+		/// 64-bit integer value.
+		AT_INT64,
+		/// Pointer sized value.
+		AT_POINTER,
+		/// Floating point value.
+		AT_DOUBLE,
+		/// ANSI string.
+		AT_STRINGA,
+		/// Unicode string.
+		AT_STRINGW
+	};
+
+	/// Parsed format string.
+	struct CFormatInfo
+	{
+		/// Copy of format string.
+		PTSTR m_pszFormat;
+		/// True if arguments of this format may be stored in binary form.
+		BOOL m_bDeferred;
+		/// Number of format arguments.
+		DWORD m_dwNumArgs;
+		/// Size of argument list.
+		DWORD m_dwArgsSize;
+		/// Types of format arguments.
+		BYTE m_arrArgTypes[MAX_ARGS];
+	};
+
+	/// Header of log entry data.
+	struct CRecordHeader
+	{
+		/// Entry time (local).
+		ULONGLONG m_ullTime;
+		/// Format string id.
+		DWORD m_dwFormatId;
+		/// Log level.
+		DWORD m_dwLogLevel;
+	};
+
+	/// Argument value read from variable argument list.
+	union CArgValue
+	{
+		/// Integer value.
+		int m_iValue;
+		/// 64-bit integer value.
+		__int64 m_i64Value;
+		/// Floating point value.
+		double m_dblValue;
+		/// Pointer value.
+		const void* m_pValue;
+	};
+
+	/// Get default log file extension.
+	virtual PCTSTR GetLogFileExtension(void) const;
+	/// Create empty log of the same format.
+	virtual CInMemLogFile* CreateHistoryLog(void) const;
+	/// Get text of entry data for query callback.
+	virtual void GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView);
+	/// Find or register format string.
+	DWORD GetFormatId(PCTSTR pszFormat);
+	/// Register new format string.
+	DWORD AddFormat(PCTSTR pszFormat);
+	/// Free all format strings and register built-in formats.
+	void ResetFormats(void);
+	/// Free all format strings.
+	void FreeFormats(void);
+	/// Parse format string.
+	static BOOL ParseFormat(PCTSTR pszFormat, CFormatInfo& rFormatInfo);
+	/// Add argument to format description.
+	static BOOL AddArgType(CFormatInfo& rFormatInfo, ARG_TYPE eArgType);
+	/// Get size of argument value.
+	static DWORD GetArgSize(ARG_TYPE eArgType);
+	/// Get size of argument slot in stored argument list.
+	static DWORD GetSlotSize(ARG_TYPE eArgType);
+	/// Read argument value from stored argument list.
+	static void ReadArgValue(const BYTE* pbArgs, const BYTE*& pbSlot, ARG_TYPE eArgType, CArgValue& rArgValue);
+	/// Format single conversion specification.
+	BOOL FormatArgValue(PCTSTR pszSpec, ARG_TYPE eArgType, const CArgValue& rArgValue);
+	/// Add binary entry.
+	BOOL AddRecordV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, ULONGLONG ullTime, DWORD dwFormatId, va_list argList);
+	/// Add binary entry.
+	BOOL AddRecordF(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, ULONGLONG ullTime, DWORD dwFormatId, ...);
+	/// Add raw text line.
+	BOOL AddRawLine(const BYTE* pbData, DWORD dwSize);
+	/// Render entry text.
+	PCTSTR FormatRecord(const CRecordHeader& rRecordHeader, const BYTE* pbArgs);
+
+	/// Parsed format strings.
+	CArray<CFormatInfo> m_arrFormats;
+	/// Map of format string addresses to format ids.
+	CHash<UINT_PTR, DWORD> m_hashFormatIds;
+	/// Text of rendered entry.
+	CStrStream m_RecordText;
+};
+
+inline CBinaryLogFile::CBinaryLogFile(void) : CInMemLogFile(0), m_hashFormatIds(FORMAT_HASH_SIZE)
+{
+	ResetFormats();
+}
+
+inline CBinaryLogFile::~CBinaryLogFile(void)
+{
+	FreeFormats();
+}
+
+/**
+ * @return log file extension.
+ */
+inline PCTSTR CBinaryLogFile::GetLogFileExtension(void) const
+{
+	return _T(".txt");
+}
+
+/**
+ * @return pointer to the new log object.
+ */
+inline CInMemLogFile* CBinaryLogFile::CreateHistoryLog(void) const
+{
+	return new CBinaryLogFile;
+}
+
+/*
+ * @return true if operation was completed successfully.
+ */
+inline BOOL CBinaryLogFile::ClearEntries(void)
+{
+	CInMemLogFile::ClearEntries();
+	// Format ids are referenced only by log entries.
+	ResetFormats();
+	return TRUE;
+}
+
+/**
+ * @param eArgType - argument type.
+ * @return size of argument value.
+ */
+inline DWORD CBinaryLogFile::GetArgSize(ARG_TYPE eArgType)
+{
+	switch (eArgType)
+	{
+	case AT_INT:    return sizeof(int);
+	case AT_INT64:  return sizeof(__int64);
+	case AT_DOUBLE: return sizeof(double);
+	default:        return sizeof(PVOID);
+	}
+}
+
+/**
+ * @param eArgType - argument type.
+ * @return size of argument slot in variable argument list.
+ */
+inline DWORD CBinaryLogFile::GetSlotSize(ARG_TYPE eArgType)
+{
+	// Slots are pointer aligned, so every value may be copied in one piece.
+	return ((GetArgSize(eArgType) + sizeof(INT_PTR) - 1) & ~(sizeof(INT_PTR) - 1));
+}
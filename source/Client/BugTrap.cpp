@@ -22,6 +22,15 @@
 #include "TextLogFile.h"
 #include "XmlLogFile.h"
 #include "LogStream.h"
+#include "MappedLogFile.h"
+#include "BinaryLogFile.h"
+#include "LogTee.h"
+#include "LogIndex.h"
+#include "LogHandles.h"
+#include "LogStaging.h"
+#include "LogEcho.h"
+#include "LogFlusher.h"
+#include "FlightRecorder.h"
 #include "ModuleImportTable.h"
 #include "Globals.h"
 
@@ -35,16 +44,18 @@ static CRITICAL_SECTION g_csMutualLogAccess;
 static CRITICAL_SECTION g_csConsoleAccess;
 /// Critical section used for synchronous error handler execution.
 static CRITICAL_SECTION g_csHandlerSync;
-/// True when code is invoked from DllMain().
-static BOOL g_bInDllMain = FALSE;
 /// Event fired when pending log request is finished.
 static HANDLE g_hLogRequestComplete = NULL;
 /// True when logging activity is enabled.
-static BOOL g_bLoggingEnabled = FALSE;
+static volatile BOOL g_bLoggingEnabled = FALSE;
 /// Number of active request to logging functions from different threads.
 static DWORD g_dwNumLogRequests = 0;
-/// Array of pointers to log descriptors.
-static CArray<CLogFile*, CDynamicTraits<CLogFile*> > g_arrLogFiles;
+/// Number of active lock-free requests to staged logs.
+static volatile LONG g_lNumStagedLogRequests = 0;
+/// Per-thread staging buffers of log entries.
+static CLogStaging g_LogStaging;
+/// Table of open log files.
+static CLogHandles g_LogHandles;
 /// Old filter of unhandled exception.
 static PTOP_LEVEL_EXCEPTION_FILTER g_pfnOldExceptionFilter = NULL;
 /// Table of modules that import SetUnhandledExceptionFilter() function.
@@ -102,6 +113,33 @@ static void StopLogging(void)
 		EnterCriticalSection(&g_csMutualLogAccess);
 	}
 	LeaveCriticalSection(&g_csMutualLogAccess);
+	// Staged requests never block, so they complete shortly.
+	while (g_lNumStagedLogRequests > 0)
+		SwitchToThread();
+	// Move staged entries to log files. Threads can't be waited in DllMain().
+	g_LogStaging.Stop(! g_bInDllMain);
+	// Write queued echo text, further entries are echoed synchronously.
+	g_LogEcho.Stop(! g_bInDllMain);
+	// Logs are saved by the caller.
+	g_LogFlusher.Stop(! g_bInDllMain);
+}
+
+/**
+ * Write summary of entries suppressed by rate limit and sampling.
+ * @param pLogFile - log file object.
+ * @param bStaged - true if summary has to be staged.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param dwNumSuppressed - number of suppressed entries.
+ */
+static void WriteSuppressedEntries(CLogFile* pLogFile, BOOL bStaged, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, DWORD dwNumSuppressed)
+{
+	TCHAR szSummary[64];
+	CLogThrottle::FormatSummary(dwNumSuppressed, szSummary, countof(szSummary));
+	if (bStaged)
+		g_LogStaging.PostEntry(pLogFile, eLogLevel, eEntryMode, szSummary);
+	else
+		pLogFile->WriteLogEntry(eLogLevel, eEntryMode, g_csConsoleAccess, szSummary);
 }
 
 /**
@@ -126,13 +164,19 @@ static void SaveLogLinkEntries(bool bCrash)
 static void SaveLogFiles(bool bCrash)
 {
 	_ASSERTE(! g_bLoggingEnabled && ! g_dwNumLogRequests);
-	size_t iNumLogFiles = g_arrLogFiles.GetCount();
-	for (size_t iLogFilePos = 0; iLogFilePos < iNumLogFiles; ++iLogFilePos)
+	DWORD dwNumSlots = g_LogHandles.GetNumSlots();
+	for (DWORD dwSlot = 0; dwSlot < dwNumSlots; ++dwSlot)
 	{
-		CLogFile* pLogFile = g_arrLogFiles[iLogFilePos];
-		_ASSERTE(pLogFile != NULL);
+		INT_PTR iHandle = g_LogHandles.GetSlotHandle(dwSlot);
+		CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
+		if (pLogFile == NULL)
+			continue;
+		DWORD dwNumSuppressed = pLogFile->GetLogThrottle().ResetSuppressedEntries();
+		if (dwNumSuppressed != 0)
+			WriteSuppressedEntries(pLogFile, FALSE, BTLL_WARNING, CLogFile::EM_APPEND, dwNumSuppressed);
 		pLogFile->SaveEntries(bCrash);
 		pLogFile->Close();
+		g_LogHandles.ReleaseLogFile(iHandle);
 	}
 }
 
@@ -173,6 +217,28 @@ static void LeaveLogFunction(void)
 	LeaveCriticalSection(&g_csMutualLogAccess);
 }
 
+/**
+ * Lock-free log function prologue.
+ * @return false if function can't be performed.
+ */
+static inline BOOL EnterStagedLogFunction(void)
+{
+	InterlockedIncrement(&g_lNumStagedLogRequests);
+	if (g_bLoggingEnabled)
+		return TRUE;
+	InterlockedDecrement(&g_lNumStagedLogRequests);
+	return FALSE;
+}
+
+/**
+ * Lock-free log function epilogue.
+ */
+static inline void LeaveStagedLogFunction(void)
+{
+	_ASSERTE(g_lNumStagedLogRequests > 0);
+	InterlockedDecrement(&g_lNumStagedLogRequests);
+}
+
 /**
  * Log function prologue.
  * @param pLogFile - log file object.
@@ -186,18 +252,6 @@ static inline CLogFile* EnterLogFunction(CLogFile* pLogFile)
 	return pLogFile;
 }
 
-/**
- * @param iHandle - log file handle.
- * @return log file object.
- */
-static inline CLogFile* GetLogFileObject(INT_PTR iHandle)
-{
-	if (iHandle >= 1 && iHandle <= (INT_PTR)g_arrLogFiles.GetCount())
-		return g_arrLogFiles[(size_t)(iHandle - 1)];
-	else
-		return NULL;
-}
-
 /**
  * Log function prologue.
  * @param iHandle - log file handle.
@@ -205,8 +259,15 @@ static inline CLogFile* GetLogFileObject(INT_PTR iHandle)
  */
 static inline CLogFile* EnterLogFunction(INT_PTR iHandle)
 {
-	CLogFile* pLogFile = GetLogFileObject(iHandle);
-	return EnterLogFunction(pLogFile);
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
+	if (! pLogFile)
+		return NULL;
+	if (! EnterLogFunction(pLogFile))
+	{
+		g_LogHandles.ReleaseLogFile(iHandle);
+		return NULL;
+	}
+	return pLogFile;
 }
 
 /**
@@ -220,6 +281,79 @@ static inline void LeaveLogFunction(CLogFile* pLogFile)
 	LeaveLogFunction();
 }
 
+/**
+ * Log function epilogue.
+ * @param iHandle - log file handle.
+ * @param pLogFile - log file object.
+ */
+static inline void LeaveLogFunction(INT_PTR iHandle, CLogFile* pLogFile)
+{
+	LeaveLogFunction(pLogFile);
+	g_LogHandles.ReleaseLogFile(iHandle);
+}
+
+/**
+ * @param pLogFile - log file object.
+ * @return true if log entries are staged in per-thread buffers.
+ */
+static inline BOOL IsStagedLogFile(CLogFile* pLogFile)
+{
+	return (pLogFile != NULL && (pLogFile->GetLogFlags() & BTLF_STAGEDWRITES) != 0);
+}
+
+/**
+ * @param pLogFile - log file object.
+ * @param dwCategory - entry category.
+ * @param eLogLevel - log level number.
+ * @return true if entry of this level is subject to rate limit and sampling.
+ */
+static inline BOOL IsThrottledLogEntry(CLogFile* pLogFile, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel)
+{
+	return (pLogFile != NULL && pLogFile->GetLogThrottle().IsEnabled() && pLogFile->IsLogLevelEnabled(dwCategory, eLogLevel));
+}
+
+/**
+ * Move staged entries of the log file to the log.
+ * @param iHandle - log file handle.
+ */
+static void DrainStagedEntries(INT_PTR iHandle)
+{
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
+	if (! pLogFile)
+		return;
+	if (IsStagedLogFile(pLogFile))
+		g_LogStaging.Drain();
+	g_LogHandles.ReleaseLogFile(iHandle);
+}
+
+/**
+ * Flush log files whose flush policy limits were reached and compress their old entries.
+ * @return time in milliseconds until the next log has to be flushed.
+ */
+static DWORD FlushDueLogFiles(void)
+{
+	DWORD dwTimeout = INFINITE;
+	DWORD dwNumSlots = g_LogHandles.GetNumSlots();
+	for (DWORD dwSlot = 0; dwSlot < dwNumSlots; ++dwSlot)
+	{
+		INT_PTR iHandle = g_LogHandles.GetSlotHandle(dwSlot);
+		CLogFile* pLogFile = EnterLogFunction(iHandle);
+		if (! pLogFile)
+			continue;
+		DWORD dwFlushTimeout = pLogFile->GetFlushTimeout(GetTickCount());
+		// Log is locked by PackEntries() only to take and replace entries.
+		pLogFile->ReleaseObject();
+		pLogFile->PackEntries();
+		LeaveLogFunction();
+		g_LogHandles.ReleaseLogFile(iHandle);
+		if (dwFlushTimeout == 0)
+			BT_FlushLogFile(iHandle);
+		else if (dwFlushTimeout < dwTimeout)
+			dwTimeout = dwFlushTimeout;
+	}
+	return dwTimeout;
+}
+
 /**
  * Free global variables to excludes this memory from the dump of memory leaks.
  */
@@ -227,7 +361,7 @@ static void FreeGlobalData(void)
 {
 	// Clear log files.
 	g_arrLogLinks.DeleteAll(true);
-	g_arrLogFiles.DeleteAll(true);
+	g_LogHandles.DeleteAll();
 	// Deallocate user messages.
 	g_strUserMessage.Free();
 	g_strFirstIntroMesage.Free();
@@ -413,22 +547,116 @@ static LONG GenericFilter(PEXCEPTION_POINTERS pExceptionPointers, CSymEngine::EX
 	}
 }
 
+/**
+ * Write log entry to the file.
+ * @param pLogFile - log file object.
+ * @param dwCategory - entry category.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text.
+ * @return true if operation was completed successfully.
+ */
+static BOOL WriteLogEntry(CLogFile* pLogFile, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry)
+{
+	// Level is checked before the entry is throttled, formatted or staged.
+	if (! pLogFile->IsLogLevelEnabled(dwCategory, eLogLevel))
+		return TRUE;
+	// Rate limit is checked before the log is locked and entry is formatted.
+	DWORD dwNumSuppressed = 0;
+	if (IsThrottledLogEntry(pLogFile, dwCategory, eLogLevel) &&
+		! pLogFile->GetLogThrottle().AllowEntry(CLogThrottle::ST_TEXT, CLogThrottle::GetTextKey(pszEntry), dwNumSuppressed))
+	{
+		return TRUE;
+	}
+	if (IsStagedLogFile(pLogFile))
+	{
+		if (! EnterStagedLogFunction())
+			return FALSE;
+		if (dwNumSuppressed != 0)
+			WriteSuppressedEntries(pLogFile, TRUE, eLogLevel, eEntryMode, dwNumSuppressed);
+		BOOL bResult = g_LogStaging.PostEntry(pLogFile, eLogLevel, eEntryMode, pszEntry);
+		LeaveStagedLogFunction();
+		return bResult;
+	}
+	if (! EnterLogFunction())
+		return FALSE;
+	// Entry is formatted and encoded in thread buffers before the log is locked.
+	CLogScratch* pScratch = g_LogScratchPool.GetThreadScratch();
+	BOOL bPrepared = pScratch != NULL && pLogFile->PrepareLogEntry(*pScratch, eLogLevel, g_csConsoleAccess, pszEntry);
+	pLogFile->CaptureObject();
+	if (dwNumSuppressed != 0)
+		WriteSuppressedEntries(pLogFile, FALSE, eLogLevel, eEntryMode, dwNumSuppressed);
+	BOOL bResult = bPrepared ?
+		pLogFile->WritePreparedEntry(*pScratch, eLogLevel, eEntryMode, g_csConsoleAccess) :
+		pLogFile->WriteLogEntry(eLogLevel, eEntryMode, g_csConsoleAccess, pszEntry);
+	LeaveLogFunction(pLogFile);
+	return bResult;
+}
+
 /**
  * Write log entry to the file.
  * @param iHandle - log file handle.
+ * @param dwCategory - entry category.
  * @param eLogLevel - log level number.
  * @param eEntryMode - entry mode.
  * @param pszEntry - log entry text.
  * @return true if operation was completed successfully.
  */
-static BOOL WriteLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry)
+static BOOL WriteLogEntry(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry)
 {
 	if (pszEntry == NULL)
 		return FALSE;
-	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
 	if (! pLogFile)
 		return FALSE;
-	BOOL bResult = pLogFile->WriteLogEntry(eLogLevel, eEntryMode, g_csConsoleAccess, pszEntry);
+	BOOL bResult = WriteLogEntry(pLogFile, dwCategory, eLogLevel, eEntryMode, pszEntry);
+	g_LogHandles.ReleaseLogFile(iHandle);
+	return bResult;
+}
+
+/**
+ * Write log entry to the file.
+ * @param pLogFile - log file object.
+ * @param dwCategory - entry category.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszFormat - format string.
+ * @param argList - variable argument list.
+ * @return true if operation was completed successfully.
+ */
+static BOOL WriteLogEntry(CLogFile* pLogFile, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszFormat, va_list argList)
+{
+	// Level is checked before the entry is throttled, formatted or staged.
+	if (! pLogFile->IsLogLevelEnabled(dwCategory, eLogLevel))
+		return TRUE;
+	// Rate limit is checked before the log is locked and entry is formatted.
+	DWORD dwNumSuppressed = 0;
+	if (IsThrottledLogEntry(pLogFile, dwCategory, eLogLevel) &&
+		! pLogFile->GetLogThrottle().AllowEntry(CLogThrottle::ST_FORMAT, (UINT_PTR)pszFormat, dwNumSuppressed))
+	{
+		return TRUE;
+	}
+	if (IsStagedLogFile(pLogFile))
+	{
+		if (! EnterStagedLogFunction())
+			return FALSE;
+		if (dwNumSuppressed != 0)
+			WriteSuppressedEntries(pLogFile, TRUE, eLogLevel, eEntryMode, dwNumSuppressed);
+		BOOL bResult = g_LogStaging.PostEntryV(pLogFile, eLogLevel, eEntryMode, pszFormat, argList);
+		LeaveStagedLogFunction();
+		return bResult;
+	}
+	if (! EnterLogFunction())
+		return FALSE;
+	// Entry is formatted and encoded in thread buffers before the log is locked.
+	CLogScratch* pScratch = g_LogScratchPool.GetThreadScratch();
+	BOOL bPrepared = pScratch != NULL && pLogFile->PrepareLogEntryV(*pScratch, eLogLevel, g_csConsoleAccess, pszFormat, argList);
+	pLogFile->CaptureObject();
+	if (dwNumSuppressed != 0)
+		WriteSuppressedEntries(pLogFile, FALSE, eLogLevel, eEntryMode, dwNumSuppressed);
+	BOOL bResult = bPrepared ?
+		pLogFile->WritePreparedEntry(*pScratch, eLogLevel, eEntryMode, g_csConsoleAccess) :
+		pLogFile->WriteLogEntryV(eLogLevel, eEntryMode, g_csConsoleAccess, pszFormat, argList);
 	LeaveLogFunction(pLogFile);
 	return bResult;
 }
@@ -436,24 +664,94 @@ static BOOL WriteLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, CLogFile:
 /**
  * Write log entry to the file.
  * @param iHandle - log file handle.
+ * @param dwCategory - entry category.
  * @param eLogLevel - log level number.
  * @param eEntryMode - entry mode.
  * @param pszFormat - format string.
  * @param argList - variable argument list.
  * @return true if operation was completed successfully.
  */
-static BOOL WriteLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszFormat, va_list argList)
+static BOOL WriteLogEntry(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszFormat, va_list argList)
 {
 	if (pszFormat == NULL)
 		return FALSE;
-	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
 	if (! pLogFile)
 		return FALSE;
-	BOOL bResult = pLogFile->WriteLogEntryV(eLogLevel, eEntryMode, g_csConsoleAccess, pszFormat, argList);
+	BOOL bResult = WriteLogEntry(pLogFile, dwCategory, eLogLevel, eEntryMode, pszFormat, argList);
+	g_LogHandles.ReleaseLogFile(iHandle);
+	return bResult;
+}
+
+/**
+ * Write log entry encoded in UTF-8 to the file.
+ * @param pLogFile - log file object.
+ * @param dwCategory - entry category.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+static BOOL WriteLogEntryUTF8(CLogFile* pLogFile, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCSTR pszEntry, DWORD dwLength)
+{
+	// Level is checked before the entry is throttled, formatted or staged.
+	if (! pLogFile->IsLogLevelEnabled(dwCategory, eLogLevel))
+		return TRUE;
+	// Rate limit is checked before the log is locked and entry is formatted.
+	DWORD dwNumSuppressed = 0;
+	if (IsThrottledLogEntry(pLogFile, dwCategory, eLogLevel) &&
+		! pLogFile->GetLogThrottle().AllowEntry(CLogThrottle::ST_TEXT, CLogThrottle::GetTextKey(pszEntry, dwLength), dwNumSuppressed))
+	{
+		return TRUE;
+	}
+	if (IsStagedLogFile(pLogFile))
+	{
+		if (! EnterStagedLogFunction())
+			return FALSE;
+		if (dwNumSuppressed != 0)
+			WriteSuppressedEntries(pLogFile, TRUE, eLogLevel, eEntryMode, dwNumSuppressed);
+		BOOL bResult = g_LogStaging.PostEntryUTF8(pLogFile, eLogLevel, eEntryMode, pszEntry, dwLength);
+		LeaveStagedLogFunction();
+		return bResult;
+	}
+	if (! EnterLogFunction())
+		return FALSE;
+	// Entry is formatted and encoded in thread buffers before the log is locked.
+	CLogScratch* pScratch = g_LogScratchPool.GetThreadScratch();
+	BOOL bPrepared = pScratch != NULL && pLogFile->PrepareLogEntryUTF8(*pScratch, eLogLevel, g_csConsoleAccess, pszEntry, dwLength);
+	pLogFile->CaptureObject();
+	if (dwNumSuppressed != 0)
+		WriteSuppressedEntries(pLogFile, FALSE, eLogLevel, eEntryMode, dwNumSuppressed);
+	BOOL bResult = bPrepared ?
+		pLogFile->WritePreparedEntry(*pScratch, eLogLevel, eEntryMode, g_csConsoleAccess) :
+		pLogFile->WriteLogEntryUTF8(eLogLevel, eEntryMode, g_csConsoleAccess, pszEntry, dwLength);
 	LeaveLogFunction(pLogFile);
 	return bResult;
 }
 
+/**
+ * Write log entry encoded in UTF-8 to the file.
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+static BOOL WriteLogEntryUTF8(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCSTR pszEntry, DWORD dwLength)
+{
+	if (pszEntry == NULL)
+		return FALSE;
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = WriteLogEntryUTF8(pLogFile, dwCategory, eLogLevel, eEntryMode, pszEntry, dwLength);
+	g_LogHandles.ReleaseLogFile(iHandle);
+	return bResult;
+}
+
 /**
  * @brief Set default report path (report is located in Application Data folder by default).
  */
@@ -483,6 +781,16 @@ static void AttachProcess(void)
 	InitializeCriticalSection(&g_csConsoleAccess);
 	// Synchronize log completion.
 	g_hLogRequestComplete = CreateEvent(NULL, FALSE, FALSE, NULL); // non-signaled auto-reset event
+	// Prepare per-thread staging of log entries.
+	g_LogStaging.Initialize(&g_csConsoleAccess);
+	// Prepare background echo of log entries.
+	g_LogEcho.Initialize(&g_csConsoleAccess);
+	// Prepare background flush of log files.
+	g_LogFlusher.Initialize(FlushDueLogFiles);
+	// Prepare per-thread scratch buffers of log entries.
+	g_LogScratchPool.Initialize();
+	// Prepare per-thread flight recorder.
+	g_FlightRecorder.Initialize();
 	// Initialize common controls.
 	InitCtrls.dwSize = sizeof(InitCtrls);
 	InitCtrls.dwICC = ICC_LISTVIEW_CLASSES | ICC_BAR_CLASSES;
@@ -503,6 +811,16 @@ static void DetachProcess(void)
 	_ASSERTE(! g_bLoggingEnabled && ! g_dwNumLogRequests);
 	// Restore exception handler.
 	BT_UninstallSehFilter();
+	// Free staging buffers.
+	g_LogStaging.Uninitialize();
+	// Free echo buffers.
+	g_LogEcho.Uninitialize();
+	// Close flusher thread.
+	g_LogFlusher.Uninitialize();
+	// Free scratch buffers.
+	g_LogScratchPool.Uninitialize();
+	// Free flight recorder rings.
+	g_FlightRecorder.Uninitialize();
 	// Close log event.
 	CloseHandle(g_hLogRequestComplete);
 	g_hLogRequestComplete = NULL;
@@ -974,7 +1292,7 @@ extern "C" BUGTRAP_API PCTSTR APIENTRY BT_GetLogFileName(INT_PTR iHandle)
 	if (! pLogFile)
 		return NULL;
 	PCTSTR pszLogFileName = pLogFile->GetLogFileName();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return pszLogFileName;
 }
 
@@ -988,7 +1306,7 @@ extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogSizeInEntries(INT_PTR iHandle)
 	if (! pLogFile)
 		return 0;
 	DWORD dwLogSizeInEntries = pLogFile->GetLogSizeInEntries();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return dwLogSizeInEntries;
 }
 
@@ -1003,7 +1321,7 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogSizeInEntries(INT_PTR iHandle, DWO
 	if (! pLogFile)
 		return FALSE;
 	BOOL bResult = pLogFile->SetLogSizeInEntries(dwLogSizeInEntries);
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return bResult;
 }
 
@@ -1017,7 +1335,7 @@ extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogSizeInBytes(INT_PTR iHandle)
 	if (! pLogFile)
 		return 0;
 	DWORD dwLogSizeInBytes = pLogFile->GetLogSizeInBytes();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return dwLogSizeInBytes;
 }
 
@@ -1032,10 +1350,196 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogSizeInBytes(INT_PTR iHandle, DWORD
 	if (! pLogFile)
 		return FALSE;
 	BOOL bResult = pLogFile->SetLogSizeInBytes(dwLogSizeInBytes);
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return bResult;
 }
 
+/**
+ * @param iHandle - log file handle.
+ * @return size of log buffer in bytes.
+ */
+extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogBufferSize(INT_PTR iHandle)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return 0;
+	DWORD dwLogBufferSize = pLogFile->GetLogBufferSize();
+	LeaveLogFunction(iHandle, pLogFile);
+	return dwLogBufferSize;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwLogBufferSize - size of log buffer in bytes.
+ * @return true if operation was accepted.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogBufferSize(INT_PTR iHandle, DWORD dwLogBufferSize)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = pLogFile->SetLogBufferSize(dwLogBufferSize);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return maximum age of log segment in minutes.
+ */
+extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogSegmentTime(INT_PTR iHandle)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return 0;
+	DWORD dwLogSegmentTime = pLogFile->GetLogSegmentTime();
+	LeaveLogFunction(iHandle, pLogFile);
+	return dwLogSegmentTime;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwLogSegmentTime - maximum age of log segment in minutes; pass 0 to disable time based rotation.
+ * @return true if operation was accepted.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogSegmentTime(INT_PTR iHandle, DWORD dwLogSegmentTime)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = pLogFile->SetLogSegmentTime(dwLogSegmentTime);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return number of kept log segments.
+ */
+extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogSegmentCount(INT_PTR iHandle)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return 0;
+	DWORD dwLogSegmentCount = pLogFile->GetLogSegmentCount();
+	LeaveLogFunction(iHandle, pLogFile);
+	return dwLogSegmentCount;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwLogSegmentCount - number of kept log segments; pass 0 to keep all segments.
+ * @return true if operation was accepted.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogSegmentCount(INT_PTR iHandle, DWORD dwLogSegmentCount)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = pLogFile->SetLogSegmentCount(dwLogSegmentCount);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param pdwFlushEntries - number of new entries that triggers flush.
+ * @param pdwFlushDelay - maximum age of unsaved entries in milliseconds.
+ * @param pdwFlushBytes - size of new entries that triggers flush.
+ * @return true if the log supports automatic flush.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_GetLogFlushPolicy(INT_PTR iHandle, PDWORD pdwFlushEntries, PDWORD pdwFlushDelay, PDWORD pdwFlushBytes)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	DWORD dwFlushEntries, dwFlushDelay, dwFlushBytes;
+	BOOL bResult = pLogFile->GetLogFlushPolicy(dwFlushEntries, dwFlushDelay, dwFlushBytes);
+	LeaveLogFunction(iHandle, pLogFile);
+	if (pdwFlushEntries)
+		*pdwFlushEntries = dwFlushEntries;
+	if (pdwFlushDelay)
+		*pdwFlushDelay = dwFlushDelay;
+	if (pdwFlushBytes)
+		*pdwFlushBytes = dwFlushBytes;
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwFlushEntries - number of new entries that triggers flush; pass 0 to ignore number of entries.
+ * @param dwFlushDelay - maximum age of unsaved entries in milliseconds; pass 0 to ignore age of entries.
+ * @param dwFlushBytes - size of new entries that triggers flush; pass 0 to ignore size of entries.
+ * @return true if operation was accepted.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogFlushPolicy(INT_PTR iHandle, DWORD dwFlushEntries, DWORD dwFlushDelay, DWORD dwFlushBytes)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = pLogFile->SetLogFlushPolicy(dwFlushEntries, dwFlushDelay, dwFlushBytes);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return maximum number of entries per second written from one call site.
+ */
+extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogRateLimit(INT_PTR iHandle)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return 0;
+	DWORD dwLogRateLimit = pLogFile->GetLogThrottle().GetRateLimit();
+	LeaveLogFunction(iHandle, pLogFile);
+	return dwLogRateLimit;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwLogRateLimit - maximum number of entries per second written from one call site; pass 0 to disable rate limit.
+ * @return true if operation was accepted.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogRateLimit(INT_PTR iHandle, DWORD dwLogRateLimit)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	pLogFile->GetLogThrottle().SetRateLimit(dwLogRateLimit);
+	LeaveLogFunction(iHandle, pLogFile);
+	return TRUE;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return sample rate of log entries.
+ */
+extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogSampleRate(INT_PTR iHandle)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return 0;
+	DWORD dwLogSampleRate = pLogFile->GetLogThrottle().GetSampleRate();
+	LeaveLogFunction(iHandle, pLogFile);
+	return dwLogSampleRate;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwLogSampleRate - only one of this number of entries is written from every call site; pass 0 or 1 to write all entries.
+ * @return true if operation was accepted.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogSampleRate(INT_PTR iHandle, DWORD dwLogSampleRate)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	pLogFile->GetLogThrottle().SetSampleRate(dwLogSampleRate);
+	LeaveLogFunction(iHandle, pLogFile);
+	return TRUE;
+}
+
 /**
  * @param iHandle - log file handle.
  * @return current set of log flags.
@@ -1046,7 +1550,7 @@ extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogFlags(INT_PTR iHandle)
 	if (! pLogFile)
 		return BTLF_NONE;
 	DWORD dwLogFlags = pLogFile->GetLogFlags();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return dwLogFlags;
 }
 
@@ -1061,7 +1565,7 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogFlags(INT_PTR iHandle, DWORD dwLog
 	if (! pLogFile)
 		return FALSE;
 	BOOL bResult = pLogFile->SetLogFlags(dwLogFlags);
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return bResult;
 }
 
@@ -1075,7 +1579,7 @@ extern "C" BUGTRAP_API BUGTRAP_LOGLEVEL APIENTRY BT_GetLogLevel(INT_PTR iHandle)
 	if (! pLogFile)
 		return BTLL_NONE;
 	BUGTRAP_LOGLEVEL eLogLevel = pLogFile->GetLogLevel();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return eLogLevel;
 }
 
@@ -1090,7 +1594,59 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogLevel(INT_PTR iHandle, BUGTRAP_LOG
 	if (! pLogFile)
 		return FALSE;
 	BOOL bResult = pLogFile->SetLogLevel(eLogLevel);
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param pszCategory - category name.
+ * @return category index or BTLC_NONE if category can't be registered.
+ */
+extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogCategory(INT_PTR iHandle, LPCTSTR pszCategory)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return BTLC_NONE;
+	DWORD dwCategory = pLogFile->GetLogCategories().GetCategory(pszCategory);
+	LeaveLogFunction(iHandle, pLogFile);
+	return dwCategory;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param pszCategoryLevels - comma separated list of category levels, e.g. "net=VERBOSE, db=WARNING".
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogCategoryLevels(INT_PTR iHandle, LPCTSTR pszCategoryLevels)
+{
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = pLogFile->GetLogCategories().SetCategoryLevels(pszCategoryLevels);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - category index or BTLC_NONE.
+ * @param eLogLevel - log level number.
+ * @return true if entry passes the log filter.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_IsLogLevelEnabled(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel)
+{
+	// The check is performed on every trace call, so the log isn't locked.
+	if (! EnterStagedLogFunction())
+		return FALSE;
+	BOOL bResult = FALSE;
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
+	if (pLogFile != NULL)
+	{
+		bResult = pLogFile->IsLogLevelEnabled(dwCategory, eLogLevel);
+		g_LogHandles.ReleaseLogFile(iHandle);
+	}
+	LeaveStagedLogFunction();
 	return bResult;
 }
 
@@ -1104,7 +1660,7 @@ extern "C" BUGTRAP_API DWORD APIENTRY BT_GetLogEchoMode(INT_PTR iHandle)
 	if (! pLogFile)
 		return BTLE_NONE;
 	DWORD dwLogEchoMode = pLogFile->GetLogEchoMode();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return dwLogEchoMode;
 }
 
@@ -1119,7 +1675,7 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_SetLogEchoMode(INT_PTR iHandle, DWORD dw
 	if (! pLogFile)
 		return FALSE;
 	BOOL bResult = pLogFile->SetLogEchoMode(dwLogEchoMode);
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
 	return bResult;
 }
 
@@ -1157,7 +1713,7 @@ extern "C" BUGTRAP_API void CDECL BT_CallNetFilter(void)
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszEntry)
 {
-	return WriteLogEntry(iHandle, eLogLevel, CLogFile::EM_INSERT, pszEntry);
+	return WriteLogEntry(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_INSERT, pszEntry);
 }
 
 /**
@@ -1168,7 +1724,127 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntry(INT_PTR iHandle, BUGTRAP_LOG
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_AppLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszEntry)
 {
-	return WriteLogEntry(iHandle, eLogLevel, CLogFile::EM_APPEND, pszEntry);
+	return WriteLogEntry(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_APPEND, pszEntry);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param eLogLevel - log level number.
+ * @param pszEntry - text of message encoded in UTF-8.
+ * @param dwLength - text length in bytes or -1 if text is null-terminated.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntryUTF8(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength)
+{
+	if (pszEntry != NULL && dwLength == MAXDWORD)
+		dwLength = (DWORD)strlen(pszEntry);
+	return WriteLogEntryUTF8(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_INSERT, pszEntry, dwLength);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param eLogLevel - log level number.
+ * @param pszEntry - text of message encoded in UTF-8.
+ * @param dwLength - text length in bytes or -1 if text is null-terminated.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_AppLogEntryUTF8(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength)
+{
+	if (pszEntry != NULL && dwLength == MAXDWORD)
+		dwLength = (DWORD)strlen(pszEntry);
+	return WriteLogEntryUTF8(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_APPEND, pszEntry, dwLength);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category returned by BT_GetLogCategory().
+ * @param eLogLevel - log level number.
+ * @param pszEntry - text of message.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntryEx(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszEntry)
+{
+	return WriteLogEntry(iHandle, dwCategory, eLogLevel, CLogFile::EM_INSERT, pszEntry);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category returned by BT_GetLogCategory().
+ * @param eLogLevel - log level number.
+ * @param pszEntry - text of message.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_AppLogEntryEx(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszEntry)
+{
+	return WriteLogEntry(iHandle, dwCategory, eLogLevel, CLogFile::EM_APPEND, pszEntry);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category returned by BT_GetLogCategory().
+ * @param eLogLevel - log level number.
+ * @param pszFormat - printf-like message format.
+ * @param argList - variable length argument list.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntryExV(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszFormat, va_list argList)
+{
+	return WriteLogEntry(iHandle, dwCategory, eLogLevel, CLogFile::EM_INSERT, pszFormat, argList);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category returned by BT_GetLogCategory().
+ * @param eLogLevel - log level number.
+ * @param pszFormat - printf-like message format.
+ * @param argList - variable length argument list.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_AppLogEntryExV(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszFormat, va_list argList)
+{
+	return WriteLogEntry(iHandle, dwCategory, eLogLevel, CLogFile::EM_APPEND, pszFormat, argList);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category returned by BT_GetLogCategory().
+ * @param eLogLevel - log level number.
+ * @param pszEntry - text of message encoded in UTF-8.
+ * @param dwLength - text length in bytes or -1 if text is null-terminated.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntryExUTF8(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength)
+{
+	if (pszEntry != NULL && dwLength == MAXDWORD)
+		dwLength = (DWORD)strlen(pszEntry);
+	return WriteLogEntryUTF8(iHandle, dwCategory, eLogLevel, CLogFile::EM_INSERT, pszEntry, dwLength);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param dwCategory - entry category returned by BT_GetLogCategory().
+ * @param eLogLevel - log level number.
+ * @param pszEntry - text of message encoded in UTF-8.
+ * @param dwLength - text length in bytes or -1 if text is null-terminated.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_AppLogEntryExUTF8(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength)
+{
+	if (pszEntry != NULL && dwLength == MAXDWORD)
+		dwLength = (DWORD)strlen(pszEntry);
+	return WriteLogEntryUTF8(iHandle, dwCategory, eLogLevel, CLogFile::EM_APPEND, pszEntry, dwLength);
+}
+
+/**
+ * @param dwEventID - application defined event identifier.
+ * @param ullParam1 - 1st payload word.
+ * @param ullParam2 - 2nd payload word.
+ * @param ullParam3 - 3rd payload word.
+ * @param ullParam4 - 4th payload word.
+ */
+extern "C" BUGTRAP_API void APIENTRY BT_RecordEvent(DWORD dwEventID, ULONGLONG ullParam1, ULONGLONG ullParam2, ULONGLONG ullParam3, ULONGLONG ullParam4)
+{
+	g_FlightRecorder.RecordEvent(dwEventID, ullParam1, ullParam2, ullParam3, ullParam4);
 }
 
 /**
@@ -1181,7 +1857,7 @@ extern "C" BUGTRAP_API BOOL CDECL BT_AppLogEntryF(INT_PTR iHandle, BUGTRAP_LOGLE
 {
 	va_list argList;
 	va_start(argList, pszFormat);
-	BOOL bResult = WriteLogEntry(iHandle, eLogLevel, CLogFile::EM_APPEND, pszFormat, argList);
+	BOOL bResult = WriteLogEntry(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_APPEND, pszFormat, argList);
 	va_end(argList);
 	return bResult;
 }
@@ -1195,7 +1871,7 @@ extern "C" BUGTRAP_API BOOL CDECL BT_AppLogEntryF(INT_PTR iHandle, BUGTRAP_LOGLE
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_AppLogEntryV(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszFormat, va_list argList)
 {
-	return WriteLogEntry(iHandle, eLogLevel, CLogFile::EM_APPEND, pszFormat, argList);
+	return WriteLogEntry(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_APPEND, pszFormat, argList);
 }
 
 /**
@@ -1208,7 +1884,7 @@ extern "C" BUGTRAP_API BOOL CDECL BT_InsLogEntryF(INT_PTR iHandle, BUGTRAP_LOGLE
 {
 	va_list argList;
 	va_start(argList, pszFormat);
-	BOOL bResult = WriteLogEntry(iHandle, eLogLevel, CLogFile::EM_INSERT, pszFormat, argList);
+	BOOL bResult = WriteLogEntry(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_INSERT, pszFormat, argList);
 	va_end(argList);
 	return bResult;
 }
@@ -1222,7 +1898,7 @@ extern "C" BUGTRAP_API BOOL CDECL BT_InsLogEntryF(INT_PTR iHandle, BUGTRAP_LOGLE
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntryV(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, PCTSTR pszFormat, va_list argList)
 {
-	return WriteLogEntry(iHandle, eLogLevel, CLogFile::EM_INSERT, pszFormat, argList);
+	return WriteLogEntry(iHandle, BTLC_NONE, eLogLevel, CLogFile::EM_INSERT, pszFormat, argList);
 }
 
 /**
@@ -1231,12 +1907,46 @@ extern "C" BUGTRAP_API BOOL APIENTRY BT_InsLogEntryV(INT_PTR iHandle, BUGTRAP_LO
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_ClearLog(INT_PTR iHandle)
 {
+	DrainStagedEntries(iHandle);
 	CLogFile* pLogFile = EnterLogFunction(iHandle);
 	if (! pLogFile)
 		return FALSE;
 	// remove entries from the memory
 	BOOL bResult = pLogFile->ClearEntries();
-	LeaveLogFunction(pLogFile);
+	LeaveLogFunction(iHandle, pLogFile);
+	return bResult;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @param eMinLogLevel - the most severe accepted log level.
+ * @param eMaxLogLevel - the least severe accepted log level.
+ * @param pftStartTime - time of the oldest accepted entry or NULL.
+ * @param pftEndTime - time that follows the newest accepted entry or NULL.
+ * @param dwMaxEntries - maximum number of the newest matching entries.
+ * @param pfnCallback - function that receives matching entries.
+ * @param nQueryParam - parameter passed to the callback.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_QueryLogEntries(INT_PTR iHandle, BUGTRAP_LOGLEVEL eMinLogLevel, BUGTRAP_LOGLEVEL eMaxLogLevel, const FILETIME* pftStartTime, const FILETIME* pftEndTime, DWORD dwMaxEntries, BT_LogEntryCallback pfnCallback, INT_PTR nQueryParam)
+{
+	if (pfnCallback == NULL)
+		return FALSE;
+	CLogQuery LogQuery;
+	LogQuery.m_eMinLogLevel = eMinLogLevel;
+	LogQuery.m_eMaxLogLevel = eMaxLogLevel;
+	LogQuery.m_ullStartTime = pftStartTime ? ((ULONGLONG)pftStartTime->dwHighDateTime << 32) | pftStartTime->dwLowDateTime : 0;
+	LogQuery.m_ullEndTime = pftEndTime ? ((ULONGLONG)pftEndTime->dwHighDateTime << 32) | pftEndTime->dwLowDateTime : ~(ULONGLONG)0;
+	LogQuery.m_dwMaxEntries = dwMaxEntries;
+	LogQuery.m_pfnCallback = pfnCallback;
+	LogQuery.m_nQueryParam = nQueryParam;
+	// Staged entries have to be visible to the query.
+	DrainStagedEntries(iHandle);
+	CLogFile* pLogFile = EnterLogFunction(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = pLogFile->QueryEntries(LogQuery);
+	LeaveLogFunction(iHandle, pLogFile);
 	return bResult;
 }
 
@@ -1357,6 +2067,17 @@ extern "C" BUGTRAP_API void APIENTRY BT_SetMailProfile(PCTSTR pszMailProfile, PC
  * @return handle of opened log file or NULL value.
  */
 extern "C" BUGTRAP_API INT_PTR APIENTRY BT_OpenLogFile(PCTSTR pszLogFileName, BUGTRAP_LOGFORMAT eLogFormat)
+{
+	return BT_OpenLogFileEx(pszLogFileName, eLogFormat, BTLF_NONE);
+}
+
+/**
+ * @param pszLogFileName - pointer to log file name or NULL pointer for default log file name value.
+ * @param eLogFormat - log file format.
+ * @param dwLogFlags - set of log flags.
+ * @return handle of opened log file or NULL value.
+ */
+extern "C" BUGTRAP_API INT_PTR APIENTRY BT_OpenLogFileEx(PCTSTR pszLogFileName, BUGTRAP_LOGFORMAT eLogFormat, DWORD dwLogFlags)
 {
 	CLogFile* pLogFile;
 	switch (eLogFormat)
@@ -1370,32 +2091,37 @@ extern "C" BUGTRAP_API INT_PTR APIENTRY BT_OpenLogFile(PCTSTR pszLogFileName, BU
 	case BTLF_STREAM:
 		pLogFile = new CLogStream();
 		break;
+	case BTLF_MMAP:
+		pLogFile = new CMappedLogFile();
+		break;
+	case BTLF_BINARY:
+		pLogFile = new CBinaryLogFile();
+		break;
 	default:
 		_ASSERT(FALSE);
 		return NULL;
 	}
-	size_t nCount = 0;
+	INT_PTR iHandle = 0;
 	if (pLogFile != NULL)
 	{
 		EnterLogFunction();
 		pLogFile->SetLogFileName(pszLogFileName);
 		pszLogFileName = pLogFile->GetLogFileName();
+		// Flags are applied to loaded entries, deferred entries are merged with respect to them later.
 		if (CreateParentFolder(pszLogFileName) &&
-			pLogFile->LoadEntries())
+			((dwLogFlags & BTLF_DEFERREDLOAD) != 0 ? pLogFile->DeferLoadEntries() : pLogFile->LoadEntries()) &&
+			(dwLogFlags == BTLF_NONE || pLogFile->SetLogFlags(dwLogFlags)))
 		{
-			EnterCriticalSection(&g_csMutualLogAccess);
-			g_arrLogFiles.AddItem(pLogFile);
-			nCount = g_arrLogFiles.GetCount();
-			LeaveCriticalSection(&g_csMutualLogAccess);
+			iHandle = g_LogHandles.AddLogFile(pLogFile);
 		}
 		LeaveLogFunction();
 	}
-	if (nCount == 0)
+	if (iHandle == 0)
 	{
 		delete pLogFile;
 		pLogFile = NULL;
 	}
-	return nCount;
+	return iHandle;
 }
 
 /**
@@ -1404,26 +2130,102 @@ extern "C" BUGTRAP_API INT_PTR APIENTRY BT_OpenLogFile(PCTSTR pszLogFileName, BU
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_CloseLogFile(INT_PTR iHandle)
 {
-	BT_FlushLogFile(iHandle);
-	// remove file entry from the list
+	// Handle is invalidated first, requests that have already found the log are completed before it's removed.
+	CLogFile* pClosedLogFile = g_LogHandles.RemoveLogFile(iHandle);
+	if (! pClosedLogFile)
+		return FALSE;
+	// Staged entries keep raw pointer to the log, it can't be deleted until they are written.
+	// The counter is checked instead of log flags, which may have been changed after entries were staged.
+	while (pClosedLogFile->HasStagedEntries())
+		g_LogStaging.Drain();
+	// Tees must not forward entries to deleted log.
 	EnterCriticalSection(&g_csMutualLogAccess);
-	if (iHandle >= 1 && iHandle <= (INT_PTR)g_arrLogFiles.GetCount())
-		g_arrLogFiles.DeleteItem(iHandle-1);
+	DWORD dwNumSlots = g_LogHandles.GetNumSlots();
+	for (DWORD dwSlot = 0; dwSlot < dwNumSlots; ++dwSlot)
+	{
+		INT_PTR iTeeHandle = g_LogHandles.GetSlotHandle(dwSlot);
+		CLogFile* pLogTee = g_LogHandles.AcquireLogFile(iTeeHandle);
+		if (pLogTee == NULL)
+			continue;
+		if (pLogTee->IsLogTee())
+		{
+			pLogTee->CaptureObject();
+			pLogTee->DetachLogFile(pClosedLogFile);
+			pLogTee->ReleaseObject();
+		}
+		g_LogHandles.ReleaseLogFile(iTeeHandle);
+	}
 	LeaveCriticalSection(&g_csMutualLogAccess);
+	if (EnterLogFunction(pClosedLogFile))
+	{
+		DWORD dwNumSuppressed = pClosedLogFile->GetLogThrottle().ResetSuppressedEntries();
+		if (dwNumSuppressed != 0)
+			WriteSuppressedEntries(pClosedLogFile, FALSE, BTLL_WARNING, CLogFile::EM_APPEND, dwNumSuppressed);
+		pClosedLogFile->SaveEntries(false);
+		LeaveLogFunction(pClosedLogFile);
+	}
+	delete pClosedLogFile;
 	return TRUE;
 }
 
+/**
+ * @return handle of log tee or NULL if tee can't be created.
+ */
+extern "C" BUGTRAP_API INT_PTR APIENTRY BT_OpenLogTee(void)
+{
+	CLogTee* pLogTee = new CLogTee();
+	if (pLogTee == NULL)
+		return NULL;
+	INT_PTR iHandle = 0;
+	if (EnterLogFunction())
+	{
+		iHandle = g_LogHandles.AddLogFile(pLogTee);
+		LeaveLogFunction();
+	}
+	if (iHandle == 0)
+		delete pLogTee;
+	return iHandle;
+}
+
+/**
+ * @param iTeeHandle - log tee handle.
+ * @param iHandle - handle of log file that receives entries of the tee.
+ * @return true if operation was completed successfully.
+ */
+extern "C" BUGTRAP_API BOOL APIENTRY BT_AddLogTeeFile(INT_PTR iTeeHandle, INT_PTR iHandle)
+{
+	// Log can't be detached from tees while it's being added to the tee.
+	CLogFile* pLogFile = g_LogHandles.AcquireLogFile(iHandle);
+	if (! pLogFile)
+		return FALSE;
+	BOOL bResult = FALSE;
+	CLogFile* pLogTee = EnterLogFunction(iTeeHandle);
+	if (pLogTee != NULL)
+	{
+		bResult = pLogTee->IsLogTee() && static_cast<CLogTee*>(pLogTee)->AddLogFile(pLogFile);
+		LeaveLogFunction(iTeeHandle, pLogTee);
+	}
+	g_LogHandles.ReleaseLogFile(iHandle);
+	return bResult;
+}
+
 /**
  * @param iHandle - log file handle.
  * @return true if operation was completed successfully.
  */
 extern "C" BUGTRAP_API BOOL APIENTRY BT_FlushLogFile(INT_PTR iHandle)
 {
+	DrainStagedEntries(iHandle);
 	CLogFile* pLogFile = EnterLogFunction(iHandle);
 	if (! pLogFile)
 		return FALSE;
+	DWORD dwNumSuppressed = pLogFile->GetLogThrottle().ResetSuppressedEntries();
+	if (dwNumSuppressed != 0)
+		WriteSuppressedEntries(pLogFile, FALSE, BTLL_WARNING, CLogFile::EM_APPEND, dwNumSuppressed);
 	BOOL bResult = pLogFile->SaveEntries(false);
-	LeaveLogFunction(pLogFile);
+	// Failed flush isn't retried until new entries are added.
+	pLogFile->ResetDirtyEntries();
+	LeaveLogFunction(iHandle, pLogFile);
 	return bResult;
 }
 
@@ -225,6 +225,8 @@ BUGTRAP_LOGLEVEL;
 
 /**
  * @brief Type of log echo mode.
+ * Copies are queued and written by background thread in batches, entries
+ * that don't fit into the full queue are dropped and their number is reported.
  */
 typedef enum BUGTRAP_LOGECHOTYPE_tag
 {
@@ -255,16 +257,68 @@ typedef enum BUGTRAP_LOGFLAGS_tag
 	/**
 	 * @brief Do not show any additional entries in the log.
 	 */
-	BTLF_NONE          = 0x00,
+	BTLF_NONE            = 0x00,
 	/**
 	 * @brief Use this option if you want to store message levels in a file.
 	 */
-	BTLF_SHOWLOGLEVEL  = 0x01,
+	BTLF_SHOWLOGLEVEL    = 0x01,
 	/**
 	 * @brief Use this option if you want to store message timestamps in a file.
 	 * Timestamps are stored in universal (locale independent) format: YYYY/MM/DD HH:MM:SS
 	 */
-	BTLF_SHOWTIMESTAMP = 0x02
+	BTLF_SHOWTIMESTAMP   = 0x02,
+	/**
+	 * @brief Use this option if you want to stage log entries in per-thread buffers.
+	 * Logging functions never wait for other threads, entries are moved to the log
+	 * by background thread. Entries are dropped when thread buffer is overflowed.
+	 */
+	BTLF_STAGEDWRITES    = 0x04,
+	/**
+	 * @brief Use this option if you want to write @a BTLF_STREAM log in background thread.
+	 * Entries are collected in the write queue and written to the file in large blocks.
+	 * Size of the queue can be changed by BT_SetLogBufferSize().
+	 */
+	BTLF_ASYNCWRITES     = 0x08,
+	/**
+	 * @brief Use this option if you want to drop log entries when write queue is full.
+	 * By default logging functions wait until queued data is written to the file.
+	 */
+	BTLF_DROPONOVERFLOW  = 0x10,
+	/**
+	 * @brief Use this option if you want to keep @a BTLF_TEXT or @a BTLF_XML log in ring buffer.
+	 * Entry data is stored in one pre-allocated block and the oldest entries are evicted
+	 * when the buffer is full. Size of the buffer can be changed by BT_SetLogBufferSize().
+	 */
+	BTLF_RINGBUFFER      = 0x20,
+	/**
+	 * @brief Use this option if you want to save only new entries of @a BTLF_TEXT log.
+	 * Entries evicted from the log are replaced by blank lines and the file is compacted
+	 * when erased space grows too large or when the crash has occurred.
+	 */
+	BTLF_INCREMENTALSAVE = 0x40,
+	/**
+	 * @brief Use this option if you want time stamps to have microsecond resolution.
+	 */
+	BTLF_MICROSECONDS    = 0x80,
+	/**
+	 * @brief Use this option if you want repeated entries of @a BTLF_TEXT or @a BTLF_XML log to be merged.
+	 * Entry that has the same level and text as the previous one only updates repeat counter
+	 * and time of the last occurrence of the previous entry.
+	 */
+	BTLF_COALESCE        = 0x100,
+	/**
+	 * @brief Use this option if you want older entries of @a BTLF_TEXT log to be kept compressed in memory.
+	 * Only the newest entries stay uncompressed and maximum log size in bytes limits the size of
+	 * compressed data. Entries are compressed by background thread, logging functions don't wait
+	 * for compression. This option has no effect when @a BTLF_RINGBUFFER is used.
+	 */
+	BTLF_COMPRESSMEMORY  = 0x200,
+	/**
+	 * @brief Use this option if you want entries of the previous session to be loaded in background thread.
+	 * The log is available for new entries immediately and old entries are put before them when the log
+	 * is saved. This option has effect only when it's passed to BT_OpenLogFileEx().
+	 */
+	BTLF_DEFERREDLOAD    = 0x400
 }
 BUGTRAP_LOGFLAGS;
 
@@ -306,7 +360,22 @@ typedef enum BUGTRAP_LOGFORMAT_tag
 	 * Unlike @a BTLF_XML and @a BTLF_TEXT log data is not cached in memory.
 	 * This type of log is optimized for large logs.
 	 */
-	BTLF_STREAM = 3
+	BTLF_STREAM = 3,
+	/**
+	 * @brief Log stored in memory mapped circular file.
+	 * Entries are copied straight into the mapping, so the log survives the crash
+	 * of the process without saving. Oldest entries are overwritten when the file
+	 * is full, size of the file can be changed by BT_SetLogSizeInBytes().
+	 */
+	BTLF_MMAP   = 4,
+	/**
+	 * @brief Log stored in plain text format with deferred formatting.
+	 * Entries are kept in memory in binary form: format string, raw argument
+	 * values, log level and time stamp. Entry text is rendered only when the log
+	 * is saved, so tracing functions don't spend time on formatting. Size limits
+	 * apply to binary form of the entries.
+	 */
+	BTLF_BINARY = 5
 }
 BUGTRAP_LOGFORMAT;
 
@@ -370,6 +439,35 @@ typedef struct BUGTRAP_REGEXPORTENTRY_tag
 }
 BUGTRAP_REGEXPORTENTRY;
 
+/**
+ * @brief Read-only view of log entry passed to BT_QueryLogEntries() callback.
+ */
+typedef struct BUGTRAP_LOGENTRYVIEW_tag
+{
+	/**
+	 * @brief Entry log level or @a BTLL_NONE if it's unknown.
+	 */
+	BUGTRAP_LOGLEVEL eLogLevel;
+	/**
+	 * @brief Entry time (local) or zero if it's unknown.
+	 */
+	FILETIME ftTime;
+	/**
+	 * @brief Entry text kept by the log, it's valid only until the callback returns.
+	 * Text isn't null-terminated and may include entry prefix.
+	 */
+	LPCVOID pEntryText;
+	/**
+	 * @brief Size of entry text in bytes.
+	 */
+	DWORD dwEntryTextSize;
+	/**
+	 * @brief True if entry text is encoded in UTF-8, otherwise it's a string of TCHARs.
+	 */
+	BOOL bUTF8Text;
+}
+BUGTRAP_LOGENTRYVIEW;
+
 /**
  * @brief Type definition of user-defined error handler that's called before and after main BugTrap dialog.
  */
@@ -380,6 +478,12 @@ typedef void (CALLBACK * BT_ErrHandler)(INT_PTR nErrHandlerParam);
 */
 typedef void (CALLBACK * BT_CustomActivityHandler)(LPCTSTR pszReportFilePath,  INT_PTR nCustomActivityHandlerParam);
 
+/**
+ * @brief Type definition of function that receives log entries found by BT_QueryLogEntries().
+ * Return false to stop the query.
+ */
+typedef BOOL (CALLBACK * BT_LogEntryCallback)(const BUGTRAP_LOGENTRYVIEW* pEntryView, INT_PTR nQueryParam);
+
 /** @} */
 
 /**
@@ -684,14 +788,33 @@ BUGTRAP_API void APIENTRY BT_SetCustomActivityHandler(BT_CustomActivityHandler p
  * @{
  */
 
+/// Category of log entries that don't belong to any category.
+#define BTLC_NONE                     0
+
 /**
  * @brief Open custom log file. This function is thread safe.
  */
 BUGTRAP_API INT_PTR APIENTRY BT_OpenLogFile(LPCTSTR pszLogFileName, BUGTRAP_LOGFORMAT eLogFormat);
+/**
+ * @brief Open custom log file with the given set of log flags. This function is thread safe.
+ * Pass @a BTLF_DEFERREDLOAD to return without waiting until entries of the previous session are loaded.
+ */
+BUGTRAP_API INT_PTR APIENTRY BT_OpenLogFileEx(LPCTSTR pszLogFileName, BUGTRAP_LOGFORMAT eLogFormat, DWORD dwLogFlags);
 /**
  * @brief Close custom log file. This function is thread safe.
+ * Handles of other log files remain valid and the closed handle is rejected by all log functions.
  */
 BUGTRAP_API BOOL APIENTRY BT_CloseLogFile(INT_PTR iHandle);
+/**
+ * @brief Open log tee that forwards every entry to attached log files. This function is thread safe.
+ * Entry written to the tee is formatted and timed once and its encoded text is shared by attached
+ * logs. Close the tee with BT_CloseLogFile(), attached logs are closed by their own handles.
+ */
+BUGTRAP_API INT_PTR APIENTRY BT_OpenLogTee(void);
+/**
+ * @brief Attach log file to log tee. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_AddLogTeeFile(INT_PTR iTeeHandle, INT_PTR iHandle);
 /**
  * @brief Flush contents of the log file.
  * @note This function is optional and not required in normal conditions.
@@ -715,8 +838,69 @@ BUGTRAP_API BOOL APIENTRY BT_SetLogSizeInEntries(INT_PTR iHandle, DWORD dwLogSiz
 BUGTRAP_API DWORD APIENTRY BT_GetLogSizeInBytes(INT_PTR iHandle);
 /**
  * @brief Set maximum log file size in bytes. This function is thread safe.
+ * Stream logs are rotated when the active file reaches this size.
  */
 BUGTRAP_API BOOL APIENTRY BT_SetLogSizeInBytes(INT_PTR iHandle, DWORD dwLogSizeInEntries);
+/**
+ * @brief Get size of log buffer in bytes. This function is thread safe.
+ * Log buffer is the memory budget of the log and its meaning depends on log type:
+ * @a BTLF_STREAM log uses it as the write queue of @a BTLF_ASYNCWRITES mode,
+ * @a BTLF_RINGBUFFER log stores all entries in the buffer of this size,
+ * other logs reserve this amount of memory for entries and return memory
+ * above it to the system when entries are released. Per-thread buffers
+ * of @a BTLF_STAGEDWRITES mode have fixed size and aren't affected.
+ */
+BUGTRAP_API DWORD APIENTRY BT_GetLogBufferSize(INT_PTR iHandle);
+/**
+ * @brief Set size of log buffer in bytes. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogBufferSize(INT_PTR iHandle, DWORD dwLogBufferSize);
+/**
+ * @brief Get maximum age of stream log segment in minutes. This function is thread safe.
+ */
+BUGTRAP_API DWORD APIENTRY BT_GetLogSegmentTime(INT_PTR iHandle);
+/**
+ * @brief Set maximum age of stream log segment in minutes. This function is thread safe.
+ * Closed segments are compressed in background and added to the error report.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogSegmentTime(INT_PTR iHandle, DWORD dwLogSegmentTime);
+/**
+ * @brief Get number of kept stream log segments. This function is thread safe.
+ */
+BUGTRAP_API DWORD APIENTRY BT_GetLogSegmentCount(INT_PTR iHandle);
+/**
+ * @brief Set number of kept stream log segments. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogSegmentCount(INT_PTR iHandle, DWORD dwLogSegmentCount);
+/**
+ * @brief Get conditions of automatic flush. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_GetLogFlushPolicy(INT_PTR iHandle, PDWORD pdwFlushEntries, PDWORD pdwFlushDelay, PDWORD pdwFlushBytes);
+/**
+ * @brief Set conditions of automatic flush. This function is thread safe.
+ * Cached log is saved by background thread when the number of new entries reaches @a dwFlushEntries,
+ * the oldest unsaved entry gets older than @a dwFlushDelay milliseconds or new entries take more than
+ * @a dwFlushBytes bytes. Pass 0 to ignore the condition. Stream logs don't need this policy.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogFlushPolicy(INT_PTR iHandle, DWORD dwFlushEntries, DWORD dwFlushDelay, DWORD dwFlushBytes);
+/**
+ * @brief Get maximum number of entries per second written from one call site. This function is thread safe.
+ */
+BUGTRAP_API DWORD APIENTRY BT_GetLogRateLimit(INT_PTR iHandle);
+/**
+ * @brief Set maximum number of entries per second written from one call site. This function is thread safe.
+ * Call site is identified by format string or by entry text. Suppressed entries
+ * are counted and reported by summary entry.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogRateLimit(INT_PTR iHandle, DWORD dwLogRateLimit);
+/**
+ * @brief Get sample rate of log entries. This function is thread safe.
+ */
+BUGTRAP_API DWORD APIENTRY BT_GetLogSampleRate(INT_PTR iHandle);
+/**
+ * @brief Set sample rate of log entries: only one of N entries is written from every call site. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogSampleRate(INT_PTR iHandle, DWORD dwLogSampleRate);
 /**
  * @brief Return true if time stamp is added to every log entry.
  */
@@ -733,6 +917,22 @@ BUGTRAP_API BUGTRAP_LOGLEVEL APIENTRY BT_GetLogLevel(INT_PTR iHandle);
  * @brief Set minimal log level accepted by tracing functions.
  */
 BUGTRAP_API BOOL APIENTRY BT_SetLogLevel(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel);
+/**
+ * @brief Find or register category of log entries. This function is thread safe.
+ * Resolve category once and keep returned value, @a BTLC_NONE is returned on failure.
+ */
+BUGTRAP_API DWORD APIENTRY BT_GetLogCategory(INT_PTR iHandle, LPCTSTR pszCategory);
+/**
+ * @brief Assign levels to categories of log entries, e.g. "net=VERBOSE, db=WARNING". This function is thread safe.
+ * Category level overrides the level of the log in both directions. Categories that aren't listed use the level of the log.
+ * Pass the category to @a BT_InsLogEntryEx() and related functions to apply its level.
+ */
+BUGTRAP_API BOOL APIENTRY BT_SetLogCategoryLevels(INT_PTR iHandle, LPCTSTR pszCategoryLevels);
+/**
+ * @brief Return true if entry of given category and level passes the log filter. This function is thread safe.
+ * The check doesn't lock the log, so call it before formatting expensive entries.
+ */
+BUGTRAP_API BOOL APIENTRY BT_IsLogLevelEnabled(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel);
 /**
  * @brief Get echo mode.
  */
@@ -745,6 +945,16 @@ BUGTRAP_API BOOL APIENTRY BT_SetLogEchoMode(INT_PTR iHandle, DWORD dwLogEchoMode
  * @brief Clear log file. This function is thread safe.
  */
 BUGTRAP_API BOOL APIENTRY BT_ClearLog(INT_PTR iHandle);
+/**
+ * @brief Pass the newest log entries that match the filter to the callback in chronological order. This function is thread safe.
+ * Levels are compared by their numbers, e.g. @a BTLL_ERROR..@a BTLL_WARNING, time range includes
+ * @a pftStartTime and excludes @a pftEndTime, pass NULL to leave the range open. Pass -1 in
+ * @a dwMaxEntries to get all matching entries. Entries are filtered by index kept beside
+ * entry data, so only matching entries are accessed. Only @a BTLF_TEXT, @a BTLF_XML and
+ * @a BTLF_BINARY logs can be queried. The log is locked until the query is complete, so
+ * the callback must not write entries to the same log.
+ */
+BUGTRAP_API BOOL APIENTRY BT_QueryLogEntries(INT_PTR iHandle, BUGTRAP_LOGLEVEL eMinLogLevel, BUGTRAP_LOGLEVEL eMaxLogLevel, const FILETIME* pftStartTime, const FILETIME* pftEndTime, DWORD dwMaxEntries, BT_LogEntryCallback pfnCallback, INT_PTR nQueryParam);
 /**
  * @brief Insert entry into the beginning of custom log file. This function is thread safe.
  */
@@ -769,6 +979,48 @@ BUGTRAP_API BOOL APIENTRY BT_InsLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogL
  * @brief Append entry to the end of custom log file. This function is thread safe.
  */
 BUGTRAP_API BOOL APIENTRY BT_AppLogEntry(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszEntry);
+/**
+ * @brief Insert entry encoded in UTF-8 into the beginning of custom log file. This function is thread safe.
+ * Pass -1 in @a dwLength if text is null-terminated.
+ */
+BUGTRAP_API BOOL APIENTRY BT_InsLogEntryUTF8(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength);
+/**
+ * @brief Append entry encoded in UTF-8 to the end of custom log file. This function is thread safe.
+ * Pass -1 in @a dwLength if text is null-terminated.
+ */
+BUGTRAP_API BOOL APIENTRY BT_AppLogEntryUTF8(INT_PTR iHandle, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength);
+/**
+ * @brief Insert entry of given category into the beginning of custom log file. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_InsLogEntryEx(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszEntry);
+/**
+ * @brief Append entry of given category to the end of custom log file. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_AppLogEntryEx(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszEntry);
+/**
+ * @brief Insert entry of given category into the beginning of custom log file. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_InsLogEntryExV(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszFormat, va_list argList);
+/**
+ * @brief Append entry of given category to the end of custom log file. This function is thread safe.
+ */
+BUGTRAP_API BOOL APIENTRY BT_AppLogEntryExV(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCTSTR pszFormat, va_list argList);
+/**
+ * @brief Insert entry of given category encoded in UTF-8 into the beginning of custom log file. This function is thread safe.
+ * Pass -1 in @a dwLength if text is null-terminated.
+ */
+BUGTRAP_API BOOL APIENTRY BT_InsLogEntryExUTF8(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength);
+/**
+ * @brief Append entry of given category encoded in UTF-8 to the end of custom log file. This function is thread safe.
+ * Pass -1 in @a dwLength if text is null-terminated.
+ */
+BUGTRAP_API BOOL APIENTRY BT_AppLogEntryExUTF8(INT_PTR iHandle, DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel, LPCSTR pszEntry, DWORD dwLength);
+/**
+ * @brief Record binary event in the flight recorder of the calling thread. This function is thread safe.
+ * Every thread keeps the last 1024 events in its own ring, the event is stored without locks and
+ * formatting. Events of all threads are merged by time and written to error report as flightrec.txt.
+ */
+BUGTRAP_API void APIENTRY BT_RecordEvent(DWORD dwEventID, ULONGLONG ullParam1, ULONGLONG ullParam2, ULONGLONG ullParam3, ULONGLONG ullParam4);
 
 /** @} */
 
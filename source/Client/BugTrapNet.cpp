@@ -216,6 +216,66 @@ namespace IntelleSoft
 			ValidateIoResult(BT_SetLogSizeInBytes((INT_PTR)this->handle, value));
 		}
 
+		int LogFile::LogBufferSize::get(void)
+		{
+			ValidateHandle();
+			return BT_GetLogBufferSize((INT_PTR)this->handle);
+		}
+
+		void LogFile::LogBufferSize::set(int value)
+		{
+			ValidateHandle();
+			ValidateIoResult(BT_SetLogBufferSize((INT_PTR)this->handle, value));
+		}
+
+		int LogFile::LogSegmentTime::get(void)
+		{
+			ValidateHandle();
+			return BT_GetLogSegmentTime((INT_PTR)this->handle);
+		}
+
+		void LogFile::LogSegmentTime::set(int value)
+		{
+			ValidateHandle();
+			ValidateIoResult(BT_SetLogSegmentTime((INT_PTR)this->handle, value));
+		}
+
+		int LogFile::LogSegmentCount::get(void)
+		{
+			ValidateHandle();
+			return BT_GetLogSegmentCount((INT_PTR)this->handle);
+		}
+
+		void LogFile::LogSegmentCount::set(int value)
+		{
+			ValidateHandle();
+			ValidateIoResult(BT_SetLogSegmentCount((INT_PTR)this->handle, value));
+		}
+
+		int LogFile::LogRateLimit::get(void)
+		{
+			ValidateHandle();
+			return BT_GetLogRateLimit((INT_PTR)this->handle);
+		}
+
+		void LogFile::LogRateLimit::set(int value)
+		{
+			ValidateHandle();
+			ValidateIoResult(BT_SetLogRateLimit((INT_PTR)this->handle, value));
+		}
+
+		int LogFile::LogSampleRate::get(void)
+		{
+			ValidateHandle();
+			return BT_GetLogSampleRate((INT_PTR)this->handle);
+		}
+
+		void LogFile::LogSampleRate::set(int value)
+		{
+			ValidateHandle();
+			ValidateIoResult(BT_SetLogSampleRate((INT_PTR)this->handle, value));
+		}
+
 		LogFlagsType LogFile::LogFlags::get(void)
 		{
 			ValidateHandle();
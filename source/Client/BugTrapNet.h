@@ -90,9 +90,17 @@ namespace IntelleSoft
 		[Flags]
 		public enum class LogFlagsType
 		{
-			None          = BTLF_NONE,
-			ShowLogLevel  = BTLF_SHOWLOGLEVEL,
-			ShowTimeStamp = BTLF_SHOWTIMESTAMP
+			None            = BTLF_NONE,
+			ShowLogLevel    = BTLF_SHOWLOGLEVEL,
+			ShowTimeStamp   = BTLF_SHOWTIMESTAMP,
+			StagedWrites    = BTLF_STAGEDWRITES,
+			AsyncWrites     = BTLF_ASYNCWRITES,
+			DropOnOverflow  = BTLF_DROPONOVERFLOW,
+			RingBuffer      = BTLF_RINGBUFFER,
+			IncrementalSave = BTLF_INCREMENTALSAVE,
+			Microseconds    = BTLF_MICROSECONDS,
+			Coalesce        = BTLF_COALESCE,
+			CompressMemory  = BTLF_COMPRESSMEMORY
 		};
 
 		public enum class ReportFormatType
@@ -103,9 +111,11 @@ namespace IntelleSoft
 
 		public enum class LogFormatType
 		{
-			Xml  = BTLF_XML,
-			Text = BTLF_TEXT,
-			Stream = BTLF_STREAM
+			Xml    = BTLF_XML,
+			Text   = BTLF_TEXT,
+			Stream = BTLF_STREAM,
+			Mmap   = BTLF_MMAP,
+			Binary = BTLF_BINARY
 		};
 
 		public enum class DialogMessageType
@@ -337,6 +347,31 @@ namespace IntelleSoft
 				int get(void);
 				void set(int value);
 			}
+			property int LogBufferSize
+			{
+				int get(void);
+				void set(int value);
+			}
+			property int LogSegmentTime
+			{
+				int get(void);
+				void set(int value);
+			}
+			property int LogSegmentCount
+			{
+				int get(void);
+				void set(int value);
+			}
+			property int LogRateLimit
+			{
+				int get(void);
+				void set(int value);
+			}
+			property int LogSampleRate
+			{
+				int get(void);
+				void set(int value);
+			}
 			property LogFlagsType LogFlags
 			{
 				LogFlagsType get(void);
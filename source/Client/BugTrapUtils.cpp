@@ -339,6 +339,90 @@ BOOL GetCompleteLogFileName(PTSTR pszCompleteLogFileName, PCTSTR pszLogFileName,
 	return TRUE;
 }
 
+/// Header of compressed log segment: gzip signature, deflate method, no flags, no time stamp, NTFS.
+const BYTE g_arrGZipHeader[10] = { 0x1F, 0x8B, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x0B };
+
+/**
+ * @brief Get name of closed log segment. Segment number is inserted before
+ * log file extension, e.g. "app.txt" becomes "app.00000001.txt".
+ * @param pszSegmentFileName - buffer for segment file name (MAX_PATH characters).
+ * @param pszLogFileName - log file name.
+ * @param dwSegmentNumber - segment number.
+ */
+void GetLogSegmentFileName(PTSTR pszSegmentFileName, PCTSTR pszLogFileName, DWORD dwSegmentNumber)
+{
+	_tcscpy_s(pszSegmentFileName, MAX_PATH, pszLogFileName);
+	PTSTR pszExtension = PathFindExtension(pszSegmentFileName);
+	TCHAR szExtension[MAX_PATH];
+	_tcscpy_s(szExtension, countof(szExtension), pszExtension);
+	_stprintf_s(pszExtension, MAX_PATH - (pszExtension - pszSegmentFileName), _T(".%08lu%s"), dwSegmentNumber, szExtension);
+}
+
+/**
+ * @param pszSegmentTemplate - buffer for search template (MAX_PATH characters).
+ * @param pszLogFileName - log file name.
+ */
+void GetLogSegmentTemplate(PTSTR pszSegmentTemplate, PCTSTR pszLogFileName)
+{
+	_tcscpy_s(pszSegmentTemplate, MAX_PATH, pszLogFileName);
+	PTSTR pszExtension = PathFindExtension(pszSegmentTemplate);
+	TCHAR szExtension[MAX_PATH];
+	_tcscpy_s(szExtension, countof(szExtension), pszExtension);
+	_stprintf_s(pszExtension, MAX_PATH - (pszExtension - pszSegmentTemplate), _T(".*%s*"), szExtension);
+}
+
+/**
+ * @param pszFileName - name of found file (without path).
+ * @param pszLogFileName - log file name.
+ * @param dwSegmentNumber - segment number.
+ * @param bCompressed - true if segment has been compressed.
+ * @return true if file is a segment of the log.
+ */
+BOOL ParseLogSegmentFileName(PCTSTR pszFileName, PCTSTR pszLogFileName, DWORD& dwSegmentNumber, BOOL& bCompressed)
+{
+	PCTSTR pszLogName = PathFindFileName(pszLogFileName);
+	PCTSTR pszLogExtension = PathFindExtension(pszLogName);
+	size_t nBaseLength = pszLogExtension - pszLogName;
+	if (_tcsnicmp(pszFileName, pszLogName, nBaseLength) != 0 || pszFileName[nBaseLength] != _T('.'))
+		return FALSE;
+	PCTSTR pszNumber = pszFileName + nBaseLength + 1;
+	dwSegmentNumber = 0;
+	int nNumDigits = 0;
+	while (_istdigit(*pszNumber))
+	{
+		dwSegmentNumber = dwSegmentNumber * 10 + (*pszNumber - _T('0'));
+		++pszNumber;
+		++nNumDigits;
+	}
+	if (nNumDigits != 8)
+		return FALSE;
+	size_t nExtensionLength = _tcslen(pszLogExtension);
+	if (_tcsnicmp(pszNumber, pszLogExtension, nExtensionLength) != 0)
+		return FALSE;
+	PCTSTR pszSuffix = pszNumber + nExtensionLength;
+	if (*pszSuffix == _T('\0'))
+		bCompressed = FALSE;
+	else if (_tcsicmp(pszSuffix, _T(".gz")) == 0)
+		bCompressed = TRUE;
+	else
+		return FALSE;
+	return TRUE;
+}
+
+/**
+ * @brief Prevent the library from being unloaded while background threads are running.
+ * Background threads are terminated by the system when the process exits.
+ */
+void PinLibraryInMemory(void)
+{
+	static volatile LONG lPinned = FALSE;
+	if (lPinned || InterlockedExchange(&lPinned, TRUE))
+		return;
+	TCHAR szModuleName[MAX_PATH];
+	if (GetModuleFileName(g_hInstance, szModuleName, countof(szModuleName)))
+		LoadLibrary(szModuleName);
+}
+
 // List controls utilities.
 
 /**
@@ -74,6 +74,15 @@ BOOL CreateTempFolder(PTSTR pszTempPath, size_t nTempPathSize);
 size_t GetCanonicalAppName(PTSTR pszAppName, size_t nBufferSize, BOOL bAllowSpaces);
 BOOL GetCompleteLogFileName(PTSTR pszCompleteLogFileName, PCTSTR pszLogFileName, PCTSTR pszDefFileExtension);
 
+// Log segments processing.
+extern const BYTE g_arrGZipHeader[10];
+void GetLogSegmentFileName(PTSTR pszSegmentFileName, PCTSTR pszLogFileName, DWORD dwSegmentNumber);
+void GetLogSegmentTemplate(PTSTR pszSegmentTemplate, PCTSTR pszLogFileName);
+BOOL ParseLogSegmentFileName(PCTSTR pszFileName, PCTSTR pszLogFileName, DWORD& dwSegmentNumber, BOOL& bCompressed);
+
+// Threads processing.
+void PinLibraryInMemory(void);
+
 // Strings processing.
 #define TrimSpaces(str)   StrTrim(str, _T(" \t\r\n"))
 #define TrimSpacesA(str)  StrTrimA(str, " \t\r\n")
@@ -0,0 +1,171 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Ring of variable-length byte records.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "ByteRing.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+/**
+ * @param dwCapacity - buffer capacity.
+ * @return true if buffer was allocated.
+ */
+BOOL CByteRing::Create(DWORD dwCapacity)
+{
+	Destroy();
+	m_pbBuffer = (PBYTE)VirtualAlloc(NULL, dwCapacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (m_pbBuffer == NULL)
+		return FALSE;
+	m_dwCapacity = dwCapacity;
+	return TRUE;
+}
+
+void CByteRing::Destroy(void)
+{
+	if (m_pbBuffer != NULL)
+	{
+		VirtualFree(m_pbBuffer, 0, MEM_RELEASE);
+		m_pbBuffer = NULL;
+	}
+	m_dwCapacity = 0;
+	FreeAll();
+}
+
+/**
+ * @param dwSize - record size.
+ * @return pointer to the record or NULL if there is not enough free space.
+ */
+PBYTE CByteRing::AllocHead(DWORD dwSize)
+{
+	if (IsEmpty())
+	{
+		if (dwSize > m_dwCapacity)
+			return NULL;
+		m_dwHead = m_dwHeadEnd = m_dwCapacity;
+	}
+	if (m_bWrapped)
+	{
+		if (m_dwHead - m_dwTail < dwSize)
+			return NULL;
+	}
+	else if (m_dwHead < dwSize)
+	{
+		// The first segment becomes the second one.
+		if (m_dwCapacity - m_dwHeadEnd < dwSize)
+			return NULL;
+		m_dwTailStart = m_dwHead;
+		m_dwTail = m_dwHeadEnd;
+		m_dwHead = m_dwHeadEnd = m_dwCapacity;
+		m_bWrapped = TRUE;
+	}
+	m_dwHead -= dwSize;
+	return (m_pbBuffer + m_dwHead);
+}
+
+/**
+ * @param dwSize - record size.
+ * @return pointer to the record or NULL if there is not enough free space.
+ */
+PBYTE CByteRing::AllocTail(DWORD dwSize)
+{
+	if (IsEmpty())
+	{
+		if (dwSize > m_dwCapacity)
+			return NULL;
+		m_dwHead = m_dwHeadEnd = 0;
+	}
+	PBYTE pbRecord;
+	if (m_bWrapped)
+	{
+		if (m_dwHead - m_dwTail < dwSize)
+			return NULL;
+		pbRecord = m_pbBuffer + m_dwTail;
+		m_dwTail += dwSize;
+	}
+	else if (m_dwCapacity - m_dwHeadEnd >= dwSize)
+	{
+		pbRecord = m_pbBuffer + m_dwHeadEnd;
+		m_dwHeadEnd += dwSize;
+	}
+	else
+	{
+		// Start the second segment at the beginning of the buffer.
+		if (m_dwHead < dwSize)
+			return NULL;
+		m_dwTailStart = 0;
+		m_dwTail = dwSize;
+		m_bWrapped = TRUE;
+		pbRecord = m_pbBuffer;
+	}
+	return pbRecord;
+}
+
+/**
+ * @param dwSize - size of the first record.
+ */
+void CByteRing::FreeHead(DWORD dwSize)
+{
+	_ASSERTE(m_dwHeadEnd - m_dwHead >= dwSize);
+	m_dwHead += dwSize;
+	if (m_dwHead == m_dwHeadEnd)
+	{
+		if (m_bWrapped)
+		{
+			m_dwHead = m_dwTailStart;
+			m_dwHeadEnd = m_dwTail;
+			m_dwTailStart = m_dwTail = 0;
+			m_bWrapped = FALSE;
+		}
+		if (IsEmpty())
+			FreeAll();
+	}
+}
+
+/**
+ * @param dwSize - size of the last record.
+ */
+void CByteRing::FreeTail(DWORD dwSize)
+{
+	if (m_bWrapped)
+	{
+		_ASSERTE(m_dwTail - m_dwTailStart >= dwSize);
+		m_dwTail -= dwSize;
+		if (m_dwTail == m_dwTailStart)
+		{
+			m_dwTailStart = m_dwTail = 0;
+			m_bWrapped = FALSE;
+		}
+	}
+	else
+	{
+		_ASSERTE(m_dwHeadEnd - m_dwHead >= dwSize);
+		m_dwHeadEnd -= dwSize;
+		if (IsEmpty())
+			FreeAll();
+	}
+}
+
+/**
+ * @param arrSegments - pointers to data segments.
+ * @param arrSegmentSizes - sizes of data segments.
+ */
+void CByteRing::GetSegments(const BYTE* arrSegments[2], DWORD arrSegmentSizes[2]) const
+{
+	arrSegments[0] = m_pbBuffer + m_dwHead;
+	arrSegmentSizes[0] = m_dwHeadEnd - m_dwHead;
+	arrSegments[1] = m_pbBuffer + m_dwTailStart;
+	arrSegmentSizes[1] = m_dwTail - m_dwTailStart;
+}
@@ -0,0 +1,108 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Ring of variable-length byte records.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+/**
+ * @brief Pre-allocated ring of variable-length byte records.
+ * Records are added and removed at both ends in constant time and never
+ * wrap around the end of the buffer, so every record is contiguous.
+ * Data is kept in at most two segments: the first segment is followed
+ * by the second one in logical order, but the second segment is located
+ * at the beginning of the buffer.
+ */
+class CByteRing
+{
+public:
+	/// Initialize the object.
+	CByteRing(void);
+	/// Destroy the object.
+	~CByteRing(void);
+	/// Allocate ring buffer.
+	BOOL Create(DWORD dwCapacity);
+	/// Free ring buffer.
+	void Destroy(void);
+	/// Get buffer capacity.
+	DWORD GetCapacity(void) const;
+	/// Return true if ring contains no records.
+	BOOL IsEmpty(void) const;
+	/// Allocate record before the first record.
+	PBYTE AllocHead(DWORD dwSize);
+	/// Allocate record after the last record.
+	PBYTE AllocTail(DWORD dwSize);
+	/// Remove the first record.
+	void FreeHead(DWORD dwSize);
+	/// Remove the last record.
+	void FreeTail(DWORD dwSize);
+	/// Remove all records.
+	void FreeAll(void);
+	/// Get data segments in logical order.
+	void GetSegments(const BYTE* arrSegments[2], DWORD arrSegmentSizes[2]) const;
+
+private:
+	/// Protects the class from being accidentally copied.
+	CByteRing(const CByteRing& rByteRing);
+	/// Protects the class from being accidentally copied.
+	CByteRing& operator=(const CByteRing& rByteRing);
+
+	/// Ring buffer.
+	PBYTE m_pbBuffer;
+	/// Buffer capacity.
+	DWORD m_dwCapacity;
+	/// Beginning of the first segment.
+	DWORD m_dwHead;
+	/// End of the first segment.
+	DWORD m_dwHeadEnd;
+	/// Beginning of the second segment.
+	DWORD m_dwTailStart;
+	/// End of the second segment.
+	DWORD m_dwTail;
+	/// True if the second segment is used.
+	BOOL m_bWrapped;
+};
+
+inline CByteRing::CByteRing(void)
+{
+	m_pbBuffer = NULL;
+	m_dwCapacity = 0;
+	FreeAll();
+}
+
+inline CByteRing::~CByteRing(void)
+{
+	Destroy();
+}
+
+/**
+ * @return buffer capacity.
+ */
+inline DWORD CByteRing::GetCapacity(void) const
+{
+	return m_dwCapacity;
+}
+
+/**
+ * @return true if ring contains no records.
+ */
+inline BOOL CByteRing::IsEmpty(void) const
+{
+	return (m_dwHead == m_dwHeadEnd);
+}
+
+inline void CByteRing::FreeAll(void)
+{
+	m_dwHead = m_dwHeadEnd = 0;
+	m_dwTailStart = m_dwTail = 0;
+	m_bWrapped = FALSE;
+}
@@ -0,0 +1,266 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-thread flight recorder of binary events.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "FlightRecorder.h"
+#include "LogClock.h"
+#include "FileStream.h"
+#include "Encoding.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CFlightRecorder g_FlightRecorder;
+
+CFlightRecorder::CFlightRecorder(void)
+{
+	m_pFirstRing = NULL;
+	m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+	m_llFrequency = 0;
+	m_bInitialized = FALSE;
+}
+
+CFlightRecorder::~CFlightRecorder(void)
+{
+	Uninitialize();
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CFlightRecorder::Initialize(void)
+{
+	_ASSERTE(! m_bInitialized);
+	LARGE_INTEGER liFrequency;
+	if (! QueryPerformanceFrequency(&liFrequency) || liFrequency.QuadPart == 0)
+		return FALSE;
+	m_dwTlsIndex = TlsAlloc();
+	if (m_dwTlsIndex == TLS_OUT_OF_INDEXES)
+		return FALSE;
+	m_llFrequency = liFrequency.QuadPart;
+	m_bInitialized = TRUE;
+	return TRUE;
+}
+
+void CFlightRecorder::Uninitialize(void)
+{
+	if (! m_bInitialized)
+		return;
+	CThreadRing* pRing = m_pFirstRing;
+	while (pRing != NULL)
+	{
+		CThreadRing* pNextRing = pRing->m_pNextRing;
+		CloseHandle(pRing->m_hOwnerThread);
+		delete pRing;
+		pRing = pNextRing;
+	}
+	m_pFirstRing = NULL;
+	TlsFree(m_dwTlsIndex);
+	m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+	m_bInitialized = FALSE;
+}
+
+/**
+ * @return ring assigned to calling thread.
+ */
+CFlightRecorder::CThreadRing* CFlightRecorder::GetThreadRing(void)
+{
+	DWORD dwLastError = GetLastError();
+	CThreadRing* pRing = (CThreadRing*)TlsGetValue(m_dwTlsIndex);
+	if (pRing == NULL)
+	{
+		pRing = AllocThreadRing();
+		if (pRing != NULL)
+			TlsSetValue(m_dwTlsIndex, pRing);
+	}
+	SetLastError(dwLastError);
+	return pRing;
+}
+
+/**
+ * @return new or reclaimed ring.
+ */
+CFlightRecorder::CThreadRing* CFlightRecorder::AllocThreadRing(void)
+{
+	HANDLE hCurrentProcess = GetCurrentProcess();
+	HANDLE hOwnerThread;
+	if (! DuplicateHandle(hCurrentProcess, GetCurrentThread(), hCurrentProcess, &hOwnerThread, SYNCHRONIZE, FALSE, 0))
+		return NULL;
+	// Reuse ring left by terminated thread, so thread pools don't grow the list.
+	CThreadRing* pRing;
+	for (pRing = m_pFirstRing; pRing != NULL; pRing = pRing->m_pNextRing)
+	{
+		if (InterlockedCompareExchange(&pRing->m_lReclaimLock, TRUE, FALSE) == FALSE)
+		{
+			BOOL bReclaimed = FALSE;
+			if (WaitForSingleObject(pRing->m_hOwnerThread, 0) == WAIT_OBJECT_0)
+			{
+				CloseHandle(pRing->m_hOwnerThread);
+				pRing->m_hOwnerThread = hOwnerThread;
+				pRing->m_dwThreadID = GetCurrentThreadId();
+				InterlockedExchange((LONG volatile*)&pRing->m_dwWritePos, 0);
+				bReclaimed = TRUE;
+			}
+			InterlockedExchange(&pRing->m_lReclaimLock, FALSE);
+			if (bReclaimed)
+				return pRing;
+		}
+	}
+	pRing = new CThreadRing;
+	if (pRing == NULL)
+	{
+		CloseHandle(hOwnerThread);
+		return NULL;
+	}
+	pRing->m_hOwnerThread = hOwnerThread;
+	pRing->m_dwThreadID = GetCurrentThreadId();
+	pRing->m_lReclaimLock = FALSE;
+	pRing->m_dwWritePos = 0;
+	pRing->m_dwDumpPos = 0;
+	pRing->m_dwDumpEnd = 0;
+	CThreadRing* pNextRing;
+	do
+	{
+		pNextRing = m_pFirstRing;
+		pRing->m_pNextRing = pNextRing;
+	}
+	while (InterlockedCompareExchangePointer((PVOID volatile*)&m_pFirstRing, pRing, pNextRing) != pNextRing);
+	return pRing;
+}
+
+/**
+ * @param dwEventID - event identifier.
+ * @param ullParam1 - 1st payload word.
+ * @param ullParam2 - 2nd payload word.
+ * @param ullParam3 - 3rd payload word.
+ * @param ullParam4 - 4th payload word.
+ */
+void CFlightRecorder::RecordEvent(DWORD dwEventID, ULONGLONG ullParam1, ULONGLONG ullParam2, ULONGLONG ullParam3, ULONGLONG ullParam4)
+{
+	if (! m_bInitialized)
+		return;
+	CThreadRing* pRing = GetThreadRing();
+	if (pRing == NULL)
+		return;
+	// Only the owner thread modifies write position.
+	DWORD dwWritePos = pRing->m_dwWritePos;
+	CEvent& rEvent = pRing->m_arrEvents[dwWritePos & (RING_SIZE - 1)];
+	LARGE_INTEGER liCounter;
+	QueryPerformanceCounter(&liCounter);
+	rEvent.m_llCounter = liCounter.QuadPart;
+	rEvent.m_dwEventID = dwEventID;
+	rEvent.m_arrParams[0] = ullParam1;
+	rEvent.m_arrParams[1] = ullParam2;
+	rEvent.m_arrParams[2] = ullParam3;
+	rEvent.m_arrParams[3] = ullParam4;
+	// Volatile store has release semantics, so the event is complete before it's published.
+	pRing->m_dwWritePos = dwWritePos + 1;
+}
+
+/**
+ * @return ring with the oldest event that wasn't dumped yet or NULL if all events were dumped.
+ */
+CFlightRecorder::CThreadRing* CFlightRecorder::GetNextDumpRing(void) const
+{
+	CThreadRing* pNextRing = NULL;
+	LONGLONG llNextCounter = 0;
+	for (CThreadRing* pRing = m_pFirstRing; pRing != NULL; pRing = pRing->m_pNextRing)
+	{
+		if (pRing->m_dwDumpPos == pRing->m_dwDumpEnd)
+			continue;
+		LONGLONG llCounter = pRing->m_arrEvents[pRing->m_dwDumpPos & (RING_SIZE - 1)].m_llCounter;
+		if (pNextRing == NULL || llCounter < llNextCounter)
+		{
+			pNextRing = pRing;
+			llNextCounter = llCounter;
+		}
+	}
+	return pNextRing;
+}
+
+/**
+ * @param pszFileName - timeline file name.
+ * @return true if operation was completed successfully.
+ */
+BOOL CFlightRecorder::WriteTimeline(PCTSTR pszFileName)
+{
+	if (! m_bInitialized)
+		return FALSE;
+	CFileStream FileStream(1024);
+	if (! FileStream.Open(pszFileName, CREATE_ALWAYS, GENERIC_WRITE))
+		return FALSE;
+	CUTF8EncStream EncStream(&FileStream);
+
+	// Events are converted to local time relatively to the moment of the dump.
+	ULONGLONG ullDumpTime = g_LogClock.GetLocalTime();
+	LARGE_INTEGER liDumpCounter;
+	QueryPerformanceCounter(&liDumpCounter);
+
+	DWORD dwNumThreads = 0;
+	for (CThreadRing* pRing = m_pFirstRing; pRing != NULL; pRing = pRing->m_pNextRing)
+	{
+		// Other threads may still be running. The slot that follows the newest
+		// event can be overwritten at any moment, so it's never dumped.
+		DWORD dwWritePos = pRing->m_dwWritePos;
+		DWORD dwNumEvents = dwWritePos < RING_SIZE - 1 ? dwWritePos : RING_SIZE - 1;
+		pRing->m_dwDumpEnd = dwWritePos;
+		pRing->m_dwDumpPos = dwWritePos - dwNumEvents;
+		if (dwNumEvents > 0)
+			++dwNumThreads;
+	}
+
+	CHAR szLine[MAX_LINE_LENGTH];
+	sprintf_s(szLine, countof(szLine),
+	          "Flight recorder timeline of %lu threads, offsets are in microseconds before the report\r\n"
+	          "%-26s %14s %8s %10s %-18s %-18s %-18s %-18s\r\n",
+	          dwNumThreads, "Time", "Offset", "Thread", "Event", "Param1", "Param2", "Param3", "Param4");
+	if (! EncStream.WriteAscii(szLine))
+		return FALSE;
+
+	for (;;)
+	{
+		CThreadRing* pRing = GetNextDumpRing();
+		if (pRing == NULL)
+			break;
+		DWORD dwDumpPos = pRing->m_dwDumpPos++;
+		CEvent Event = pRing->m_arrEvents[dwDumpPos & (RING_SIZE - 1)];
+		// Skip the event if owner thread has overwritten it while it was being copied.
+		if (pRing->m_dwWritePos - dwDumpPos >= RING_SIZE)
+			continue;
+		LONGLONG llElapsedTicks = liDumpCounter.QuadPart - Event.m_llCounter;
+		if (llElapsedTicks < 0)
+			llElapsedTicks = 0;
+		ULONGLONG ullElapsedTime = (ULONGLONG)(llElapsedTicks / m_llFrequency * CLogClock::TICKS_PER_SECOND +
+		                                       llElapsedTicks % m_llFrequency * CLogClock::TICKS_PER_SECOND / m_llFrequency);
+		ULONGLONG ullEventTime = ullDumpTime - ullElapsedTime;
+		FILETIME ftTime;
+		ftTime.dwLowDateTime = (DWORD)ullEventTime;
+		ftTime.dwHighDateTime = (DWORD)(ullEventTime >> 32);
+		SYSTEMTIME st;
+		if (! FileTimeToSystemTime(&ftTime, &st))
+			ZeroMemory(&st, sizeof(st));
+		sprintf_s(szLine, countof(szLine),
+		          "%04d/%02d/%02d %02d:%02d:%02d.%06lu %14.1f %8lu %10lu 0x%016I64X 0x%016I64X 0x%016I64X 0x%016I64X\r\n",
+		          st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+		          (DWORD)(ullEventTime % CLogClock::TICKS_PER_SECOND / 10),
+		          (double)ullElapsedTime / 10.0,
+		          pRing->m_dwThreadID,
+		          Event.m_dwEventID,
+		          Event.m_arrParams[0], Event.m_arrParams[1], Event.m_arrParams[2], Event.m_arrParams[3]);
+		if (! EncStream.WriteAscii(szLine))
+			return FALSE;
+	}
+	return TRUE;
+}
@@ -0,0 +1,115 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-thread flight recorder of binary events.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+/**
+ * @brief Fixed-size rings of compact binary events recorded by every thread.
+ * Events are written by owner thread without any lock or formatting, the ring
+ * silently overwrites the oldest events. Rings are only read when error report
+ * is generated: events of all threads are merged by time into text timeline.
+ */
+class CFlightRecorder
+{
+public:
+	/// Initialize the object.
+	CFlightRecorder(void);
+	/// Destroy the object.
+	~CFlightRecorder(void);
+	/// Allocate system resources.
+	BOOL Initialize(void);
+	/// Free system resources.
+	void Uninitialize(void);
+	/// Record new event in the ring of calling thread.
+	void RecordEvent(DWORD dwEventID, ULONGLONG ullParam1, ULONGLONG ullParam2, ULONGLONG ullParam3, ULONGLONG ullParam4);
+	/// Return true if no thread has recorded events.
+	BOOL IsEmpty(void) const;
+	/// Write merged timeline of all rings to the file.
+	BOOL WriteTimeline(PCTSTR pszFileName);
+
+private:
+	/// Recorder parameters.
+	enum
+	{
+		/// Number of events in per-thread ring (must be power of 2).
+		RING_SIZE = 1024,
+		/// Number of payload words in the event.
+		NUM_EVENT_PARAMS = 4,
+		/// Maximum length of timeline line.
+		MAX_LINE_LENGTH = 256
+	};
+
+	/// Recorded event.
+	struct CEvent
+	{
+		/// Performance counter value.
+		LONGLONG m_llCounter;
+		/// Event identifier.
+		DWORD m_dwEventID;
+		/// Event payload.
+		ULONGLONG m_arrParams[NUM_EVENT_PARAMS];
+	};
+
+	/// Ring owned by single thread.
+	struct CThreadRing
+	{
+		/// Next ring in the list.
+		CThreadRing* m_pNextRing;
+		/// Owner thread handle.
+		HANDLE m_hOwnerThread;
+		/// Owner thread identifier.
+		DWORD m_dwThreadID;
+		/// Non-zero while ring is being reclaimed.
+		volatile LONG m_lReclaimLock;
+		/// Number of events written by owner thread.
+		volatile DWORD m_dwWritePos;
+		/// Position of the next event to be dumped.
+		DWORD m_dwDumpPos;
+		/// End of dumped events.
+		DWORD m_dwDumpEnd;
+		/// Ring events.
+		CEvent m_arrEvents[RING_SIZE];
+	};
+
+	/// Protects the class from being accidentally copied.
+	CFlightRecorder(const CFlightRecorder& rFlightRecorder);
+	/// Protects the class from being accidentally copied.
+	CFlightRecorder& operator=(const CFlightRecorder& rFlightRecorder);
+	/// Get ring assigned to calling thread.
+	CThreadRing* GetThreadRing(void);
+	/// Allocate or reclaim ring for calling thread.
+	CThreadRing* AllocThreadRing(void);
+	/// Find ring with the oldest event that wasn't dumped yet.
+	CThreadRing* GetNextDumpRing(void) const;
+
+	/// List of per-thread rings.
+	CThreadRing* volatile m_pFirstRing;
+	/// TLS slot that keeps ring of the current thread.
+	DWORD m_dwTlsIndex;
+	/// Performance counter frequency.
+	LONGLONG m_llFrequency;
+	/// True when resources were allocated.
+	BOOL m_bInitialized;
+};
+
+/// Flight recorder shared by all threads.
+extern CFlightRecorder g_FlightRecorder;
+
+/**
+ * @return true if no thread has recorded events.
+ */
+inline BOOL CFlightRecorder::IsEmpty(void) const
+{
+	return (m_pFirstRing == NULL);
+}
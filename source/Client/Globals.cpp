@@ -24,6 +24,8 @@
 HINSTANCE g_hInstance = NULL;
 /// Module of interest handle
 extern HINSTANCE g_hModule = NULL;
+/// True when code is invoked from DllMain().
+BOOL g_bInDllMain = FALSE;
 /// Application name.
 TCHAR g_szAppName[MAX_PATH] = _T("");
 /// Application version number.
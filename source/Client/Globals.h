@@ -56,6 +56,8 @@ const DWORD g_dwProtocolSignature = (('B' << 0) | ('T' << 8) | ('0' << 16) | ('1
 extern HINSTANCE g_hInstance;
 /// Module of interest handle
 extern HINSTANCE g_hModule;
+/// True when code is invoked from DllMain().
+extern BOOL g_bInDllMain;
 /// Application name.
 extern TCHAR g_szAppName[MAX_PATH];
 /// Application version number.
@@ -14,6 +14,8 @@
 
 #include "StdAfx.h"
 #include "InMemLogFile.h"
+#include "LogFlusher.h"
+#include "Globals.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -31,12 +33,223 @@ CInMemLogFile::CInMemLogFile(DWORD dwInitialLogSizeInBytes)
 	m_dwNumBytes = dwInitialLogSizeInBytes;
 	m_pFirstEntry = NULL;
 	m_pLastEntry = NULL;
+	m_pRing = NULL;
+	m_dwBufferSize = 0;
+	m_dwNumSavedEntries = 0;
+	m_dwNumEvictedBytes = 0;
+	m_bRewriteRequired = TRUE;
+	m_bPackEntries = FALSE;
+	m_bPackRequested = FALSE;
+	m_dwNumPackedBytes = 0;
+	m_dwNumCompressedBytes = 0;
+	m_pRepeatedEntry = NULL;
+	m_eRepeatedMode = EM_APPEND;
+	m_eRepeatedLevel = BTLL_ALL;
+	m_ullRepeatedTime = 0;
+	m_dwRepeatedTextSize = 0;
+	m_dwNumRepeats = 0;
+	m_ullLastRepeatTime = 0;
+	m_KeyEncStream.SetStream(&m_KeyStream);
+	m_hLoadThread = NULL;
+	m_uLoadThreadID = 0;
+	m_pHistoryLog = NULL;
+	m_lLoadState = LS_PENDING;
+	m_bHistoryUnloaded = FALSE;
+	m_dwFlushEntries = 0;
+	m_dwFlushDelay = 0;
+	m_dwFlushBytes = 0;
+	m_dwNumDirtyEntries = 0;
+	m_dwNumDirtyBytes = 0;
+	m_dwDirtyTime = 0;
+	m_bFlushRequested = FALSE;
+}
+
+/**
+ * @param dwDataSize - size of entry data.
+ * @param eEntryMode - entry mode.
+ * @param bEvict - true if entries at the opposite end may be evicted to free space in ring buffer.
+ * @return pointer to the new entry or NULL.
+ */
+CInMemLogFile::CLogEntry* CInMemLogFile::AllocEntry(DWORD dwDataSize, ENTRY_MODE eEntryMode, BOOL bEvict)
+{
+	CLogEntry* pLogEntry;
+	if (m_pRing == NULL)
+	{
+		pLogEntry = (CLogEntry*)m_Allocator.Allocate(sizeof(CLogEntry) + dwDataSize);
+		if (pLogEntry)
+		{
+			pLogEntry->m_pbData = (PBYTE)(pLogEntry + 1);
+			pLogEntry->m_dwDataSize = dwDataSize;
+			pLogEntry->m_dwNumPacked = 0;
+		}
+		return pLogEntry;
+	}
+	if (dwDataSize > m_pRing->GetCapacity())
+		return NULL;
+	pLogEntry = (CLogEntry*)m_Allocator.Allocate(sizeof(CLogEntry));
+	if (pLogEntry == NULL)
+		return NULL;
+	for (;;)
+	{
+		PBYTE pbData = eEntryMode == EM_APPEND ? m_pRing->AllocTail(dwDataSize) : m_pRing->AllocHead(dwDataSize);
+		if (pbData)
+		{
+			pLogEntry->m_pbData = pbData;
+			pLogEntry->m_dwDataSize = dwDataSize;
+			pLogEntry->m_dwNumPacked = 0;
+			return pLogEntry;
+		}
+		if (! bEvict)
+		{
+			FreeEntry(pLogEntry);
+			return NULL;
+		}
+		// Evict entries from the opposite end of the log.
+		_ASSERTE(m_dwNumEntries > 0);
+		if (eEntryMode == EM_APPEND)
+			DeleteHead();
+		else
+			DeleteTail();
+	}
+}
+
+/**
+ * @param pLogEntry - log entry.
+ */
+void CInMemLogFile::FreeEntry(CLogEntry* pLogEntry)
+{
+	m_Allocator.Free(pLogEntry);
+}
+
+/**
+ * @param bUseRing - true if entry data has to be kept in ring buffer.
+ * @param dwRingSize - size of ring buffer.
+ * @return true if operation was completed successfully.
+ */
+BOOL CInMemLogFile::SetStorage(BOOL bUseRing, DWORD dwRingSize)
+{
+	CByteRing* pNewRing = NULL;
+	if (bUseRing)
+	{
+		pNewRing = new CByteRing;
+		if (pNewRing == NULL)
+			return FALSE;
+		if (! pNewRing->Create(dwRingSize))
+		{
+			delete pNewRing;
+			return FALSE;
+		}
+	}
+	CByteRing* pOldRing = m_pRing;
+	CLogEntry* pLogEntry = m_pFirstEntry;
+	CLogIndex OldIndex;
+	OldIndex.Swap(m_Index);
+	DWORD dwIndexPos = 0;
+	m_pFirstEntry = NULL;
+	m_pLastEntry = NULL;
+	m_dwNumEntries = 0;
+	m_dwNumBytes = m_dwInitialLogSizeInBytes;
+	m_dwNumSavedEntries = 0;
+	m_dwNumEvictedBytes = 0;
+	m_bRewriteRequired = TRUE;
+	m_dwNumPackedBytes = 0;
+	m_dwNumCompressedBytes = 0;
+	m_pRing = pNewRing;
+	// Copy entries in original order, the oldest ones are evicted if new storage is smaller.
+	while (pLogEntry)
+	{
+		CLogEntry* pNextEntry = pLogEntry->m_pNextEntry;
+		DWORD dwNumNodeEntries = GetNumNodeEntries(pLogEntry);
+		CLogEntry* pNewEntry = AllocEntry(pLogEntry->m_dwDataSize, EM_APPEND);
+		if (pNewEntry)
+		{
+			CopyMemory(pNewEntry->m_pbData, pLogEntry->m_pbData, pLogEntry->m_dwDataSize);
+			pNewEntry->m_dwSize = pLogEntry->m_dwSize;
+			pNewEntry->m_dwNumPacked = pLogEntry->m_dwNumPacked;
+			CopyIndexRecords(OldIndex, dwIndexPos, dwNumNodeEntries, EM_APPEND);
+			LinkTail(pNewEntry);
+		}
+		dwIndexPos += dwNumNodeEntries;
+		if (pLogEntry == m_pRepeatedEntry)
+		{
+			if (pNewEntry)
+				m_pRepeatedEntry = pNewEntry;
+			else
+				ResetRepeatedEntry();
+		}
+		FreeEntry(pLogEntry);
+		pLogEntry = pNextEntry;
+	}
+	delete pOldRing;
+	m_Allocator.SetReservedSize(bUseRing ? 0 : m_dwBufferSize);
+	return TRUE;
+}
+
+/**
+ * @param dwLogFlags - set of log flags.
+ * @return true if operation was completed successfully.
+ */
+BOOL CInMemLogFile::SetLogFlags(DWORD dwLogFlags)
+{
+	BOOL bUseRing = (dwLogFlags & BTLF_RINGBUFFER) != 0;
+	if (bUseRing != (m_pRing != NULL))
+	{
+		if (bUseRing && m_dwBufferSize == 0)
+			m_dwBufferSize = DEFAULT_RING_SIZE;
+		if (! SetStorage(bUseRing, m_dwBufferSize))
+			return FALSE;
+	}
+	m_bPackEntries = (dwLogFlags & BTLF_COMPRESSMEMORY) != 0 && CanPackEntries();
+	return CLogFile::SetLogFlags(dwLogFlags);
+}
+
+/**
+ * @param dwLogBufferSize - size of memory reserved for log entries.
+ * @return true if operation was accepted.
+ */
+BOOL CInMemLogFile::SetLogBufferSize(DWORD dwLogBufferSize)
+{
+	if (m_pRing != NULL)
+	{
+		if (dwLogBufferSize == 0 || ! SetStorage(TRUE, dwLogBufferSize))
+			return FALSE;
+	}
+	else if (! m_Allocator.SetReservedSize(dwLogBufferSize))
+		return FALSE;
+	m_dwBufferSize = dwLogBufferSize;
+	return TRUE;
 }
 
 /**
  * @param pLogEntry - new log entry.
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
  */
-void CInMemLogFile::AddToHead(CLogEntry* pLogEntry)
+void CInMemLogFile::AddToHead(CLogEntry* pLogEntry, BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime)
+{
+	_ASSERTE(pLogEntry != NULL && pLogEntry->m_dwNumPacked == 0);
+	m_Index.AddToHead(eLogLevel, ullTime, pLogEntry->m_dwDataSize);
+	LinkHead(pLogEntry);
+	AccountDirtyEntry(pLogEntry->m_dwDataSize);
+}
+
+/**
+ * @param pLogEntry - new log entry.
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
+ */
+void CInMemLogFile::AddToTail(CLogEntry* pLogEntry, BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime)
+{
+	_ASSERTE(pLogEntry != NULL && pLogEntry->m_dwNumPacked == 0);
+	m_Index.AddToTail(eLogLevel, ullTime, pLogEntry->m_dwDataSize);
+	LinkTail(pLogEntry);
+	AccountDirtyEntry(pLogEntry->m_dwDataSize);
+}
+
+/**
+ * @param pLogEntry - list node with index records already added.
+ */
+void CInMemLogFile::LinkHead(CLogEntry* pLogEntry)
 {
 	_ASSERTE(pLogEntry != NULL);
 	pLogEntry->m_pPrevEntry = NULL;
@@ -46,15 +259,16 @@ void CInMemLogFile::AddToHead(CLogEntry* pLogEntry)
 	else
 		m_pLastEntry = pLogEntry;
 	m_pFirstEntry = pLogEntry;
-	m_dwNumBytes += pLogEntry->m_dwSize;
-	++m_dwNumEntries;
+	AccountEntry(pLogEntry, TRUE);
+	// Saved data can't be preceded by the new entry.
+	m_bRewriteRequired = TRUE;
 	FreeTail();
 }
 
 /**
- * @param pLogEntry - new log entry.
+ * @param pLogEntry - list node with index records already added.
  */
-void CInMemLogFile::AddToTail(CLogEntry* pLogEntry)
+void CInMemLogFile::LinkTail(CLogEntry* pLogEntry)
 {
 	_ASSERTE(pLogEntry != NULL);
 	pLogEntry->m_pPrevEntry = m_pLastEntry;
@@ -64,8 +278,8 @@ void CInMemLogFile::AddToTail(CLogEntry* pLogEntry)
 	else
 		m_pFirstEntry = pLogEntry;
 	m_pLastEntry = pLogEntry;
-	m_dwNumBytes += pLogEntry->m_dwSize;
-	++m_dwNumEntries;
+	AccountEntry(pLogEntry, TRUE);
+	RequestPacking();
 	FreeHead();
 }
 
@@ -78,9 +292,28 @@ void CInMemLogFile::DeleteHead(void)
 		m_pFirstEntry->m_pPrevEntry = NULL;
 	else
 		m_pLastEntry = NULL;
-	m_dwNumBytes -= pLogEntry->m_dwSize;
-	--m_dwNumEntries;
-	delete[] (PBYTE)pLogEntry;
+	AccountEntry(pLogEntry, FALSE);
+	m_Index.DeleteHead(GetNumNodeEntries(pLogEntry));
+	if (m_dwNumSavedEntries > 0)
+	{
+		DWORD dwNumNodeEntries = GetNumNodeEntries(pLogEntry);
+		if (m_dwNumSavedEntries >= dwNumNodeEntries)
+		{
+			m_dwNumSavedEntries -= dwNumNodeEntries;
+			m_dwNumEvictedBytes += pLogEntry->m_dwSize;
+		}
+		else
+		{
+			// Sizes of saved entries of the block are unknown.
+			m_dwNumSavedEntries = 0;
+			m_bRewriteRequired = TRUE;
+		}
+	}
+	if (m_pRing)
+		m_pRing->FreeHead(pLogEntry->m_dwDataSize);
+	if (pLogEntry == m_pRepeatedEntry)
+		ResetRepeatedEntry();
+	FreeEntry(pLogEntry);
 }
 
 void CInMemLogFile::DeleteTail(void)
@@ -92,9 +325,18 @@ void CInMemLogFile::DeleteTail(void)
 		m_pLastEntry->m_pNextEntry = NULL;
 	else
 		m_pFirstEntry = NULL;
-	m_dwNumBytes -= pLogEntry->m_dwSize;
-	--m_dwNumEntries;
-	delete[] (PBYTE)pLogEntry;
+	AccountEntry(pLogEntry, FALSE);
+	m_Index.DeleteTail(GetNumNodeEntries(pLogEntry));
+	if (m_dwNumSavedEntries > m_dwNumEntries)
+	{
+		m_dwNumSavedEntries = m_dwNumEntries;
+		m_bRewriteRequired = TRUE;
+	}
+	if (m_pRing)
+		m_pRing->FreeTail(pLogEntry->m_dwDataSize);
+	if (pLogEntry == m_pRepeatedEntry)
+		ResetRepeatedEntry();
+	FreeEntry(pLogEntry);
 }
 
 void CInMemLogFile::FreeHead(void)
@@ -106,7 +348,7 @@ void CInMemLogFile::FreeHead(void)
 	}
 	if (m_dwLogSizeInBytes != MAXDWORD)
 	{
-		while (m_dwNumBytes > m_dwLogSizeInBytes && m_dwNumEntries > 0)
+		while (GetNumStoredBytes() > m_dwLogSizeInBytes && m_dwNumEntries > 0)
 			DeleteHead();
 	}
 }
@@ -120,20 +362,595 @@ void CInMemLogFile::FreeTail(void)
 	}
 	if (m_dwLogSizeInBytes != MAXDWORD)
 	{
-		while (m_dwNumBytes > m_dwLogSizeInBytes && m_dwNumEntries > 0)
+		while (GetNumStoredBytes() > m_dwLogSizeInBytes && m_dwNumEntries > 0)
 			DeleteTail();
 	}
 }
 
 void CInMemLogFile::FreeEntries(void)
 {
-	while (m_pFirstEntry)
-	{
-		CLogEntry* pNextEntry = m_pFirstEntry->m_pNextEntry;
-		delete[] (PBYTE)m_pFirstEntry;
-		m_pFirstEntry = pNextEntry;
-	}
+	// All entries are released at once.
+	m_Allocator.FreeAll();
+	if (m_pRing)
+		m_pRing->FreeAll();
+	m_pFirstEntry = NULL;
 	m_pLastEntry = NULL;
 	m_dwNumEntries = 0;
 	m_dwNumBytes = m_dwInitialLogSizeInBytes;
+	m_dwNumSavedEntries = 0;
+	m_dwNumEvictedBytes = 0;
+	m_bRewriteRequired = TRUE;
+	m_dwNumPackedBytes = 0;
+	m_dwNumCompressedBytes = 0;
+	m_Index.Clear();
+	ResetRepeatedEntry();
+}
+
+/**
+ * @param rLogIndex - index that keeps records of list node.
+ * @param dwPosition - position of the first record of list node.
+ * @param dwCount - number of entries kept by list node.
+ * @param eEntryMode - end of the log where the node is added.
+ */
+void CInMemLogFile::CopyIndexRecords(const CLogIndex& rLogIndex, DWORD dwPosition, DWORD dwCount, ENTRY_MODE eEntryMode)
+{
+	if (! rLogIndex.IsValid())
+	{
+		m_Index.Invalidate();
+		return;
+	}
+	if (eEntryMode == EM_APPEND)
+	{
+		for (DWORD dwRecordPos = dwPosition; dwRecordPos < dwPosition + dwCount; ++dwRecordPos)
+			m_Index.AddToTail(rLogIndex.GetLogLevel(dwRecordPos), rLogIndex.GetTime(dwRecordPos), rLogIndex.GetSize(dwRecordPos));
+	}
+	else
+	{
+		for (DWORD dwRecordPos = dwPosition + dwCount; dwRecordPos > dwPosition; --dwRecordPos)
+			m_Index.AddToHead(rLogIndex.GetLogLevel(dwRecordPos - 1), rLogIndex.GetTime(dwRecordPos - 1), rLogIndex.GetSize(dwRecordPos - 1));
+	}
+}
+
+/**
+ * @param pLogEntry - list node.
+ * @param bAdded - true if node was added to the list.
+ */
+void CInMemLogFile::AccountEntry(const CLogEntry* pLogEntry, BOOL bAdded)
+{
+	DWORD dwNumNodeEntries = GetNumNodeEntries(pLogEntry);
+	if (bAdded)
+	{
+		m_dwNumBytes += pLogEntry->m_dwSize;
+		m_dwNumEntries += dwNumNodeEntries;
+		if (pLogEntry->m_dwNumPacked != 0)
+		{
+			m_dwNumPackedBytes += pLogEntry->m_dwSize;
+			m_dwNumCompressedBytes += pLogEntry->m_dwDataSize;
+		}
+	}
+	else
+	{
+		m_dwNumBytes -= pLogEntry->m_dwSize;
+		m_dwNumEntries -= dwNumNodeEntries;
+		if (pLogEntry->m_dwNumPacked != 0)
+		{
+			m_dwNumPackedBytes -= pLogEntry->m_dwSize;
+			m_dwNumCompressedBytes -= pLogEntry->m_dwDataSize;
+		}
+	}
+}
+
+void CInMemLogFile::RequestPacking(void)
+{
+	// Ring buffer releases data in FIFO order, so blocks can't be allocated there.
+	if (m_bPackRequested || ! m_bPackEntries || m_pRing != NULL || ! HasColdEntries())
+		return;
+	m_bPackRequested = TRUE;
+	g_LogFlusher.RequestFlush();
+}
+
+void CInMemLogFile::PackEntries(void)
+{
+	// Writers are blocked only while entries are copied and replaced, never during compression.
+	for (;;)
+	{
+		CaptureObject();
+		DWORD dwNumPacked = 0, dwPackedSize = 0;
+		CLogEntry* pCopiedEntry = NULL;
+		if (m_bPackRequested && m_bPackEntries && m_pRing == NULL && HasColdEntries())
+			pCopiedEntry = CopyColdEntries(dwNumPacked, dwPackedSize);
+		if (pCopiedEntry == NULL)
+			m_bPackRequested = FALSE;
+		ReleaseObject();
+		if (pCopiedEntry == NULL)
+			break;
+		PBYTE pbPackedData = m_CompressBuffer.GetData();
+		uLongf ulCompressedSize = compressBound(dwPackedSize);
+		int nResult = compress2(pbPackedData + dwPackedSize, &ulCompressedSize, pbPackedData, dwPackedSize, Z_BEST_SPEED);
+		CaptureObject();
+		BOOL bReplaced = nResult == Z_OK && ReplaceColdEntries(pCopiedEntry, dwNumPacked, dwPackedSize, (DWORD)ulCompressedSize);
+		// Entries changed by writers are compressed after the next request.
+		if (! bReplaced)
+			m_bPackRequested = FALSE;
+		ReleaseObject();
+		if (! bReplaced)
+			break;
+	}
+}
+
+/**
+ * @param rdwNumPacked - number of entries in the run.
+ * @param rdwPackedSize - size of entries in the run.
+ * @return the first entry of the run or NULL.
+ */
+CInMemLogFile::CLogEntry* CInMemLogFile::FindColdEntries(DWORD& rdwNumPacked, DWORD& rdwPackedSize) const
+{
+	// Find the oldest run of regular entries.
+	DWORD dwEntryIndex = 0;
+	CLogEntry* pFirstEntry = m_pFirstEntry;
+	while (pFirstEntry && (pFirstEntry->m_dwNumPacked != 0 || pFirstEntry == m_pRepeatedEntry))
+	{
+		dwEntryIndex += GetNumNodeEntries(pFirstEntry);
+		pFirstEntry = pFirstEntry->m_pNextEntry;
+	}
+	// Block never mixes saved and new entries, so incremental save may skip saved blocks.
+	BOOL bSaved = dwEntryIndex < m_dwNumSavedEntries;
+	DWORD dwNumPacked = 0, dwPackedSize = 0;
+	for (CLogEntry* pLogEntry = pFirstEntry; pLogEntry != NULL; pLogEntry = pLogEntry->m_pNextEntry)
+	{
+		if (pLogEntry == m_pLastEntry ||
+			pLogEntry == m_pRepeatedEntry ||
+			pLogEntry->m_dwNumPacked != 0 ||
+			(dwEntryIndex + dwNumPacked < m_dwNumSavedEntries) != bSaved ||
+			dwPackedSize >= PACK_BLOCK_SIZE)
+		{
+			break;
+		}
+		_ASSERTE(pLogEntry->m_dwSize == pLogEntry->m_dwDataSize);
+		dwPackedSize += pLogEntry->m_dwSize;
+		++dwNumPacked;
+	}
+	rdwNumPacked = dwNumPacked;
+	rdwPackedSize = dwPackedSize;
+	return (dwNumPacked != 0 ? pFirstEntry : NULL);
+}
+
+/**
+ * @param rdwNumPacked - number of copied entries.
+ * @param rdwPackedSize - size of copied entries.
+ * @return the first copied entry or NULL.
+ */
+CInMemLogFile::CLogEntry* CInMemLogFile::CopyColdEntries(DWORD& rdwNumPacked, DWORD& rdwPackedSize)
+{
+	CLogEntry* pFirstEntry = FindColdEntries(rdwNumPacked, rdwPackedSize);
+	if (pFirstEntry == NULL)
+		return NULL;
+	// Buffer keeps copied entries followed by compressed data.
+	if (! m_CompressBuffer.SetSize(rdwPackedSize + (DWORD)compressBound(rdwPackedSize)))
+		return NULL;
+	PBYTE pbPackedData = m_CompressBuffer.GetData();
+	DWORD dwPosition = 0;
+	CLogEntry* pLogEntry = pFirstEntry;
+	for (DWORD dwEntry = 0; dwEntry < rdwNumPacked; ++dwEntry)
+	{
+		CopyMemory(pbPackedData + dwPosition, pLogEntry->m_pbData, pLogEntry->m_dwSize);
+		dwPosition += pLogEntry->m_dwSize;
+		pLogEntry = pLogEntry->m_pNextEntry;
+	}
+	return pFirstEntry;
+}
+
+/**
+ * @param pCopiedEntry - the first copied entry.
+ * @param dwNumPacked - number of copied entries.
+ * @param dwPackedSize - size of copied entries.
+ * @param dwCompressedSize - size of compressed data.
+ * @return true if entries were replaced by compressed block.
+ */
+BOOL CInMemLogFile::ReplaceColdEntries(const CLogEntry* pCopiedEntry, DWORD dwNumPacked, DWORD dwPackedSize, DWORD dwCompressedSize)
+{
+	if (! m_bPackEntries || m_pRing != NULL)
+		return FALSE;
+	// Entries might be evicted, saved or merged while the log wasn't locked,
+	// so the same run must still start at the same place with the same data.
+	DWORD dwNumFound, dwFoundSize;
+	CLogEntry* pFirstEntry = FindColdEntries(dwNumFound, dwFoundSize);
+	if (pFirstEntry != pCopiedEntry || dwNumFound != dwNumPacked || dwFoundSize != dwPackedSize)
+		return FALSE;
+	const BYTE* pbPackedData = m_CompressBuffer.GetData();
+	DWORD dwPosition = 0;
+	CLogEntry* pLastEntry = pFirstEntry;
+	for (DWORD dwEntry = 0; ; ++dwEntry)
+	{
+		if (memcmp(pbPackedData + dwPosition, pLastEntry->m_pbData, pLastEntry->m_dwSize) != 0)
+			return FALSE;
+		dwPosition += pLastEntry->m_dwSize;
+		if (dwEntry + 1 == dwNumPacked)
+			break;
+		pLastEntry = pLastEntry->m_pNextEntry;
+	}
+	CLogEntry* pBlock = AllocEntry(dwCompressedSize, EM_APPEND);
+	if (pBlock == NULL)
+		return FALSE;
+	CopyMemory(pBlock->m_pbData, pbPackedData + dwPackedSize, dwCompressedSize);
+	pBlock->m_dwSize = dwPackedSize;
+	pBlock->m_dwNumPacked = dwNumPacked;
+	pBlock->m_pPrevEntry = pFirstEntry->m_pPrevEntry;
+	pBlock->m_pNextEntry = pLastEntry->m_pNextEntry;
+	if (pBlock->m_pPrevEntry)
+		pBlock->m_pPrevEntry->m_pNextEntry = pBlock;
+	else
+		m_pFirstEntry = pBlock;
+	// Block is never the last node.
+	_ASSERTE(pBlock->m_pNextEntry != NULL);
+	pBlock->m_pNextEntry->m_pPrevEntry = pBlock;
+	CLogEntry* pLogEntry = pFirstEntry;
+	for (;;)
+	{
+		CLogEntry* pNextEntry = pLogEntry->m_pNextEntry;
+		FreeEntry(pLogEntry);
+		if (pLogEntry == pLastEntry)
+			break;
+		pLogEntry = pNextEntry;
+	}
+	// Number of entries and their size in the log file are not changed.
+	m_dwNumPackedBytes += dwPackedSize;
+	m_dwNumCompressedBytes += dwCompressedSize;
+	return TRUE;
+}
+
+/**
+ * @param pLogEntry - list node.
+ * @return pointer to uncompressed entry data of m_dwSize bytes or NULL in case of error.
+ */
+const BYTE* CInMemLogFile::GetEntryData(const CLogEntry* pLogEntry)
+{
+	if (pLogEntry->m_dwNumPacked == 0)
+		return pLogEntry->m_pbData;
+	// Buffer is usually large enough since the block was compressed.
+	if (! m_PackBuffer.SetSize(pLogEntry->m_dwSize))
+		return NULL;
+	PBYTE pbPackedData = m_PackBuffer.GetData();
+	uLongf ulPackedSize = pLogEntry->m_dwSize;
+	if (uncompress(pbPackedData, &ulPackedSize, pLogEntry->m_pbData, pLogEntry->m_dwDataSize) != Z_OK ||
+		ulPackedSize != pLogEntry->m_dwSize)
+	{
+		return NULL;
+	}
+	return pbPackedData;
+}
+
+/**
+ * @param pszEntry - entry text.
+ * @param rpbKey - UTF-8 entry text.
+ * @param rdwKeySize - size of UTF-8 entry text in bytes.
+ * @return true if entry text was encoded.
+ */
+BOOL CInMemLogFile::GetCoalescingKey(PCTSTR pszEntry, const BYTE*& rpbKey, DWORD& rdwKeySize)
+{
+	// Entries written as TCHAR and as UTF-8 text are compared in the same form.
+	m_KeyEncStream.Reset();
+	if (! m_KeyEncStream.WriteUTF8Bin(pszEntry))
+		return FALSE;
+	rdwKeySize = (DWORD)m_KeyStream.GetLength();
+	rpbKey = rdwKeySize > 0 ? m_KeyStream.GetBuffer() : (const BYTE*)"";
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pbText - UTF-8 entry text.
+ * @param dwTextSize - size of entry text in bytes.
+ * @param ullTime - entry time.
+ * @return true if entry was merged into the previous entry.
+ */
+BOOL CInMemLogFile::CoalesceEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, const BYTE* pbText, DWORD dwTextSize, ULONGLONG ullTime)
+{
+	if (m_pRepeatedEntry == NULL ||
+		m_eRepeatedLevel != eLogLevel ||
+		m_eRepeatedMode != eEntryMode ||
+		m_dwRepeatedTextSize != dwTextSize)
+	{
+		return FALSE;
+	}
+	// Entry is merged only while it stays at the end where new entries are added.
+	if (m_pRepeatedEntry != (eEntryMode == EM_APPEND ? m_pLastEntry : m_pFirstEntry))
+		return FALSE;
+	if (memcmp(m_RepeatedText.GetData(), pbText, dwTextSize) != 0)
+		return FALSE;
+	++m_dwNumRepeats;
+	m_ullLastRepeatTime = ullTime;
+	// Merged entry changes only the repeat summary.
+	AccountDirtyEntry(0);
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pbText - UTF-8 entry text.
+ * @param dwTextSize - size of entry text in bytes.
+ * @param ullTime - entry time.
+ */
+void CInMemLogFile::SetRepeatedEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, const BYTE* pbText, DWORD dwTextSize, ULONGLONG ullTime)
+{
+	_ASSERTE(m_dwNumRepeats == 0);
+	ResetRepeatedEntry();
+	if (! m_RepeatedText.SetSize(max(dwTextSize, (DWORD)1)))
+		return;
+	CopyMemory(m_RepeatedText.GetData(), pbText, dwTextSize);
+	m_dwRepeatedTextSize = dwTextSize;
+	m_eRepeatedLevel = eLogLevel;
+	m_eRepeatedMode = eEntryMode;
+	m_ullRepeatedTime = ullTime;
+	m_pRepeatedEntry = eEntryMode == EM_APPEND ? m_pLastEntry : m_pFirstEntry;
+}
+
+/**
+ * @param dwSize - size of entry data.
+ */
+void CInMemLogFile::AccountDirtyEntry(DWORD dwSize)
+{
+	if (m_dwFlushEntries == 0 && m_dwFlushDelay == 0 && m_dwFlushBytes == 0)
+		return;
+	// Flusher is signaled once to start the timer and once when the limit is reached.
+	BOOL bNotifyFlusher = FALSE;
+	if (m_dwNumDirtyEntries++ == 0)
+	{
+		m_dwDirtyTime = GetTickCount();
+		bNotifyFlusher = m_dwFlushDelay != 0;
+	}
+	m_dwNumDirtyBytes += dwSize;
+	if (! m_bFlushRequested &&
+		((m_dwFlushEntries != 0 && m_dwNumDirtyEntries >= m_dwFlushEntries) ||
+		 (m_dwFlushBytes != 0 && m_dwNumDirtyBytes >= m_dwFlushBytes)))
+	{
+		m_bFlushRequested = TRUE;
+		bNotifyFlusher = TRUE;
+	}
+	if (bNotifyFlusher)
+		g_LogFlusher.RequestFlush();
+}
+
+/**
+ * @param rdwFlushEntries - number of new entries that triggers flush.
+ * @param rdwFlushDelay - maximum age of unsaved entries in milliseconds.
+ * @param rdwFlushBytes - size of new entries that triggers flush.
+ * @return true if the log supports automatic flush.
+ */
+BOOL CInMemLogFile::GetLogFlushPolicy(DWORD& rdwFlushEntries, DWORD& rdwFlushDelay, DWORD& rdwFlushBytes) const
+{
+	rdwFlushEntries = m_dwFlushEntries;
+	rdwFlushDelay = m_dwFlushDelay;
+	rdwFlushBytes = m_dwFlushBytes;
+	return TRUE;
+}
+
+/**
+ * @param dwFlushEntries - number of new entries that triggers flush or 0.
+ * @param dwFlushDelay - maximum age of unsaved entries in milliseconds or 0.
+ * @param dwFlushBytes - size of new entries that triggers flush or 0.
+ * @return true if operation is accepted.
+ */
+BOOL CInMemLogFile::SetLogFlushPolicy(DWORD dwFlushEntries, DWORD dwFlushDelay, DWORD dwFlushBytes)
+{
+	m_dwFlushEntries = dwFlushEntries;
+	m_dwFlushDelay = dwFlushDelay;
+	m_dwFlushBytes = dwFlushBytes;
+	// Entries added before the policy was set are not counted.
+	ResetDirtyEntries();
+	return TRUE;
+}
+
+/**
+ * @param dwCurrentTime - current tick count.
+ * @return time in milliseconds until the log has to be flushed, 0 if it's due or INFINITE.
+ */
+DWORD CInMemLogFile::GetFlushTimeout(DWORD dwCurrentTime) const
+{
+	if (m_dwNumDirtyEntries == 0)
+		return INFINITE;
+	if (m_bFlushRequested)
+		return 0;
+	if (m_dwFlushDelay == 0)
+		return INFINITE;
+	DWORD dwDirtyTime = dwCurrentTime - m_dwDirtyTime;
+	return (dwDirtyTime >= m_dwFlushDelay ? 0 : m_dwFlushDelay - dwDirtyTime);
+}
+
+void CInMemLogFile::ResetDirtyEntries(void)
+{
+	m_dwNumDirtyEntries = 0;
+	m_dwNumDirtyBytes = 0;
+	m_bFlushRequested = FALSE;
+}
+
+/**
+ * @param pszSummary - summary text buffer.
+ * @param dwSummarySize - size of summary text buffer.
+ */
+void CInMemLogFile::FormatRepeatSummary(PTSTR pszSummary, DWORD dwSummarySize)
+{
+	_stprintf_s(pszSummary, dwSummarySize, _T(" (repeated %lu times, last at %s)"), m_dwNumRepeats, GetTimeStamp(m_ullLastRepeatTime));
+}
+
+/**
+ * @param pParam - log that waits for entries of previous session.
+ * @return thread exit code.
+ */
+UINT CALLBACK CInMemLogFile::LoadThreadProc(PVOID pParam)
+{
+	CInMemLogFile* pLogFile = (CInMemLogFile*)pParam;
+	BOOL bLoaded = pLogFile->m_pHistoryLog->LoadEntries();
+	// Exit code can't be trusted: thread killed at process exit reports exit code of the process.
+	InterlockedExchange(&pLogFile->m_lLoadState, bLoaded ? LS_LOADED : LS_FAILED);
+	return 0;
+}
+
+/**
+ * @return true if loading was started or entries were loaded.
+ */
+BOOL CInMemLogFile::DeferLoadEntries(void)
+{
+	_ASSERTE(m_hLoadThread == NULL && m_pHistoryLog == NULL);
+	// Entries are parsed into separate log, so new entries may be added meanwhile.
+	m_pHistoryLog = CreateHistoryLog();
+	if (m_pHistoryLog != NULL)
+	{
+		m_pHistoryLog->SetLogFileName(GetLogFileName());
+		// Loaded entries are trimmed and packed the same way as entries of this log,
+		// the temporary log is kept in regular memory even if this log uses a ring.
+		m_pHistoryLog->SetLogSizeInEntries(m_dwLogSizeInEntries);
+		m_pHistoryLog->SetLogSizeInBytes(m_dwLogSizeInBytes);
+		m_pHistoryLog->SetLogFlags(GetLogFlags() & ~(BTLF_RINGBUFFER | BTLF_DEFERREDLOAD));
+		PinLibraryInMemory();
+		m_lLoadState = LS_PENDING;
+		m_hLoadThread = (HANDLE)_beginthreadex(NULL, 0, LoadThreadProc, this, 0, &m_uLoadThreadID);
+		if (m_hLoadThread != NULL)
+			return TRUE;
+		delete m_pHistoryLog;
+		m_pHistoryLog = NULL;
+	}
+	return LoadEntries();
+}
+
+/**
+ * @param bMerge - true if loaded entries have to be added to the log.
+ * @param bWait - true if the caller may wait for the loader.
+ * @return false if entries of previous session are kept only in the log file.
+ */
+BOOL CInMemLogFile::FinishDeferredLoad(BOOL bMerge, BOOL bWait)
+{
+	if (m_hLoadThread == NULL)
+		return ! m_bHistoryUnloaded;
+	// Crash handler may be invoked by loader thread itself.
+	if (GetCurrentThreadId() == m_uLoadThreadID)
+		return FALSE;
+	// Crashed thread may hold a lock the loader needs, and DllMain() can't wait for threads.
+	if (bWait && ! g_bInDllMain)
+		WaitForSingleObject(m_hLoadThread, INFINITE);
+	else if (WaitForSingleObject(m_hLoadThread, 0) != WAIT_OBJECT_0)
+		return FALSE;
+	CloseHandle(m_hLoadThread);
+	m_hLoadThread = NULL;
+	m_uLoadThreadID = 0;
+	LONG lLoadState = m_lLoadState;
+	if (lLoadState == LS_PENDING)
+	{
+		// Loader was killed at process exit. Its log may be left in the middle
+		// of an update, so it's abandoned and the file is never truncated.
+		m_pHistoryLog = NULL;
+		m_bHistoryUnloaded = TRUE;
+		return FALSE;
+	}
+	// Unreadable log of previous session is discarded.
+	if (bMerge && lLoadState == LS_LOADED)
+		MergeHistoryLog(*m_pHistoryLog);
+	delete m_pHistoryLog;
+	m_pHistoryLog = NULL;
+	return TRUE;
+}
+
+/**
+ * @param rHistoryLog - log with entries of previous session.
+ */
+void CInMemLogFile::MergeHistoryLog(const CInMemLogFile& rHistoryLog)
+{
+	// The newest entries of previous session are added first and the rest is dropped
+	// when the log is full, so new entries are never evicted by older ones.
+	const CLogEntry* pHistoryEntry = rHistoryLog.m_pLastEntry;
+	DWORD dwIndexPos = rHistoryLog.m_Index.GetCount();
+	while (pHistoryEntry != NULL)
+	{
+		// Packed node keeps several entries, the whole node must fit or LinkHead()
+		// would evict the newest entries from the tail.
+		DWORD dwNumNodeEntries = GetNumNodeEntries(pHistoryEntry);
+		DWORD dwNumStoredBytes = GetNumStoredBytes();
+		if (m_dwNumEntries > m_dwLogSizeInEntries ||
+			dwNumNodeEntries > m_dwLogSizeInEntries - m_dwNumEntries ||
+			dwNumStoredBytes > m_dwLogSizeInBytes ||
+			pHistoryEntry->m_dwSize > m_dwLogSizeInBytes - dwNumStoredBytes)
+		{
+			break;
+		}
+		CLogEntry* pLogEntry = AllocEntry(pHistoryEntry->m_dwDataSize, EM_INSERT, FALSE);
+		if (pLogEntry == NULL)
+			break;
+		CopyMemory(pLogEntry->m_pbData, pHistoryEntry->m_pbData, pHistoryEntry->m_dwDataSize);
+		pLogEntry->m_dwSize = pHistoryEntry->m_dwSize;
+		pLogEntry->m_dwNumPacked = pHistoryEntry->m_dwNumPacked;
+		dwIndexPos -= dwNumNodeEntries;
+		CopyIndexRecords(rHistoryLog.m_Index, dwIndexPos, dwNumNodeEntries, EM_INSERT);
+		LinkHead(pLogEntry);
+		pHistoryEntry = pHistoryEntry->m_pPrevEntry;
+	}
+}
+
+/**
+ * @param rLogQuery - query filter and receiver of entries.
+ * @return true if operation was completed successfully.
+ */
+BOOL CInMemLogFile::QueryEntries(const CLogQuery& rLogQuery)
+{
+	// Query sees entries of previous session too.
+	FinishDeferredLoad(TRUE, TRUE);
+	if (! m_Index.IsValid())
+		return FALSE;
+	_ASSERTE(m_Index.GetCount() == m_dwNumEntries);
+	// Only the index is scanned backwards to find the oldest of the newest matching entries.
+	DWORD dwNumMatches = 0, dwFirstPos = 0;
+	for (DWORD dwRecordPos = m_Index.GetCount(); dwRecordPos > 0 && dwNumMatches < rLogQuery.m_dwMaxEntries; --dwRecordPos)
+	{
+		if (m_Index.IsMatching(dwRecordPos - 1, rLogQuery))
+		{
+			dwFirstPos = dwRecordPos - 1;
+			++dwNumMatches;
+		}
+	}
+	if (dwNumMatches == 0)
+		return TRUE;
+	// Find list node that keeps the first matching entry.
+	CLogEntry* pLogEntry = m_pLastEntry;
+	DWORD dwNodePos = m_dwNumEntries - GetNumNodeEntries(pLogEntry);
+	while (dwNodePos > dwFirstPos)
+	{
+		pLogEntry = pLogEntry->m_pPrevEntry;
+		dwNodePos -= GetNumNodeEntries(pLogEntry);
+	}
+	BUGTRAP_LOGENTRYVIEW EntryView;
+	while (dwNumMatches > 0)
+	{
+		_ASSERTE(pLogEntry != NULL);
+		DWORD dwNodeEndPos = dwNodePos + GetNumNodeEntries(pLogEntry);
+		// Compressed block is unpacked only if it has matching entries.
+		const BYTE* pbNodeData = NULL;
+		DWORD dwOffset = 0;
+		for (DWORD dwRecordPos = dwNodePos; dwRecordPos < dwNodeEndPos && dwNumMatches > 0; ++dwRecordPos)
+		{
+			DWORD dwSize = m_Index.GetSize(dwRecordPos);
+			if (dwRecordPos >= dwFirstPos && m_Index.IsMatching(dwRecordPos, rLogQuery))
+			{
+				if (pbNodeData == NULL)
+				{
+					pbNodeData = GetEntryData(pLogEntry);
+					if (pbNodeData == NULL)
+						return FALSE;
+				}
+				_ASSERTE(dwOffset + dwSize <= (pLogEntry->m_dwNumPacked != 0 ? pLogEntry->m_dwSize : pLogEntry->m_dwDataSize));
+				ULONGLONG ullTime = m_Index.GetTime(dwRecordPos);
+				EntryView.eLogLevel = m_Index.GetLogLevel(dwRecordPos);
+				EntryView.ftTime.dwLowDateTime = (DWORD)ullTime;
+				EntryView.ftTime.dwHighDateTime = (DWORD)(ullTime >> 32);
+				GetEntryView(pbNodeData + dwOffset, dwSize, EntryView);
+				--dwNumMatches;
+				if (! rLogQuery.m_pfnCallback(&EntryView, rLogQuery.m_nQueryParam))
+					return TRUE;
+			}
+			dwOffset += dwSize;
+		}
+		dwNodePos = dwNodeEndPos;
+		pLogEntry = pLogEntry->m_pNextEntry;
+	}
+	return TRUE;
 }
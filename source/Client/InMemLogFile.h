@@ -15,6 +15,9 @@
 #pragma once
 
 #include "LogFile.h"
+#include "SlabAllocator.h"
+#include "ByteRing.h"
+#include "LogIndex.h"
 
 /**
  * @brief Base class for in-memory log file.
@@ -34,10 +37,30 @@ public:
 	virtual DWORD GetLogSizeInBytes(void) const;
 	/// Set maximum log file size in bytes.
 	virtual BOOL SetLogSizeInBytes(DWORD dwLogSizeInBytes);
+	/// Set new set of log flags.
+	virtual BOOL SetLogFlags(DWORD dwLogFlags);
+	/// Get size of memory pre-reserved for log entries.
+	virtual DWORD GetLogBufferSize(void) const;
+	/// Set size of memory pre-reserved for log entries.
+	virtual BOOL SetLogBufferSize(DWORD dwLogBufferSize);
 	/// Clear log entries.
 	virtual BOOL ClearEntries(void);
 	/// Close log file.
 	virtual void Close(void);
+	/// Load entries of previous session in background thread.
+	virtual BOOL DeferLoadEntries(void);
+	/// Pass entries that match the filter to the callback.
+	virtual BOOL QueryEntries(const CLogQuery& rLogQuery);
+	/// Get conditions of automatic flush.
+	virtual BOOL GetLogFlushPolicy(DWORD& rdwFlushEntries, DWORD& rdwFlushDelay, DWORD& rdwFlushBytes) const;
+	/// Set conditions of automatic flush.
+	virtual BOOL SetLogFlushPolicy(DWORD dwFlushEntries, DWORD dwFlushDelay, DWORD dwFlushBytes);
+	/// Get time left until automatic flush.
+	virtual DWORD GetFlushTimeout(DWORD dwCurrentTime) const;
+	/// Forget entries added since the last flush.
+	virtual void ResetDirtyEntries(void);
+	/// Compress old entries in background, the log must not be locked by the caller.
+	virtual void PackEntries(void);
 	/// Get number of entries in a log.
 	DWORD GetNumEntries(void) const;
 	/// Get number of bytes in a log.
@@ -53,16 +76,26 @@ protected:
 		CLogEntry* m_pNextEntry;
 		/// Buffer size in bytes.
 		DWORD m_dwSize;
+		/// Entry data.
+		PBYTE m_pbData;
+		/// Size of entry data in memory.
+		DWORD m_dwDataSize;
+		/// Number of entries compressed into this block or 0 for regular entry.
+		DWORD m_dwNumPacked;
 	};
 
+	/// Allocate log entry at the given end of the log.
+	CLogEntry* AllocEntry(DWORD dwDataSize, ENTRY_MODE eEntryMode, BOOL bEvict = TRUE);
+	/// Get contiguous segments of entry data.
+	BOOL GetDataSegments(const BYTE* arrSegments[2], DWORD arrSegmentSizes[2]) const;
 	/// Get pointer to the first log entry.
 	CLogEntry* GetFirstEntry(void) const;
 	/// Get pointer to the last log entry.
 	CLogEntry* GetLastEntry(void) const;
 	/// Add log entry to the head.
-	void AddToHead(CLogEntry* pLogEntry);
+	void AddToHead(CLogEntry* pLogEntry, BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime);
 	/// Add log entry to the tail.
-	void AddToTail(CLogEntry* pLogEntry);
+	void AddToTail(CLogEntry* pLogEntry, BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime);
 	/// Remove the entry from the head.
 	void DeleteHead(void);
 	/// Remove the entry from the tail.
@@ -73,6 +106,42 @@ protected:
 	void FreeTail(void);
 	/// Free log entries.
 	void FreeEntries(void);
+	/// Get number of head entries stored in the log file.
+	DWORD GetNumSavedEntries(void) const;
+	/// Get size of saved entries evicted since the last save.
+	DWORD GetNumEvictedBytes(void) const;
+	/// Return true if log file has to be completely rewritten.
+	BOOL IsRewriteRequired(void) const;
+	/// Mark all entries as stored in the log file.
+	void MarkEntriesSaved(void);
+	/// Return true if entry data may be compressed.
+	virtual BOOL CanPackEntries(void) const;
+	/// Get number of log entries kept by list node.
+	static DWORD GetNumNodeEntries(const CLogEntry* pLogEntry);
+	/// Return true if some entries are compressed.
+	BOOL HasPackedEntries(void) const;
+	/// Get uncompressed entry data.
+	const BYTE* GetEntryData(const CLogEntry* pLogEntry);
+	/// Return true if repeated entries have to be merged.
+	BOOL IsCoalescingEnabled(void) const;
+	/// Get UTF-8 entry text used to detect repeated entries.
+	BOOL GetCoalescingKey(PCTSTR pszEntry, const BYTE*& rpbKey, DWORD& rdwKeySize);
+	/// Merge entry into the previous one if it has the same level and text.
+	BOOL CoalesceEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, const BYTE* pbText, DWORD dwTextSize, ULONGLONG ullTime);
+	/// Remember the last added entry as candidate for merging.
+	void SetRepeatedEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, const BYTE* pbText, DWORD dwTextSize, ULONGLONG ullTime);
+	/// Get entry that absorbed repeated entries.
+	CLogEntry* GetRepeatedEntry(ENTRY_MODE& reEntryMode, BUGTRAP_LOGLEVEL& reLogLevel, ULONGLONG& rullTime) const;
+	/// Stop merging entries into the last entry.
+	void ResetRepeatedEntry(void);
+	/// Format summary of repeated entries.
+	void FormatRepeatSummary(PTSTR pszSummary, DWORD dwSummarySize);
+	/// Create empty log of the same format.
+	virtual CInMemLogFile* CreateHistoryLog(void) const = 0;
+	/// Wait for background loader and optionally merge loaded entries.
+	BOOL FinishDeferredLoad(BOOL bMerge, BOOL bWait);
+	/// Get text of entry data for query callback.
+	virtual void GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView);
 
 private:
 	/// Protects the class from being accidentally copied.
@@ -80,6 +149,59 @@ private:
 	/// Protects the class from being accidentally copied.
 	CInMemLogFile& operator=(const CInMemLogFile& rLogFile);
 
+	/// Storage parameters.
+	enum
+	{
+		/// Default size of ring buffer.
+		DEFAULT_RING_SIZE = 256 * 1024,
+		/// Size of the newest entries that are never compressed.
+		HOT_TAIL_SIZE = 64 * 1024,
+		/// Size of uncompressed data in one compressed block.
+		PACK_BLOCK_SIZE = 64 * 1024
+	};
+
+	/// State of background loader.
+	enum LOAD_STATE
+	{
+		/// Loader hasn't finished.
+		LS_PENDING,
+		/// Entries of previous session were loaded.
+		LS_LOADED,
+		/// Log of previous session couldn't be read.
+		LS_FAILED
+	};
+
+	/// Release memory of log entry.
+	void FreeEntry(CLogEntry* pLogEntry);
+	/// Link list node before the first node.
+	void LinkHead(CLogEntry* pLogEntry);
+	/// Link list node after the last node.
+	void LinkTail(CLogEntry* pLogEntry);
+	/// Copy index records of list node from another index.
+	void CopyIndexRecords(const CLogIndex& rLogIndex, DWORD dwPosition, DWORD dwCount, ENTRY_MODE eEntryMode);
+	/// Move log entries to the new storage.
+	BOOL SetStorage(BOOL bUseRing, DWORD dwRingSize);
+	/// Get size of memory used by log entries.
+	DWORD GetNumStoredBytes(void) const;
+	/// Update log statistics for the added or removed list node.
+	void AccountEntry(const CLogEntry* pLogEntry, BOOL bAdded);
+	/// Account new entry against flush policy.
+	void AccountDirtyEntry(DWORD dwSize);
+	/// Ask background thread to compress old entries.
+	void RequestPacking(void);
+	/// Return true if uncompressed old entries fill a block.
+	BOOL HasColdEntries(void) const;
+	/// Find the oldest run of entries that can be compressed into one block.
+	CLogEntry* FindColdEntries(DWORD& rdwNumPacked, DWORD& rdwPackedSize) const;
+	/// Copy the oldest run of entries to compression buffer.
+	CLogEntry* CopyColdEntries(DWORD& rdwNumPacked, DWORD& rdwPackedSize);
+	/// Replace copied entries by compressed block unless they were changed meanwhile.
+	BOOL ReplaceColdEntries(const CLogEntry* pCopiedEntry, DWORD dwNumPacked, DWORD dwPackedSize, DWORD dwCompressedSize);
+	/// Put entries of previous session before new entries.
+	void MergeHistoryLog(const CInMemLogFile& rHistoryLog);
+	/// Load entries of previous session.
+	static UINT CALLBACK LoadThreadProc(PVOID pParam);
+
 	/// Number of entries kept in memory.
 	DWORD m_dwNumEntries;
 	/// Size of log in bytes.
@@ -94,6 +216,76 @@ private:
 	CLogEntry* m_pFirstEntry;
 	/// Pointer to the last log entry.
 	CLogEntry* m_pLastEntry;
+	/// Allocator of log entries.
+	CSlabAllocator m_Allocator;
+	/// Ring buffer that keeps entry data or NULL.
+	CByteRing* m_pRing;
+	/// Size of memory reserved for log entries.
+	DWORD m_dwBufferSize;
+	/// Number of head entries stored in the log file.
+	DWORD m_dwNumSavedEntries;
+	/// Size of saved entries evicted since the last save.
+	DWORD m_dwNumEvictedBytes;
+	/// True if log file has to be completely rewritten.
+	BOOL m_bRewriteRequired;
+	/// True if old entries have to be compressed.
+	BOOL m_bPackEntries;
+	/// Uncompressed size of compressed entries.
+	DWORD m_dwNumPackedBytes;
+	/// Size of compressed entry data.
+	DWORD m_dwNumCompressedBytes;
+	/// Buffer used for compression and decompression of entry data.
+	CDynamicBuffer<BYTE> m_PackBuffer;
+	/// Buffer used by background compression without the log lock.
+	CDynamicBuffer<BYTE> m_CompressBuffer;
+	/// True if background thread was asked to compress old entries.
+	BOOL m_bPackRequested;
+	/// Entry that absorbs repeated entries or NULL.
+	CLogEntry* m_pRepeatedEntry;
+	/// Mode of entry that absorbs repeated entries.
+	ENTRY_MODE m_eRepeatedMode;
+	/// Log level of entry that absorbs repeated entries.
+	BUGTRAP_LOGLEVEL m_eRepeatedLevel;
+	/// Time of entry that absorbs repeated entries.
+	ULONGLONG m_ullRepeatedTime;
+	/// UTF-8 text of entry that absorbs repeated entries.
+	CDynamicBuffer<BYTE> m_RepeatedText;
+	/// Size of entry text in bytes.
+	DWORD m_dwRepeatedTextSize;
+	/// Number of merged entries.
+	DWORD m_dwNumRepeats;
+	/// Time of the last merged entry.
+	ULONGLONG m_ullLastRepeatTime;
+	/// Buffer of UTF-8 text of the new entry.
+	CMemStream m_KeyStream;
+	/// Encoder of UTF-8 text of the new entry.
+	CUTF8EncStream m_KeyEncStream;
+	/// Thread that loads entries of previous session or NULL.
+	HANDLE m_hLoadThread;
+	/// Loader thread ID.
+	UINT m_uLoadThreadID;
+	/// Log that receives entries of previous session.
+	CInMemLogFile* m_pHistoryLog;
+	/// Result of background loader published by the loader itself.
+	volatile LONG m_lLoadState;
+	/// True if loader was abandoned and entries of previous session are kept only in the file.
+	BOOL m_bHistoryUnloaded;
+	/// Level, time and size of every entry.
+	CLogIndex m_Index;
+	/// Number of new entries that triggers flush or 0.
+	DWORD m_dwFlushEntries;
+	/// Maximum age of unsaved entries in milliseconds or 0.
+	DWORD m_dwFlushDelay;
+	/// Size of new entries that triggers flush or 0.
+	DWORD m_dwFlushBytes;
+	/// Number of entries added since the last flush.
+	DWORD m_dwNumDirtyEntries;
+	/// Size of entries added since the last flush.
+	DWORD m_dwNumDirtyBytes;
+	/// Tick count when the first entry was added after the last flush.
+	DWORD m_dwDirtyTime;
+	/// True if entries or bytes limit was reached.
+	BOOL m_bFlushRequested;
 };
 
 /**
@@ -132,6 +324,27 @@ inline BOOL CInMemLogFile::SetLogSizeInBytes(DWORD dwLogSizeInBytes)
 	return TRUE;
 }
 
+/**
+ * @return size of memory pre-reserved for log entries.
+ */
+inline DWORD CInMemLogFile::GetLogBufferSize(void) const
+{
+	return m_dwBufferSize;
+}
+
+/**
+ * @param arrSegments - pointers to data segments.
+ * @param arrSegmentSizes - sizes of data segments.
+ * @return true if entry data is kept in ring buffer.
+ */
+inline BOOL CInMemLogFile::GetDataSegments(const BYTE* arrSegments[2], DWORD arrSegmentSizes[2]) const
+{
+	if (m_pRing == NULL)
+		return FALSE;
+	m_pRing->GetSegments(arrSegments, arrSegmentSizes);
+	return TRUE;
+}
+
 /**
  * @return pointer to the first log entry.
  */
@@ -164,9 +377,112 @@ inline DWORD CInMemLogFile::GetNumBytes(void) const
 	return m_dwNumBytes;
 }
 
+/**
+ * @return number of head entries stored in the log file.
+ */
+inline DWORD CInMemLogFile::GetNumSavedEntries(void) const
+{
+	return m_dwNumSavedEntries;
+}
+
+/**
+ * @return size of saved entries evicted since the last save.
+ */
+inline DWORD CInMemLogFile::GetNumEvictedBytes(void) const
+{
+	return m_dwNumEvictedBytes;
+}
+
+/**
+ * @return true if log file has to be completely rewritten.
+ */
+inline BOOL CInMemLogFile::IsRewriteRequired(void) const
+{
+	return m_bRewriteRequired;
+}
+
+inline void CInMemLogFile::MarkEntriesSaved(void)
+{
+	m_dwNumSavedEntries = m_dwNumEntries;
+	m_dwNumEvictedBytes = 0;
+	m_bRewriteRequired = FALSE;
+}
+
+/**
+ * @return true if entry data may be compressed.
+ */
+inline BOOL CInMemLogFile::CanPackEntries(void) const
+{
+	return FALSE;
+}
+
+/**
+ * @param pLogEntry - list node.
+ * @return number of log entries kept by list node.
+ */
+inline DWORD CInMemLogFile::GetNumNodeEntries(const CLogEntry* pLogEntry)
+{
+	return (pLogEntry->m_dwNumPacked != 0 ? pLogEntry->m_dwNumPacked : 1);
+}
+
+/**
+ * @return true if some entries are compressed.
+ */
+inline BOOL CInMemLogFile::HasPackedEntries(void) const
+{
+	return (m_dwNumPackedBytes != 0);
+}
+
+/**
+ * @return true if uncompressed old entries fill a block.
+ */
+inline BOOL CInMemLogFile::HasColdEntries(void) const
+{
+	return (m_dwNumBytes - m_dwInitialLogSizeInBytes - m_dwNumPackedBytes > HOT_TAIL_SIZE + PACK_BLOCK_SIZE);
+}
+
+/**
+ * @return size of memory used by log entries.
+ */
+inline DWORD CInMemLogFile::GetNumStoredBytes(void) const
+{
+	return (m_dwNumBytes - m_dwNumPackedBytes + m_dwNumCompressedBytes);
+}
+
+/**
+ * @return true if repeated entries have to be merged.
+ */
+inline BOOL CInMemLogFile::IsCoalescingEnabled(void) const
+{
+	return ((GetLogFlags() & BTLF_COALESCE) != 0);
+}
+
+/**
+ * @param reEntryMode - mode of the entry.
+ * @param reLogLevel - log level of the entry.
+ * @param rullTime - time of the entry.
+ * @return pointer to the entry that absorbed repeated entries or NULL if there are no repeated entries.
+ */
+inline CInMemLogFile::CLogEntry* CInMemLogFile::GetRepeatedEntry(ENTRY_MODE& reEntryMode, BUGTRAP_LOGLEVEL& reLogLevel, ULONGLONG& rullTime) const
+{
+	reEntryMode = m_eRepeatedMode;
+	reLogLevel = m_eRepeatedLevel;
+	rullTime = m_ullRepeatedTime;
+	return (m_dwNumRepeats > 0 ? m_pRepeatedEntry : NULL);
+}
+
+inline void CInMemLogFile::ResetRepeatedEntry(void)
+{
+	m_pRepeatedEntry = NULL;
+	m_dwNumRepeats = 0;
+	m_ullLastRepeatTime = 0;
+}
+
 inline CInMemLogFile::~CInMemLogFile(void)
 {
+	FinishDeferredLoad(FALSE, TRUE);
 	FreeEntries();
+	delete m_pRing;
 }
 
 /*
@@ -174,6 +490,8 @@ inline CInMemLogFile::~CInMemLogFile(void)
  */
 inline BOOL CInMemLogFile::ClearEntries(void)
 {
+	// Entries of previous session are cleared too.
+	FinishDeferredLoad(FALSE, TRUE);
 	FreeEntries();
 	return TRUE;
 }
@@ -181,3 +499,15 @@ inline BOOL CInMemLogFile::ClearEntries(void)
 inline void CInMemLogFile::Close(void)
 {
 }
+
+/**
+ * @param pbData - entry data.
+ * @param dwSize - size of entry data.
+ * @param rEntryView - view that receives entry text.
+ */
+inline void CInMemLogFile::GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView)
+{
+	rEntryView.pEntryText = pbData;
+	rEntryView.dwEntryTextSize = dwSize;
+	rEntryView.bUTF8Text = TRUE;
+}
@@ -0,0 +1,195 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-category verbosity of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogCategories.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogCategories::CLogCategories(void)
+{
+	InitializeCriticalSection(&m_csCategories);
+	ZeroMemory(m_arrCategories, sizeof(m_arrCategories));
+	// The first entry is reserved for entries without category.
+	m_arrCategories[0].m_lLogLevel = INHERITED_LEVEL;
+	m_lNumCategories = 1;
+	m_lMaxLogLevel = INHERITED_LEVEL;
+}
+
+CLogCategories::~CLogCategories(void)
+{
+	DeleteCriticalSection(&m_csCategories);
+}
+
+/**
+ * @param pszCategory - category name.
+ * @param nLength - length of category name.
+ * @return category index or 0 if category table is full.
+ */
+DWORD CLogCategories::FindCategory(PCTSTR pszCategory, size_t nLength)
+{
+	if (nLength == 0 || nLength >= MAX_NAME_LENGTH)
+		return 0;
+	DWORD dwNumCategories = (DWORD)m_lNumCategories;
+	for (DWORD dwCategory = 1; dwCategory < dwNumCategories; ++dwCategory)
+	{
+		PCTSTR pszName = m_arrCategories[dwCategory].m_szName;
+		if (_tcsnicmp(pszName, pszCategory, nLength) == 0 && pszName[nLength] == _T('\0'))
+			return dwCategory;
+	}
+	if (dwNumCategories >= MAX_CATEGORIES)
+		return 0;
+	CCategory& rCategory = m_arrCategories[dwNumCategories];
+	_tcsncpy_s(rCategory.m_szName, countof(rCategory.m_szName), pszCategory, nLength);
+	rCategory.m_lLogLevel = INHERITED_LEVEL;
+	// Readers see the new entry only after it was filled.
+	InterlockedExchange(&m_lNumCategories, (LONG)(dwNumCategories + 1));
+	return dwNumCategories;
+}
+
+/**
+ * @param pszCategory - category name.
+ * @return category index or 0 if category can't be registered.
+ */
+DWORD CLogCategories::GetCategory(PCTSTR pszCategory)
+{
+	if (pszCategory == NULL)
+		return 0;
+	EnterCriticalSection(&m_csCategories);
+	DWORD dwCategory = FindCategory(pszCategory, _tcslen(pszCategory));
+	LeaveCriticalSection(&m_csCategories);
+	return dwCategory;
+}
+
+/**
+ * @param pszLogLevel - log level name or number.
+ * @param nLength - length of log level text.
+ * @param reLogLevel - parsed log level.
+ * @return true if log level was recognized.
+ */
+BOOL CLogCategories::ParseLogLevel(PCTSTR pszLogLevel, size_t nLength, BUGTRAP_LOGLEVEL& reLogLevel)
+{
+	static const struct
+	{
+		PCTSTR m_pszName;
+		BUGTRAP_LOGLEVEL m_eLogLevel;
+	}
+	arrLogLevels[] =
+	{
+		{ _T("NONE"),      BTLL_NONE },
+		{ _T("ERROR"),     BTLL_ERROR },
+		{ _T("WARNING"),   BTLL_WARNING },
+		{ _T("IMPORTANT"), BTLL_IMPORTANT },
+		{ _T("INFO"),      BTLL_INFO },
+		{ _T("VERBOSE"),   BTLL_VERBOSE },
+		{ _T("DEBUG"),     BTLL_VERBOSE },
+		{ _T("ALL"),       BTLL_ALL }
+	};
+	if (nLength == 1 && *pszLogLevel >= _T('0') && *pszLogLevel <= _T('0') + BTLL_VERBOSE)
+	{
+		reLogLevel = (BUGTRAP_LOGLEVEL)(*pszLogLevel - _T('0'));
+		return TRUE;
+	}
+	for (int iLevelPos = 0; iLevelPos < countof(arrLogLevels); ++iLevelPos)
+	{
+		PCTSTR pszName = arrLogLevels[iLevelPos].m_pszName;
+		if (_tcsnicmp(pszName, pszLogLevel, nLength) == 0 && pszName[nLength] == _T('\0'))
+		{
+			reLogLevel = arrLogLevels[iLevelPos].m_eLogLevel;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+ * @param pszCategoryLevels - comma separated list of category levels.
+ * @param bApply - true if levels have to be assigned, the table must be locked.
+ * @return true if list was parsed and all categories were registered.
+ */
+BOOL CLogCategories::ParseCategoryLevels(PCTSTR pszCategoryLevels, BOOL bApply)
+{
+	BOOL bResult = TRUE;
+	PCTSTR pszItem = pszCategoryLevels;
+	for (;;)
+	{
+		while (_istspace(*pszItem) || *pszItem == _T(',') || *pszItem == _T(';'))
+			++pszItem;
+		if (*pszItem == _T('\0'))
+			break;
+		PCTSTR pszName = pszItem;
+		while (*pszItem && *pszItem != _T('=') && *pszItem != _T(',') && *pszItem != _T(';') && ! _istspace(*pszItem))
+			++pszItem;
+		size_t nNameLength = pszItem - pszName;
+		while (_istspace(*pszItem))
+			++pszItem;
+		if (*pszItem != _T('=') || nNameLength == 0 || nNameLength >= MAX_NAME_LENGTH)
+			return FALSE;
+		++pszItem;
+		while (_istspace(*pszItem))
+			++pszItem;
+		PCTSTR pszLogLevel = pszItem;
+		while (*pszItem && *pszItem != _T(',') && *pszItem != _T(';') && ! _istspace(*pszItem))
+			++pszItem;
+		BUGTRAP_LOGLEVEL eLogLevel;
+		if (! ParseLogLevel(pszLogLevel, pszItem - pszLogLevel, eLogLevel))
+			return FALSE;
+		if (bApply)
+		{
+			DWORD dwCategory = FindCategory(pszName, nNameLength);
+			if (dwCategory != 0)
+				InterlockedExchange(&m_arrCategories[dwCategory].m_lLogLevel, eLogLevel);
+			else
+				bResult = FALSE;
+		}
+	}
+	return bResult;
+}
+
+/**
+ * @param pszCategoryLevels - comma separated list of category levels, e.g. "net=VERBOSE, db=WARNING";
+ * categories that are not listed inherit level of the log.
+ * @return true if list was parsed and all categories were registered.
+ */
+BOOL CLogCategories::SetCategoryLevels(PCTSTR pszCategoryLevels)
+{
+	if (pszCategoryLevels == NULL)
+		pszCategoryLevels = _T("");
+	// The list is validated before the table is changed.
+	if (! ParseCategoryLevels(pszCategoryLevels, FALSE))
+		return FALSE;
+	EnterCriticalSection(&m_csCategories);
+	DWORD dwNumCategories = (DWORD)m_lNumCategories;
+	for (DWORD dwCategory = 1; dwCategory < dwNumCategories; ++dwCategory)
+		InterlockedExchange(&m_arrCategories[dwCategory].m_lLogLevel, INHERITED_LEVEL);
+	BOOL bResult = ParseCategoryLevels(pszCategoryLevels, TRUE);
+	UpdateMaxLogLevel();
+	LeaveCriticalSection(&m_csCategories);
+	return bResult;
+}
+
+void CLogCategories::UpdateMaxLogLevel(void)
+{
+	LONG lMaxLogLevel = INHERITED_LEVEL;
+	DWORD dwNumCategories = (DWORD)m_lNumCategories;
+	for (DWORD dwCategory = 1; dwCategory < dwNumCategories; ++dwCategory)
+	{
+		LONG lLogLevel = m_arrCategories[dwCategory].m_lLogLevel;
+		if (lLogLevel > lMaxLogLevel)
+			lMaxLogLevel = lLogLevel;
+	}
+	InterlockedExchange(&m_lMaxLogLevel, lMaxLogLevel);
+}
@@ -0,0 +1,109 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-category verbosity of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "BugTrap.h"
+
+/**
+ * @brief Table of log levels assigned to entry categories.
+ * Category names are resolved to table indices once, so the level
+ * of category is checked by single read without locking the log.
+ * Category level overrides the level of the whole log in both directions.
+ */
+class CLogCategories
+{
+public:
+	/// Initialize the object.
+	CLogCategories(void);
+	/// Destroy the object.
+	~CLogCategories(void);
+	/// Find or register category.
+	DWORD GetCategory(PCTSTR pszCategory);
+	/// Assign levels to categories, e.g. "net=VERBOSE, db=WARNING".
+	BOOL SetCategoryLevels(PCTSTR pszCategoryLevels);
+	/// Get effective level of category.
+	BUGTRAP_LOGLEVEL GetCategoryLevel(DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel) const;
+	/// Get the most verbose level accepted by the log or any of its categories.
+	BUGTRAP_LOGLEVEL GetMaxLogLevel(BUGTRAP_LOGLEVEL eLogLevel) const;
+	/// Parse log level name or number.
+	static BOOL ParseLogLevel(PCTSTR pszLogLevel, size_t nLength, BUGTRAP_LOGLEVEL& reLogLevel);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogCategories(const CLogCategories& rLogCategories);
+	/// Protects the class from being accidentally copied.
+	CLogCategories& operator=(const CLogCategories& rLogCategories);
+
+	/// Category table parameters.
+	enum
+	{
+		/// Maximum number of categories including reserved entry for entries without category.
+		MAX_CATEGORIES = 64,
+		/// Maximum length of category name.
+		MAX_NAME_LENGTH = 32,
+		/// Category inherits level of the log.
+		INHERITED_LEVEL = -1
+	};
+
+	/// Category entry.
+	struct CCategory
+	{
+		/// Category name.
+		TCHAR m_szName[MAX_NAME_LENGTH];
+		/// Category level or INHERITED_LEVEL.
+		volatile LONG m_lLogLevel;
+	};
+
+	/// Find or register category, the table must be locked.
+	DWORD FindCategory(PCTSTR pszCategory, size_t nLength);
+	/// Parse list of category levels and optionally assign them.
+	BOOL ParseCategoryLevels(PCTSTR pszCategoryLevels, BOOL bApply);
+	/// Find the most verbose category level, the table must be locked.
+	void UpdateMaxLogLevel(void);
+
+	/// Protects registration of categories.
+	CRITICAL_SECTION m_csCategories;
+	/// Number of registered categories.
+	volatile LONG m_lNumCategories;
+	/// The most verbose category level or INHERITED_LEVEL.
+	volatile LONG m_lMaxLogLevel;
+	/// Category table.
+	CCategory m_arrCategories[MAX_CATEGORIES];
+};
+
+/**
+ * @param dwCategory - category index or 0 for entries without category.
+ * @param eLogLevel - level of the log.
+ * @return effective level of category.
+ */
+inline BUGTRAP_LOGLEVEL CLogCategories::GetCategoryLevel(DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel) const
+{
+	if (dwCategory == 0 || dwCategory >= (DWORD)m_lNumCategories)
+		return eLogLevel;
+	LONG lLogLevel = m_arrCategories[dwCategory].m_lLogLevel;
+	if (lLogLevel == INHERITED_LEVEL)
+		return eLogLevel;
+	return (BUGTRAP_LOGLEVEL)lLogLevel;
+}
+
+/**
+ * @param eLogLevel - level of the log.
+ * @return the most verbose level accepted by the log or any of its categories.
+ */
+inline BUGTRAP_LOGLEVEL CLogCategories::GetMaxLogLevel(BUGTRAP_LOGLEVEL eLogLevel) const
+{
+	LONG lMaxLogLevel = m_lMaxLogLevel;
+	return (lMaxLogLevel > (LONG)eLogLevel ? (BUGTRAP_LOGLEVEL)lMaxLogLevel : eLogLevel);
+}
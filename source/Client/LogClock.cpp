@@ -0,0 +1,99 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Clock used for log time stamps.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogClock.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogClock g_LogClock;
+
+CLogClock::CLogClock(void)
+{
+	LARGE_INTEGER liFrequency;
+	m_llFrequency = QueryPerformanceFrequency(&liFrequency) ? liFrequency.QuadPart : 0;
+	m_llCalibrationTicks = m_llFrequency * CALIBRATION_INTERVAL / 1000;
+	LARGE_INTEGER liCounter;
+	m_llStartCounter = m_llFrequency != 0 && QueryPerformanceCounter(&liCounter) ? liCounter.QuadPart : 0;
+	m_llBaseCounter = 0;
+	m_ullBaseTime = 0;
+	m_lVersion = 0;
+	m_lCalibrating = 0;
+	if (m_llFrequency != 0)
+		Calibrate();
+}
+
+/**
+ * @return current local time.
+ */
+ULONGLONG CLogClock::Calibrate(void)
+{
+	LARGE_INTEGER liCounter;
+	QueryPerformanceCounter(&liCounter);
+	ULONGLONG ullTime = GetSystemLocalTime();
+	InterlockedIncrement(&m_lVersion);
+	m_llBaseCounter = liCounter.QuadPart;
+	m_ullBaseTime = ullTime;
+	InterlockedIncrement(&m_lVersion);
+	return ullTime;
+}
+
+/**
+ * @return local time in 100-nanosecond intervals since January 1, 1601.
+ */
+ULONGLONG CLogClock::GetLocalTime(void)
+{
+	if (m_llFrequency == 0)
+		return GetSystemLocalTime();
+	LARGE_INTEGER liCounter;
+	QueryPerformanceCounter(&liCounter);
+	for (;;)
+	{
+		LONG lVersion = m_lVersion;
+		MemoryBarrier();
+		LONGLONG llBaseCounter = m_llBaseCounter;
+		ULONGLONG ullBaseTime = m_ullBaseTime;
+		MemoryBarrier();
+		if ((lVersion & 1) == 0 && lVersion == m_lVersion)
+		{
+			LONGLONG llElapsedTicks = liCounter.QuadPart - llBaseCounter;
+			if (llElapsedTicks >= 0 && llElapsedTicks < m_llCalibrationTicks)
+				return (ullBaseTime + (ULONGLONG)(llElapsedTicks * (LONGLONG)TICKS_PER_SECOND / m_llFrequency));
+			break;
+		}
+		YieldProcessor();
+	}
+	// Only one thread updates calibration data, others read system time meanwhile.
+	if (InterlockedCompareExchange(&m_lCalibrating, 1, 0) != 0)
+		return GetSystemLocalTime();
+	ULONGLONG ullTime = Calibrate();
+	InterlockedExchange(&m_lCalibrating, 0);
+	return ullTime;
+}
+
+/**
+ * @return time in 100-nanosecond intervals elapsed since the clock was created.
+ */
+ULONGLONG CLogClock::GetMonotonicTime(void) const
+{
+	if (m_llFrequency == 0)
+		return ((ULONGLONG)GetTickCount() * (TICKS_PER_SECOND / 1000));
+	LARGE_INTEGER liCounter;
+	QueryPerformanceCounter(&liCounter);
+	LONGLONG llElapsedTicks = liCounter.QuadPart - m_llStartCounter;
+	return (ULONGLONG)(llElapsedTicks / m_llFrequency * TICKS_PER_SECOND +
+	                   llElapsedTicks % m_llFrequency * TICKS_PER_SECOND / m_llFrequency);
+}
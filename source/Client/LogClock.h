@@ -0,0 +1,86 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Clock used for log time stamps.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+/**
+ * @brief Clock used for log time stamps.
+ * Local time is computed from performance counter and the offset
+ * that is periodically recalibrated against system time. Calibration
+ * data is protected by sequence lock, so readers never wait.
+ */
+class CLogClock
+{
+public:
+	/// Time units.
+	enum
+	{
+		/// Number of 100-nanosecond intervals in one second.
+		TICKS_PER_SECOND = 10000000
+	};
+
+	/// Initialize the object.
+	CLogClock(void);
+	/// Get local time in 100-nanosecond intervals since January 1, 1601.
+	ULONGLONG GetLocalTime(void);
+	/// Get time in 100-nanosecond intervals that is not affected by system time changes.
+	ULONGLONG GetMonotonicTime(void) const;
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogClock(const CLogClock& rLogClock);
+	/// Protects the class from being accidentally copied.
+	CLogClock& operator=(const CLogClock& rLogClock);
+
+	/// Clock parameters.
+	enum
+	{
+		/// Interval between calibrations (in milliseconds).
+		CALIBRATION_INTERVAL = 1000
+	};
+
+	/// Read local time from the system.
+	static ULONGLONG GetSystemLocalTime(void);
+	/// Synchronize performance counter with system time.
+	ULONGLONG Calibrate(void);
+
+	/// Performance counter frequency or 0 if counter is not available.
+	LONGLONG m_llFrequency;
+	/// Counter value at the moment of clock creation.
+	LONGLONG m_llStartCounter;
+	/// Number of counter ticks between calibrations.
+	LONGLONG m_llCalibrationTicks;
+	/// Counter value at the moment of calibration.
+	LONGLONG m_llBaseCounter;
+	/// Local time at the moment of calibration.
+	ULONGLONG m_ullBaseTime;
+	/// Version of calibration data, odd value means update is in progress.
+	volatile LONG m_lVersion;
+	/// Non-zero if some thread is calibrating the clock.
+	volatile LONG m_lCalibrating;
+};
+
+/// Clock shared by all log files.
+extern CLogClock g_LogClock;
+
+/**
+ * @return local time read from the system.
+ */
+inline ULONGLONG CLogClock::GetSystemLocalTime(void)
+{
+	FILETIME ftSystemTime, ftLocalTime;
+	GetSystemTimeAsFileTime(&ftSystemTime);
+	FileTimeToLocalFileTime(&ftSystemTime, &ftLocalTime);
+	return (((ULONGLONG)ftLocalTime.dwHighDateTime << 32) | ftLocalTime.dwLowDateTime);
+}
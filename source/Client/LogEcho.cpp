@@ -0,0 +1,302 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Background echo of log entries to the console and debugger.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogEcho.h"
+#include "BugTrap.h"
+#include "BugTrapUtils.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogEcho g_LogEcho;
+
+CLogEcho::CLogEcho(void)
+{
+	m_pbQueue = NULL;
+	m_dwQueueSize = 0;
+	m_pbFlushBuffer = NULL;
+	m_pcsConsoleAccess = NULL;
+	m_hFlushEvent = NULL;
+	m_hEchoThread = NULL;
+	m_uEchoThreadID = 0;
+	m_lNumDroppedEntries = 0;
+	m_lThreadStarted = FALSE;
+	m_lStopped = FALSE;
+	m_bInitialized = FALSE;
+}
+
+CLogEcho::~CLogEcho(void)
+{
+	Uninitialize();
+}
+
+/**
+ * @param pcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogEcho::Initialize(CRITICAL_SECTION* pcsConsoleAccess)
+{
+	_ASSERTE(! m_bInitialized);
+	// Text of one output never exceeds the size of queued entries.
+	if (! m_TextBuffer.SetSize(ECHO_BUFFER_SIZE / sizeof(TCHAR) + MAX_NOTICE_LENGTH + 1))
+		return FALSE;
+	m_pbQueue = new BYTE[ECHO_BUFFER_SIZE];
+	m_pbFlushBuffer = new BYTE[ECHO_BUFFER_SIZE];
+	m_hFlushEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // non-signaled auto-reset event
+	if (m_pbQueue == NULL || m_pbFlushBuffer == NULL || m_hFlushEvent == NULL)
+	{
+		delete[] m_pbQueue;
+		m_pbQueue = NULL;
+		delete[] m_pbFlushBuffer;
+		m_pbFlushBuffer = NULL;
+		if (m_hFlushEvent != NULL)
+		{
+			CloseHandle(m_hFlushEvent);
+			m_hFlushEvent = NULL;
+		}
+		return FALSE;
+	}
+	InitializeCriticalSection(&m_csQueue);
+	InitializeCriticalSection(&m_csFlush);
+	m_pcsConsoleAccess = pcsConsoleAccess;
+	m_dwQueueSize = 0;
+	m_lNumDroppedEntries = 0;
+	m_lThreadStarted = FALSE;
+	m_lStopped = FALSE;
+	m_bInitialized = TRUE;
+	return TRUE;
+}
+
+void CLogEcho::Uninitialize(void)
+{
+	if (! m_bInitialized)
+		return;
+	Stop(FALSE);
+	if (m_hEchoThread != NULL)
+	{
+		CloseHandle(m_hEchoThread);
+		m_hEchoThread = NULL;
+	}
+	CloseHandle(m_hFlushEvent);
+	m_hFlushEvent = NULL;
+	delete[] m_pbQueue;
+	m_pbQueue = NULL;
+	delete[] m_pbFlushBuffer;
+	m_pbFlushBuffer = NULL;
+	DeleteCriticalSection(&m_csQueue);
+	DeleteCriticalSection(&m_csFlush);
+	m_pcsConsoleAccess = NULL;
+	m_bInitialized = FALSE;
+}
+
+/**
+ * @param pParam - echo object.
+ * @return thread exit code.
+ */
+UINT CALLBACK CLogEcho::EchoThreadProc(PVOID pParam)
+{
+	CLogEcho* pThis = (CLogEcho*)pParam;
+	while (! pThis->m_lStopped)
+	{
+		WaitForSingleObject(pThis->m_hFlushEvent, FLUSH_INTERVAL);
+		pThis->Flush();
+	}
+	return 0;
+}
+
+void CLogEcho::StartEchoThread(void)
+{
+	if (m_lThreadStarted || InterlockedExchange(&m_lThreadStarted, TRUE))
+		return;
+	PinLibraryInMemory();
+	m_hEchoThread = (HANDLE)_beginthreadex(NULL, 0, EchoThreadProc, this, 0, &m_uEchoThreadID);
+}
+
+/**
+ * @param dwLogEchoMode - outputs that receive the text.
+ * @param pszText - entry text.
+ * @param dwTextLength - text length in characters.
+ * @return true if text was queued or dropped and false if it has to be written synchronously.
+ */
+BOOL CLogEcho::PostText(DWORD dwLogEchoMode, PCTSTR pszText, DWORD dwTextLength)
+{
+	if (! m_bInitialized || m_lStopped)
+		return FALSE;
+	DWORD dwEntrySize = GetEntrySize(dwTextLength);
+	if (dwEntrySize > MAX_ENTRY_SIZE)
+		return FALSE;
+	StartEchoThread();
+	if (m_hEchoThread == NULL)
+		return FALSE;
+	// Only one console stream receives the text, standard output takes precedence.
+	if (dwLogEchoMode & BTLE_STDOUT)
+		dwLogEchoMode &= ~BTLE_STDERR;
+	BOOL bFlushNeeded = FALSE;
+	EnterCriticalSection(&m_csQueue);
+	DWORD dwQueueSize = m_dwQueueSize;
+	if (dwQueueSize + dwEntrySize <= ECHO_BUFFER_SIZE)
+	{
+		CEchoEntry* pEntry = (CEchoEntry*)(m_pbQueue + dwQueueSize);
+		pEntry->m_dwLogEchoMode = dwLogEchoMode;
+		pEntry->m_dwTextLength = dwTextLength;
+		CopyMemory(pEntry->m_szText, pszText, dwTextLength * sizeof(TCHAR));
+		m_dwQueueSize = dwQueueSize + dwEntrySize;
+		// Echo thread is woken up once when the queue becomes half full.
+		bFlushNeeded = dwQueueSize < ECHO_BUFFER_SIZE / 2 && m_dwQueueSize >= ECHO_BUFFER_SIZE / 2;
+	}
+	else
+		InterlockedIncrement(&m_lNumDroppedEntries);
+	LeaveCriticalSection(&m_csQueue);
+	if (bFlushNeeded)
+		SetEvent(m_hFlushEvent);
+	return TRUE;
+}
+
+void CLogEcho::Flush(void)
+{
+	if (! m_bInitialized)
+		return;
+	EnterCriticalSection(&m_csFlush);
+	EnterCriticalSection(&m_csQueue);
+	PBYTE pbData = m_pbQueue;
+	DWORD dwDataSize = m_dwQueueSize;
+	m_pbQueue = m_pbFlushBuffer;
+	m_dwQueueSize = 0;
+	m_pbFlushBuffer = pbData;
+	LeaveCriticalSection(&m_csQueue);
+	DWORD dwNumDroppedEntries = (DWORD)InterlockedExchange(&m_lNumDroppedEntries, 0);
+	if (dwDataSize != 0)
+	{
+		EnterCriticalSection(m_pcsConsoleAccess);
+		WriteQueuedText(pbData, dwDataSize, BTLE_STDOUT, dwNumDroppedEntries);
+		WriteQueuedText(pbData, dwDataSize, BTLE_STDERR, dwNumDroppedEntries);
+		WriteQueuedText(pbData, dwDataSize, BTLE_DBGOUT, dwNumDroppedEntries);
+		LeaveCriticalSection(m_pcsConsoleAccess);
+	}
+	LeaveCriticalSection(&m_csFlush);
+}
+
+/**
+ * @param pbData - queued entries.
+ * @param dwDataSize - size of queued entries.
+ * @param dwLogEchoMode - output that receives the text.
+ * @param dwNumDroppedEntries - number of entries dropped after queued entries.
+ */
+void CLogEcho::WriteQueuedText(const BYTE* pbData, DWORD dwDataSize, DWORD dwLogEchoMode, DWORD dwNumDroppedEntries)
+{
+	HANDLE hConsole;
+	if (dwLogEchoMode == BTLE_STDOUT)
+		hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+	else if (dwLogEchoMode == BTLE_STDERR)
+		hConsole = GetStdHandle(STD_ERROR_HANDLE);
+	else
+		hConsole = NULL;
+	if ((dwLogEchoMode & BTLE_DBGOUT) == 0 && (hConsole == NULL || hConsole == INVALID_HANDLE_VALUE))
+		return;
+	PTSTR pszText = m_TextBuffer.GetData();
+	DWORD dwTextLength = 0;
+	for (DWORD dwOffset = 0; dwOffset < dwDataSize; )
+	{
+		const CEchoEntry* pEntry = (const CEchoEntry*)(pbData + dwOffset);
+		dwOffset += GetEntrySize(pEntry->m_dwTextLength);
+		if ((pEntry->m_dwLogEchoMode & dwLogEchoMode) == 0)
+			continue;
+		// Debugger receives text in chunks of limited size.
+		if (hConsole == NULL && dwTextLength != 0 && dwTextLength + pEntry->m_dwTextLength > MAX_DEBUG_TEXT_LENGTH)
+		{
+			WriteText(hConsole, dwTextLength);
+			dwTextLength = 0;
+		}
+		CopyMemory(pszText + dwTextLength, pEntry->m_szText, pEntry->m_dwTextLength * sizeof(TCHAR));
+		dwTextLength += pEntry->m_dwTextLength;
+	}
+	if (dwTextLength != 0)
+	{
+		if (dwNumDroppedEntries != 0)
+		{
+			int nNoticeLength = _stprintf_s(pszText + dwTextLength, MAX_NOTICE_LENGTH, _T("%lu log entries were dropped due to echo buffer overflow\r\n"), dwNumDroppedEntries);
+			if (nNoticeLength > 0)
+				dwTextLength += nNoticeLength;
+		}
+		WriteText(hConsole, dwTextLength);
+	}
+}
+
+/**
+ * @param hConsole - console handle or NULL for debugger output.
+ * @param dwTextLength - length of collected text.
+ */
+void CLogEcho::WriteText(HANDLE hConsole, DWORD dwTextLength)
+{
+	if (hConsole != NULL)
+		WriteConsoleText(hConsole, dwTextLength);
+	else
+	{
+		PTSTR pszText = m_TextBuffer.GetData();
+		pszText[dwTextLength] = _T('\0');
+		OutputDebugString(pszText);
+	}
+}
+
+/**
+ * @param hConsole - console handle.
+ * @param dwTextLength - length of collected text.
+ */
+void CLogEcho::WriteConsoleText(HANDLE hConsole, DWORD dwTextLength)
+{
+	PCTSTR pszText = m_TextBuffer.GetData();
+	DWORD dwWritten;
+#ifndef _UNICODE
+	UINT uConsoleCP = GetConsoleOutputCP();
+	if (uConsoleCP != CP_ACP)
+	{
+		DWORD dwTextSizeW = MultiByteToWideChar(CP_ACP, 0, pszText, dwTextLength, NULL, 0);
+		if (m_ConsoleBufferW.GetSize() < dwTextSizeW)
+		{
+			if (! m_ConsoleBufferW.SetSize(dwTextSizeW * 2))
+				return;
+		}
+		dwTextSizeW = MultiByteToWideChar(CP_ACP, 0, pszText, dwTextLength, m_ConsoleBufferW.GetData(), m_ConsoleBufferW.GetSize());
+		DWORD dwTextSizeA = WideCharToMultiByte(uConsoleCP, 0, m_ConsoleBufferW.GetData(), dwTextSizeW, NULL, 0, NULL, NULL);
+		if (m_ConsoleBufferA.GetSize() < dwTextSizeA)
+		{
+			if (! m_ConsoleBufferA.SetSize(dwTextSizeA * 2))
+				return;
+		}
+		dwTextSizeA = WideCharToMultiByte(uConsoleCP, 0, m_ConsoleBufferW.GetData(), dwTextSizeW, m_ConsoleBufferA.GetData(), m_ConsoleBufferA.GetSize(), NULL, NULL);
+		WriteConsoleA(hConsole, m_ConsoleBufferA.GetData(), dwTextSizeA, &dwWritten, NULL);
+		return;
+	}
+#endif
+	WriteConsole(hConsole, pszText, dwTextLength, &dwWritten, NULL);
+}
+
+/**
+ * @param bWaitThread - true if function has to wait for background thread termination.
+ */
+void CLogEcho::Stop(BOOL bWaitThread)
+{
+	if (! m_bInitialized)
+		return;
+	InterlockedExchange(&m_lStopped, TRUE);
+	if (m_hEchoThread != NULL)
+	{
+		SetEvent(m_hFlushEvent);
+		if (bWaitThread && GetCurrentThreadId() != m_uEchoThreadID)
+			WaitForSingleObject(m_hEchoThread, INFINITE);
+	}
+	Flush();
+}
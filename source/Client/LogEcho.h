@@ -0,0 +1,140 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Background echo of log entries to the console and debugger.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "Buffer.h"
+
+/**
+ * @brief Bounded queue of formatted entry text echoed by background thread.
+ * Logging threads only copy text into the queue under a short lock. Echo thread
+ * swaps queue buffers once per flush interval and writes all queued entries of
+ * every output in one call, so console I/O never serializes logging threads.
+ * Entries that don't fit into the full queue are dropped and counted.
+ */
+class CLogEcho
+{
+public:
+	/// Initialize the object.
+	CLogEcho(void);
+	/// Destroy the object.
+	~CLogEcho(void);
+	/// Allocate system resources.
+	BOOL Initialize(CRITICAL_SECTION* pcsConsoleAccess);
+	/// Free system resources.
+	void Uninitialize(void);
+	/// Queue entry text for background echo.
+	BOOL PostText(DWORD dwLogEchoMode, PCTSTR pszText, DWORD dwTextLength);
+	/// Write all queued text.
+	void Flush(void);
+	/// Stop background thread and write remaining text.
+	void Stop(BOOL bWaitThread);
+
+private:
+	/// Echo parameters.
+	enum
+	{
+		/// Size of every queue buffer in bytes.
+		ECHO_BUFFER_SIZE = 64 * 1024,
+		/// Maximum size of queued entry, larger entries are written synchronously.
+		MAX_ENTRY_SIZE = ECHO_BUFFER_SIZE / 4,
+		/// Period of background flush operation (in milliseconds).
+		FLUSH_INTERVAL = 50,
+		/// Maximum length of text passed to debugger in one call.
+		MAX_DEBUG_TEXT_LENGTH = 4000,
+		/// Maximum length of dropped entries notice.
+		MAX_NOTICE_LENGTH = 128,
+		/// Alignment of queued entries.
+		ENTRY_ALIGNMENT = 4
+	};
+
+#pragma warning(push)
+#pragma warning(disable : 4200) // nonstandard extension used : zero-sized array in struct/union
+	/// Queued entry text.
+	struct CEchoEntry
+	{
+		/// Outputs that receive the text.
+		DWORD m_dwLogEchoMode;
+		/// Text length in characters.
+		DWORD m_dwTextLength;
+		/// Entry text (not terminated).
+		TCHAR m_szText[0];
+	};
+#pragma warning(pop)
+
+	/// Protects the class from being accidentally copied.
+	CLogEcho(const CLogEcho& rLogEcho);
+	/// Protects the class from being accidentally copied.
+	CLogEcho& operator=(const CLogEcho& rLogEcho);
+	/// Get size of queued entry.
+	static DWORD GetEntrySize(DWORD dwTextLength);
+	/// Start background thread on demand.
+	void StartEchoThread(void);
+	/// Write queued entries of one output.
+	void WriteQueuedText(const BYTE* pbData, DWORD dwDataSize, DWORD dwLogEchoMode, DWORD dwNumDroppedEntries);
+	/// Write collected text to one output.
+	void WriteText(HANDLE hConsole, DWORD dwTextLength);
+	/// Write collected text to the console.
+	void WriteConsoleText(HANDLE hConsole, DWORD dwTextLength);
+	/// Background thread procedure.
+	static UINT CALLBACK EchoThreadProc(PVOID pParam);
+
+	/// Buffer that receives new entries.
+	PBYTE m_pbQueue;
+	/// Size of queued entries.
+	DWORD m_dwQueueSize;
+	/// Buffer that is being written by consumer.
+	PBYTE m_pbFlushBuffer;
+	/// Text collected for one output.
+	CDynamicBuffer<TCHAR> m_TextBuffer;
+#ifndef _UNICODE
+	/// Console text converted to wide characters.
+	CDynamicBuffer<WCHAR> m_ConsoleBufferW;
+	/// Console text converted to console code page.
+	CDynamicBuffer<CHAR> m_ConsoleBufferA;
+#endif
+	/// Protects the queue.
+	CRITICAL_SECTION m_csQueue;
+	/// Serializes consumers.
+	CRITICAL_SECTION m_csFlush;
+	/// Provides synchronous access to the console.
+	CRITICAL_SECTION* m_pcsConsoleAccess;
+	/// Event fired when queue needs to be flushed.
+	HANDLE m_hFlushEvent;
+	/// Background thread handle.
+	HANDLE m_hEchoThread;
+	/// Background thread identifier.
+	UINT m_uEchoThreadID;
+	/// Number of entries dropped since the last flush.
+	volatile LONG m_lNumDroppedEntries;
+	/// Non-zero once background thread has been started.
+	volatile LONG m_lThreadStarted;
+	/// Non-zero when echo is stopped.
+	volatile LONG m_lStopped;
+	/// True when resources were allocated.
+	BOOL m_bInitialized;
+};
+
+/// Echo shared by all log files.
+extern CLogEcho g_LogEcho;
+
+/**
+ * @param dwTextLength - text length in characters.
+ * @return size of queued entry.
+ */
+inline DWORD CLogEcho::GetEntrySize(DWORD dwTextLength)
+{
+	DWORD dwEntrySize = offsetof(CEchoEntry, m_szText) + dwTextLength * sizeof(TCHAR);
+	return ((dwEntrySize + ENTRY_ALIGNMENT - 1) & ~(ENTRY_ALIGNMENT - 1));
+}
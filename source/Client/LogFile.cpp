@@ -14,6 +14,7 @@
 
 #include "StdAfx.h"
 #include "LogFile.h"
+#include "LogEcho.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -22,12 +23,14 @@
 /**
  * @param dwInitialLogSizeInBytes - initial log file size.
  */
-CLogFile::CLogFile(void) : m_StrStream(1024)
+CLogFile::CLogFile(void)
 {
 	*m_szLogFileName = _T('\0');
 	m_dwLogEchoMode = BTLE_NONE;
 	m_dwLogFlags = BTLF_NONE;
 	m_eLogLevel = BTLL_ALL;
+	m_lNumDroppedEntries = 0;
+	m_lNumStagedEntries = 0;
 	InitializeCriticalSection(&m_csLogFile);
 }
 
@@ -74,104 +77,145 @@ HANDLE CLogFile::GetConsoleHandle(void) const
 }
 
 /**
+ * @param rScratch - scratch buffers of calling thread.
  * @param hConsole - console handle.
  */
-void CLogFile::WriteTextToConsole(HANDLE hConsole)
+void CLogFile::WriteTextToConsole(CLogScratch& rScratch, HANDLE hConsole)
 {
 	DWORD dwTextLength, dwWritten;
-	PCTSTR pszText = m_StrStream;
+	PCTSTR pszText = rScratch.m_StrStream;
 #ifndef _UNICODE
 	UINT uConsoleCP = GetConsoleOutputCP();
 	if (uConsoleCP != CP_ACP)
 	{
+		CDynamicBuffer<CHAR>& rConsoleBufferA = rScratch.m_ConsoleBufferA;
+		CDynamicBuffer<WCHAR>& rConsoleBufferW = rScratch.m_ConsoleBufferW;
 		DWORD dwTextSizeW = MultiByteToWideChar(CP_ACP, 0, pszText, -1, NULL, 0);
-		if (m_ConsoleBufferW.GetSize() < dwTextSizeW)
+		if (rConsoleBufferW.GetSize() < dwTextSizeW)
 		{
 			dwTextSizeW *= 2;
-			if (! m_ConsoleBufferW.SetSize(dwTextSizeW))
+			if (! rConsoleBufferW.SetSize(dwTextSizeW))
 				return;
 		}
-		MultiByteToWideChar(CP_ACP, 0, pszText, -1, m_ConsoleBufferW.GetData(), dwTextSizeW);
-		DWORD dwTextSizeA = WideCharToMultiByte(uConsoleCP, 0, m_ConsoleBufferW.GetData(), -1, NULL, 0, NULL, NULL);
-		if (m_ConsoleBufferA.GetSize() < dwTextSizeA)
+		MultiByteToWideChar(CP_ACP, 0, pszText, -1, rConsoleBufferW.GetData(), dwTextSizeW);
+		DWORD dwTextSizeA = WideCharToMultiByte(uConsoleCP, 0, rConsoleBufferW.GetData(), -1, NULL, 0, NULL, NULL);
+		if (rConsoleBufferA.GetSize() < dwTextSizeA)
 		{
 			dwTextSizeA *= 2;
-			if (! m_ConsoleBufferA.SetSize(dwTextSizeA))
+			if (! rConsoleBufferA.SetSize(dwTextSizeA))
 				return;
 		}
-		dwTextLength = WideCharToMultiByte(uConsoleCP, 0, m_ConsoleBufferW.GetData(), -1, m_ConsoleBufferA.GetData(), dwTextSizeA, NULL, NULL);
-		WriteConsoleA(hConsole, m_ConsoleBufferA.GetData(), dwTextLength - 1, &dwWritten, NULL);
+		dwTextLength = WideCharToMultiByte(uConsoleCP, 0, rConsoleBufferW.GetData(), -1, rConsoleBufferA.GetData(), dwTextSizeA, NULL, NULL);
+		WriteConsoleA(hConsole, rConsoleBufferA.GetData(), dwTextLength - 1, &dwWritten, NULL);
 	}
 	else
 	{
-		dwTextLength = (DWORD)m_StrStream.GetLength();
+		dwTextLength = (DWORD)rScratch.m_StrStream.GetLength();
 		WriteConsoleA(hConsole, pszText, dwTextLength, &dwWritten, NULL);
 	}
 #else
-	dwTextLength = (DWORD)m_StrStream.GetLength();
+	dwTextLength = (DWORD)rScratch.m_StrStream.GetLength();
 	WriteConsole(hConsole, pszText, dwTextLength, &dwWritten, NULL);
 #endif
 }
 
 /**
- * @param pSystemTime - pointer to system time.
- * @param pszTimeStatistics - time statistics buffer.
- * @param dwTimeStatisticsSize - size of time statistics buffer.
+ * @param ullTime - local time in 100-nanosecond intervals.
+ * @return time stamp text.
  */
-void CLogFile::GetTimeStatistics(const SYSTEMTIME* pSystemTime, PTSTR pszTimeStatistics, DWORD dwTimeStatisticsSize)
+PCTSTR CLogFile::GetTimeStamp(ULONGLONG ullTime)
 {
-	_stprintf_s(pszTimeStatistics, dwTimeStatisticsSize,
-	            _T("%04d/%02d/%02d %02d:%02d:%02d"),
-	            pSystemTime->wYear, pSystemTime->wMonth, pSystemTime->wDay, pSystemTime->wHour, pSystemTime->wMinute, pSystemTime->wSecond);
+	// Date and time are rendered only once per second, consecutive
+	// entries just reuse the cached text.
+	CLogScratch& rScratch = GetScratch();
+	PTSTR pszTimeStamp = rScratch.m_szTimeStamp;
+	ULONGLONG ullSecond = ullTime / CLogClock::TICKS_PER_SECOND;
+	if (rScratch.m_ullTimeStampSecond != ullSecond)
+	{
+		FILETIME ftTime;
+		ftTime.dwLowDateTime = (DWORD)ullTime;
+		ftTime.dwHighDateTime = (DWORD)(ullTime >> 32);
+		SYSTEMTIME st;
+		if (! FileTimeToSystemTime(&ftTime, &st))
+			ZeroMemory(&st, sizeof(st));
+		_stprintf_s(pszTimeStamp, countof(rScratch.m_szTimeStamp),
+		            _T("%04d/%02d/%02d %02d:%02d:%02d"),
+		            st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+		rScratch.m_ullTimeStampSecond = ullSecond;
+	}
+	if (m_dwLogFlags & BTLF_MICROSECONDS)
+	{
+		DWORD dwMicroseconds = (DWORD)(ullTime % CLogClock::TICKS_PER_SECOND / 10);
+		PTSTR pszFraction = pszTimeStamp + TIME_STAMP_LENGTH;
+		pszFraction[0] = _T('.');
+		for (int iDigit = 6; iDigit > 0; --iDigit)
+		{
+			pszFraction[iDigit] = (TCHAR)(_T('0') + dwMicroseconds % 10);
+			dwMicroseconds /= 10;
+		}
+		pszFraction[7] = _T('\0');
+	}
+	else
+		pszTimeStamp[TIME_STAMP_LENGTH] = _T('\0');
+	return pszTimeStamp;
 }
 
 /**
- * @param pSystemTime - pointer to system time.
  * @param eLogLevel - log level number.
- * @param pszEntry - log entry text.
+ * @param ullTime - local time in 100-nanosecond intervals.
  */
-void CLogFile::FillEntryText(BUGTRAP_LOGLEVEL eLogLevel, const SYSTEMTIME* pSystemTime, PCTSTR pszEntry)
+void CLogFile::FillEntryPrefix(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime)
 {
-	_ASSERTE(pszEntry != NULL);
-	m_StrStream.Reset();
+	CStrStream& rStrStream = GetScratch().m_StrStream;
+	rStrStream.Reset();
 	if (m_dwLogFlags & BTLF_SHOWTIMESTAMP)
 	{
-		TCHAR szTimeStatistics[32];
-		GetTimeStatistics(pSystemTime, szTimeStatistics, countof(szTimeStatistics));
-		m_StrStream << _T('[') << szTimeStatistics << _T("] ");
+		rStrStream << _T('[') << GetTimeStamp(ullTime) << _T("] ");
 	}
 	if (m_dwLogFlags & BTLF_SHOWLOGLEVEL)
 	{
 		PCTSTR pszLogLevelPrefix = GetLogLevelPrefix(eLogLevel);
 		if (pszLogLevelPrefix)
-			m_StrStream << pszLogLevelPrefix << _T(": ");
+			rStrStream << pszLogLevelPrefix << _T(": ");
 	}
-	m_StrStream << pszEntry << _T("\r\n");
 }
 
 /**
+ * @param ullTime - local time in 100-nanosecond intervals.
+ * @param eLogLevel - log level number.
+ * @param pszEntry - log entry text.
+ */
+void CLogFile::FillEntryText(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, PCTSTR pszEntry)
+{
+	_ASSERTE(pszEntry != NULL);
+	FillEntryPrefix(eLogLevel, ullTime);
+	GetScratch().m_StrStream << pszEntry << _T("\r\n");
+}
+
+/**
+ * @param rFormatBuffer - buffer that receives formatted string.
  * @param pszFormat - format expression.
  * @param argList - variable argument list.
  * @return true if string was formatted.
  */
-BOOL CLogFile::FormatBufferV(PCTSTR pszFormat, va_list argList)
+BOOL CLogFile::FormatBufferV(CDynamicBuffer<TCHAR>& rFormatBuffer, PCTSTR pszFormat, va_list argList)
 {
-	DWORD dwFormatBufferSize = m_FormatBuffer.GetSize();
+	DWORD dwFormatBufferSize = rFormatBuffer.GetSize();
 	if (dwFormatBufferSize == 0)
 	{
 		dwFormatBufferSize = 256;
-		if (! m_FormatBuffer.SetSize(dwFormatBufferSize))
+		if (! rFormatBuffer.SetSize(dwFormatBufferSize))
 			return FALSE;
 	}
 	for (;;)
 	{
-		int iResult = _vsntprintf_s(m_FormatBuffer.GetData(), dwFormatBufferSize, _TRUNCATE, pszFormat, argList);
+		int iResult = _vsntprintf_s(rFormatBuffer.GetData(), dwFormatBufferSize, _TRUNCATE, pszFormat, argList);
 		if (iResult >= 0)
 			return TRUE;
 		dwFormatBufferSize *= 2;
-		if (! m_FormatBuffer.SetSize(dwFormatBufferSize))
+		if (! rFormatBuffer.SetSize(dwFormatBufferSize))
 			return FALSE;
-		_ASSERTE(m_FormatBuffer.GetSize() >= dwFormatBufferSize);
+		_ASSERTE(rFormatBuffer.GetSize() >= dwFormatBufferSize);
 	}
 }
 
@@ -215,38 +259,229 @@ BOOL CLogFile::WriteLogEntryF(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode,
  */
 BOOL CLogFile::WriteLogEntryV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList)
 {
-	BUGTRAP_LOGLEVEL eLogFileLevel = GetLogLevel();
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
 	if (eLogLevel > eLogFileLevel)
 		return TRUE;
-	BOOL bResult = FormatBufferV(pszFormat, argList);
+	CDynamicBuffer<TCHAR>& rFormatBuffer = GetScratch().m_FormatBuffer;
+	BOOL bResult = FormatBufferV(rFormatBuffer, pszFormat, argList);
 	if (bResult)
-		bResult = WriteLogEntry(eLogLevel, eEntryMode, rcsConsoleAccess, m_FormatBuffer.GetData());
+		bResult = WriteLogEntry(eLogLevel, eEntryMode, rcsConsoleAccess, rFormatBuffer.GetData());
+	return bResult;
+}
+
+/**
+ * @param pszText - UTF-8 text.
+ * @param dwLength - text length in bytes.
+ * @param rTextBuffer - buffer that receives decoded text.
+ * @return true if text was decoded.
+ */
+BOOL CLogFile::DecodeUTF8(PCSTR pszText, DWORD dwLength, CDynamicBuffer<TCHAR>& rTextBuffer)
+{
+#ifdef _UNICODE
+	DWORD dwTextSize = dwLength > 0 ? MultiByteToWideChar(CP_UTF8, 0, pszText, dwLength, NULL, 0) : 0;
+	if (rTextBuffer.GetSize() <= dwTextSize && ! rTextBuffer.SetSize(dwTextSize + 1))
+		return FALSE;
+	PTSTR pszBuffer = rTextBuffer.GetData();
+	if (dwTextSize > 0)
+		MultiByteToWideChar(CP_UTF8, 0, pszText, dwLength, pszBuffer, dwTextSize);
+	pszBuffer[dwTextSize] = _T('\0');
+#else
+	CDynamicBuffer<WCHAR> TextBufferW;
+	DWORD dwTextSizeW = dwLength > 0 ? MultiByteToWideChar(CP_UTF8, 0, pszText, dwLength, NULL, 0) : 0;
+	if (! TextBufferW.SetSize(dwTextSizeW + 1))
+		return FALSE;
+	if (dwTextSizeW > 0)
+		MultiByteToWideChar(CP_UTF8, 0, pszText, dwLength, TextBufferW.GetData(), dwTextSizeW);
+	DWORD dwTextSize = dwTextSizeW > 0 ? WideCharToMultiByte(CP_ACP, 0, TextBufferW.GetData(), dwTextSizeW, NULL, 0, NULL, NULL) : 0;
+	if (rTextBuffer.GetSize() <= dwTextSize && ! rTextBuffer.SetSize(dwTextSize + 1))
+		return FALSE;
+	PTSTR pszBuffer = rTextBuffer.GetData();
+	if (dwTextSize > 0)
+		WideCharToMultiByte(CP_ACP, 0, TextBufferW.GetData(), dwTextSizeW, pszBuffer, dwTextSize, NULL, NULL);
+	pszBuffer[dwTextSize] = _T('\0');
+#endif
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogFile::WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return TRUE;
+	CDynamicBuffer<TCHAR>& rFormatBuffer = GetScratch().m_FormatBuffer;
+	BOOL bResult = DecodeUTF8(pszEntry, dwLength, rFormatBuffer);
+	if (bResult)
+		bResult = WriteLogEntry(eLogLevel, eEntryMode, rcsConsoleAccess, rFormatBuffer.GetData());
 	return bResult;
 }
 
 /**
  * @param eLogLevel - log level number.
- * @param pSystemTime - system time.
+ * @param ullTime - local time in 100-nanosecond intervals.
  * @param rcsConsoleAccess - provides synchronous access to the console.
  * @param pszEntry - log entry text.
  * @return true if text was written to console.
  */
-BOOL CLogFile::WriteLogEntryToConsole(BUGTRAP_LOGLEVEL eLogLevel, const SYSTEMTIME* pSystemTime, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry)
+BOOL CLogFile::WriteLogEntryToConsole(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry)
 {
 	DWORD dwLogEchoMode = GetLogEchoMode();
 	HANDLE hConsole = GetConsoleHandle();
 	BOOL bLogEcho = (dwLogEchoMode & BTLE_DBGOUT) != 0;
 	if (hConsole || bLogEcho)
 	{
-		FillEntryText(eLogLevel, pSystemTime, pszEntry);
+		FillEntryText(eLogLevel, ullTime, pszEntry);
+		CLogScratch& rScratch = GetScratch();
+		// Text is written by echo thread unless it can't be queued.
+		if (g_LogEcho.PostText(dwLogEchoMode, rScratch.m_StrStream, (DWORD)rScratch.m_StrStream.GetLength()))
+			return TRUE;
+		// Queued text is written first to keep entries in order.
+		g_LogEcho.Flush();
 		EnterCriticalSection(&rcsConsoleAccess);
 		if (hConsole)
-			WriteTextToConsole(hConsole);
+			WriteTextToConsole(rScratch, hConsole);
 		if (bLogEcho)
-			WriteTextToDebugConsole();
+			WriteTextToDebugConsole(rScratch);
 		LeaveCriticalSection(&rcsConsoleAccess);
 		return TRUE;
 	}
 	else
 		return FALSE;
 }
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text.
+ * @return true if entry was prepared and false if it has to be written under the lock.
+ */
+BOOL CLogFile::PrepareLogEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& /*rcsConsoleAccess*/, PCTSTR pszEntry)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return FALSE;
+	rScratch.m_pszEntry = pszEntry;
+	// Repeated entries are compared in UTF-8, TCHAR text is encoded only if the log needs it.
+	rScratch.m_pbEntryText = NULL;
+	rScratch.m_dwEntryTextSize = 0;
+	rScratch.m_ullTime = g_LogClock.GetLocalTime();
+	rScratch.m_bEncoded = FALSE;
+	// Otherwise entry is only timed here, it's rendered when the log is locked.
+	EncodePreparedEntry(rScratch, eLogLevel);
+	return TRUE;
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszFormat - format string.
+ * @param argList - variable argument list.
+ * @return true if entry was prepared and false if it has to be written under the lock.
+ */
+BOOL CLogFile::PrepareLogEntryV(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return FALSE;
+	if (! FormatBufferV(rScratch.m_FormatBuffer, pszFormat, argList))
+		return FALSE;
+	return PrepareLogEntry(rScratch, eLogLevel, rcsConsoleAccess, rScratch.m_FormatBuffer.GetData());
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if entry was prepared and false if it has to be written under the lock.
+ */
+BOOL CLogFile::PrepareLogEntryUTF8(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return FALSE;
+	// Console echo needs decoded entry text.
+	if (CanEncodeEntries() && m_dwLogEchoMode == BTLE_NONE)
+	{
+		EncodePreparedEntryUTF8(rScratch, eLogLevel, pszEntry, dwLength);
+		return TRUE;
+	}
+	if (! DecodeUTF8(pszEntry, dwLength, rScratch.m_FormatBuffer))
+		return FALSE;
+	return PrepareLogEntry(rScratch, eLogLevel, rcsConsoleAccess, rScratch.m_FormatBuffer.GetData());
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogFile::WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess)
+{
+	// Encoded text is ignored, it might be prepared for another log.
+	_ASSERTE(rScratch.m_pszEntry != NULL);
+	return WriteLogEntry(eLogLevel, eEntryMode, rcsConsoleAccess, rScratch.m_pszEntry, rScratch.m_ullTime);
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread with prepared entry text and time.
+ * @param eLogLevel - log level number.
+ * @return true if entry was encoded and false if this log renders entries under the lock.
+ */
+BOOL CLogFile::EncodePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel)
+{
+	if (! CanEncodeEntries())
+		return FALSE;
+	_ASSERTE(rScratch.m_pszEntry != NULL && &rScratch == &GetScratch());
+	// Echo is posted by WritePreparedEntry(), so console keeps the order of the log.
+	FillEntryText(eLogLevel, rScratch.m_ullTime, rScratch.m_pszEntry);
+	rScratch.m_EncStream.Reset();
+	rScratch.m_EncStream.WriteUTF8Bin(rScratch.m_StrStream);
+	rScratch.m_bEncoded = TRUE;
+	return TRUE;
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread with prepared entry text and time.
+ * @param eLogLevel - log level number.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ */
+void CLogFile::EchoPreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess)
+{
+	// Entries passed in UTF-8 are prepared only when echo is turned off.
+	if (rScratch.m_pszEntry != NULL)
+		WriteLogEntryToConsole(eLogLevel, rScratch.m_ullTime, rcsConsoleAccess, rScratch.m_pszEntry);
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ */
+void CLogFile::EncodePreparedEntryUTF8(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, PCSTR pszEntry, DWORD dwLength)
+{
+	ULONGLONG ullTime = g_LogClock.GetLocalTime();
+	FillEntryPrefix(eLogLevel, ullTime);
+	rScratch.m_EncStream.Reset();
+	rScratch.m_EncStream.WriteUTF8Bin(rScratch.m_StrStream);
+	rScratch.m_EncStream.WriteBytes((const BYTE*)pszEntry, dwLength);
+	rScratch.m_EncStream.WriteAscii("\r\n");
+	rScratch.m_pszEntry = NULL;
+	rScratch.m_pbEntryText = (const BYTE*)pszEntry;
+	rScratch.m_dwEntryTextSize = dwLength;
+	rScratch.m_ullTime = ullTime;
+	rScratch.m_bEncoded = TRUE;
+}
@@ -18,6 +18,12 @@
 #include "BugTrapUtils.h"
 #include "StrStream.h"
 #include "Buffer.h"
+#include "LogClock.h"
+#include "LogThrottle.h"
+#include "LogCategories.h"
+#include "LogScratch.h"
+
+struct CLogQuery;
 
 /**
  * @brief Base class for custom log file.
@@ -50,14 +56,40 @@ public:
 	virtual DWORD GetLogSizeInBytes(void) const;
 	/// Set maximum log file size in bytes.
 	virtual BOOL SetLogSizeInBytes(DWORD dwLogSizeInBytes);
+	/// Get size of write buffer in bytes.
+	virtual DWORD GetLogBufferSize(void) const;
+	/// Set size of write buffer in bytes.
+	virtual BOOL SetLogBufferSize(DWORD dwLogBufferSize);
+	/// Get maximum age of log segment in minutes.
+	virtual DWORD GetLogSegmentTime(void) const;
+	/// Set maximum age of log segment in minutes.
+	virtual BOOL SetLogSegmentTime(DWORD dwLogSegmentTime);
+	/// Get number of kept log segments.
+	virtual DWORD GetLogSegmentCount(void) const;
+	/// Set number of kept log segments.
+	virtual BOOL SetLogSegmentCount(DWORD dwLogSegmentCount);
+	/// Get conditions of automatic flush.
+	virtual BOOL GetLogFlushPolicy(DWORD& rdwFlushEntries, DWORD& rdwFlushDelay, DWORD& rdwFlushBytes) const;
+	/// Set conditions of automatic flush.
+	virtual BOOL SetLogFlushPolicy(DWORD dwFlushEntries, DWORD dwFlushDelay, DWORD dwFlushBytes);
+	/// Get time left until automatic flush.
+	virtual DWORD GetFlushTimeout(DWORD dwCurrentTime) const;
+	/// Forget entries added since the last flush.
+	virtual void ResetDirtyEntries(void);
+	/// Compress old entries in background, the log must not be locked by the caller.
+	virtual void PackEntries(void);
 	/// Return true if time stamp is added to every log entry.
 	DWORD GetLogFlags(void) const;
 	/// Set true if time stamp is added to every log entry.
-	BOOL SetLogFlags(DWORD dwLogFlags);
+	virtual BOOL SetLogFlags(DWORD dwLogFlags);
 	/// Return minimal log level accepted by tracing functions.
 	BUGTRAP_LOGLEVEL GetLogLevel(void) const;
 	/// Set minimal log level accepted by tracing functions.
 	BOOL SetLogLevel(BUGTRAP_LOGLEVEL eLogLevel);
+	/// Return true if entry of given category and level passes the log filter.
+	BOOL IsLogLevelEnabled(DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel) const;
+	/// Return the most verbose level accepted by the log or any of its categories.
+	BUGTRAP_LOGLEVEL GetMaxLogLevel(void) const;
 	/// Get echo mode.
 	DWORD GetLogEchoMode(void);
 	/// Set echo mode.
@@ -68,6 +100,8 @@ public:
 	void ReleaseObject(void);
 	/// Load Entries into memory.
 	virtual BOOL LoadEntries(void) = 0;
+	/// Load entries of previous session without blocking the caller.
+	virtual BOOL DeferLoadEntries(void);
 	/// Save entries into disk.
 	virtual BOOL SaveEntries(BOOL bCrash) = 0;
 	/// Clear log entries.
@@ -75,31 +109,85 @@ public:
 	/// Close log file.
 	virtual void Close(void) = 0;
 	/// Add new log entry.
-	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry) = 0;
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0) = 0;
 	/// Add new log entry.
 	BOOL WriteLogEntryF(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, ...);
 	/// Add new log entry.
-	BOOL WriteLogEntryV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList);
+	virtual BOOL WriteLogEntryV(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList);
+	/// Add new log entry encoded in UTF-8.
+	virtual BOOL WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength);
+	/// Prepare log entry before the log is locked.
+	virtual BOOL PrepareLogEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry);
+	/// Format and prepare log entry before the log is locked.
+	virtual BOOL PrepareLogEntryV(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszFormat, va_list argList);
+	/// Prepare log entry encoded in UTF-8 before the log is locked.
+	virtual BOOL PrepareLogEntryUTF8(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength);
+	/// Add log entry prepared before the log was locked.
+	virtual BOOL WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess);
+	/// Render text of prepared entry and encode it in UTF-8.
+	BOOL EncodePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel);
+	/// Get flags that affect rendered entry text.
+	DWORD GetEntryTextFlags(void) const;
+	/// Return true if the log forwards entries to other logs.
+	virtual BOOL IsLogTee(void) const;
+	/// Remove references to the log file that is being closed.
+	virtual void DetachLogFile(CLogFile* pLogFile);
+	/// Pass entries that match the filter to the callback.
+	virtual BOOL QueryEntries(const CLogQuery& rLogQuery);
+	/// Decode UTF-8 text.
+	static BOOL DecodeUTF8(PCSTR pszText, DWORD dwLength, CDynamicBuffer<TCHAR>& rTextBuffer);
+	/// Account log entry that was dropped before reaching the log.
+	void AddDroppedEntry(void);
+	/// Get and reset the number of dropped log entries.
+	DWORD ResetDroppedEntries(void);
+	/// Pin the log while entries are staged for it.
+	void AddStagedEntries(LONG lNumEntries);
+	/// Unpin the log once staged entries were written.
+	void RemoveStagedEntries(LONG lNumEntries);
+	/// Return true if some staged entries weren't written to the log yet.
+	BOOL HasStagedEntries(void) const;
+	/// Get rate limiter and sampler of log entries.
+	CLogThrottle& GetLogThrottle(void);
+	/// Get table of category levels.
+	CLogCategories& GetLogCategories(void);
 
 protected:
 	/// Get default log file extension.
 	virtual PCTSTR GetLogFileExtension(void) const = 0;
+	/// Return true if entries may be rendered and encoded before the log is locked.
+	virtual BOOL CanEncodeEntries(void) const;
+	/// Get scratch buffers of calling thread.
+	CLogScratch& GetScratch(void);
+	/// Render entry prefix and encode it with UTF-8 entry text.
+	void EncodePreparedEntryUTF8(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, PCSTR pszEntry, DWORD dwLength);
 	/// Get last entry text.
 	PCTSTR GetEntryText(void) const;
 	/// Get log level prefix.
 	static PCTSTR GetLogLevelPrefix(BUGTRAP_LOGLEVEL eLogLevel);
-	/// Get time statistics.
-	static void GetTimeStatistics(const SYSTEMTIME* pSystemTime, PTSTR pszTimeStatistics, DWORD dwTimeStatisticsSize);
+	/// Get time stamp text.
+	PCTSTR GetTimeStamp(ULONGLONG ullTime);
+	/// Fill entry prefix.
+	void FillEntryPrefix(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime);
 	/// Fill entry text.
-	void FillEntryText(BUGTRAP_LOGLEVEL eLogLevel, const SYSTEMTIME* pSystemTime, PCTSTR pszEntry);
+	void FillEntryText(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, PCTSTR pszEntry);
 	/// Write text to console.
-	void WriteTextToConsole(HANDLE hConsole);
+	void WriteTextToConsole(CLogScratch& rScratch, HANDLE hConsole);
 	/// Write text to debug console.
-	void WriteTextToDebugConsole(void);
+	void WriteTextToDebugConsole(CLogScratch& rScratch);
 	/// Get output console handle.
 	HANDLE GetConsoleHandle(void) const;
 	/// Write log entry to the console.
-	BOOL WriteLogEntryToConsole(BUGTRAP_LOGLEVEL eLogLevel, const SYSTEMTIME* pSystemTime, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry);
+	BOOL WriteLogEntryToConsole(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry);
+	/// Echo prepared entry once it has been added to the log.
+	void EchoPreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, CRITICAL_SECTION& rcsConsoleAccess);
+	/// Fill buffer with formatted string.
+	BOOL FormatBufferF(PCTSTR pszFormat, ...);
+	/// Fill buffer with formatted string.
+	BOOL FormatBufferV(PCTSTR pszFormat, va_list argList);
+	/// Fill buffer with formatted string.
+	static BOOL FormatBufferV(CDynamicBuffer<TCHAR>& rFormatBuffer, PCTSTR pszFormat, va_list argList);
+	/// Get formatted string.
+	PCTSTR GetFormattedText(void);
 
 private:
 	/// Protects the class from being accidentally copied.
@@ -108,10 +196,13 @@ private:
 	CLogFile& operator=(const CLogFile& rLogFile);
 	/// Set log file name to default value.
 	BOOL CompleteLogFileName(PCTSTR pszLogFileName);
-	/// Fill buffer with formatted string.
-	BOOL FormatBufferV(PCTSTR pszFormat, va_list argList);
-	/// Fill buffer with formatted string.
-	BOOL FormatBufferF(PCTSTR pszFormat, ...);
+
+	/// Time stamp parameters.
+	enum
+	{
+		/// Length of time stamp without fraction of second.
+		TIME_STAMP_LENGTH = 19
+	};
 
 	/// Custom log file name.
 	TCHAR m_szLogFileName[MAX_PATH];
@@ -119,20 +210,20 @@ private:
 	DWORD m_dwLogFlags;
 	/// Echo mode.
 	DWORD m_dwLogEchoMode;
-	/// Minimal log level accepted by tracing functions.
-	BUGTRAP_LOGLEVEL m_eLogLevel;
+	/// Minimal log level accepted by tracing functions (read without locking the log).
+	volatile BUGTRAP_LOGLEVEL m_eLogLevel;
 	/// Synchronization object.
 	CRITICAL_SECTION m_csLogFile;
-	/// Pre-allocated buffer for log entry text.
-	CStrStream m_StrStream;
-	/// Pre-allocated buffer for format string.
-	CDynamicBuffer<TCHAR> m_FormatBuffer;
-#ifndef _UNICODE
-	/// Pre-allocated buffer for encoded console message.
-	CDynamicBuffer<CHAR> m_ConsoleBufferA;
-	/// Pre-allocated buffer for encoded console message.
-	CDynamicBuffer<WCHAR> m_ConsoleBufferW;
-#endif
+	/// Number of entries dropped before reaching the log.
+	volatile LONG m_lNumDroppedEntries;
+	/// Number of entries staged for the log, the log can't be deleted until it drops to 0.
+	volatile LONG m_lNumStagedEntries;
+	/// Rate limiter and sampler of log entries.
+	CLogThrottle m_LogThrottle;
+	/// Levels of entry categories.
+	CLogCategories m_LogCategories;
+	/// Scratch buffers of threads that couldn't get their own buffers (used under the lock).
+	CLogScratch m_Scratch;
 };
 
 inline CLogFile::~CLogFile(void)
@@ -174,6 +265,140 @@ inline BOOL CLogFile::SetLogSizeInBytes(DWORD /*dwLogSizeInBytes*/)
 	return FALSE;
 }
 
+/**
+ * @return size of write buffer in bytes.
+ */
+inline DWORD CLogFile::GetLogBufferSize(void) const
+{
+	return 0;
+}
+
+/**
+ * @param dwLogBufferSize - size of write buffer in bytes.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogFile::SetLogBufferSize(DWORD /*dwLogBufferSize*/)
+{
+	return FALSE;
+}
+
+/**
+ * @return maximum age of log segment in minutes.
+ */
+inline DWORD CLogFile::GetLogSegmentTime(void) const
+{
+	return 0;
+}
+
+/**
+ * @param dwLogSegmentTime - maximum age of log segment in minutes.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogFile::SetLogSegmentTime(DWORD /*dwLogSegmentTime*/)
+{
+	return FALSE;
+}
+
+/**
+ * @return number of kept log segments.
+ */
+inline DWORD CLogFile::GetLogSegmentCount(void) const
+{
+	return 0;
+}
+
+/**
+ * @param dwLogSegmentCount - number of kept log segments.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogFile::SetLogSegmentCount(DWORD /*dwLogSegmentCount*/)
+{
+	return FALSE;
+}
+
+/**
+ * @param rdwFlushEntries - number of new entries that triggers flush.
+ * @param rdwFlushDelay - maximum age of unsaved entries in milliseconds.
+ * @param rdwFlushBytes - size of new entries that triggers flush.
+ * @return true if the log supports automatic flush.
+ */
+inline BOOL CLogFile::GetLogFlushPolicy(DWORD& rdwFlushEntries, DWORD& rdwFlushDelay, DWORD& rdwFlushBytes) const
+{
+	rdwFlushEntries = 0;
+	rdwFlushDelay = 0;
+	rdwFlushBytes = 0;
+	return FALSE;
+}
+
+/**
+ * @param dwFlushEntries - number of new entries that triggers flush.
+ * @param dwFlushDelay - maximum age of unsaved entries in milliseconds.
+ * @param dwFlushBytes - size of new entries that triggers flush.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogFile::SetLogFlushPolicy(DWORD /*dwFlushEntries*/, DWORD /*dwFlushDelay*/, DWORD /*dwFlushBytes*/)
+{
+	return FALSE;
+}
+
+/**
+ * @param dwCurrentTime - current tick count.
+ * @return time in milliseconds until the log has to be flushed, 0 if it's due or INFINITE.
+ */
+inline DWORD CLogFile::GetFlushTimeout(DWORD /*dwCurrentTime*/) const
+{
+	return INFINITE;
+}
+
+inline void CLogFile::ResetDirtyEntries(void)
+{
+}
+
+inline void CLogFile::PackEntries(void)
+{
+}
+
+/**
+ * @return flags that affect rendered entry text.
+ */
+inline DWORD CLogFile::GetEntryTextFlags(void) const
+{
+	DWORD dwEntryTextFlags = m_dwLogFlags & (BTLF_SHOWLOGLEVEL | BTLF_SHOWTIMESTAMP | BTLF_MICROSECONDS);
+	// Echoed text has to be rendered by every log.
+	return (m_dwLogEchoMode == BTLE_NONE ? dwEntryTextFlags : MAXDWORD);
+}
+
+/**
+ * @return true if the log forwards entries to other logs.
+ */
+inline BOOL CLogFile::IsLogTee(void) const
+{
+	return FALSE;
+}
+
+inline void CLogFile::DetachLogFile(CLogFile* /*pLogFile*/)
+{
+}
+
+/**
+ * @param rLogQuery - query filter and receiver of entries.
+ * @return true if operation was completed successfully.
+ */
+inline BOOL CLogFile::QueryEntries(const CLogQuery& /*rLogQuery*/)
+{
+	// Only in-memory logs keep entries that can be queried.
+	return FALSE;
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+inline BOOL CLogFile::DeferLoadEntries(void)
+{
+	// Only in-memory logs keep entries of previous session.
+	return LoadEntries();
+}
+
 inline void CLogFile::CaptureObject(void)
 {
 	EnterCriticalSection(&m_csLogFile);
@@ -220,6 +445,25 @@ inline BOOL CLogFile::SetLogLevel(BUGTRAP_LOGLEVEL eLogLevel)
 	return TRUE;
 }
 
+/**
+ * @param dwCategory - category index or 0 for entries without category.
+ * @param eLogLevel - log level number.
+ * @return true if entry passes the log filter.
+ */
+inline BOOL CLogFile::IsLogLevelEnabled(DWORD dwCategory, BUGTRAP_LOGLEVEL eLogLevel) const
+{
+	return (eLogLevel <= m_LogCategories.GetCategoryLevel(dwCategory, m_eLogLevel));
+}
+
+/**
+ * @return the most verbose level accepted by the log or any of its categories.
+ */
+inline BUGTRAP_LOGLEVEL CLogFile::GetMaxLogLevel(void) const
+{
+	// Entry category is checked by the caller, the log only drops entries no category accepts.
+	return m_LogCategories.GetMaxLogLevel(m_eLogLevel);
+}
+
 /**
  * @return current echo mode.
  */
@@ -238,9 +482,79 @@ inline BOOL CLogFile::SetLogEchoMode(DWORD dwLogEchoMode)
 	return TRUE;
 }
 
-inline void CLogFile::WriteTextToDebugConsole(void)
+inline void CLogFile::AddDroppedEntry(void)
 {
-	OutputDebugString(m_StrStream);
+	InterlockedIncrement(&m_lNumDroppedEntries);
+}
+
+/**
+ * @return number of entries dropped since the last call.
+ */
+inline DWORD CLogFile::ResetDroppedEntries(void)
+{
+	return (DWORD)InterlockedExchange(&m_lNumDroppedEntries, 0);
+}
+
+/**
+ * @param lNumEntries - number of staged entries.
+ */
+inline void CLogFile::AddStagedEntries(LONG lNumEntries)
+{
+	InterlockedExchangeAdd(&m_lNumStagedEntries, lNumEntries);
+}
+
+/**
+ * @param lNumEntries - number of written entries.
+ */
+inline void CLogFile::RemoveStagedEntries(LONG lNumEntries)
+{
+	InterlockedExchangeAdd(&m_lNumStagedEntries, -lNumEntries);
+}
+
+/**
+ * @return true if some staged entries weren't written to the log yet.
+ */
+inline BOOL CLogFile::HasStagedEntries(void) const
+{
+	return (m_lNumStagedEntries > 0);
+}
+
+/**
+ * @return rate limiter and sampler of log entries.
+ */
+inline CLogThrottle& CLogFile::GetLogThrottle(void)
+{
+	return m_LogThrottle;
+}
+
+/**
+ * @return table of category levels.
+ */
+inline CLogCategories& CLogFile::GetLogCategories(void)
+{
+	return m_LogCategories;
+}
+
+inline BOOL CLogFile::CanEncodeEntries(void) const
+{
+	return FALSE;
+}
+
+/**
+ * @return scratch buffers of calling thread.
+ */
+inline CLogScratch& CLogFile::GetScratch(void)
+{
+	CLogScratch* pScratch = g_LogScratchPool.GetThreadScratch();
+	return (pScratch != NULL ? *pScratch : m_Scratch);
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ */
+inline void CLogFile::WriteTextToDebugConsole(CLogScratch& rScratch)
+{
+	OutputDebugString(rScratch.m_StrStream);
 }
 
 /**
@@ -248,7 +562,27 @@ inline void CLogFile::WriteTextToDebugConsole(void)
  */
 inline PCTSTR CLogFile::GetEntryText(void) const
 {
-	return (PCTSTR)m_StrStream;
+	// Entry text is rendered by the same thread, so its scratch object is already allocated.
+	CLogScratch* pScratch = g_LogScratchPool.GetThreadScratch();
+	return (PCTSTR)(pScratch != NULL ? pScratch->m_StrStream : m_Scratch.m_StrStream);
+}
+
+/**
+ * @return formatted string.
+ */
+inline PCTSTR CLogFile::GetFormattedText(void)
+{
+	return GetScratch().m_FormatBuffer.GetData();
+}
+
+/**
+ * @param pszFormat - format expression.
+ * @param argList - variable argument list.
+ * @return true if string was formatted.
+ */
+inline BOOL CLogFile::FormatBufferV(PCTSTR pszFormat, va_list argList)
+{
+	return FormatBufferV(GetScratch().m_FormatBuffer, pszFormat, argList);
 }
 
 /**
@@ -0,0 +1,122 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Background flush of cached log files.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogFlusher.h"
+#include "BugTrapUtils.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogFlusher g_LogFlusher;
+
+CLogFlusher::CLogFlusher(void)
+{
+	m_pfnFlushLogFiles = NULL;
+	m_hFlushEvent = NULL;
+	m_hFlushThread = NULL;
+	m_uFlushThreadID = 0;
+	m_lThreadStarted = FALSE;
+	m_lStopped = FALSE;
+	m_bInitialized = FALSE;
+}
+
+CLogFlusher::~CLogFlusher(void)
+{
+	Uninitialize();
+}
+
+/**
+ * @param pfnFlushLogFiles - function that flushes due logs.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogFlusher::Initialize(TFlushFunc pfnFlushLogFiles)
+{
+	_ASSERTE(! m_bInitialized && pfnFlushLogFiles != NULL);
+	m_hFlushEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // non-signaled auto-reset event
+	if (m_hFlushEvent == NULL)
+		return FALSE;
+	m_pfnFlushLogFiles = pfnFlushLogFiles;
+	m_lThreadStarted = FALSE;
+	m_lStopped = FALSE;
+	m_bInitialized = TRUE;
+	return TRUE;
+}
+
+void CLogFlusher::Uninitialize(void)
+{
+	if (! m_bInitialized)
+		return;
+	Stop(FALSE);
+	if (m_hFlushThread != NULL)
+	{
+		CloseHandle(m_hFlushThread);
+		m_hFlushThread = NULL;
+	}
+	CloseHandle(m_hFlushEvent);
+	m_hFlushEvent = NULL;
+	m_pfnFlushLogFiles = NULL;
+	m_bInitialized = FALSE;
+}
+
+/**
+ * @param pParam - flusher object.
+ * @return thread exit code.
+ */
+UINT CALLBACK CLogFlusher::FlushThreadProc(PVOID pParam)
+{
+	CLogFlusher* pThis = (CLogFlusher*)pParam;
+	DWORD dwTimeout = INFINITE;
+	for (;;)
+	{
+		WaitForSingleObject(pThis->m_hFlushEvent, dwTimeout);
+		if (pThis->m_lStopped)
+			break;
+		dwTimeout = pThis->m_pfnFlushLogFiles();
+	}
+	return 0;
+}
+
+void CLogFlusher::StartFlushThread(void)
+{
+	if (m_lThreadStarted || InterlockedExchange(&m_lThreadStarted, TRUE))
+		return;
+	PinLibraryInMemory();
+	m_hFlushThread = (HANDLE)_beginthreadex(NULL, 0, FlushThreadProc, this, 0, &m_uFlushThreadID);
+}
+
+void CLogFlusher::RequestFlush(void)
+{
+	if (! m_bInitialized || m_lStopped)
+		return;
+	StartFlushThread();
+	SetEvent(m_hFlushEvent);
+}
+
+/**
+ * @param bWaitThread - true if function has to wait for background thread termination.
+ */
+void CLogFlusher::Stop(BOOL bWaitThread)
+{
+	if (! m_bInitialized)
+		return;
+	InterlockedExchange(&m_lStopped, TRUE);
+	if (m_hFlushThread != NULL)
+	{
+		SetEvent(m_hFlushEvent);
+		if (bWaitThread && GetCurrentThreadId() != m_uFlushThreadID)
+			WaitForSingleObject(m_hFlushThread, INFINITE);
+	}
+}
@@ -0,0 +1,69 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Background flush of cached log files.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+/**
+ * @brief Single background thread that flushes all logs with flush policy.
+ * Logs only signal the thread when flush condition is met or when the first
+ * unsaved entry starts the flush timer. Requests that arrive while the thread
+ * is busy are coalesced into one pass over open logs.
+ */
+class CLogFlusher
+{
+public:
+	/// Function that flushes due logs and returns time until the next flush.
+	typedef DWORD (*TFlushFunc)(void);
+
+	/// Initialize the object.
+	CLogFlusher(void);
+	/// Destroy the object.
+	~CLogFlusher(void);
+	/// Allocate system resources.
+	BOOL Initialize(TFlushFunc pfnFlushLogFiles);
+	/// Free system resources.
+	void Uninitialize(void);
+	/// Ask background thread to check logs.
+	void RequestFlush(void);
+	/// Stop background thread.
+	void Stop(BOOL bWaitThread);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogFlusher(const CLogFlusher& rLogFlusher);
+	/// Protects the class from being accidentally copied.
+	CLogFlusher& operator=(const CLogFlusher& rLogFlusher);
+	/// Start background thread on demand.
+	void StartFlushThread(void);
+	/// Background thread procedure.
+	static UINT CALLBACK FlushThreadProc(PVOID pParam);
+
+	/// Function that flushes due logs.
+	TFlushFunc m_pfnFlushLogFiles;
+	/// Event fired when logs need to be checked.
+	HANDLE m_hFlushEvent;
+	/// Background thread handle.
+	HANDLE m_hFlushThread;
+	/// Background thread identifier.
+	UINT m_uFlushThreadID;
+	/// Non-zero once background thread has been started.
+	volatile LONG m_lThreadStarted;
+	/// Non-zero when flusher is stopped.
+	volatile LONG m_lStopped;
+	/// True when resources were allocated.
+	BOOL m_bInitialized;
+};
+
+/// Flusher shared by all log files.
+extern CLogFlusher g_LogFlusher;
@@ -0,0 +1,127 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Table of open log file handles.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogHandles.h"
+#include "LogFile.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogHandles::~CLogHandles(void)
+{
+	DeleteAll();
+	DeleteCriticalSection(&m_csHandles);
+}
+
+/**
+ * @param pLogFile - log file object.
+ * @return log file handle or 0 if table is full.
+ */
+INT_PTR CLogHandles::AddLogFile(CLogFile* pLogFile)
+{
+	_ASSERTE(pLogFile != NULL);
+	INT_PTR iHandle = 0;
+	EnterCriticalSection(&m_csHandles);
+	DWORD dwSlot = m_dwFirstFreeSlot;
+	if (dwSlot == NO_SLOT && m_dwNumSlots < MAX_SLOTS)
+	{
+		DWORD dwPage = m_dwNumSlots / PAGE_SIZE;
+		if (m_arrPages[dwPage] == NULL)
+		{
+			CSlot* pPage = new CSlot[PAGE_SIZE];
+			if (pPage != NULL)
+			{
+				ZeroMemory(pPage, PAGE_SIZE * sizeof(CSlot));
+				InterlockedExchangePointer((PVOID volatile*)&m_arrPages[dwPage], pPage);
+			}
+		}
+		if (m_arrPages[dwPage] != NULL)
+		{
+			dwSlot = m_dwNumSlots;
+			m_arrPages[dwPage][dwSlot % PAGE_SIZE].m_dwNextFreeSlot = NO_SLOT;
+			m_dwFirstFreeSlot = dwSlot;
+			++m_dwNumSlots;
+		}
+	}
+	if (dwSlot != NO_SLOT)
+	{
+		CSlot& rSlot = m_arrPages[dwSlot / PAGE_SIZE][dwSlot % PAGE_SIZE];
+		m_dwFirstFreeSlot = rSlot.m_dwNextFreeSlot;
+		_ASSERTE(rSlot.m_pLogFile == NULL && rSlot.m_lNumUsers == 0);
+		InterlockedExchangePointer((PVOID volatile*)&rSlot.m_pLogFile, pLogFile);
+		iHandle = MakeHandle(dwSlot, rSlot.m_lGeneration);
+	}
+	LeaveCriticalSection(&m_csHandles);
+	return iHandle;
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return removed log file object or NULL if handle is invalid or stale.
+ * Caller owns returned object. Function must not be called by the thread
+ * that has acquired the same log file.
+ */
+CLogFile* CLogHandles::RemoveLogFile(INT_PTR iHandle)
+{
+	EnterCriticalSection(&m_csHandles);
+	CSlot* pSlot = GetSlot(iHandle);
+	LONG lGeneration = (LONG)(iHandle >> SLOT_BITS);
+	if (pSlot == NULL || pSlot->m_lGeneration != lGeneration || pSlot->m_pLogFile == NULL)
+	{
+		LeaveCriticalSection(&m_csHandles);
+		return NULL;
+	}
+	CLogFile* pLogFile = (CLogFile*)InterlockedExchangePointer((PVOID volatile*)&pSlot->m_pLogFile, NULL);
+	// Generation may wrap around after many reuses of the same slot, handle that
+	// old would have to be kept all this time to be confused with the new one.
+	InterlockedExchange(&pSlot->m_lGeneration, (lGeneration + 1) & GENERATION_MASK);
+	LeaveCriticalSection(&m_csHandles);
+	// Threads that have found the log before its handle was invalidated finish shortly.
+	while (pSlot->m_lNumUsers > 0)
+		SwitchToThread();
+	EnterCriticalSection(&m_csHandles);
+	DWORD dwSlot = (DWORD)(iHandle & SLOT_MASK) - 1;
+	pSlot->m_dwNextFreeSlot = m_dwFirstFreeSlot;
+	m_dwFirstFreeSlot = dwSlot;
+	LeaveCriticalSection(&m_csHandles);
+	return pLogFile;
+}
+
+/**
+ * @param dwSlot - slot number.
+ * @return handle of log file kept in the slot or 0 if slot is free.
+ */
+INT_PTR CLogHandles::GetSlotHandle(DWORD dwSlot) const
+{
+	_ASSERTE(dwSlot < m_dwNumSlots);
+	const CSlot& rSlot = m_arrPages[dwSlot / PAGE_SIZE][dwSlot % PAGE_SIZE];
+	return (rSlot.m_pLogFile != NULL ? MakeHandle(dwSlot, rSlot.m_lGeneration) : 0);
+}
+
+void CLogHandles::DeleteAll(void)
+{
+	EnterCriticalSection(&m_csHandles);
+	for (DWORD dwSlot = 0; dwSlot < m_dwNumSlots; ++dwSlot)
+		delete m_arrPages[dwSlot / PAGE_SIZE][dwSlot % PAGE_SIZE].m_pLogFile;
+	for (DWORD dwPage = 0; dwPage < MAX_PAGES; ++dwPage)
+	{
+		delete[] m_arrPages[dwPage];
+		m_arrPages[dwPage] = NULL;
+	}
+	m_dwNumSlots = 0;
+	m_dwFirstFreeSlot = NO_SLOT;
+	LeaveCriticalSection(&m_csHandles);
+}
@@ -0,0 +1,173 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Table of open log file handles.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+class CLogFile;
+
+/**
+ * @brief Generational slot map of open log files.
+ * Handle keeps slot number in low bits and slot generation in high bits.
+ * Slots are kept in pages that never move until the table is destroyed,
+ * so handles are looked up without locks. Closing the log changes slot
+ * generation, therefore stale handles are rejected by one comparison
+ * and slot can be reused without confusing old handles with new ones.
+ * Every slot counts threads that use its log file, closed log is
+ * deleted only when the last of these threads releases it.
+ */
+class CLogHandles
+{
+public:
+	/// Initialize the object.
+	CLogHandles(void);
+	/// Destroy the object.
+	~CLogHandles(void);
+	/// Put log file into free slot.
+	INT_PTR AddLogFile(CLogFile* pLogFile);
+	/// Invalidate log file handle and wait until other threads release the log.
+	CLogFile* RemoveLogFile(INT_PTR iHandle);
+	/// Find log file and protect it from being removed.
+	CLogFile* AcquireLogFile(INT_PTR iHandle);
+	/// Allow acquired log file to be removed.
+	void ReleaseLogFile(INT_PTR iHandle);
+	/// Get number of slots that have ever been used.
+	DWORD GetNumSlots(void) const;
+	/// Get handle of log file kept in the slot.
+	INT_PTR GetSlotHandle(DWORD dwSlot) const;
+	/// Delete all log files.
+	void DeleteAll(void);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogHandles(const CLogHandles& rLogHandles);
+	/// Protects the class from being accidentally copied.
+	CLogHandles& operator=(const CLogHandles& rLogHandles);
+
+	/// Table parameters.
+	enum
+	{
+		/// Number of handle bits used for slot number.
+		SLOT_BITS        = 14,
+		/// Mask of slot number bits.
+		SLOT_MASK        = (1 << SLOT_BITS) - 1,
+		/// Mask of generation bits, handles are kept positive on all platforms.
+		GENERATION_MASK  = (1 << (31 - SLOT_BITS)) - 1,
+		/// Number of slots in one page.
+		PAGE_SIZE        = 256,
+		/// Maximum number of slots, slot number 0 is reserved for invalid handles.
+		MAX_SLOTS        = SLOT_MASK,
+		/// Maximum number of pages.
+		MAX_PAGES        = (MAX_SLOTS + PAGE_SIZE - 1) / PAGE_SIZE,
+		/// End of free slots list.
+		NO_SLOT          = 0xFFFFFFFF
+	};
+
+	/// Log file slot.
+	struct CSlot
+	{
+		/// Log file object or NULL if slot is free.
+		CLogFile* volatile m_pLogFile;
+		/// Generation of valid handle.
+		volatile LONG m_lGeneration;
+		/// Number of threads that use log file.
+		volatile LONG m_lNumUsers;
+		/// Next free slot.
+		DWORD m_dwNextFreeSlot;
+	};
+
+	/// Find slot of the handle.
+	CSlot* GetSlot(INT_PTR iHandle) const;
+	/// Get handle of the slot.
+	static INT_PTR MakeHandle(DWORD dwSlot, LONG lGeneration);
+
+	/// Protects free slots list and allocation of pages.
+	CRITICAL_SECTION m_csHandles;
+	/// Pages of slots.
+	CSlot* volatile m_arrPages[MAX_PAGES];
+	/// Number of slots that have ever been used.
+	volatile DWORD m_dwNumSlots;
+	/// First free slot.
+	DWORD m_dwFirstFreeSlot;
+};
+
+inline CLogHandles::CLogHandles(void)
+{
+	InitializeCriticalSection(&m_csHandles);
+	ZeroMemory((PVOID)m_arrPages, sizeof(m_arrPages));
+	m_dwNumSlots = 0;
+	m_dwFirstFreeSlot = NO_SLOT;
+}
+
+/**
+ * @return number of slots that have ever been used.
+ */
+inline DWORD CLogHandles::GetNumSlots(void) const
+{
+	return m_dwNumSlots;
+}
+
+/**
+ * @param dwSlot - slot number.
+ * @param lGeneration - slot generation.
+ * @return log file handle.
+ */
+inline INT_PTR CLogHandles::MakeHandle(DWORD dwSlot, LONG lGeneration)
+{
+	return (((INT_PTR)lGeneration << SLOT_BITS) | (INT_PTR)(dwSlot + 1));
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return slot of the handle or NULL if handle is out of range.
+ */
+inline CLogHandles::CSlot* CLogHandles::GetSlot(INT_PTR iHandle) const
+{
+	DWORD dwSlot = (DWORD)(iHandle & SLOT_MASK) - 1;
+	if (iHandle <= 0 || dwSlot >= MAX_SLOTS)
+		return NULL;
+	CSlot* pPage = m_arrPages[dwSlot / PAGE_SIZE];
+	return (pPage != NULL ? pPage + dwSlot % PAGE_SIZE : NULL);
+}
+
+/**
+ * @param iHandle - log file handle.
+ * @return log file object or NULL if handle is invalid or stale.
+ */
+inline CLogFile* CLogHandles::AcquireLogFile(INT_PTR iHandle)
+{
+	CSlot* pSlot = GetSlot(iHandle);
+	LONG lGeneration = (LONG)(iHandle >> SLOT_BITS);
+	if (pSlot == NULL || pSlot->m_lGeneration != lGeneration)
+		return NULL;
+	InterlockedIncrement(&pSlot->m_lNumUsers);
+	// Generation is changed before the closing thread counts users,
+	// so either that thread waits for this one or the check fails.
+	CLogFile* pLogFile = pSlot->m_pLogFile;
+	if (pSlot->m_lGeneration != lGeneration || pLogFile == NULL)
+	{
+		InterlockedDecrement(&pSlot->m_lNumUsers);
+		return NULL;
+	}
+	return pLogFile;
+}
+
+/**
+ * @param iHandle - handle of acquired log file.
+ */
+inline void CLogHandles::ReleaseLogFile(INT_PTR iHandle)
+{
+	CSlot* pSlot = GetSlot(iHandle);
+	_ASSERTE(pSlot != NULL && pSlot->m_lNumUsers > 0);
+	InterlockedDecrement(&pSlot->m_lNumUsers);
+}
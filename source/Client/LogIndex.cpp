@@ -0,0 +1,283 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Side index of in-memory log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogIndex.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+/**
+ * @return true if there is room for one more record.
+ */
+BOOL CLogIndex::Grow(void)
+{
+	if (m_dwCount < m_dwCapacity)
+		return TRUE;
+	DWORD dwNewCapacity = m_dwCapacity != 0 ? m_dwCapacity * 2 : INITIAL_CAPACITY;
+	if (dwNewCapacity < m_dwCapacity)
+		return FALSE;
+	// Arrays share one block, the widest array goes first to keep others aligned.
+	PBYTE pbNewBlock = new BYTE[dwNewCapacity * (sizeof(ULONGLONG) + sizeof(DWORD) + sizeof(BYTE))];
+	if (pbNewBlock == NULL)
+		return FALSE;
+	ULONGLONG* pNewTimes = (ULONGLONG*)pbNewBlock;
+	DWORD* pNewSizes = (DWORD*)(pNewTimes + dwNewCapacity);
+	PBYTE pNewLevels = (PBYTE)(pNewSizes + dwNewCapacity);
+	for (DWORD dwPosition = 0; dwPosition < m_dwCount; ++dwPosition)
+	{
+		DWORD dwSlot = GetSlot(dwPosition);
+		pNewTimes[dwPosition] = m_pTimes[dwSlot];
+		pNewSizes[dwPosition] = m_pSizes[dwSlot];
+		pNewLevels[dwPosition] = m_pLevels[dwSlot];
+	}
+	delete[] (PBYTE)m_pTimes;
+	m_pTimes = pNewTimes;
+	m_pSizes = pNewSizes;
+	m_pLevels = pNewLevels;
+	m_dwCapacity = dwNewCapacity;
+	m_dwHead = 0;
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - entry log level.
+ * @param ullTime - entry time.
+ * @param dwSize - entry size in memory.
+ */
+void CLogIndex::AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, DWORD dwSize)
+{
+	if (! m_bValid)
+		return;
+	if (! Grow())
+	{
+		Invalidate();
+		return;
+	}
+	m_dwHead = (m_dwHead - 1) & (m_dwCapacity - 1);
+	++m_dwCount;
+	m_pTimes[m_dwHead] = ullTime;
+	m_pSizes[m_dwHead] = dwSize;
+	m_pLevels[m_dwHead] = (BYTE)eLogLevel;
+}
+
+/**
+ * @param eLogLevel - entry log level.
+ * @param ullTime - entry time.
+ * @param dwSize - entry size in memory.
+ */
+void CLogIndex::AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, DWORD dwSize)
+{
+	if (! m_bValid)
+		return;
+	if (! Grow())
+	{
+		Invalidate();
+		return;
+	}
+	DWORD dwSlot = (m_dwHead + m_dwCount) & (m_dwCapacity - 1);
+	++m_dwCount;
+	m_pTimes[dwSlot] = ullTime;
+	m_pSizes[dwSlot] = dwSize;
+	m_pLevels[dwSlot] = (BYTE)eLogLevel;
+}
+
+/**
+ * @param dwCount - number of removed records.
+ */
+void CLogIndex::DeleteHead(DWORD dwCount)
+{
+	if (! m_bValid)
+		return;
+	_ASSERTE(dwCount <= m_dwCount);
+	m_dwHead = (m_dwHead + dwCount) & (m_dwCapacity - 1);
+	m_dwCount -= dwCount;
+}
+
+/**
+ * @param dwCount - number of removed records.
+ */
+void CLogIndex::DeleteTail(DWORD dwCount)
+{
+	if (! m_bValid)
+		return;
+	_ASSERTE(dwCount <= m_dwCount);
+	m_dwCount -= dwCount;
+}
+
+/**
+ * @param rLogIndex - another index.
+ */
+void CLogIndex::Swap(CLogIndex& rLogIndex)
+{
+	ULONGLONG* pTimes = m_pTimes;
+	m_pTimes = rLogIndex.m_pTimes;
+	rLogIndex.m_pTimes = pTimes;
+	DWORD* pSizes = m_pSizes;
+	m_pSizes = rLogIndex.m_pSizes;
+	rLogIndex.m_pSizes = pSizes;
+	PBYTE pLevels = m_pLevels;
+	m_pLevels = rLogIndex.m_pLevels;
+	rLogIndex.m_pLevels = pLevels;
+	DWORD dwCapacity = m_dwCapacity;
+	m_dwCapacity = rLogIndex.m_dwCapacity;
+	rLogIndex.m_dwCapacity = dwCapacity;
+	DWORD dwHead = m_dwHead;
+	m_dwHead = rLogIndex.m_dwHead;
+	rLogIndex.m_dwHead = dwHead;
+	DWORD dwCount = m_dwCount;
+	m_dwCount = rLogIndex.m_dwCount;
+	rLogIndex.m_dwCount = dwCount;
+	BOOL bValid = m_bValid;
+	m_bValid = rLogIndex.m_bValid;
+	rLogIndex.m_bValid = bValid;
+}
+
+/**
+ * @brief Parse fixed number of decimal digits.
+ * @param pchText - text position.
+ * @param dwNumDigits - number of digits.
+ * @param rwValue - parsed value.
+ * @return true if all characters are digits.
+ */
+template <class CHAR_TYPE>
+static BOOL ParseDigits(const CHAR_TYPE* pchText, DWORD dwNumDigits, WORD& rwValue)
+{
+	rwValue = 0;
+	for (DWORD dwDigitPos = 0; dwDigitPos < dwNumDigits; ++dwDigitPos)
+	{
+		CHAR_TYPE chDigit = pchText[dwDigitPos];
+		if (chDigit < '0' || chDigit > '9')
+			return FALSE;
+		rwValue = (WORD)(rwValue * 10 + (chDigit - '0'));
+	}
+	return TRUE;
+}
+
+/**
+ * @brief Parse time stamp in "YYYY/MM/DD HH:MM:SS[.ffffff]" format.
+ * @param pchTimeStamp - time stamp text.
+ * @param dwLength - text length.
+ * @param rullTime - local time in 100-nanosecond intervals.
+ * @return true if time stamp was parsed.
+ */
+template <class CHAR_TYPE>
+static BOOL ParseTimeStampT(const CHAR_TYPE* pchTimeStamp, DWORD dwLength, ULONGLONG& rullTime)
+{
+	static const char szPattern[] = "0000/00/00 00:00:00";
+	const DWORD dwPatternLength = countof(szPattern) - 1;
+	if (dwLength != dwPatternLength && (dwLength != dwPatternLength + 7 || pchTimeStamp[dwPatternLength] != '.'))
+		return FALSE;
+	for (DWORD dwCharPos = 0; dwCharPos < dwPatternLength; ++dwCharPos)
+	{
+		if (szPattern[dwCharPos] != '0' && pchTimeStamp[dwCharPos] != szPattern[dwCharPos])
+			return FALSE;
+	}
+	SYSTEMTIME st;
+	ZeroMemory(&st, sizeof(st));
+	if (! ParseDigits(pchTimeStamp, 4, st.wYear) ||
+		! ParseDigits(pchTimeStamp + 5, 2, st.wMonth) ||
+		! ParseDigits(pchTimeStamp + 8, 2, st.wDay) ||
+		! ParseDigits(pchTimeStamp + 11, 2, st.wHour) ||
+		! ParseDigits(pchTimeStamp + 14, 2, st.wMinute) ||
+		! ParseDigits(pchTimeStamp + 17, 2, st.wSecond))
+	{
+		return FALSE;
+	}
+	FILETIME ftTime;
+	if (! SystemTimeToFileTime(&st, &ftTime))
+		return FALSE;
+	ULONGLONG ullTime = ((ULONGLONG)ftTime.dwHighDateTime << 32) | ftTime.dwLowDateTime;
+	if (dwLength > dwPatternLength)
+	{
+		WORD wHighDigits, wLowDigits;
+		if (! ParseDigits(pchTimeStamp + dwPatternLength + 1, 3, wHighDigits) ||
+			! ParseDigits(pchTimeStamp + dwPatternLength + 4, 3, wLowDigits))
+		{
+			return FALSE;
+		}
+		ullTime += ((ULONGLONG)wHighDigits * 1000 + wLowDigits) * 10;
+	}
+	rullTime = ullTime;
+	return TRUE;
+}
+
+/**
+ * @param pchTimeStamp - time stamp text.
+ * @param dwLength - text length.
+ * @param rullTime - local time in 100-nanosecond intervals.
+ * @return true if time stamp was parsed.
+ */
+BOOL CLogIndex::ParseTimeStamp(const CHAR* pchTimeStamp, DWORD dwLength, ULONGLONG& rullTime)
+{
+	return ParseTimeStampT(pchTimeStamp, dwLength, rullTime);
+}
+
+/**
+ * @param pchTimeStamp - time stamp text.
+ * @param dwLength - text length.
+ * @param rullTime - local time in 100-nanosecond intervals.
+ * @return true if time stamp was parsed.
+ */
+BOOL CLogIndex::ParseTimeStamp(const WCHAR* pchTimeStamp, DWORD dwLength, ULONGLONG& rullTime)
+{
+	return ParseTimeStampT(pchTimeStamp, dwLength, rullTime);
+}
+
+/**
+ * @param pchLine - line text encoded in UTF-8.
+ * @param dwLength - line length in bytes.
+ * @param reLogLevel - log level or BTLL_NONE if line has no level prefix.
+ * @param rullTime - entry time or 0 if line has no time stamp.
+ */
+void CLogIndex::ParseEntryPrefix(const CHAR* pchLine, DWORD dwLength, BUGTRAP_LOGLEVEL& reLogLevel, ULONGLONG& rullTime)
+{
+	// Prefix is written by CLogFile::FillEntryPrefix(): "[time stamp] LEVEL: ".
+	static const struct
+	{
+		PCSTR m_pszPrefix;
+		DWORD m_dwLength;
+		BUGTRAP_LOGLEVEL m_eLogLevel;
+	}
+	arrLogLevels[] =
+	{
+		{ "ERROR: ",     sizeof("ERROR: ") - 1,     BTLL_ERROR },
+		{ "WARNING: ",   sizeof("WARNING: ") - 1,   BTLL_WARNING },
+		{ "IMPORTANT: ", sizeof("IMPORTANT: ") - 1, BTLL_IMPORTANT },
+		{ "INFO: ",      sizeof("INFO: ") - 1,      BTLL_INFO },
+		{ "VERBOSE: ",   sizeof("VERBOSE: ") - 1,   BTLL_VERBOSE }
+	};
+	reLogLevel = BTLL_NONE;
+	rullTime = 0;
+	if (dwLength > 0 && *pchLine == '[')
+	{
+		const CHAR* pchEnd = (const CHAR*)memchr(pchLine, ']', dwLength);
+		if (pchEnd != NULL && pchEnd + 1 < pchLine + dwLength && pchEnd[1] == ' ' &&
+			ParseTimeStamp(pchLine + 1, (DWORD)(pchEnd - pchLine - 1), rullTime))
+		{
+			dwLength -= (DWORD)(pchEnd + 2 - pchLine);
+			pchLine = pchEnd + 2;
+		}
+	}
+	for (int iLevelPos = 0; iLevelPos < countof(arrLogLevels); ++iLevelPos)
+	{
+		DWORD dwPrefixLength = arrLogLevels[iLevelPos].m_dwLength;
+		if (dwLength >= dwPrefixLength && memcmp(pchLine, arrLogLevels[iLevelPos].m_pszPrefix, dwPrefixLength) == 0)
+		{
+			reLogLevel = arrLogLevels[iLevelPos].m_eLogLevel;
+			break;
+		}
+	}
+}
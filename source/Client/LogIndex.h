@@ -0,0 +1,218 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Side index of in-memory log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "BugTrap.h"
+
+/**
+ * @brief Filter and receiver of log entries passed to BT_QueryLogEntries().
+ */
+struct CLogQuery
+{
+	/// The most severe accepted log level.
+	BUGTRAP_LOGLEVEL m_eMinLogLevel;
+	/// The least severe accepted log level.
+	BUGTRAP_LOGLEVEL m_eMaxLogLevel;
+	/// Time of the oldest accepted entry.
+	ULONGLONG m_ullStartTime;
+	/// Time that follows the newest accepted entry.
+	ULONGLONG m_ullEndTime;
+	/// Maximum number of the newest matching entries.
+	DWORD m_dwMaxEntries;
+	/// Function that receives matching entries.
+	BT_LogEntryCallback m_pfnCallback;
+	/// Parameter passed to the callback.
+	INT_PTR m_nQueryParam;
+};
+
+/**
+ * @brief Level, time and size of every log entry kept in parallel arrays.
+ * Records are kept in the same order as log entries and are added and removed
+ * at both ends, so queries scan only few bytes per entry and never touch entry
+ * data until matching entry is found. Size lets the query split compressed blocks.
+ * Index that failed to grow stops tracking entries until it's cleared.
+ */
+class CLogIndex
+{
+public:
+	/// Initialize the object.
+	CLogIndex(void);
+	/// Destroy the object.
+	~CLogIndex(void);
+	/// Return true if index matches log entries.
+	BOOL IsValid(void) const;
+	/// Get number of records.
+	DWORD GetCount(void) const;
+	/// Add record before the first record.
+	void AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, DWORD dwSize);
+	/// Add record after the last record.
+	void AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, DWORD dwSize);
+	/// Remove the first records.
+	void DeleteHead(DWORD dwCount);
+	/// Remove the last records.
+	void DeleteTail(DWORD dwCount);
+	/// Remove all records and start tracking entries again.
+	void Clear(void);
+	/// Stop tracking entries until the index is cleared.
+	void Invalidate(void);
+	/// Exchange contents of two indices.
+	void Swap(CLogIndex& rLogIndex);
+	/// Get log level of the record.
+	BUGTRAP_LOGLEVEL GetLogLevel(DWORD dwPosition) const;
+	/// Get time of the record.
+	ULONGLONG GetTime(DWORD dwPosition) const;
+	/// Get entry size of the record.
+	DWORD GetSize(DWORD dwPosition) const;
+	/// Return true if the record passes query filter.
+	BOOL IsMatching(DWORD dwPosition, const CLogQuery& rLogQuery) const;
+	/// Parse time stamp written by CLogFile::GetTimeStamp().
+	static BOOL ParseTimeStamp(const CHAR* pchTimeStamp, DWORD dwLength, ULONGLONG& rullTime);
+	/// Parse time stamp written by CLogFile::GetTimeStamp().
+	static BOOL ParseTimeStamp(const WCHAR* pchTimeStamp, DWORD dwLength, ULONGLONG& rullTime);
+	/// Get log level and time from the prefix of text line.
+	static void ParseEntryPrefix(const CHAR* pchLine, DWORD dwLength, BUGTRAP_LOGLEVEL& reLogLevel, ULONGLONG& rullTime);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogIndex(const CLogIndex& rLogIndex);
+	/// Protects the class from being accidentally copied.
+	CLogIndex& operator=(const CLogIndex& rLogIndex);
+
+	/// Index parameters.
+	enum
+	{
+		/// Initial number of records, must be a power of 2.
+		INITIAL_CAPACITY = 256
+	};
+
+	/// Get array slot of the record.
+	DWORD GetSlot(DWORD dwPosition) const;
+	/// Make room for one more record.
+	BOOL Grow(void);
+
+	/// Record times.
+	ULONGLONG* m_pTimes;
+	/// Record sizes.
+	DWORD* m_pSizes;
+	/// Record log levels.
+	PBYTE m_pLevels;
+	/// Number of record slots, it's a power of 2.
+	DWORD m_dwCapacity;
+	/// Slot of the first record.
+	DWORD m_dwHead;
+	/// Number of records.
+	DWORD m_dwCount;
+	/// True if index matches log entries.
+	BOOL m_bValid;
+};
+
+inline CLogIndex::CLogIndex(void)
+{
+	m_pTimes = NULL;
+	m_pSizes = NULL;
+	m_pLevels = NULL;
+	m_dwCapacity = 0;
+	m_dwHead = 0;
+	m_dwCount = 0;
+	m_bValid = TRUE;
+}
+
+inline CLogIndex::~CLogIndex(void)
+{
+	// Arrays share one memory block.
+	delete[] (PBYTE)m_pTimes;
+}
+
+/**
+ * @return true if index matches log entries.
+ */
+inline BOOL CLogIndex::IsValid(void) const
+{
+	return m_bValid;
+}
+
+/**
+ * @return number of records.
+ */
+inline DWORD CLogIndex::GetCount(void) const
+{
+	return m_dwCount;
+}
+
+inline void CLogIndex::Clear(void)
+{
+	m_dwHead = 0;
+	m_dwCount = 0;
+	m_bValid = TRUE;
+}
+
+inline void CLogIndex::Invalidate(void)
+{
+	m_dwHead = 0;
+	m_dwCount = 0;
+	m_bValid = FALSE;
+}
+
+/**
+ * @param dwPosition - record position starting from the first record.
+ * @return array slot of the record.
+ */
+inline DWORD CLogIndex::GetSlot(DWORD dwPosition) const
+{
+	_ASSERTE(dwPosition < m_dwCount);
+	return ((m_dwHead + dwPosition) & (m_dwCapacity - 1));
+}
+
+/**
+ * @param dwPosition - record position starting from the first record.
+ * @return log level of the record.
+ */
+inline BUGTRAP_LOGLEVEL CLogIndex::GetLogLevel(DWORD dwPosition) const
+{
+	return (BUGTRAP_LOGLEVEL)m_pLevels[GetSlot(dwPosition)];
+}
+
+/**
+ * @param dwPosition - record position starting from the first record.
+ * @return time of the record.
+ */
+inline ULONGLONG CLogIndex::GetTime(DWORD dwPosition) const
+{
+	return m_pTimes[GetSlot(dwPosition)];
+}
+
+/**
+ * @param dwPosition - record position starting from the first record.
+ * @return entry size of the record.
+ */
+inline DWORD CLogIndex::GetSize(DWORD dwPosition) const
+{
+	return m_pSizes[GetSlot(dwPosition)];
+}
+
+/**
+ * @param dwPosition - record position starting from the first record.
+ * @param rLogQuery - query filter.
+ * @return true if the record passes query filter.
+ */
+inline BOOL CLogIndex::IsMatching(DWORD dwPosition, const CLogQuery& rLogQuery) const
+{
+	DWORD dwSlot = GetSlot(dwPosition);
+	BYTE bLogLevel = m_pLevels[dwSlot];
+	if (bLogLevel < (BYTE)rLogQuery.m_eMinLogLevel || bLogLevel > (BYTE)rLogQuery.m_eMaxLogLevel)
+		return FALSE;
+	ULONGLONG ullTime = m_pTimes[dwSlot];
+	return (ullTime >= rLogQuery.m_ullStartTime && ullTime < rLogQuery.m_ullEndTime);
+}
@@ -0,0 +1,112 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-thread scratch buffers of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogScratch.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogScratchPool g_LogScratchPool;
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogScratchPool::Initialize(void)
+{
+	_ASSERTE(m_dwTlsIndex == TLS_OUT_OF_INDEXES);
+	m_dwTlsIndex = TlsAlloc();
+	return (m_dwTlsIndex != TLS_OUT_OF_INDEXES);
+}
+
+void CLogScratchPool::Uninitialize(void)
+{
+	if (m_dwTlsIndex == TLS_OUT_OF_INDEXES)
+		return;
+	CLogScratch* pScratch = m_pFirstScratch;
+	while (pScratch != NULL)
+	{
+		CLogScratch* pNextScratch = pScratch->m_pNextScratch;
+		CloseHandle(pScratch->m_hOwnerThread);
+		delete pScratch;
+		pScratch = pNextScratch;
+	}
+	m_pFirstScratch = NULL;
+	TlsFree(m_dwTlsIndex);
+	m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+}
+
+/**
+ * @return scratch buffers of calling thread or NULL.
+ */
+CLogScratch* CLogScratchPool::GetThreadScratch(void)
+{
+	if (m_dwTlsIndex == TLS_OUT_OF_INDEXES)
+		return NULL;
+	DWORD dwLastError = GetLastError();
+	CLogScratch* pScratch = (CLogScratch*)TlsGetValue(m_dwTlsIndex);
+	if (pScratch == NULL)
+	{
+		pScratch = AllocThreadScratch();
+		if (pScratch != NULL)
+			TlsSetValue(m_dwTlsIndex, pScratch);
+	}
+	SetLastError(dwLastError);
+	return pScratch;
+}
+
+/**
+ * @return new or reclaimed scratch object.
+ */
+CLogScratch* CLogScratchPool::AllocThreadScratch(void)
+{
+	HANDLE hCurrentProcess = GetCurrentProcess();
+	HANDLE hOwnerThread;
+	if (! DuplicateHandle(hCurrentProcess, GetCurrentThread(), hCurrentProcess, &hOwnerThread, SYNCHRONIZE, FALSE, 0))
+		return NULL;
+	// Scratch buffers are used only during the call, so buffers of terminated thread are free.
+	CLogScratch* pScratch;
+	for (pScratch = m_pFirstScratch; pScratch != NULL; pScratch = pScratch->m_pNextScratch)
+	{
+		if (InterlockedCompareExchange(&pScratch->m_lReclaimLock, TRUE, FALSE) == FALSE)
+		{
+			BOOL bReclaimed = FALSE;
+			if (WaitForSingleObject(pScratch->m_hOwnerThread, 0) == WAIT_OBJECT_0)
+			{
+				CloseHandle(pScratch->m_hOwnerThread);
+				pScratch->m_hOwnerThread = hOwnerThread;
+				bReclaimed = TRUE;
+			}
+			InterlockedExchange(&pScratch->m_lReclaimLock, FALSE);
+			if (bReclaimed)
+				return pScratch;
+		}
+	}
+	pScratch = new CLogScratch;
+	if (pScratch == NULL)
+	{
+		CloseHandle(hOwnerThread);
+		return NULL;
+	}
+	pScratch->m_hOwnerThread = hOwnerThread;
+	CLogScratch* pNextScratch;
+	do
+	{
+		pNextScratch = m_pFirstScratch;
+		pScratch->m_pNextScratch = pNextScratch;
+	}
+	while (InterlockedCompareExchangePointer((PVOID volatile*)&m_pFirstScratch, pScratch, pNextScratch) != pNextScratch);
+	return pScratch;
+}
@@ -0,0 +1,135 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-thread scratch buffers of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "Buffer.h"
+#include "StrStream.h"
+#include "MemStream.h"
+#include "Encoding.h"
+
+/**
+ * @brief Buffers used to format, prefix and encode log entry.
+ * Every thread owns its own set of buffers, so entry may be prepared
+ * before the log is locked.
+ */
+class CLogScratch
+{
+public:
+	/// Initialize the object.
+	CLogScratch(void);
+
+	/// Pre-allocated buffer for format string.
+	CDynamicBuffer<TCHAR> m_FormatBuffer;
+	/// Pre-allocated buffer for log entry text.
+	CStrStream m_StrStream;
+	/// Pre-allocated buffer for encoded log entry.
+	CMemStream m_MemStream;
+	/// Encoder of log entry text.
+	CUTF8EncStream m_EncStream;
+	/// Cached text of the last time stamp.
+	TCHAR m_szTimeStamp[32];
+	/// Second when the cached time stamp was rendered.
+	ULONGLONG m_ullTimeStampSecond;
+#ifndef _UNICODE
+	/// Pre-allocated buffer for encoded console message.
+	CDynamicBuffer<CHAR> m_ConsoleBufferA;
+	/// Pre-allocated buffer for encoded console message.
+	CDynamicBuffer<WCHAR> m_ConsoleBufferW;
+#endif
+	/// Text of prepared entry or NULL if entry was passed in UTF-8.
+	PCTSTR m_pszEntry;
+	/// UTF-8 entry text used to detect repeated entries or NULL if entry was passed as TCHAR text.
+	const BYTE* m_pbEntryText;
+	/// Size of entry text in bytes.
+	DWORD m_dwEntryTextSize;
+	/// Time of prepared entry.
+	ULONGLONG m_ullTime;
+	/// True if encoded entry is kept in memory stream.
+	BOOL m_bEncoded;
+
+private:
+	friend class CLogScratchPool;
+
+	/// Protects the class from being accidentally copied.
+	CLogScratch(const CLogScratch& rLogScratch);
+	/// Protects the class from being accidentally copied.
+	CLogScratch& operator=(const CLogScratch& rLogScratch);
+
+	/// Next scratch object in the list.
+	CLogScratch* m_pNextScratch;
+	/// Owner thread handle.
+	HANDLE m_hOwnerThread;
+	/// Non-zero while scratch object is being reclaimed.
+	volatile LONG m_lReclaimLock;
+};
+
+inline CLogScratch::CLogScratch(void) : m_StrStream(1024), m_MemStream(1024), m_EncStream(&m_MemStream)
+{
+	*m_szTimeStamp = _T('\0');
+	m_ullTimeStampSecond = (ULONGLONG)-1;
+	m_pszEntry = NULL;
+	m_pbEntryText = NULL;
+	m_dwEntryTextSize = 0;
+	m_ullTime = 0;
+	m_bEncoded = FALSE;
+	m_pNextScratch = NULL;
+	m_hOwnerThread = NULL;
+	m_lReclaimLock = FALSE;
+}
+
+/**
+ * @brief Pool of per-thread scratch buffers.
+ */
+class CLogScratchPool
+{
+public:
+	/// Initialize the object.
+	CLogScratchPool(void);
+	/// Destroy the object.
+	~CLogScratchPool(void);
+	/// Allocate system resources.
+	BOOL Initialize(void);
+	/// Free system resources.
+	void Uninitialize(void);
+	/// Get scratch buffers of calling thread.
+	CLogScratch* GetThreadScratch(void);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogScratchPool(const CLogScratchPool& rLogScratchPool);
+	/// Protects the class from being accidentally copied.
+	CLogScratchPool& operator=(const CLogScratchPool& rLogScratchPool);
+	/// Allocate or reclaim scratch buffers for calling thread.
+	CLogScratch* AllocThreadScratch(void);
+
+	/// List of per-thread scratch objects.
+	CLogScratch* volatile m_pFirstScratch;
+	/// TLS slot that keeps scratch object of the current thread.
+	DWORD m_dwTlsIndex;
+};
+
+inline CLogScratchPool::CLogScratchPool(void)
+{
+	m_pFirstScratch = NULL;
+	m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+}
+
+inline CLogScratchPool::~CLogScratchPool(void)
+{
+	Uninitialize();
+}
+
+/// Per-thread scratch buffers of log entries.
+extern CLogScratchPool g_LogScratchPool;
@@ -0,0 +1,459 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-thread staging of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogStaging.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogStaging::CLogStaging(void)
+{
+	m_pFirstBuffer = NULL;
+	m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+	m_pcsConsoleAccess = NULL;
+	m_hDrainEvent = NULL;
+	m_hDrainThread = NULL;
+	m_uDrainThreadID = 0;
+	m_lThreadStarted = FALSE;
+	m_lStopped = FALSE;
+	m_bInitialized = FALSE;
+}
+
+CLogStaging::~CLogStaging(void)
+{
+	Uninitialize();
+}
+
+/**
+ * @param pcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStaging::Initialize(CRITICAL_SECTION* pcsConsoleAccess)
+{
+	_ASSERTE(! m_bInitialized);
+	m_dwTlsIndex = TlsAlloc();
+	if (m_dwTlsIndex == TLS_OUT_OF_INDEXES)
+		return FALSE;
+	m_hDrainEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // non-signaled auto-reset event
+	if (m_hDrainEvent == NULL)
+	{
+		TlsFree(m_dwTlsIndex);
+		m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+		return FALSE;
+	}
+	InitializeCriticalSection(&m_csDrain);
+	m_pcsConsoleAccess = pcsConsoleAccess;
+	m_lThreadStarted = FALSE;
+	m_lStopped = FALSE;
+	m_bInitialized = TRUE;
+	return TRUE;
+}
+
+void CLogStaging::Uninitialize(void)
+{
+	if (! m_bInitialized)
+		return;
+	Stop(FALSE);
+	CThreadBuffer* pBuffer = m_pFirstBuffer;
+	while (pBuffer != NULL)
+	{
+		CThreadBuffer* pNextBuffer = pBuffer->m_pNextBuffer;
+		CloseHandle(pBuffer->m_hOwnerThread);
+		delete[] pBuffer->m_pbData;
+		delete pBuffer;
+		pBuffer = pNextBuffer;
+	}
+	m_pFirstBuffer = NULL;
+	if (m_hDrainThread != NULL)
+	{
+		CloseHandle(m_hDrainThread);
+		m_hDrainThread = NULL;
+	}
+	CloseHandle(m_hDrainEvent);
+	m_hDrainEvent = NULL;
+	TlsFree(m_dwTlsIndex);
+	m_dwTlsIndex = TLS_OUT_OF_INDEXES;
+	DeleteCriticalSection(&m_csDrain);
+	m_pcsConsoleAccess = NULL;
+	m_bInitialized = FALSE;
+}
+
+/**
+ * @param pParam - staging object.
+ * @return thread exit code.
+ */
+UINT CALLBACK CLogStaging::DrainThreadProc(PVOID pParam)
+{
+	CLogStaging* pThis = (CLogStaging*)pParam;
+	while (! pThis->m_lStopped)
+	{
+		WaitForSingleObject(pThis->m_hDrainEvent, DRAIN_INTERVAL);
+		pThis->Drain();
+	}
+	return 0;
+}
+
+void CLogStaging::StartDrainThread(void)
+{
+	if (m_lThreadStarted || InterlockedExchange(&m_lThreadStarted, TRUE))
+		return;
+	PinLibraryInMemory();
+	m_hDrainThread = (HANDLE)_beginthreadex(NULL, 0, DrainThreadProc, this, 0, &m_uDrainThreadID);
+}
+
+/**
+ * @return buffer assigned to calling thread.
+ */
+CLogStaging::CThreadBuffer* CLogStaging::GetThreadBuffer(void)
+{
+	DWORD dwLastError = GetLastError();
+	CThreadBuffer* pBuffer = (CThreadBuffer*)TlsGetValue(m_dwTlsIndex);
+	if (pBuffer == NULL)
+	{
+		pBuffer = AllocThreadBuffer();
+		if (pBuffer != NULL)
+			TlsSetValue(m_dwTlsIndex, pBuffer);
+	}
+	SetLastError(dwLastError);
+	return pBuffer;
+}
+
+/**
+ * @return new or reclaimed buffer.
+ */
+CLogStaging::CThreadBuffer* CLogStaging::AllocThreadBuffer(void)
+{
+	HANDLE hCurrentProcess = GetCurrentProcess();
+	HANDLE hOwnerThread;
+	if (! DuplicateHandle(hCurrentProcess, GetCurrentThread(), hCurrentProcess, &hOwnerThread, SYNCHRONIZE, FALSE, 0))
+		return NULL;
+	// Reuse empty buffer left by terminated thread.
+	CThreadBuffer* pBuffer;
+	for (pBuffer = m_pFirstBuffer; pBuffer != NULL; pBuffer = pBuffer->m_pNextBuffer)
+	{
+		if (InterlockedCompareExchange(&pBuffer->m_lReclaimLock, TRUE, FALSE) == FALSE)
+		{
+			BOOL bReclaimed = FALSE;
+			if (pBuffer->m_dwReadPos == pBuffer->m_dwWritePos &&
+				WaitForSingleObject(pBuffer->m_hOwnerThread, 0) == WAIT_OBJECT_0)
+			{
+				CloseHandle(pBuffer->m_hOwnerThread);
+				pBuffer->m_hOwnerThread = hOwnerThread;
+				bReclaimed = TRUE;
+			}
+			InterlockedExchange(&pBuffer->m_lReclaimLock, FALSE);
+			if (bReclaimed)
+				return pBuffer;
+		}
+	}
+	pBuffer = new CThreadBuffer;
+	if (pBuffer == NULL)
+		goto error;
+	pBuffer->m_pbData = new BYTE[STAGING_BUFFER_SIZE];
+	if (pBuffer->m_pbData == NULL)
+	{
+		delete pBuffer;
+		goto error;
+	}
+	pBuffer->m_hOwnerThread = hOwnerThread;
+	pBuffer->m_lReclaimLock = FALSE;
+	pBuffer->m_dwWritePos = 0;
+	pBuffer->m_dwReadPos = 0;
+	CThreadBuffer* pNextBuffer;
+	do
+	{
+		pNextBuffer = m_pFirstBuffer;
+		pBuffer->m_pNextBuffer = pNextBuffer;
+	}
+	while (InterlockedCompareExchangePointer((PVOID volatile*)&m_pFirstBuffer, pBuffer, pNextBuffer) != pNextBuffer);
+	return pBuffer;
+
+error:
+	CloseHandle(hOwnerThread);
+	return NULL;
+}
+
+/**
+ * @param pBuffer - buffer of the current thread.
+ * @param pLogFile - target log file.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text.
+ * @param dwEntryLength - length of log entry text.
+ * @return true if entry was staged and false if buffer is full.
+ */
+BOOL CLogStaging::StageEntry(CThreadBuffer* pBuffer, CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry, DWORD dwEntryLength)
+{
+	DWORD dwEntrySize = (DWORD)(offsetof(CStagedEntry, m_szEntry) + (dwEntryLength + 1) * sizeof(TCHAR));
+	dwEntrySize = (dwEntrySize + ENTRY_ALIGNMENT - 1) & ~(ENTRY_ALIGNMENT - 1);
+	_ASSERTE(dwEntrySize <= MAX_ENTRY_SIZE);
+	// Only the owner thread modifies write position.
+	DWORD dwWritePos = pBuffer->m_dwWritePos;
+	DWORD dwUsedSize = dwWritePos - pBuffer->m_dwReadPos;
+	DWORD dwOffset = dwWritePos & (STAGING_BUFFER_SIZE - 1);
+	DWORD dwTailSize = STAGING_BUFFER_SIZE - dwOffset;
+	DWORD dwRequiredSize = dwEntrySize;
+	if (dwTailSize < dwEntrySize)
+		dwRequiredSize += dwTailSize;
+	if (dwUsedSize + dwRequiredSize > STAGING_BUFFER_SIZE)
+	{
+		pLogFile->AddDroppedEntry();
+		SetEvent(m_hDrainEvent);
+		return FALSE;
+	}
+	if (dwTailSize < dwEntrySize)
+	{
+		// Entries never wrap around. Consumer skips tails that can't hold entry header.
+		if (dwTailSize >= GetHeaderSize())
+		{
+			CStagedEntry* pPadding = (CStagedEntry*)(pBuffer->m_pbData + dwOffset);
+			pPadding->m_pLogFile = NULL;
+			pPadding->m_dwSize = dwTailSize;
+		}
+		dwWritePos += dwTailSize;
+		dwOffset = 0;
+	}
+	CStagedEntry* pEntry = (CStagedEntry*)(pBuffer->m_pbData + dwOffset);
+	pEntry->m_pLogFile = pLogFile;
+	pEntry->m_dwSize = dwEntrySize;
+	pEntry->m_eLogLevel = eLogLevel;
+	pEntry->m_eEntryMode = eEntryMode;
+	pEntry->m_ullTime = g_LogClock.GetLocalTime();
+	CopyMemory(pEntry->m_szEntry, pszEntry, (dwEntryLength + 1) * sizeof(TCHAR));
+	// Log can't be deleted until consumer writes the entry.
+	pLogFile->AddStagedEntries(1);
+	// Publish the entry to the consumer.
+	InterlockedExchange((LONG volatile*)&pBuffer->m_dwWritePos, (LONG)(dwWritePos + dwEntrySize));
+	if (dwUsedSize < STAGING_BUFFER_SIZE / 2 && dwUsedSize + dwRequiredSize >= STAGING_BUFFER_SIZE / 2)
+		SetEvent(m_hDrainEvent);
+	return TRUE;
+}
+
+/**
+ * @param pLogFile - target log file.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStaging::WriteEntryDirectly(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry)
+{
+	// Preserve order of entries produced by the current thread.
+	Drain();
+	pLogFile->CaptureObject();
+	BOOL bResult = pLogFile->WriteLogEntry(eLogLevel, eEntryMode, *m_pcsConsoleAccess, pszEntry);
+	pLogFile->ReleaseObject();
+	return bResult;
+}
+
+/**
+ * @param pLogFile - target log file.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStaging::PostEntry(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry)
+{
+	_ASSERTE(m_bInitialized && pLogFile != NULL && pszEntry != NULL);
+	if (eLogLevel > pLogFile->GetMaxLogLevel())
+		return TRUE;
+	CThreadBuffer* pBuffer = m_lStopped ? NULL : GetThreadBuffer();
+	if (pBuffer != NULL)
+	{
+		StartDrainThread();
+		if (m_hDrainThread != NULL)
+		{
+			DWORD dwEntryLength = (DWORD)_tcslen(pszEntry);
+			if (offsetof(CStagedEntry, m_szEntry) + (dwEntryLength + 1) * sizeof(TCHAR) <= MAX_ENTRY_SIZE)
+				return StageEntry(pBuffer, pLogFile, eLogLevel, eEntryMode, pszEntry, dwEntryLength);
+		}
+	}
+	return WriteEntryDirectly(pLogFile, eLogLevel, eEntryMode, pszEntry);
+}
+
+/**
+ * @param pLogFile - target log file.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszFormat - format string.
+ * @param argList - variable argument list.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStaging::PostEntryV(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszFormat, va_list argList)
+{
+	_ASSERTE(m_bInitialized && pLogFile != NULL && pszFormat != NULL);
+	if (eLogLevel > pLogFile->GetMaxLogLevel())
+		return TRUE;
+	CThreadBuffer* pBuffer = m_lStopped ? NULL : GetThreadBuffer();
+	if (pBuffer == NULL)
+	{
+		// Format buffer of log file object is protected by log file lock.
+		Drain();
+		pLogFile->CaptureObject();
+		BOOL bResult = pLogFile->WriteLogEntryV(eLogLevel, eEntryMode, *m_pcsConsoleAccess, pszFormat, argList);
+		pLogFile->ReleaseObject();
+		return bResult;
+	}
+	if (! FormatBufferV(pBuffer->m_FormatBuffer, pszFormat, argList))
+		return FALSE;
+	return PostEntry(pLogFile, eLogLevel, eEntryMode, pBuffer->m_FormatBuffer.GetData());
+}
+
+/**
+ * @param pLogFile - target log file.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStaging::PostEntryUTF8(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCSTR pszEntry, DWORD dwLength)
+{
+	_ASSERTE(m_bInitialized && pLogFile != NULL && pszEntry != NULL);
+	if (eLogLevel > pLogFile->GetMaxLogLevel())
+		return TRUE;
+	CThreadBuffer* pBuffer = m_lStopped ? NULL : GetThreadBuffer();
+	if (pBuffer == NULL)
+	{
+		Drain();
+		pLogFile->CaptureObject();
+		BOOL bResult = pLogFile->WriteLogEntryUTF8(eLogLevel, eEntryMode, *m_pcsConsoleAccess, pszEntry, dwLength);
+		pLogFile->ReleaseObject();
+		return bResult;
+	}
+	if (! CLogFile::DecodeUTF8(pszEntry, dwLength, pBuffer->m_FormatBuffer))
+		return FALSE;
+	return PostEntry(pLogFile, eLogLevel, eEntryMode, pBuffer->m_FormatBuffer.GetData());
+}
+
+/**
+ * @param rFormatBuffer - format buffer.
+ * @param pszFormat - format expression.
+ * @param argList - variable argument list.
+ * @return true if string was formatted.
+ */
+BOOL CLogStaging::FormatBufferV(CDynamicBuffer<TCHAR>& rFormatBuffer, PCTSTR pszFormat, va_list argList)
+{
+	DWORD dwFormatBufferSize = rFormatBuffer.GetSize();
+	if (dwFormatBufferSize == 0)
+	{
+		dwFormatBufferSize = 256;
+		if (! rFormatBuffer.SetSize(dwFormatBufferSize))
+			return FALSE;
+	}
+	for (;;)
+	{
+		int iResult = _vsntprintf_s(rFormatBuffer.GetData(), dwFormatBufferSize, _TRUNCATE, pszFormat, argList);
+		if (iResult >= 0)
+			return TRUE;
+		dwFormatBufferSize *= 2;
+		if (! rFormatBuffer.SetSize(dwFormatBufferSize))
+			return FALSE;
+		_ASSERTE(rFormatBuffer.GetSize() >= dwFormatBufferSize);
+	}
+}
+
+/**
+ * @param pLogFile - captured log file.
+ */
+void CLogStaging::ReportDroppedEntries(CLogFile* pLogFile)
+{
+	DWORD dwNumDroppedEntries = pLogFile->ResetDroppedEntries();
+	if (dwNumDroppedEntries != 0)
+		pLogFile->WriteLogEntryF(BTLL_WARNING, CLogFile::EM_APPEND, *m_pcsConsoleAccess, _T("%lu log entries were dropped due to staging buffer overflow"), dwNumDroppedEntries);
+}
+
+/**
+ * @param pBuffer - drained buffer.
+ */
+void CLogStaging::DrainBuffer(CThreadBuffer* pBuffer)
+{
+	DWORD dwReadPos = pBuffer->m_dwReadPos;
+	DWORD dwWritePos = pBuffer->m_dwWritePos;
+	CLogFile* pCapturedLogFile = NULL;
+	LONG lNumCapturedEntries = 0;
+	while (dwReadPos != dwWritePos)
+	{
+		DWORD dwOffset = dwReadPos & (STAGING_BUFFER_SIZE - 1);
+		DWORD dwTailSize = STAGING_BUFFER_SIZE - dwOffset;
+		if (dwTailSize < GetHeaderSize())
+		{
+			dwReadPos += dwTailSize;
+			continue;
+		}
+		const CStagedEntry* pEntry = (const CStagedEntry*)(pBuffer->m_pbData + dwOffset);
+		CLogFile* pLogFile = pEntry->m_pLogFile;
+		if (pLogFile != NULL)
+		{
+			// Consecutive entries of the same log are written in one batch.
+			if (pCapturedLogFile != pLogFile)
+			{
+				if (pCapturedLogFile != NULL)
+					ReleaseCapturedLogFile(pCapturedLogFile, lNumCapturedEntries);
+				pCapturedLogFile = pLogFile;
+				pCapturedLogFile->CaptureObject();
+				lNumCapturedEntries = 0;
+			}
+			pCapturedLogFile->WriteLogEntry(pEntry->m_eLogLevel, pEntry->m_eEntryMode, *m_pcsConsoleAccess, pEntry->m_szEntry, pEntry->m_ullTime);
+			++lNumCapturedEntries;
+		}
+		dwReadPos += pEntry->m_dwSize;
+		InterlockedExchange((LONG volatile*)&pBuffer->m_dwReadPos, (LONG)dwReadPos);
+	}
+	InterlockedExchange((LONG volatile*)&pBuffer->m_dwReadPos, (LONG)dwReadPos);
+	if (pCapturedLogFile != NULL)
+		ReleaseCapturedLogFile(pCapturedLogFile, lNumCapturedEntries);
+}
+
+/**
+ * @param pLogFile - log file that received batch of staged entries.
+ * @param lNumEntries - number of entries in the batch.
+ */
+void CLogStaging::ReleaseCapturedLogFile(CLogFile* pLogFile, LONG lNumEntries)
+{
+	ReportDroppedEntries(pLogFile);
+	pLogFile->ReleaseObject();
+	// This must be the last access to the log, it may be deleted as soon as the counter drops to 0.
+	pLogFile->RemoveStagedEntries(lNumEntries);
+}
+
+void CLogStaging::Drain(void)
+{
+	if (! m_bInitialized)
+		return;
+	EnterCriticalSection(&m_csDrain);
+	for (CThreadBuffer* pBuffer = m_pFirstBuffer; pBuffer != NULL; pBuffer = pBuffer->m_pNextBuffer)
+		DrainBuffer(pBuffer);
+	LeaveCriticalSection(&m_csDrain);
+}
+
+/**
+ * @param bWaitThread - true if function has to wait for background thread termination.
+ */
+void CLogStaging::Stop(BOOL bWaitThread)
+{
+	if (! m_bInitialized)
+		return;
+	InterlockedExchange(&m_lStopped, TRUE);
+	if (m_hDrainThread != NULL)
+	{
+		SetEvent(m_hDrainEvent);
+		if (bWaitThread && GetCurrentThreadId() != m_uDrainThreadID)
+			WaitForSingleObject(m_hDrainThread, INFINITE);
+	}
+	Drain();
+}
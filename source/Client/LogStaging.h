@@ -0,0 +1,157 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Per-thread staging of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "LogFile.h"
+#include "Buffer.h"
+
+/**
+ * @brief Per-thread lock-free staging of log entries.
+ * Every producer thread owns a single-producer/single-consumer ring buffer.
+ * Entries are copied into the buffer without taking any lock and a single
+ * consumer (background thread or explicit drain request) moves them into
+ * log file objects.
+ */
+class CLogStaging
+{
+public:
+	/// Initialize the object.
+	CLogStaging(void);
+	/// Destroy the object.
+	~CLogStaging(void);
+	/// Allocate system resources.
+	BOOL Initialize(CRITICAL_SECTION* pcsConsoleAccess);
+	/// Free system resources.
+	void Uninitialize(void);
+	/// Stage new log entry.
+	BOOL PostEntry(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry);
+	/// Format and stage new log entry.
+	BOOL PostEntryV(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszFormat, va_list argList);
+	/// Decode and stage new log entry.
+	BOOL PostEntryUTF8(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCSTR pszEntry, DWORD dwLength);
+	/// Move all staged entries to log files.
+	void Drain(void);
+	/// Stop background thread and move remaining entries to log files.
+	void Stop(BOOL bWaitThread);
+
+private:
+	/// Staging parameters.
+	enum
+	{
+		/// Size of per-thread ring buffer (must be power of 2).
+		STAGING_BUFFER_SIZE = 64 * 1024,
+		/// Maximum size of staged entry, larger entries are written synchronously.
+		MAX_ENTRY_SIZE = STAGING_BUFFER_SIZE / 4,
+		/// Period of background drain operation (in milliseconds).
+		DRAIN_INTERVAL = 50,
+		/// Alignment of staged entries.
+		ENTRY_ALIGNMENT = 8
+	};
+
+#pragma warning(push)
+#pragma warning(disable : 4200) // nonstandard extension used : zero-sized array in struct/union
+	/// Staged log entry.
+	struct CStagedEntry
+	{
+		/// Target log file or NULL for padding entry.
+		CLogFile* m_pLogFile;
+		/// Total entry size in bytes (including header).
+		DWORD m_dwSize;
+		/// Log level.
+		BUGTRAP_LOGLEVEL m_eLogLevel;
+		/// Entry mode.
+		CLogFile::ENTRY_MODE m_eEntryMode;
+		/// Entry time.
+		ULONGLONG m_ullTime;
+		/// Entry text.
+		TCHAR m_szEntry[0];
+	};
+#pragma warning(pop)
+
+	/// Ring buffer owned by single producer thread.
+	struct CThreadBuffer
+	{
+		/// Next buffer in the list.
+		CThreadBuffer* m_pNextBuffer;
+		/// Owner thread handle.
+		HANDLE m_hOwnerThread;
+		/// Non-zero while buffer is being reclaimed.
+		volatile LONG m_lReclaimLock;
+		/// Position of the next write operation (updated by producer).
+		volatile DWORD m_dwWritePos;
+		/// Position of the next read operation (updated by consumer).
+		volatile DWORD m_dwReadPos;
+		/// Buffer data.
+		BYTE* m_pbData;
+		/// Pre-allocated buffer for format string.
+		CDynamicBuffer<TCHAR> m_FormatBuffer;
+	};
+
+	/// Protects the class from being accidentally copied.
+	CLogStaging(const CLogStaging& rLogStaging);
+	/// Protects the class from being accidentally copied.
+	CLogStaging& operator=(const CLogStaging& rLogStaging);
+	/// Get size of the entry header.
+	static DWORD GetHeaderSize(void);
+	/// Get buffer assigned to calling thread.
+	CThreadBuffer* GetThreadBuffer(void);
+	/// Allocate or reclaim buffer for calling thread.
+	CThreadBuffer* AllocThreadBuffer(void);
+	/// Start background thread on demand.
+	void StartDrainThread(void);
+	/// Copy entry to the ring buffer.
+	BOOL StageEntry(CThreadBuffer* pBuffer, CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry, DWORD dwEntryLength);
+	/// Write entry bypassing staging buffer.
+	BOOL WriteEntryDirectly(CLogFile* pLogFile, BUGTRAP_LOGLEVEL eLogLevel, CLogFile::ENTRY_MODE eEntryMode, PCTSTR pszEntry);
+	/// Move entries of the single buffer to log files.
+	void DrainBuffer(CThreadBuffer* pBuffer);
+	/// Report entries lost due to buffer overflow.
+	void ReportDroppedEntries(CLogFile* pLogFile);
+	/// Unlock log file after batch of staged entries was written.
+	void ReleaseCapturedLogFile(CLogFile* pLogFile, LONG lNumEntries);
+	/// Fill format buffer with formatted string.
+	static BOOL FormatBufferV(CDynamicBuffer<TCHAR>& rFormatBuffer, PCTSTR pszFormat, va_list argList);
+	/// Background thread procedure.
+	static UINT CALLBACK DrainThreadProc(PVOID pParam);
+
+	/// List of per-thread buffers.
+	CThreadBuffer* volatile m_pFirstBuffer;
+	/// TLS slot that keeps buffer of the current thread.
+	DWORD m_dwTlsIndex;
+	/// Serializes consumers.
+	CRITICAL_SECTION m_csDrain;
+	/// Provides synchronous access to the console.
+	CRITICAL_SECTION* m_pcsConsoleAccess;
+	/// Event fired when buffer needs to be drained.
+	HANDLE m_hDrainEvent;
+	/// Background thread handle.
+	HANDLE m_hDrainThread;
+	/// Background thread identifier.
+	UINT m_uDrainThreadID;
+	/// Non-zero once background thread has been started.
+	volatile LONG m_lThreadStarted;
+	/// Non-zero when staging is stopped.
+	volatile LONG m_lStopped;
+	/// True when resources were allocated.
+	BOOL m_bInitialized;
+};
+
+/**
+ * @return size of the entry header.
+ */
+inline DWORD CLogStaging::GetHeaderSize(void)
+{
+	return (offsetof(CStagedEntry, m_szEntry) + ENTRY_ALIGNMENT - 1) & ~(ENTRY_ALIGNMENT - 1);
+}
@@ -16,6 +16,10 @@
 #include "LogStream.h"
 #include "TextFormat.h"
 
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
 /**
  * @return true if operation was completed successfully.
  */
@@ -24,6 +28,20 @@ BOOL CLogStream::LoadEntries(void)
 	_ASSERTE(m_hFile == INVALID_HANDLE_VALUE);
 	if (m_hFile != INVALID_HANDLE_VALUE)
 		return FALSE;
+	m_dwSegmentNumber = FindLastSegmentNumber();
+	if (! OpenSegment())
+	{
+		Close();
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::OpenSegment(void)
+{
 	PCTSTR pszLogFileName = GetLogFileName();
 	m_hFile = CreateFile(pszLogFileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (m_hFile == INVALID_HANDLE_VALUE)
@@ -34,16 +52,20 @@ BOOL CLogStream::LoadEntries(void)
 		DWORD dwWritten;
 		if (! WriteFile(m_hFile, g_arrUTF8Preamble, sizeof(g_arrUTF8Preamble), &dwWritten, NULL))
 			goto error;
+		dwFileSize = sizeof(g_arrUTF8Preamble);
 	}
 	else
 	{
 		if (SetFilePointer(m_hFile, 0, NULL, FILE_END) == INVALID_SET_FILE_POINTER)
 			goto error;
 	}
+	m_dwSegmentLength = dwFileSize;
+	m_ullSegmentStartTime = g_LogClock.GetLocalTime();
 	return TRUE;
 
 error:
-	Close();
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
 	return FALSE;
 }
 
@@ -55,15 +77,28 @@ BOOL CLogStream::ClearEntries(void)
 	_ASSERTE(m_hFile != INVALID_HANDLE_VALUE);
 	if (m_hFile == INVALID_HANDLE_VALUE)
 		return FALSE;
+	BOOL bResult = FALSE;
+	EnterCriticalSection(&m_csWrite);
+	EnterCriticalSection(&m_csQueue);
+	m_dwActiveLength = 0;
+	LeaveCriticalSection(&m_csQueue);
 	if (SetFilePointer(m_hFile, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
-		return FALSE;
+		goto end;
 	if (! SetEndOfFile(m_hFile))
-		return FALSE;
-	return TRUE;
+		goto end;
+	m_dwSegmentLength = 0;
+	m_ullSegmentStartTime = g_LogClock.GetLocalTime();
+	bResult = TRUE;
+
+end:
+	LeaveCriticalSection(&m_csWrite);
+	return bResult;
 }
 
 void CLogStream::Close(void)
 {
+	StopWriterThread();
+	StopCompressorThread();
 	if (m_hFile != INVALID_HANDLE_VALUE)
 	{
 		CloseHandle(m_hFile);
@@ -76,9 +111,10 @@ void CLogStream::Close(void)
  * @param eEntryMode - entry mode.
  * @param rcsConsoleAccess - provides synchronous access to the console.
  * @param pszEntry - log entry text.
+ * @param ullTime - entry time or 0 for the current time.
  * @return true if operation was completed successfully.
  */
-BOOL CLogStream::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry)
+BOOL CLogStream::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime)
 {
 	_ASSERTE(m_hFile != INVALID_HANDLE_VALUE);
 	if (m_hFile == INVALID_HANDLE_VALUE)
@@ -86,21 +122,532 @@ BOOL CLogStream::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode
 	_ASSERTE(eEntryMode == EM_APPEND);
 	if (eEntryMode != EM_APPEND)
 		return FALSE;
-	BUGTRAP_LOGLEVEL eLogFileLevel = GetLogLevel();
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
 	if (eLogLevel <= eLogFileLevel)
 	{
-		SYSTEMTIME st;
-		GetLocalTime(&st);
-		if (! WriteLogEntryToConsole(eLogLevel, &st, rcsConsoleAccess, pszEntry))
-			FillEntryText(eLogLevel, &st, pszEntry);
+		if (ullTime == 0)
+			ullTime = g_LogClock.GetLocalTime();
+		WriteDroppedEntriesWarning(ullTime);
+		if (! WriteLogEntryToConsole(eLogLevel, ullTime, rcsConsoleAccess, pszEntry))
+			FillEntryText(eLogLevel, ullTime, pszEntry);
 		EncodeEntryText();
-		const BYTE* pBuffer = m_MemStream.GetBuffer();
-		if (pBuffer == NULL)
+		return WriteEntryData();
+	}
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength)
+{
+	_ASSERTE(m_hFile != INVALID_HANDLE_VALUE);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	_ASSERTE(eEntryMode == EM_APPEND);
+	if (eEntryMode != EM_APPEND)
+		return FALSE;
+	// Console echo needs decoded entry text.
+	if (GetLogEchoMode() != BTLE_NONE)
+		return CLogFile::WriteLogEntryUTF8(eLogLevel, eEntryMode, rcsConsoleAccess, pszEntry, dwLength);
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel <= eLogFileLevel)
+	{
+		ULONGLONG ullTime = g_LogClock.GetLocalTime();
+		WriteDroppedEntriesWarning(ullTime);
+		FillEntryPrefix(eLogLevel, ullTime);
+		EncodeEntryText(pszEntry, dwLength);
+		return WriteEntryData();
+	}
+	return TRUE;
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess)
+{
+	if (! rScratch.m_bEncoded)
+		return CLogFile::WritePreparedEntry(rScratch, eLogLevel, eEntryMode, rcsConsoleAccess);
+	_ASSERTE(m_hFile != INVALID_HANDLE_VALUE);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	_ASSERTE(eEntryMode == EM_APPEND);
+	if (eEntryMode != EM_APPEND)
+		return FALSE;
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel <= eLogFileLevel)
+	{
+		WriteDroppedEntriesWarning(rScratch.m_ullTime);
+		const BYTE* pBuffer = rScratch.m_MemStream.GetBuffer();
+		if (pBuffer == NULL || ! WriteEntryData(pBuffer, (DWORD)rScratch.m_MemStream.GetLength()))
 			return FALSE;
-		DWORD dwLength = (DWORD)m_MemStream.GetLength();
-		_ASSERTE(dwLength > 0);
+		EchoPreparedEntry(rScratch, eLogLevel, rcsConsoleAccess);
+	}
+	return TRUE;
+}
+
+/**
+ * @param ullTime - entry time.
+ */
+void CLogStream::WriteDroppedEntriesWarning(ULONGLONG ullTime)
+{
+	if ((GetLogFlags() & BTLF_ASYNCWRITES) == 0)
+		return;
+	DWORD dwNumDroppedEntries = ResetDroppedEntries();
+	if (dwNumDroppedEntries != 0)
+	{
+		TCHAR szWarning[128];
+		_stprintf_s(szWarning, countof(szWarning), _T("%lu log entries were dropped due to write queue overflow"), dwNumDroppedEntries);
+		FillEntryText(BTLL_WARNING, ullTime, szWarning);
+		EncodeEntryText();
+		WriteEntryData();
+	}
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::WriteEntryData(void)
+{
+	const BYTE* pBuffer = m_MemStream.GetBuffer();
+	if (pBuffer == NULL)
+		return FALSE;
+	return WriteEntryData(pBuffer, (DWORD)m_MemStream.GetLength());
+}
+
+/**
+ * @param pBuffer - encoded entry data.
+ * @param dwLength - data length in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::WriteEntryData(const BYTE* pBuffer, DWORD dwLength)
+{
+	_ASSERTE(dwLength > 0);
+	if (IsSegmentFull(dwLength) && ! RotateSegment())
+		return FALSE;
+	m_dwSegmentLength += dwLength;
+	if ((GetLogFlags() & BTLF_ASYNCWRITES) && StartWriterThread())
+		return QueueEntryData(pBuffer, dwLength);
+	// Entries queued before async mode was turned off must precede this entry.
+	if (m_pActiveBlock != NULL)
+		WriteQueuedData();
+	DWORD dwWritten;
+	return WriteFile(m_hFile, pBuffer, dwLength, &dwWritten, NULL);
+}
+
+/**
+ * @param pBuffer - encoded entry data.
+ * @param dwLength - data length.
+ * @return true if entry was queued or written.
+ */
+BOOL CLogStream::QueueEntryData(const BYTE* pBuffer, DWORD dwLength)
+{
+	DWORD dwBlockSize = m_dwBufferSize / 2;
+	if (dwLength > dwBlockSize)
+	{
+		WriteQueuedData();
 		DWORD dwWritten;
 		return WriteFile(m_hFile, pBuffer, dwLength, &dwWritten, NULL);
 	}
+	// Active block is filled only under log file lock, so there is no other writer here.
+	EnterCriticalSection(&m_csQueue);
+	if (m_dwActiveLength + dwLength > dwBlockSize)
+	{
+		LeaveCriticalSection(&m_csQueue);
+		if (GetLogFlags() & BTLF_DROPONOVERFLOW)
+		{
+			AddDroppedEntry();
+			SetEvent(m_hDataEvent);
+			return FALSE;
+		}
+		// Block until both blocks are written.
+		if (! WriteQueuedData())
+			return FALSE;
+		EnterCriticalSection(&m_csQueue);
+	}
+	CopyMemory(m_pActiveBlock + m_dwActiveLength, pBuffer, dwLength);
+	m_dwActiveLength += dwLength;
+	BOOL bWakeWriter = m_dwActiveLength >= dwBlockSize / 2;
+	LeaveCriticalSection(&m_csQueue);
+	if (bWakeWriter)
+		SetEvent(m_hDataEvent);
+	return TRUE;
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::WriteQueuedData(void)
+{
+	BOOL bResult = TRUE;
+	EnterCriticalSection(&m_csWrite);
+	EnterCriticalSection(&m_csQueue);
+	BYTE* pBlock = m_pActiveBlock;
+	DWORD dwLength = m_dwActiveLength;
+	m_pActiveBlock = m_pWriteBlock;
+	m_pWriteBlock = pBlock;
+	m_dwActiveLength = 0;
+	LeaveCriticalSection(&m_csQueue);
+	if (dwLength > 0 && m_hFile != INVALID_HANDLE_VALUE)
+	{
+		DWORD dwWritten;
+		bResult = WriteFile(m_hFile, pBlock, dwLength, &dwWritten, NULL);
+	}
+	LeaveCriticalSection(&m_csWrite);
+	return bResult;
+}
+
+/**
+ * @param pParam - log stream object.
+ * @return thread exit code.
+ */
+UINT CALLBACK CLogStream::WriterThreadProc(PVOID pParam)
+{
+	CLogStream* pThis = (CLogStream*)pParam;
+	while (! pThis->m_lStopWriter)
+	{
+		WaitForSingleObject(pThis->m_hDataEvent, FLUSH_INTERVAL);
+		pThis->WriteQueuedData();
+	}
+	return 0;
+}
+
+/**
+ * @return true if background writer is running.
+ */
+BOOL CLogStream::StartWriterThread(void)
+{
+	if (m_hWriterThread != NULL)
+		return TRUE;
+	if (m_pActiveBlock == NULL)
+	{
+		DWORD dwBlockSize = m_dwBufferSize / 2;
+		m_pActiveBlock = new BYTE[dwBlockSize];
+		m_pWriteBlock = new BYTE[dwBlockSize];
+		if (m_pActiveBlock == NULL || m_pWriteBlock == NULL)
+			goto error;
+		m_dwActiveLength = 0;
+	}
+	if (m_hDataEvent == NULL)
+	{
+		m_hDataEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // non-signaled auto-reset event
+		if (m_hDataEvent == NULL)
+			goto error;
+	}
+	PinLibraryInMemory();
+	m_lStopWriter = FALSE;
+	m_hWriterThread = (HANDLE)_beginthreadex(NULL, 0, WriterThreadProc, this, 0, &m_uWriterThreadID);
+	if (m_hWriterThread == NULL)
+		goto error;
 	return TRUE;
+
+error:
+	StopWriterThread();
+	return FALSE;
+}
+
+void CLogStream::StopWriterThread(void)
+{
+	if (m_hWriterThread != NULL)
+	{
+		InterlockedExchange(&m_lStopWriter, TRUE);
+		SetEvent(m_hDataEvent);
+		// Crash handler may be invoked by background writer itself.
+		if (GetCurrentThreadId() != m_uWriterThreadID)
+			WaitForSingleObject(m_hWriterThread, INFINITE);
+		CloseHandle(m_hWriterThread);
+		m_hWriterThread = NULL;
+	}
+	WriteQueuedData();
+	if (m_hDataEvent != NULL)
+	{
+		CloseHandle(m_hDataEvent);
+		m_hDataEvent = NULL;
+	}
+	delete[] m_pActiveBlock;
+	m_pActiveBlock = NULL;
+	delete[] m_pWriteBlock;
+	m_pWriteBlock = NULL;
+	m_dwActiveLength = 0;
+}
+
+/**
+ * @param dwLogBufferSize - size of write queue in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::SetLogBufferSize(DWORD dwLogBufferSize)
+{
+	if (dwLogBufferSize < MIN_BUFFER_SIZE)
+		return FALSE;
+	// Write queue is re-allocated on the next asynchronous write.
+	StopWriterThread();
+	m_dwBufferSize = dwLogBufferSize;
+	return TRUE;
+}
+
+/**
+ * @param dwLength - length of new data.
+ * @return true if active segment has to be closed.
+ */
+BOOL CLogStream::IsSegmentFull(DWORD dwLength) const
+{
+	// Segment always keeps at least one entry.
+	if (m_dwSegmentLength <= sizeof(g_arrUTF8Preamble))
+		return FALSE;
+	if (m_dwSegmentLength >= m_dwSegmentSize || dwLength > m_dwSegmentSize - m_dwSegmentLength)
+		return TRUE;
+	if (m_dwSegmentTime != 0)
+	{
+		ULONGLONG ullSegmentAge = g_LogClock.GetLocalTime() - m_ullSegmentStartTime;
+		if (ullSegmentAge >= (ULONGLONG)m_dwSegmentTime * 60 * CLogClock::TICKS_PER_SECOND)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogStream::RotateSegment(void)
+{
+	EnterCriticalSection(&m_csWrite);
+	// Queued entries belong to the closed segment.
+	WriteQueuedData();
+	CloseHandle(m_hFile);
+	m_hFile = INVALID_HANDLE_VALUE;
+	PCTSTR pszLogFileName = GetLogFileName();
+	TCHAR szSegmentFileName[MAX_PATH];
+	GetLogSegmentFileName(szSegmentFileName, pszLogFileName, m_dwSegmentNumber + 1);
+	BOOL bRotated = MoveFileEx(pszLogFileName, szSegmentFileName, MOVEFILE_REPLACE_EXISTING);
+	if (bRotated)
+		++m_dwSegmentNumber;
+	// Keep writing to the same file if it can't be renamed.
+	BOOL bResult = OpenSegment();
+	// Segment budget starts over, so renaming is retried when the file grows by
+	// another segment or the next interval elapses rather than on every entry.
+	if (bResult && ! bRotated)
+		m_dwSegmentLength = sizeof(g_arrUTF8Preamble);
+	LeaveCriticalSection(&m_csWrite);
+	if (bRotated && StartCompressorThread())
+		SetEvent(m_hSegmentEvent);
+	return bResult;
+}
+
+/**
+ * @return number of the last closed segment or 0 if there are no segments.
+ */
+DWORD CLogStream::FindLastSegmentNumber(void)
+{
+	DWORD dwLastSegmentNumber = 0;
+	PCTSTR pszLogFileName = GetLogFileName();
+	TCHAR szFindFileTemplate[MAX_PATH];
+	GetLogSegmentTemplate(szFindFileTemplate, pszLogFileName);
+	WIN32_FIND_DATA FindData;
+	HANDLE hFindFile = FindFirstFile(szFindFileTemplate, &FindData);
+	if (hFindFile != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			DWORD dwSegmentNumber;
+			BOOL bCompressed;
+			if (ParseLogSegmentFileName(FindData.cFileName, pszLogFileName, dwSegmentNumber, bCompressed) &&
+				dwLastSegmentNumber < dwSegmentNumber)
+			{
+				dwLastSegmentNumber = dwSegmentNumber;
+			}
+		}
+		while (FindNextFile(hFindFile, &FindData));
+		FindClose(hFindFile);
+	}
+	return dwLastSegmentNumber;
+}
+
+void CLogStream::ProcessSegments(void)
+{
+	PCTSTR pszLogFileName = GetLogFileName();
+	DWORD dwLastSegmentNumber = m_dwSegmentNumber;
+	DWORD dwSegmentCount = m_dwSegmentCount;
+	TCHAR szFolderPath[MAX_PATH];
+	_tcscpy_s(szFolderPath, countof(szFolderPath), pszLogFileName);
+	PathRemoveFileSpec(szFolderPath);
+	TCHAR szFindFileTemplate[MAX_PATH];
+	GetLogSegmentTemplate(szFindFileTemplate, pszLogFileName);
+	WIN32_FIND_DATA FindData;
+	HANDLE hFindFile = FindFirstFile(szFindFileTemplate, &FindData);
+	if (hFindFile == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		if (m_lStopCompressor)
+			break;
+		DWORD dwSegmentNumber;
+		BOOL bCompressed;
+		if (! ParseLogSegmentFileName(FindData.cFileName, pszLogFileName, dwSegmentNumber, bCompressed))
+			continue;
+		TCHAR szSegmentFileName[MAX_PATH];
+		PathCombine(szSegmentFileName, szFolderPath, FindData.cFileName);
+		// Segments are numbered sequentially, so only the newest ones are kept.
+		if (dwSegmentCount != 0 && dwSegmentNumber + dwSegmentCount <= dwLastSegmentNumber)
+			DeleteFile(szSegmentFileName);
+		else if (! bCompressed)
+			CompressSegment(szSegmentFileName);
+	}
+	while (FindNextFile(hFindFile, &FindData));
+	FindClose(hFindFile);
+}
+
+/**
+ * @param pszSegmentFileName - segment file name.
+ * @return true if segment was compressed.
+ */
+BOOL CLogStream::CompressSegment(PCTSTR pszSegmentFileName)
+{
+	TCHAR szArchiveFileName[MAX_PATH];
+	_stprintf_s(szArchiveFileName, countof(szArchiveFileName), _T("%s.gz"), pszSegmentFileName);
+	TCHAR szTempFileName[MAX_PATH];
+	_stprintf_s(szTempFileName, countof(szTempFileName), _T("%s.tmp"), szArchiveFileName);
+	HANDLE hSegmentFile = CreateFile(pszSegmentFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hSegmentFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	HANDLE hArchiveFile = CreateFile(szTempFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hArchiveFile == INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(hSegmentFile);
+		return FALSE;
+	}
+	BOOL bResult = FALSE;
+	BOOL bStreamOpened = FALSE;
+	BYTE* pInputBuffer = new BYTE[COMPRESSION_BUFFER_SIZE];
+	BYTE* pOutputBuffer = new BYTE[COMPRESSION_BUFFER_SIZE];
+	uLong ulCrc32 = crc32(0, Z_NULL, 0);
+	DWORD dwSegmentSize = 0;
+	z_stream zStream;
+	ZeroMemory(&zStream, sizeof(zStream));
+	DWORD dwWritten;
+	BYTE arrTrailer[8];
+	int nFlush;
+	if (pInputBuffer == NULL || pOutputBuffer == NULL)
+		goto end;
+	// Raw deflate data is wrapped by gzip header and trailer, so the archiver may store it in zip file as is.
+	if (deflateInit2(&zStream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		goto end;
+	bStreamOpened = TRUE;
+	if (! WriteFile(hArchiveFile, g_arrGZipHeader, sizeof(g_arrGZipHeader), &dwWritten, NULL))
+		goto end;
+	do
+	{
+		if (m_lStopCompressor)
+			goto end;
+		DWORD dwProcessedNumber;
+		if (! ReadFile(hSegmentFile, pInputBuffer, COMPRESSION_BUFFER_SIZE, &dwProcessedNumber, NULL))
+			goto end;
+		ulCrc32 = crc32(ulCrc32, pInputBuffer, dwProcessedNumber);
+		dwSegmentSize += dwProcessedNumber;
+		nFlush = dwProcessedNumber == 0 ? Z_FINISH : Z_NO_FLUSH;
+		zStream.next_in = pInputBuffer;
+		zStream.avail_in = dwProcessedNumber;
+		do
+		{
+			zStream.next_out = pOutputBuffer;
+			zStream.avail_out = COMPRESSION_BUFFER_SIZE;
+			if (deflate(&zStream, nFlush) == Z_STREAM_ERROR)
+				goto end;
+			DWORD dwOutputSize = COMPRESSION_BUFFER_SIZE - zStream.avail_out;
+			if (dwOutputSize > 0 && ! WriteFile(hArchiveFile, pOutputBuffer, dwOutputSize, &dwWritten, NULL))
+				goto end;
+		}
+		while (zStream.avail_out == 0);
+	}
+	while (nFlush != Z_FINISH);
+	// gzip trailer: CRC-32 and size of original data in little-endian order.
+	for (int iByte = 0; iByte < 4; ++iByte)
+	{
+		arrTrailer[iByte] = (BYTE)(ulCrc32 >> (iByte * 8));
+		arrTrailer[iByte + 4] = (BYTE)(dwSegmentSize >> (iByte * 8));
+	}
+	bResult = WriteFile(hArchiveFile, arrTrailer, sizeof(arrTrailer), &dwWritten, NULL);
+
+end:
+	if (bStreamOpened)
+		deflateEnd(&zStream);
+	delete[] pInputBuffer;
+	delete[] pOutputBuffer;
+	CloseHandle(hArchiveFile);
+	CloseHandle(hSegmentFile);
+	if (bResult)
+		bResult = MoveFileEx(szTempFileName, szArchiveFileName, MOVEFILE_REPLACE_EXISTING);
+	if (bResult)
+		DeleteFile(pszSegmentFileName);
+	else
+		DeleteFile(szTempFileName);
+	return bResult;
+}
+
+/**
+ * @param pParam - log stream object.
+ * @return thread exit code.
+ */
+UINT CALLBACK CLogStream::CompressorThreadProc(PVOID pParam)
+{
+	CLogStream* pThis = (CLogStream*)pParam;
+	while (! pThis->m_lStopCompressor)
+	{
+		WaitForSingleObject(pThis->m_hSegmentEvent, INFINITE);
+		if (pThis->m_lStopCompressor)
+			break;
+		pThis->ProcessSegments();
+	}
+	return 0;
+}
+
+/**
+ * @return true if segment compressor is running.
+ */
+BOOL CLogStream::StartCompressorThread(void)
+{
+	if (m_hCompressorThread != NULL)
+		return TRUE;
+	if (m_hSegmentEvent == NULL)
+	{
+		m_hSegmentEvent = CreateEvent(NULL, FALSE, FALSE, NULL); // non-signaled auto-reset event
+		if (m_hSegmentEvent == NULL)
+			return FALSE;
+	}
+	PinLibraryInMemory();
+	m_lStopCompressor = FALSE;
+	UINT uThreadID;
+	m_hCompressorThread = (HANDLE)_beginthreadex(NULL, 0, CompressorThreadProc, this, CREATE_SUSPENDED, &uThreadID);
+	if (m_hCompressorThread == NULL)
+		return FALSE;
+	// Compression must not compete with the application.
+	SetThreadPriority(m_hCompressorThread, THREAD_PRIORITY_BELOW_NORMAL);
+	ResumeThread(m_hCompressorThread);
+	return TRUE;
+}
+
+void CLogStream::StopCompressorThread(void)
+{
+	if (m_hCompressorThread != NULL)
+	{
+		InterlockedExchange(&m_lStopCompressor, TRUE);
+		SetEvent(m_hSegmentEvent);
+		WaitForSingleObject(m_hCompressorThread, INFINITE);
+		CloseHandle(m_hCompressorThread);
+		m_hCompressorThread = NULL;
+	}
+	if (m_hSegmentEvent != NULL)
+	{
+		CloseHandle(m_hSegmentEvent);
+		m_hSegmentEvent = NULL;
+	}
 }
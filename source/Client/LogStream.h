@@ -35,13 +35,35 @@ public:
 	/// Clear log entries.
 	virtual BOOL ClearEntries(void);
 	/// Add new log entry.
-	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry);
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0);
+	/// Add new log entry encoded in UTF-8.
+	virtual BOOL WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength);
+	/// Add log entry prepared before the log was locked.
+	virtual BOOL WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess);
 	/// Close log file.
 	virtual void Close(void);
+	/// Get size of write queue in bytes.
+	virtual DWORD GetLogBufferSize(void) const;
+	/// Set size of write queue in bytes.
+	virtual BOOL SetLogBufferSize(DWORD dwLogBufferSize);
+	/// Get maximum segment size in bytes.
+	virtual DWORD GetLogSizeInBytes(void) const;
+	/// Set maximum segment size in bytes.
+	virtual BOOL SetLogSizeInBytes(DWORD dwLogSizeInBytes);
+	/// Get maximum age of log segment in minutes.
+	virtual DWORD GetLogSegmentTime(void) const;
+	/// Set maximum age of log segment in minutes.
+	virtual BOOL SetLogSegmentTime(DWORD dwLogSegmentTime);
+	/// Get number of kept log segments.
+	virtual DWORD GetLogSegmentCount(void) const;
+	/// Set number of kept log segments.
+	virtual BOOL SetLogSegmentCount(DWORD dwLogSegmentCount);
 
 protected:
 	/// Get default log file extension.
 	virtual PCTSTR GetLogFileExtension(void) const;
+	/// Return true if entries may be rendered and encoded before the log is locked.
+	virtual BOOL CanEncodeEntries(void) const;
 
 private:
 	/// Protects the class from being accidentally copied.
@@ -49,8 +71,59 @@ private:
 	/// Protects the class from being accidentally copied.
 	CLogStream& operator=(const CLogStream& rLogFile);
 
+	/// Write queue parameters.
+	enum
+	{
+		/// Default size of write queue.
+		DEFAULT_BUFFER_SIZE = 128 * 1024,
+		/// Minimal size of write queue.
+		MIN_BUFFER_SIZE = 8 * 1024,
+		/// Period of background write operation (in milliseconds).
+		FLUSH_INTERVAL = 100,
+		/// Default number of kept log segments.
+		DEFAULT_SEGMENT_COUNT = 10,
+		/// Size of buffers used by segment compressor.
+		COMPRESSION_BUFFER_SIZE = 16 * 1024
+	};
+
+	/// Write warning about entries dropped by background writer.
+	void WriteDroppedEntriesWarning(ULONGLONG ullTime);
 	/// Encode entry text.
 	void EncodeEntryText(void);
+	/// Encode entry prefix followed by UTF-8 text.
+	void EncodeEntryText(PCSTR pszEntry, DWORD dwLength);
+	/// Write encoded entry to the file or to the write queue.
+	BOOL WriteEntryData(void);
+	/// Write entry data to the stream.
+	BOOL WriteEntryData(const BYTE* pBuffer, DWORD dwLength);
+	/// Append encoded entry to the write queue.
+	BOOL QueueEntryData(const BYTE* pBuffer, DWORD dwLength);
+	/// Write all queued data to the file.
+	BOOL WriteQueuedData(void);
+	/// Allocate write queue and start background writer.
+	BOOL StartWriterThread(void);
+	/// Stop background writer and release write queue.
+	void StopWriterThread(void);
+	/// Background writer thread procedure.
+	static UINT CALLBACK WriterThreadProc(PVOID pParam);
+	/// Open active segment of the log.
+	BOOL OpenSegment(void);
+	/// Check if active segment has to be closed before writing new data.
+	BOOL IsSegmentFull(DWORD dwLength) const;
+	/// Close active segment and start the new one.
+	BOOL RotateSegment(void);
+	/// Find number of the last closed segment.
+	DWORD FindLastSegmentNumber(void);
+	/// Compress closed segments and delete obsolete ones.
+	void ProcessSegments(void);
+	/// Compress closed segment.
+	BOOL CompressSegment(PCTSTR pszSegmentFileName);
+	/// Start background segment compressor.
+	BOOL StartCompressorThread(void);
+	/// Stop background segment compressor.
+	void StopCompressorThread(void);
+	/// Background segment compressor thread procedure.
+	static UINT CALLBACK CompressorThreadProc(PVOID pParam);
 
 	/// Log file handle.
 	HANDLE m_hFile;
@@ -58,16 +131,75 @@ private:
 	CUTF8EncStream m_EncStream;
 	/// Pre-allocated buffer for encoded log entry text.
 	CMemStream m_MemStream;
+	/// Size of write queue in bytes.
+	DWORD m_dwBufferSize;
+	/// Block filled by log writers.
+	BYTE* m_pActiveBlock;
+	/// Block written by background writer.
+	BYTE* m_pWriteBlock;
+	/// Size of data in active block.
+	DWORD m_dwActiveLength;
+	/// Protects active block.
+	CRITICAL_SECTION m_csQueue;
+	/// Serializes file write operations.
+	CRITICAL_SECTION m_csWrite;
+	/// Event fired when active block has to be written.
+	HANDLE m_hDataEvent;
+	/// Background writer thread handle.
+	HANDLE m_hWriterThread;
+	/// Background writer thread identifier.
+	UINT m_uWriterThreadID;
+	/// Non-zero when background writer has to exit.
+	volatile LONG m_lStopWriter;
+	/// Maximum segment size in bytes.
+	DWORD m_dwSegmentSize;
+	/// Maximum age of log segment in minutes.
+	DWORD m_dwSegmentTime;
+	/// Number of kept log segments.
+	volatile DWORD m_dwSegmentCount;
+	/// Number of the last closed segment.
+	volatile DWORD m_dwSegmentNumber;
+	/// Size of active segment in bytes.
+	DWORD m_dwSegmentLength;
+	/// Time when active segment was started.
+	ULONGLONG m_ullSegmentStartTime;
+	/// Event fired when closed segment has to be compressed.
+	HANDLE m_hSegmentEvent;
+	/// Background segment compressor thread handle.
+	HANDLE m_hCompressorThread;
+	/// Non-zero when segment compressor has to exit.
+	volatile LONG m_lStopCompressor;
 };
 
 inline CLogStream::CLogStream(void) : m_MemStream(1024), m_EncStream(&m_MemStream)
 {
 	m_hFile = INVALID_HANDLE_VALUE;
+	m_dwBufferSize = DEFAULT_BUFFER_SIZE;
+	m_pActiveBlock = NULL;
+	m_pWriteBlock = NULL;
+	m_dwActiveLength = 0;
+	m_hDataEvent = NULL;
+	m_hWriterThread = NULL;
+	m_uWriterThreadID = 0;
+	m_lStopWriter = FALSE;
+	m_dwSegmentSize = MAXDWORD;
+	m_dwSegmentTime = 0;
+	m_dwSegmentCount = DEFAULT_SEGMENT_COUNT;
+	m_dwSegmentNumber = 0;
+	m_dwSegmentLength = 0;
+	m_ullSegmentStartTime = 0;
+	m_hSegmentEvent = NULL;
+	m_hCompressorThread = NULL;
+	m_lStopCompressor = FALSE;
+	InitializeCriticalSection(&m_csQueue);
+	InitializeCriticalSection(&m_csWrite);
 }
 
 inline CLogStream::~CLogStream(void)
 {
 	Close();
+	DeleteCriticalSection(&m_csWrite);
+	DeleteCriticalSection(&m_csQueue);
 }
 
 /**
@@ -76,7 +208,75 @@ inline CLogStream::~CLogStream(void)
  */
 inline BOOL CLogStream::SaveEntries(BOOL /*bCrash*/)
 {
-	return FALSE;
+	// Synchronous stream has nothing to flush and keeps reporting false as before.
+	if (m_pActiveBlock == NULL)
+		return FALSE;
+	// Queued data is written by the calling thread, so nothing is lost on crash.
+	return WriteQueuedData();
+}
+
+/**
+ * @return size of write queue in bytes.
+ */
+inline DWORD CLogStream::GetLogBufferSize(void) const
+{
+	return m_dwBufferSize;
+}
+
+/**
+ * @return maximum segment size in bytes.
+ */
+inline DWORD CLogStream::GetLogSizeInBytes(void) const
+{
+	return m_dwSegmentSize;
+}
+
+/**
+ * @param dwLogSizeInBytes - maximum segment size in bytes; pass MAXDWORD for unlimited log.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogStream::SetLogSizeInBytes(DWORD dwLogSizeInBytes)
+{
+	if (dwLogSizeInBytes == 0)
+		return FALSE;
+	m_dwSegmentSize = dwLogSizeInBytes;
+	return TRUE;
+}
+
+/**
+ * @return maximum age of log segment in minutes.
+ */
+inline DWORD CLogStream::GetLogSegmentTime(void) const
+{
+	return m_dwSegmentTime;
+}
+
+/**
+ * @param dwLogSegmentTime - maximum age of log segment in minutes; pass 0 to disable time based rotation.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogStream::SetLogSegmentTime(DWORD dwLogSegmentTime)
+{
+	m_dwSegmentTime = dwLogSegmentTime;
+	return TRUE;
+}
+
+/**
+ * @return number of kept log segments.
+ */
+inline DWORD CLogStream::GetLogSegmentCount(void) const
+{
+	return m_dwSegmentCount;
+}
+
+/**
+ * @param dwLogSegmentCount - number of kept log segments; pass 0 to keep all segments.
+ * @return true if operation is accepted.
+ */
+inline BOOL CLogStream::SetLogSegmentCount(DWORD dwLogSegmentCount)
+{
+	m_dwSegmentCount = dwLogSegmentCount;
+	return TRUE;
 }
 
 /**
@@ -87,9 +287,30 @@ inline PCTSTR CLogStream::GetLogFileExtension(void) const
 	return _T(".txt");
 }
 
+/**
+ * @return true if entries may be rendered and encoded before the log is locked.
+ */
+inline BOOL CLogStream::CanEncodeEntries(void) const
+{
+	return TRUE;
+}
+
 inline void CLogStream::EncodeEntryText(void)
 {
 	m_EncStream.Reset();
 	PCTSTR pszEntry = GetEntryText();
 	m_EncStream.WriteUTF8Bin(pszEntry);
 }
+
+/**
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ */
+inline void CLogStream::EncodeEntryText(PCSTR pszEntry, DWORD dwLength)
+{
+	m_EncStream.Reset();
+	PCTSTR pszEntryPrefix = GetEntryText();
+	m_EncStream.WriteUTF8Bin(pszEntryPrefix);
+	m_EncStream.WriteBytes((const BYTE*)pszEntry, dwLength);
+	m_EncStream.WriteAscii("\r\n");
+}
@@ -0,0 +1,138 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Fan-out of log entries to several log files.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogTee.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogTee::ClearEntries(void)
+{
+	BOOL bResult = TRUE;
+	size_t nNumLogFiles = m_arrLogFiles.GetCount();
+	for (size_t nLogFilePos = 0; nLogFilePos < nNumLogFiles; ++nLogFilePos)
+	{
+		CLogFile* pLogFile = m_arrLogFiles[nLogFilePos];
+		pLogFile->CaptureObject();
+		if (! pLogFile->ClearEntries())
+			bResult = FALSE;
+		pLogFile->ReleaseObject();
+	}
+	return bResult;
+}
+
+/**
+ * @param pLogFile - log file object.
+ * @return true if log file was attached.
+ */
+BOOL CLogTee::AddLogFile(CLogFile* pLogFile)
+{
+	// Nested tees could form a cycle.
+	if (pLogFile == NULL || pLogFile->IsLogTee())
+		return FALSE;
+	size_t nNumLogFiles = m_arrLogFiles.GetCount();
+	for (size_t nLogFilePos = 0; nLogFilePos < nNumLogFiles; ++nLogFilePos)
+	{
+		if (m_arrLogFiles[nLogFilePos] == pLogFile)
+			return TRUE;
+	}
+	m_arrLogFiles.AddItem(pLogFile);
+	return TRUE;
+}
+
+/**
+ * @param pLogFile - log file that is being closed.
+ */
+void CLogTee::DetachLogFile(CLogFile* pLogFile)
+{
+	size_t nNumLogFiles = m_arrLogFiles.GetCount();
+	for (size_t nLogFilePos = 0; nLogFilePos < nNumLogFiles; ++nLogFilePos)
+	{
+		if (m_arrLogFiles[nLogFilePos] == pLogFile)
+		{
+			m_arrLogFiles.DeleteItem(nLogFilePos);
+			break;
+		}
+	}
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text.
+ * @param ullTime - entry time or 0 for the current time.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogTee::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime)
+{
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return TRUE;
+	// All logs get the same time stamp.
+	if (ullTime == 0)
+		ullTime = g_LogClock.GetLocalTime();
+	BOOL bResult = TRUE;
+	size_t nNumLogFiles = m_arrLogFiles.GetCount();
+	for (size_t nLogFilePos = 0; nLogFilePos < nNumLogFiles; ++nLogFilePos)
+	{
+		CLogFile* pLogFile = m_arrLogFiles[nLogFilePos];
+		pLogFile->CaptureObject();
+		if (! pLogFile->WriteLogEntry(eLogLevel, eEntryMode, rcsConsoleAccess, pszEntry, ullTime))
+			bResult = FALSE;
+		pLogFile->ReleaseObject();
+	}
+	return bResult;
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CLogTee::WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess)
+{
+	_ASSERTE(rScratch.m_pszEntry != NULL && ! rScratch.m_bEncoded);
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return TRUE;
+	BOOL bResult = TRUE;
+	// Flags of the text kept in memory stream of scratch buffers.
+	DWORD dwEncodedFlags = MAXDWORD;
+	size_t nNumLogFiles = m_arrLogFiles.GetCount();
+	for (size_t nLogFilePos = 0; nLogFilePos < nNumLogFiles; ++nLogFilePos)
+	{
+		CLogFile* pLogFile = m_arrLogFiles[nLogFilePos];
+		if (! pLogFile->IsLogLevelEnabled(BTLC_NONE, eLogLevel))
+			continue;
+		// Encoded text is shared by logs with the same prefix, other logs render it under their locks.
+		DWORD dwEntryTextFlags = pLogFile->GetEntryTextFlags();
+		rScratch.m_bEncoded = (dwEntryTextFlags != MAXDWORD && dwEntryTextFlags == dwEncodedFlags);
+		if (! rScratch.m_bEncoded && pLogFile->EncodePreparedEntry(rScratch, eLogLevel))
+			dwEncodedFlags = dwEntryTextFlags;
+		pLogFile->CaptureObject();
+		if (! pLogFile->WritePreparedEntry(rScratch, eLogLevel, eEntryMode, rcsConsoleAccess))
+			bResult = FALSE;
+		pLogFile->ReleaseObject();
+	}
+	rScratch.m_bEncoded = FALSE;
+	return bResult;
+}
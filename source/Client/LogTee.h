@@ -0,0 +1,106 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Fan-out of log entries to several log files.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "LogFile.h"
+#include "Array.h"
+
+/**
+ * @brief Log that forwards every entry to attached log files.
+ * Entry is formatted and timed once. Its UTF-8 text is encoded once per
+ * distinct set of prefix flags and shared by all text based logs.
+ * Attached logs are owned by their own handles.
+ */
+class CLogTee : public CLogFile
+{
+public:
+	/// Initialize the object.
+	CLogTee(void);
+	/// Load entries into memory.
+	virtual BOOL LoadEntries(void);
+	/// Save entries into disk.
+	virtual BOOL SaveEntries(BOOL bCrash);
+	/// Clear log entries.
+	virtual BOOL ClearEntries(void);
+	/// Close log file.
+	virtual void Close(void);
+	/// Add new log entry.
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0);
+	/// Add log entry prepared before the log was locked.
+	virtual BOOL WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess);
+	/// Return true if the log forwards entries to other logs.
+	virtual BOOL IsLogTee(void) const;
+	/// Remove references to the log file that is being closed.
+	virtual void DetachLogFile(CLogFile* pLogFile);
+	/// Attach log file to the tee.
+	BOOL AddLogFile(CLogFile* pLogFile);
+
+protected:
+	/// Get default log file extension.
+	virtual PCTSTR GetLogFileExtension(void) const;
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogTee(const CLogTee& rLogTee);
+	/// Protects the class from being accidentally copied.
+	CLogTee& operator=(const CLogTee& rLogTee);
+
+	/// Attached log files.
+	CArray<CLogFile*> m_arrLogFiles;
+};
+
+inline CLogTee::CLogTee(void)
+{
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+inline BOOL CLogTee::LoadEntries(void)
+{
+	// Tee doesn't have its own file.
+	return TRUE;
+}
+
+/**
+ * @param bCrash - true if crash has occurred.
+ * @return true if operation was completed successfully.
+ */
+inline BOOL CLogTee::SaveEntries(BOOL /*bCrash*/)
+{
+	// Attached logs are saved by their own handles.
+	return TRUE;
+}
+
+/**
+ * @return true if the log forwards entries to other logs.
+ */
+inline BOOL CLogTee::IsLogTee(void) const
+{
+	return TRUE;
+}
+
+inline void CLogTee::Close(void)
+{
+	m_arrLogFiles.DeleteAll();
+}
+
+/**
+ * @return log file extension.
+ */
+inline PCTSTR CLogTee::GetLogFileExtension(void) const
+{
+	return _T("");
+}
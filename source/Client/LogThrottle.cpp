@@ -0,0 +1,193 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Rate limiting and sampling of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "LogThrottle.h"
+#include "LogClock.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+CLogThrottle::CLogThrottle(void)
+{
+	m_dwRateLimit = 0;
+	m_dwSampleRate = 0;
+	m_lNumEvictedSuppressed = 0;
+	ZeroMemory(m_arrSites, sizeof(m_arrSites));
+}
+
+/**
+ * @param eSiteType - kind of call site key.
+ * @param uSiteKey - call site key.
+ * @return call site state.
+ */
+CLogThrottle::CSiteState* CLogThrottle::GetSiteState(SITE_TYPE eSiteType, UINT_PTR uSiteKey)
+{
+	CSiteState* arrSites = m_arrSites[eSiteType];
+	PVOID pSiteKey = (PVOID)uSiteKey;
+	DWORD dwHomePos = (DWORD)((uSiteKey ^ (uSiteKey >> 8) ^ (uSiteKey >> 16)) % NUM_SITES);
+	for (DWORD dwProbe = 0; dwProbe < MAX_PROBES; ++dwProbe)
+	{
+		CSiteState* pSiteState = &arrSites[(dwHomePos + dwProbe) % NUM_SITES];
+		PVOID pSlotKey = pSiteState->m_pSiteKey;
+		if (pSlotKey == pSiteKey)
+			return pSiteState;
+		if (pSlotKey == NULL)
+		{
+			pSlotKey = InterlockedCompareExchangePointer(&pSiteState->m_pSiteKey, pSiteKey, NULL);
+			if (pSlotKey == NULL || pSlotKey == pSiteKey)
+				return pSiteState;
+		}
+	}
+	// All probed slots are busy, so the home slot is taken by the new call site.
+	// Statistics of concurrent callers from the evicted site may be slightly off.
+	CSiteState* pSiteState = &arrSites[dwHomePos];
+	InterlockedExchangePointer(&pSiteState->m_pSiteKey, pSiteKey);
+	InterlockedExchange64(&pSiteState->m_llArrivalTime, 0);
+	InterlockedExchange(&pSiteState->m_lNumCalls, 0);
+	LONG lNumSuppressed = InterlockedExchange(&pSiteState->m_lNumSuppressed, 0);
+	if (lNumSuppressed != 0)
+		InterlockedExchangeAdd(&m_lNumEvictedSuppressed, lNumSuppressed);
+	return pSiteState;
+}
+
+/**
+ * @param pSiteState - call site state.
+ * @param dwRateLimit - maximum number of entries per second.
+ * @return true if entry conforms to the rate limit.
+ */
+BOOL CLogThrottle::AcquireToken(CSiteState* pSiteState, DWORD dwRateLimit)
+{
+	// Token bucket is expressed as theoretical arrival time of the next entry,
+	// so it's updated by single compare-and-swap. Bucket holds one second of entries.
+	LONGLONG llInterval = max((LONGLONG)CLogClock::TICKS_PER_SECOND / dwRateLimit, (LONGLONG)1);
+	LONGLONG llTolerance = llInterval * (dwRateLimit - 1);
+	LONGLONG llCurrentTime = (LONGLONG)g_LogClock.GetMonotonicTime();
+	for (;;)
+	{
+		LONGLONG llArrivalTime = pSiteState->m_llArrivalTime;
+		LONGLONG llStartTime = max(llArrivalTime, llCurrentTime);
+		if (llStartTime - llCurrentTime > llTolerance)
+			return FALSE;
+		if (InterlockedCompareExchange64(&pSiteState->m_llArrivalTime, llStartTime + llInterval, llArrivalTime) == llArrivalTime)
+			return TRUE;
+	}
+}
+
+/**
+ * @param eSiteType - kind of call site key.
+ * @param uSiteKey - call site key.
+ * @param rdwNumSuppressed - number of entries suppressed at this call site since the last written entry.
+ * @return true if entry has to be written.
+ */
+BOOL CLogThrottle::AllowEntry(SITE_TYPE eSiteType, UINT_PTR uSiteKey, DWORD& rdwNumSuppressed)
+{
+	rdwNumSuppressed = 0;
+	DWORD dwRateLimit = m_dwRateLimit;
+	DWORD dwSampleRate = m_dwSampleRate;
+	if (dwRateLimit == 0 && dwSampleRate <= 1)
+		return TRUE;
+	CSiteState* pSiteState = GetSiteState(eSiteType, uSiteKey);
+	BOOL bAllowEntry = TRUE;
+	if (dwSampleRate > 1)
+	{
+		DWORD dwCallNumber = (DWORD)InterlockedIncrement(&pSiteState->m_lNumCalls) - 1;
+		bAllowEntry = dwCallNumber % dwSampleRate == 0;
+	}
+	if (bAllowEntry && dwRateLimit != 0)
+		bAllowEntry = AcquireToken(pSiteState, dwRateLimit);
+	if (! bAllowEntry)
+	{
+		InterlockedIncrement(&pSiteState->m_lNumSuppressed);
+		return FALSE;
+	}
+	if (pSiteState->m_lNumSuppressed != 0)
+		rdwNumSuppressed = (DWORD)InterlockedExchange(&pSiteState->m_lNumSuppressed, 0);
+	return TRUE;
+}
+
+/**
+ * @return number of suppressed entries that were not reported yet.
+ */
+DWORD CLogThrottle::ResetSuppressedEntries(void)
+{
+	DWORD dwNumSuppressed = (DWORD)InterlockedExchange(&m_lNumEvictedSuppressed, 0);
+	for (DWORD dwSiteType = 0; dwSiteType < NUM_SITE_TYPES; ++dwSiteType)
+	{
+		for (DWORD dwSitePos = 0; dwSitePos < NUM_SITES; ++dwSitePos)
+		{
+			CSiteState& rSiteState = m_arrSites[dwSiteType][dwSitePos];
+			if (rSiteState.m_lNumSuppressed != 0)
+				dwNumSuppressed += (DWORD)InterlockedExchange(&rSiteState.m_lNumSuppressed, 0);
+		}
+	}
+	return dwNumSuppressed;
+}
+
+/**
+ * @param pszEntry - entry text.
+ * @return call site key.
+ */
+UINT_PTR CLogThrottle::GetTextKey(PCTSTR pszEntry)
+{
+	// FNV-1a hash, zero is reserved for empty slots.
+	DWORD dwHash = 2166136261u;
+	while (*pszEntry)
+	{
+		dwHash ^= (DWORD)(_TUCHAR)*pszEntry++;
+		dwHash *= 16777619u;
+	}
+	return (dwHash != 0 ? (UINT_PTR)dwHash : 1);
+}
+
+/**
+ * @param pszEntry - entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return call site key.
+ */
+UINT_PTR CLogThrottle::GetTextKey(PCSTR pszEntry, DWORD dwLength)
+{
+	DWORD dwHash = 2166136261u;
+	for (DWORD dwPosition = 0; dwPosition < dwLength; ++dwPosition)
+	{
+		dwHash ^= (BYTE)pszEntry[dwPosition];
+		dwHash *= 16777619u;
+	}
+	return (dwHash != 0 ? (UINT_PTR)dwHash : 1);
+}
+
+/**
+ * @param dwNumSuppressed - number of suppressed entries.
+ * @param pszSummary - summary text buffer.
+ * @param dwSummarySize - size of summary text buffer.
+ */
+void CLogThrottle::FormatSummary(DWORD dwNumSuppressed, PTSTR pszSummary, DWORD dwSummarySize)
+{
+	// Group digits by thousands: 12345 -> "12,345".
+	TCHAR szNumber[32];
+	PTSTR pszNumber = szNumber + countof(szNumber) - 1;
+	*pszNumber = _T('\0');
+	int nNumDigits = 0;
+	do
+	{
+		if (nNumDigits != 0 && nNumDigits % 3 == 0)
+			*--pszNumber = _T(',');
+		*--pszNumber = (TCHAR)(_T('0') + dwNumSuppressed % 10);
+		dwNumSuppressed /= 10;
+		++nNumDigits;
+	}
+	while (dwNumSuppressed != 0);
+	_stprintf_s(pszSummary, dwSummarySize, _T("Suppressed %s similar entries"), pszNumber);
+}
@@ -0,0 +1,142 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Rate limiting and sampling of log entries.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+/**
+ * @brief Rate limiting and sampling of log entries.
+ * Entries are throttled per call site, which is identified by format string
+ * address or by hash of entry text. Each kind of key has its own table, so
+ * text hashes never collide with addresses. State of every call site is updated
+ * with interlocked operations, so the check is performed before log is locked.
+ */
+class CLogThrottle
+{
+public:
+	/// Kind of call site key.
+	enum SITE_TYPE
+	{
+		/// Address of format string.
+		ST_FORMAT,
+		/// Hash of entry text.
+		ST_TEXT,
+		/// Number of key kinds.
+		NUM_SITE_TYPES
+	};
+
+	/// Initialize the object.
+	CLogThrottle(void);
+	/// Get maximum number of entries per second written from one call site.
+	DWORD GetRateLimit(void) const;
+	/// Set maximum number of entries per second written from one call site.
+	void SetRateLimit(DWORD dwRateLimit);
+	/// Get sample rate.
+	DWORD GetSampleRate(void) const;
+	/// Set sample rate.
+	void SetSampleRate(DWORD dwSampleRate);
+	/// Return true if entries are throttled.
+	BOOL IsEnabled(void) const;
+	/// Check if entry of given call site has to be written.
+	BOOL AllowEntry(SITE_TYPE eSiteType, UINT_PTR uSiteKey, DWORD& rdwNumSuppressed);
+	/// Get and reset the number of suppressed entries of all call sites.
+	DWORD ResetSuppressedEntries(void);
+	/// Get call site key of entry text.
+	static UINT_PTR GetTextKey(PCTSTR pszEntry);
+	/// Get call site key of entry text encoded in UTF-8.
+	static UINT_PTR GetTextKey(PCSTR pszEntry, DWORD dwLength);
+	/// Format summary of suppressed entries.
+	static void FormatSummary(DWORD dwNumSuppressed, PTSTR pszSummary, DWORD dwSummarySize);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CLogThrottle(const CLogThrottle& rLogThrottle);
+	/// Protects the class from being accidentally copied.
+	CLogThrottle& operator=(const CLogThrottle& rLogThrottle);
+
+	/// Call site table parameters.
+	enum
+	{
+		/// Number of call sites tracked at the same time.
+		NUM_SITES = 256,
+		/// Maximum number of probed slots.
+		MAX_PROBES = 8
+	};
+
+	/// State of one call site.
+	struct CSiteState
+	{
+		/// Call site key or NULL for empty slot.
+		PVOID volatile m_pSiteKey;
+		/// Time when the next entry conforms to the rate limit.
+		volatile LONGLONG m_llArrivalTime;
+		/// Number of calls from this site.
+		volatile LONG m_lNumCalls;
+		/// Number of entries suppressed since the last written entry.
+		volatile LONG m_lNumSuppressed;
+	};
+
+	/// Find or allocate call site state.
+	CSiteState* GetSiteState(SITE_TYPE eSiteType, UINT_PTR uSiteKey);
+	/// Check if entry conforms to the rate limit.
+	static BOOL AcquireToken(CSiteState* pSiteState, DWORD dwRateLimit);
+
+	/// Maximum number of entries per second written from one call site.
+	volatile DWORD m_dwRateLimit;
+	/// Only one of this number of entries is written.
+	volatile DWORD m_dwSampleRate;
+	/// Number of suppressed entries of evicted call sites.
+	volatile LONG m_lNumEvictedSuppressed;
+	/// Call site states of every key kind.
+	CSiteState m_arrSites[NUM_SITE_TYPES][NUM_SITES];
+};
+
+/**
+ * @return maximum number of entries per second or 0 if rate is not limited.
+ */
+inline DWORD CLogThrottle::GetRateLimit(void) const
+{
+	return m_dwRateLimit;
+}
+
+/**
+ * @param dwRateLimit - maximum number of entries per second; pass 0 to disable rate limit.
+ */
+inline void CLogThrottle::SetRateLimit(DWORD dwRateLimit)
+{
+	m_dwRateLimit = dwRateLimit;
+}
+
+/**
+ * @return sample rate.
+ */
+inline DWORD CLogThrottle::GetSampleRate(void) const
+{
+	return m_dwSampleRate;
+}
+
+/**
+ * @param dwSampleRate - only one of this number of entries is written; pass 0 or 1 to write all entries.
+ */
+inline void CLogThrottle::SetSampleRate(DWORD dwSampleRate)
+{
+	m_dwSampleRate = dwSampleRate;
+}
+
+/**
+ * @return true if entries are throttled.
+ */
+inline BOOL CLogThrottle::IsEnabled(void) const
+{
+	return (m_dwRateLimit != 0 || m_dwSampleRate > 1);
+}
@@ -0,0 +1,453 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Memory mapped log file.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "MappedLogFile.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::LoadEntries(void)
+{
+	_ASSERTE(m_hFile == INVALID_HANDLE_VALUE);
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		return FALSE;
+	PCTSTR pszLogFileName = GetLogFileName();
+	m_hFile = CreateFile(pszLogFileName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD dwFileSize = GetFileSize(m_hFile, NULL);
+	if (dwFileSize != INVALID_FILE_SIZE &&
+		dwFileSize >= HEADER_SIZE + MIN_DATA_SIZE &&
+		dwFileSize <= HEADER_SIZE + MAX_DATA_SIZE &&
+		MapFile(dwFileSize - HEADER_SIZE))
+	{
+		if (IsValidHeader())
+		{
+			m_dwLogSizeInBytes = m_dwDataSize;
+			DWORD dwNumLostBytes = ValidateRecords();
+			if (dwNumLostBytes != 0)
+			{
+				ULONGLONG ullTime = g_LogClock.GetLocalTime();
+				TCHAR szWarning[128];
+				_stprintf_s(szWarning, countof(szWarning), _T("%lu bytes of damaged log entries were discarded"), dwNumLostBytes);
+				FillEntryText(BTLL_WARNING, ullTime, szWarning);
+				EncodeEntryText();
+				const BYTE* pBuffer = m_MemStream.GetBuffer();
+				if (pBuffer != NULL)
+					AppendRecord(pBuffer, (DWORD)m_MemStream.GetLength());
+			}
+			return TRUE;
+		}
+		UnmapFile();
+	}
+	if (! MapFile(m_dwLogSizeInBytes))
+		goto error;
+	InitHeader();
+	return TRUE;
+
+error:
+	Close();
+	return FALSE;
+}
+
+/**
+ * @param bCrash - true if crash has occurred.
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::SaveEntries(BOOL bCrash)
+{
+	if (m_pHeader == NULL)
+		return FALSE;
+	// Mapped data survives the process, so it's written to the disk on request only.
+	if (bCrash)
+		return TRUE;
+	return FlushViewOfFile(m_pHeader, 0);
+}
+
+/**
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::ClearEntries(void)
+{
+	_ASSERTE(m_pHeader != NULL);
+	if (m_pHeader == NULL)
+		return FALSE;
+	// Old records are not reachable from the head, so they can't be restored after crash.
+	m_pHeader->m_dwHead = m_pHeader->m_dwTail;
+	return TRUE;
+}
+
+void CMappedLogFile::Close(void)
+{
+	UnmapFile();
+	if (m_hFile != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+/**
+ * @param dwLogSizeInBytes - maximum log file size in bytes.
+ * @return true if operation was accepted.
+ */
+BOOL CMappedLogFile::SetLogSizeInBytes(DWORD dwLogSizeInBytes)
+{
+	if (dwLogSizeInBytes < MIN_DATA_SIZE || dwLogSizeInBytes > MAX_DATA_SIZE)
+		return FALSE;
+	dwLogSizeInBytes = (dwLogSizeInBytes + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+	if (m_pHeader != NULL && dwLogSizeInBytes != m_dwDataSize && ! ResizeFile(dwLogSizeInBytes))
+		return FALSE;
+	m_dwLogSizeInBytes = dwLogSizeInBytes;
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text.
+ * @param ullTime - entry time or 0 for the current time.
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime)
+{
+	_ASSERTE(m_pHeader != NULL);
+	if (m_pHeader == NULL)
+		return FALSE;
+	_ASSERTE(eEntryMode == EM_APPEND);
+	if (eEntryMode != EM_APPEND)
+		return FALSE;
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel <= eLogFileLevel)
+	{
+		if (ullTime == 0)
+			ullTime = g_LogClock.GetLocalTime();
+		if (! WriteLogEntryToConsole(eLogLevel, ullTime, rcsConsoleAccess, pszEntry))
+			FillEntryText(eLogLevel, ullTime, pszEntry);
+		EncodeEntryText();
+		const BYTE* pBuffer = m_MemStream.GetBuffer();
+		if (pBuffer == NULL)
+			return FALSE;
+		return AppendRecord(pBuffer, (DWORD)m_MemStream.GetLength());
+	}
+	return TRUE;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength)
+{
+	_ASSERTE(m_pHeader != NULL);
+	if (m_pHeader == NULL)
+		return FALSE;
+	_ASSERTE(eEntryMode == EM_APPEND);
+	if (eEntryMode != EM_APPEND)
+		return FALSE;
+	// Console echo needs decoded entry text.
+	if (GetLogEchoMode() != BTLE_NONE)
+		return CLogFile::WriteLogEntryUTF8(eLogLevel, eEntryMode, rcsConsoleAccess, pszEntry, dwLength);
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel <= eLogFileLevel)
+	{
+		ULONGLONG ullTime = g_LogClock.GetLocalTime();
+		FillEntryPrefix(eLogLevel, ullTime);
+		EncodeEntryText(pszEntry, dwLength);
+		const BYTE* pBuffer = m_MemStream.GetBuffer();
+		if (pBuffer == NULL)
+			return FALSE;
+		return AppendRecord(pBuffer, (DWORD)m_MemStream.GetLength());
+	}
+	return TRUE;
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess)
+{
+	if (! rScratch.m_bEncoded)
+		return CLogFile::WritePreparedEntry(rScratch, eLogLevel, eEntryMode, rcsConsoleAccess);
+	_ASSERTE(m_pHeader != NULL);
+	if (m_pHeader == NULL)
+		return FALSE;
+	_ASSERTE(eEntryMode == EM_APPEND);
+	if (eEntryMode != EM_APPEND)
+		return FALSE;
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel <= eLogFileLevel)
+	{
+		const BYTE* pBuffer = rScratch.m_MemStream.GetBuffer();
+		if (pBuffer == NULL || ! AppendRecord(pBuffer, (DWORD)rScratch.m_MemStream.GetLength()))
+			return FALSE;
+		EchoPreparedEntry(rScratch, eLogLevel, rcsConsoleAccess);
+	}
+	return TRUE;
+}
+
+/**
+ * @param dwDataSize - size of record area.
+ * @return true if file was mapped.
+ */
+BOOL CMappedLogFile::MapFile(DWORD dwDataSize)
+{
+	_ASSERTE(m_pHeader == NULL && m_hMapping == NULL);
+	DWORD dwFileSize = HEADER_SIZE + dwDataSize;
+	if (SetFilePointer(m_hFile, dwFileSize, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER ||
+		! SetEndOfFile(m_hFile))
+	{
+		return FALSE;
+	}
+	m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, 0, dwFileSize, NULL);
+	if (m_hMapping == NULL)
+		return FALSE;
+	m_pHeader = (CLogHeader*)MapViewOfFile(m_hMapping, FILE_MAP_WRITE, 0, 0, dwFileSize);
+	if (m_pHeader == NULL)
+	{
+		UnmapFile();
+		return FALSE;
+	}
+	m_pbData = (PBYTE)m_pHeader + HEADER_SIZE;
+	m_dwDataSize = dwDataSize;
+	return TRUE;
+}
+
+void CMappedLogFile::UnmapFile(void)
+{
+	if (m_pHeader != NULL)
+	{
+		UnmapViewOfFile(m_pHeader);
+		m_pHeader = NULL;
+		m_pbData = NULL;
+	}
+	if (m_hMapping != NULL)
+	{
+		CloseHandle(m_hMapping);
+		m_hMapping = NULL;
+	}
+}
+
+void CMappedLogFile::InitHeader(void)
+{
+	m_pHeader->m_dwSignature = LOG_SIGNATURE;
+	m_pHeader->m_dwVersion = LOG_VERSION;
+	m_pHeader->m_dwDataSize = m_dwDataSize;
+	m_pHeader->m_dwHead = 0;
+	m_pHeader->m_dwTail = 0;
+}
+
+/**
+ * @return true if header matches mapped file.
+ */
+BOOL CMappedLogFile::IsValidHeader(void) const
+{
+	return (m_pHeader->m_dwSignature == LOG_SIGNATURE &&
+	        m_pHeader->m_dwVersion == LOG_VERSION &&
+	        m_pHeader->m_dwDataSize == m_dwDataSize &&
+	        (m_dwDataSize & (RECORD_ALIGNMENT - 1)) == 0);
+}
+
+/**
+ * @param dwOffset - offset of the record or wrap marker.
+ * @return offset of the record.
+ */
+DWORD CMappedLogFile::SkipWrapMarker(DWORD dwOffset) const
+{
+	// Record sizes are aligned, so the header of the next record fits the area unless it's the end of area.
+	if (dwOffset >= m_dwDataSize || ((const CRecordHeader*)(m_pbData + dwOffset))->m_dwSize == MAXDWORD)
+		return 0;
+	return dwOffset;
+}
+
+/**
+ * @return number of discarded bytes.
+ */
+DWORD CMappedLogFile::ValidateRecords(void)
+{
+	DWORD dwHead = m_pHeader->m_dwHead;
+	DWORD dwTail = m_pHeader->m_dwTail;
+	if (dwHead > m_dwDataSize || dwTail > m_dwDataSize ||
+		((dwHead | dwTail) & (RECORD_ALIGNMENT - 1)) != 0)
+	{
+		InitHeader();
+		return m_dwDataSize;
+	}
+	DWORD dwOffset = dwHead, dwNumScannedBytes = 0;
+	for (;;)
+	{
+		if (dwOffset == dwTail)
+			return 0;
+		DWORD dwRecordOffset = SkipWrapMarker(dwOffset);
+		if (dwRecordOffset != dwOffset)
+		{
+			dwNumScannedBytes += m_dwDataSize - dwOffset;
+			dwOffset = dwRecordOffset;
+			if (dwNumScannedBytes <= m_dwDataSize)
+				continue;
+		}
+		else
+		{
+			const CRecordHeader* pRecord = (const CRecordHeader*)(m_pbData + dwOffset);
+			if (pRecord->m_dwSize <= m_dwDataSize - dwOffset - sizeof(CRecordHeader) &&
+				pRecord->m_dwChecksum == GetChecksum((const BYTE*)(pRecord + 1), pRecord->m_dwSize))
+			{
+				DWORD dwRecordSize = GetRecordSize(pRecord->m_dwSize);
+				dwNumScannedBytes += dwRecordSize;
+				if (dwNumScannedBytes <= m_dwDataSize)
+				{
+					dwOffset += dwRecordSize;
+					continue;
+				}
+			}
+		}
+		// Records after this offset were not completely written, truncate torn tail.
+		DWORD dwNumLostBytes = dwTail >= dwOffset ? dwTail - dwOffset : m_dwDataSize - dwOffset + dwTail;
+		m_pHeader->m_dwTail = dwOffset;
+		return dwNumLostBytes;
+	}
+}
+
+void CMappedLogFile::DeleteHead(void)
+{
+	DWORD dwHead = m_pHeader->m_dwHead;
+	_ASSERTE(dwHead != m_pHeader->m_dwTail);
+	const CRecordHeader* pRecord = (const CRecordHeader*)(m_pbData + dwHead);
+	dwHead += GetRecordSize(pRecord->m_dwSize);
+	// Head always points to a record unless the log is empty.
+	if (dwHead != m_pHeader->m_dwTail)
+		dwHead = SkipWrapMarker(dwHead);
+	m_pHeader->m_dwHead = dwHead;
+}
+
+/**
+ * @param pbData - record data.
+ * @param dwSize - size of record data.
+ * @return true if record was added.
+ */
+BOOL CMappedLogFile::AppendRecord(const BYTE* pbData, DWORD dwSize)
+{
+	DWORD dwRecordSize = GetRecordSize(dwSize);
+	// Leave space for wrap marker, so the tail never reaches the head.
+	if (dwRecordSize + sizeof(CRecordHeader) > m_dwDataSize)
+		return FALSE;
+	DWORD dwOffset;
+	BOOL bEmpty;
+	for (;;)
+	{
+		DWORD dwHead = m_pHeader->m_dwHead;
+		DWORD dwTail = m_pHeader->m_dwTail;
+		bEmpty = dwHead == dwTail;
+		if (dwTail >= dwHead)
+		{
+			// Free space is located after the tail and before the head.
+			if (m_dwDataSize - dwTail >= dwRecordSize)
+			{
+				dwOffset = dwTail;
+				break;
+			}
+			if (bEmpty || dwRecordSize < dwHead)
+			{
+				if (dwTail < m_dwDataSize)
+					((CRecordHeader*)(m_pbData + dwTail))->m_dwSize = MAXDWORD;
+				dwOffset = 0;
+				break;
+			}
+		}
+		else if (dwHead - dwTail > dwRecordSize)
+		{
+			dwOffset = dwTail;
+			break;
+		}
+		// Head is moved before its record is overwritten.
+		DeleteHead();
+	}
+	CRecordHeader* pRecord = (CRecordHeader*)(m_pbData + dwOffset);
+	CopyMemory(pRecord + 1, pbData, dwSize);
+	pRecord->m_dwSize = dwSize;
+	pRecord->m_dwChecksum = GetChecksum(pbData, dwSize);
+	// Record must be complete before it becomes visible.
+	MemoryBarrier();
+	m_pHeader->m_dwTail = dwOffset + dwRecordSize;
+	if (bEmpty)
+		m_pHeader->m_dwHead = dwOffset;
+	return TRUE;
+}
+
+/**
+ * @param dwDataSize - new size of record area.
+ * @return true if operation was completed successfully.
+ */
+BOOL CMappedLogFile::ResizeFile(DWORD dwDataSize)
+{
+	DWORD dwHead = m_pHeader->m_dwHead;
+	DWORD dwTail = m_pHeader->m_dwTail;
+	DWORD dwUsedSize = dwTail >= dwHead ? dwTail - dwHead : m_dwDataSize - dwHead + dwTail;
+	PBYTE pbRecords = NULL;
+	DWORD dwRecordsSize = 0;
+	if (dwUsedSize > 0)
+	{
+		pbRecords = new BYTE[dwUsedSize];
+		if (pbRecords == NULL)
+			return FALSE;
+		DWORD dwOffset = dwHead;
+		while (dwOffset != dwTail)
+		{
+			DWORD dwRecordOffset = SkipWrapMarker(dwOffset);
+			if (dwRecordOffset != dwOffset)
+			{
+				dwOffset = dwRecordOffset;
+				continue;
+			}
+			const CRecordHeader* pRecord = (const CRecordHeader*)(m_pbData + dwOffset);
+			DWORD dwRecordSize = GetRecordSize(pRecord->m_dwSize);
+			_ASSERTE(dwRecordsSize + dwRecordSize <= dwUsedSize);
+			CopyMemory(pbRecords + dwRecordsSize, pRecord, dwRecordSize);
+			dwRecordsSize += dwRecordSize;
+			dwOffset += dwRecordSize;
+		}
+	}
+	DWORD dwOldDataSize = m_dwDataSize;
+	UnmapFile();
+	BOOL bResult = MapFile(dwDataSize);
+	if (! bResult && ! MapFile(dwOldDataSize))
+	{
+		delete[] pbRecords;
+		return FALSE;
+	}
+	InitHeader();
+	// The oldest records are evicted if the new area is smaller.
+	for (DWORD dwRecordPos = 0; dwRecordPos < dwRecordsSize; )
+	{
+		const CRecordHeader* pRecord = (const CRecordHeader*)(pbRecords + dwRecordPos);
+		AppendRecord((const BYTE*)(pRecord + 1), pRecord->m_dwSize);
+		dwRecordPos += GetRecordSize(pRecord->m_dwSize);
+	}
+	delete[] pbRecords;
+	return bResult;
+}
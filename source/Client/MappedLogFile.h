@@ -0,0 +1,228 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Memory mapped log file.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+#include "LogFile.h"
+#include "MemStream.h"
+#include "Encoding.h"
+
+/**
+ * @brief Log file kept in memory mapped circular buffer.
+ * Encoded entries are copied straight into the mapping, so the data is
+ * owned by the system cache and nothing has to be saved on crash.
+ */
+class CMappedLogFile : public CLogFile
+{
+public:
+	/// Object constructor,
+	CMappedLogFile(void);
+	/// Object destructor.
+	virtual ~CMappedLogFile(void);
+	/// Load Entries into memory.
+	virtual BOOL LoadEntries(void);
+	/// Save entries into disk.
+	virtual BOOL SaveEntries(BOOL bCrash);
+	/// Clear log entries.
+	virtual BOOL ClearEntries(void);
+	/// Add new log entry.
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0);
+	/// Add new log entry encoded in UTF-8.
+	virtual BOOL WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength);
+	/// Add log entry prepared before the log was locked.
+	virtual BOOL WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess);
+	/// Close log file.
+	virtual void Close(void);
+	/// Get maximum log file size in bytes.
+	virtual DWORD GetLogSizeInBytes(void) const;
+	/// Set maximum log file size in bytes.
+	virtual BOOL SetLogSizeInBytes(DWORD dwLogSizeInBytes);
+
+protected:
+	/// Get default log file extension.
+	virtual PCTSTR GetLogFileExtension(void) const;
+	/// Return true if entries may be rendered and encoded before the log is locked.
+	virtual BOOL CanEncodeEntries(void) const;
+
+private:
+	/// Protects the class from being accidentally copied.
+	CMappedLogFile(const CMappedLogFile& rLogFile);
+	/// Protects the class from being accidentally copied.
+	CMappedLogFile& operator=(const CMappedLogFile& rLogFile);
+
+	/// File format parameters.
+	enum
+	{
+		/// File signature ("BTLG").
+		LOG_SIGNATURE = 0x474C5442,
+		/// File format version.
+		LOG_VERSION = 1,
+		/// Size of file header.
+		HEADER_SIZE = 64,
+		/// Alignment of records.
+		RECORD_ALIGNMENT = 8,
+		/// Default size of record area.
+		DEFAULT_DATA_SIZE = 1024 * 1024,
+		/// Minimal size of record area.
+		MIN_DATA_SIZE = 4 * 1024,
+		/// Maximal size of record area.
+		MAX_DATA_SIZE = 256 * 1024 * 1024
+	};
+
+	/// Header of log file.
+	struct CLogHeader
+	{
+		/// File signature.
+		DWORD m_dwSignature;
+		/// File format version.
+		DWORD m_dwVersion;
+		/// Size of record area.
+		DWORD m_dwDataSize;
+		/// Offset of the oldest record.
+		volatile DWORD m_dwHead;
+		/// Offset after the newest record.
+		volatile DWORD m_dwTail;
+	};
+
+	/// Header of log record.
+	struct CRecordHeader
+	{
+		/// Size of record data or MAXDWORD if data continues at the beginning of record area.
+		DWORD m_dwSize;
+		/// Checksum of record data.
+		DWORD m_dwChecksum;
+	};
+
+	/// Encode entry text.
+	void EncodeEntryText(void);
+	/// Encode entry prefix followed by UTF-8 text.
+	void EncodeEntryText(PCSTR pszEntry, DWORD dwLength);
+	/// Map log file into memory.
+	BOOL MapFile(DWORD dwDataSize);
+	/// Unmap log file.
+	void UnmapFile(void);
+	/// Initialize empty log.
+	void InitHeader(void);
+	/// Check header of existing log.
+	BOOL IsValidHeader(void) const;
+	/// Drop damaged records at the end of the log.
+	DWORD ValidateRecords(void);
+	/// Get offset of the record that follows wrap marker.
+	DWORD SkipWrapMarker(DWORD dwOffset) const;
+	/// Remove the oldest record.
+	void DeleteHead(void);
+	/// Append new record to the log.
+	BOOL AppendRecord(const BYTE* pbData, DWORD dwSize);
+	/// Change size of record area.
+	BOOL ResizeFile(DWORD dwDataSize);
+	/// Get aligned record size.
+	static DWORD GetRecordSize(DWORD dwDataSize);
+	/// Compute checksum of record data.
+	static DWORD GetChecksum(const BYTE* pbData, DWORD dwSize);
+
+	/// Log file handle.
+	HANDLE m_hFile;
+	/// File mapping handle.
+	HANDLE m_hMapping;
+	/// Mapped log header.
+	CLogHeader* m_pHeader;
+	/// Mapped record area.
+	PBYTE m_pbData;
+	/// Size of record area.
+	DWORD m_dwDataSize;
+	/// Requested size of record area.
+	DWORD m_dwLogSizeInBytes;
+	/// Encoder object pre-allocated for the log.
+	CUTF8EncStream m_EncStream;
+	/// Pre-allocated buffer for encoded log entry text.
+	CMemStream m_MemStream;
+};
+
+inline CMappedLogFile::CMappedLogFile(void) : m_MemStream(1024), m_EncStream(&m_MemStream)
+{
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+	m_pHeader = NULL;
+	m_pbData = NULL;
+	m_dwDataSize = 0;
+	m_dwLogSizeInBytes = DEFAULT_DATA_SIZE;
+}
+
+inline CMappedLogFile::~CMappedLogFile(void)
+{
+	Close();
+}
+
+/**
+ * @return maximum log file size in bytes.
+ */
+inline DWORD CMappedLogFile::GetLogSizeInBytes(void) const
+{
+	return m_dwLogSizeInBytes;
+}
+
+/**
+ * @return log file extension.
+ */
+inline PCTSTR CMappedLogFile::GetLogFileExtension(void) const
+{
+	return _T(".log");
+}
+
+/**
+ * @return true if entries may be rendered and encoded before the log is locked.
+ */
+inline BOOL CMappedLogFile::CanEncodeEntries(void) const
+{
+	return TRUE;
+}
+
+inline void CMappedLogFile::EncodeEntryText(void)
+{
+	m_EncStream.Reset();
+	PCTSTR pszEntry = GetEntryText();
+	m_EncStream.WriteUTF8Bin(pszEntry);
+}
+
+/**
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ */
+inline void CMappedLogFile::EncodeEntryText(PCSTR pszEntry, DWORD dwLength)
+{
+	m_EncStream.Reset();
+	PCTSTR pszEntryPrefix = GetEntryText();
+	m_EncStream.WriteUTF8Bin(pszEntryPrefix);
+	m_EncStream.WriteBytes((const BYTE*)pszEntry, dwLength);
+	m_EncStream.WriteAscii("\r\n");
+}
+
+/**
+ * @param dwDataSize - size of record data.
+ * @return aligned record size.
+ */
+inline DWORD CMappedLogFile::GetRecordSize(DWORD dwDataSize)
+{
+	return ((sizeof(CRecordHeader) + dwDataSize + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1));
+}
+
+/**
+ * @param pbData - record data.
+ * @param dwSize - size of record data.
+ * @return record checksum.
+ */
+inline DWORD CMappedLogFile::GetChecksum(const BYTE* pbData, DWORD dwSize)
+{
+	return crc32(dwSize, pbData, dwSize);
+}
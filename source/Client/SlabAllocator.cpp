@@ -0,0 +1,283 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Slab allocator for small variable-size blocks.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#include "StdAfx.h"
+#include "SlabAllocator.h"
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif
+
+/// Sizes of size classes (including block header).
+const DWORD CSlabAllocator::m_arrSizeClasses[NUM_SIZE_CLASSES] =
+{
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192
+};
+
+CSlabAllocator::CSlabAllocator(void)
+{
+	C_ASSERT(sizeof(CSlab) <= SLAB_HEADER_SIZE);
+	ZeroMemory(m_arrBins, sizeof(m_arrBins));
+	m_pFreeSlabs = NULL;
+	m_dwNumFreeSlabs = 0;
+	m_dwNumSlabs = 0;
+	m_pLargeBlocks = NULL;
+	m_dwReservedSize = 0;
+}
+
+CSlabAllocator::~CSlabAllocator(void)
+{
+	FreeAll();
+	m_dwReservedSize = 0;
+	TrimSlabs();
+}
+
+/**
+ * @param dwBlockSize - block size including header.
+ * @return size class number.
+ */
+DWORD CSlabAllocator::GetSizeClass(DWORD dwBlockSize)
+{
+	for (DWORD dwSizeClass = 0; dwSizeClass < NUM_SIZE_CLASSES; ++dwSizeClass)
+	{
+		if (dwBlockSize <= m_arrSizeClasses[dwSizeClass])
+			return dwSizeClass;
+	}
+	return LARGE_SIZE_CLASS;
+}
+
+/**
+ * @param pSlabList - list of slabs.
+ * @param pSlab - added slab.
+ */
+void CSlabAllocator::LinkSlab(CSlab*& pSlabList, CSlab* pSlab)
+{
+	pSlab->m_pPrevSlab = NULL;
+	pSlab->m_pNextSlab = pSlabList;
+	if (pSlabList != NULL)
+		pSlabList->m_pPrevSlab = pSlab;
+	pSlabList = pSlab;
+}
+
+/**
+ * @param pSlabList - list of slabs.
+ * @param pSlab - removed slab.
+ */
+void CSlabAllocator::UnlinkSlab(CSlab*& pSlabList, CSlab* pSlab)
+{
+	if (pSlab->m_pPrevSlab != NULL)
+		pSlab->m_pPrevSlab->m_pNextSlab = pSlab->m_pNextSlab;
+	else
+		pSlabList = pSlab->m_pNextSlab;
+	if (pSlab->m_pNextSlab != NULL)
+		pSlab->m_pNextSlab->m_pPrevSlab = pSlab->m_pPrevSlab;
+}
+
+/**
+ * @param dwSizeClass - size class of slab blocks.
+ * @return pointer to the slab.
+ */
+CSlabAllocator::CSlab* CSlabAllocator::AllocSlab(DWORD dwSizeClass)
+{
+	CSlab* pSlab = m_pFreeSlabs;
+	if (pSlab != NULL)
+	{
+		m_pFreeSlabs = pSlab->m_pNextSlab;
+		--m_dwNumFreeSlabs;
+	}
+	else
+	{
+		pSlab = (CSlab*)VirtualAlloc(NULL, SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (pSlab == NULL)
+			return NULL;
+		++m_dwNumSlabs;
+	}
+	pSlab->m_pFreeList = NULL;
+	pSlab->m_pbCarvePos = (PBYTE)pSlab + SLAB_HEADER_SIZE;
+	pSlab->m_dwNumBlocks = 0;
+	pSlab->m_dwSizeClass = dwSizeClass;
+	LinkSlab(m_arrBins[dwSizeClass].m_pAvailSlabs, pSlab);
+	return pSlab;
+}
+
+/**
+ * @param pSlab - slab without allocated blocks.
+ */
+void CSlabAllocator::FreeSlab(CSlab* pSlab)
+{
+	_ASSERTE(pSlab->m_dwNumBlocks == 0);
+	pSlab->m_pNextSlab = m_pFreeSlabs;
+	m_pFreeSlabs = pSlab;
+	++m_dwNumFreeSlabs;
+}
+
+void CSlabAllocator::TrimSlabs(void)
+{
+	DWORD dwNumReservedSlabs = GetNumReservedSlabs();
+	while (m_dwNumFreeSlabs > 0 && m_dwNumSlabs > dwNumReservedSlabs)
+	{
+		CSlab* pSlab = m_pFreeSlabs;
+		m_pFreeSlabs = pSlab->m_pNextSlab;
+		--m_dwNumFreeSlabs;
+		--m_dwNumSlabs;
+		VirtualFree(pSlab, 0, MEM_RELEASE);
+	}
+}
+
+/**
+ * @param dwSize - requested block size.
+ * @return pointer to allocated block or NULL.
+ */
+PVOID CSlabAllocator::Allocate(DWORD dwSize)
+{
+	DWORD dwSizeClass = GetSizeClass(dwSize + BLOCK_HEADER_SIZE);
+	PBYTE pbBlock;
+	if (dwSizeClass == LARGE_SIZE_CLASS)
+	{
+		pbBlock = new BYTE[sizeof(CLargeBlock) + BLOCK_HEADER_SIZE + dwSize];
+		if (pbBlock == NULL)
+			return NULL;
+		CLargeBlock* pLargeBlock = (CLargeBlock*)pbBlock;
+		pLargeBlock->m_pPrevBlock = NULL;
+		pLargeBlock->m_pNextBlock = m_pLargeBlocks;
+		if (m_pLargeBlocks != NULL)
+			m_pLargeBlocks->m_pPrevBlock = pLargeBlock;
+		m_pLargeBlocks = pLargeBlock;
+		pbBlock += sizeof(CLargeBlock);
+	}
+	else
+	{
+		CBin& rBin = m_arrBins[dwSizeClass];
+		CSlab* pSlab = rBin.m_pAvailSlabs;
+		if (pSlab == NULL)
+		{
+			pSlab = AllocSlab(dwSizeClass);
+			if (pSlab == NULL)
+				return NULL;
+		}
+		if (pSlab->m_pFreeList != NULL)
+		{
+			pbBlock = (PBYTE)pSlab->m_pFreeList;
+			pSlab->m_pFreeList = pSlab->m_pFreeList->m_pNextBlock;
+		}
+		else
+		{
+			pbBlock = pSlab->m_pbCarvePos;
+			pSlab->m_pbCarvePos += m_arrSizeClasses[dwSizeClass];
+		}
+		++pSlab->m_dwNumBlocks;
+		if (IsSlabFull(pSlab))
+		{
+			UnlinkSlab(rBin.m_pAvailSlabs, pSlab);
+			LinkSlab(rBin.m_pFullSlabs, pSlab);
+		}
+	}
+	((CBlockHeader*)pbBlock)->m_dwSizeClass = dwSizeClass;
+	return (pbBlock + BLOCK_HEADER_SIZE);
+}
+
+/**
+ * @param pBlock - pointer to memory block.
+ */
+void CSlabAllocator::Free(PVOID pBlock)
+{
+	if (pBlock == NULL)
+		return;
+	PBYTE pbBlock = (PBYTE)pBlock - BLOCK_HEADER_SIZE;
+	DWORD dwSizeClass = ((CBlockHeader*)pbBlock)->m_dwSizeClass;
+	if (dwSizeClass == LARGE_SIZE_CLASS)
+	{
+		CLargeBlock* pLargeBlock = (CLargeBlock*)(pbBlock - sizeof(CLargeBlock));
+		if (pLargeBlock->m_pPrevBlock != NULL)
+			pLargeBlock->m_pPrevBlock->m_pNextBlock = pLargeBlock->m_pNextBlock;
+		else
+			m_pLargeBlocks = pLargeBlock->m_pNextBlock;
+		if (pLargeBlock->m_pNextBlock != NULL)
+			pLargeBlock->m_pNextBlock->m_pPrevBlock = pLargeBlock->m_pPrevBlock;
+		delete[] (PBYTE)pLargeBlock;
+	}
+	else
+	{
+		_ASSERTE(dwSizeClass < NUM_SIZE_CLASSES);
+		CBin& rBin = m_arrBins[dwSizeClass];
+		CSlab* pSlab = GetBlockSlab(pbBlock);
+		_ASSERTE(pSlab->m_dwSizeClass == dwSizeClass && pSlab->m_dwNumBlocks > 0);
+		BOOL bWasFull = IsSlabFull(pSlab);
+		CFreeBlock* pFreeBlock = (CFreeBlock*)pbBlock;
+		pFreeBlock->m_pNextBlock = pSlab->m_pFreeList;
+		pSlab->m_pFreeList = pFreeBlock;
+		if (--pSlab->m_dwNumBlocks == 0)
+		{
+			// Empty slab may be reused by any size class or returned to the system.
+			UnlinkSlab(bWasFull ? rBin.m_pFullSlabs : rBin.m_pAvailSlabs, pSlab);
+			FreeSlab(pSlab);
+			TrimSlabs();
+		}
+		else if (bWasFull)
+		{
+			UnlinkSlab(rBin.m_pFullSlabs, pSlab);
+			LinkSlab(rBin.m_pAvailSlabs, pSlab);
+		}
+	}
+}
+
+void CSlabAllocator::FreeAll(void)
+{
+	while (m_pLargeBlocks != NULL)
+	{
+		CLargeBlock* pNextBlock = m_pLargeBlocks->m_pNextBlock;
+		delete[] (PBYTE)m_pLargeBlocks;
+		m_pLargeBlocks = pNextBlock;
+	}
+	for (DWORD dwSizeClass = 0; dwSizeClass < NUM_SIZE_CLASSES; ++dwSizeClass)
+	{
+		CBin& rBin = m_arrBins[dwSizeClass];
+		CSlab* arrSlabLists[] = { rBin.m_pAvailSlabs, rBin.m_pFullSlabs };
+		for (DWORD dwListNum = 0; dwListNum < countof(arrSlabLists); ++dwListNum)
+		{
+			CSlab* pSlab = arrSlabLists[dwListNum];
+			while (pSlab != NULL)
+			{
+				CSlab* pNextSlab = pSlab->m_pNextSlab;
+				pSlab->m_dwNumBlocks = 0;
+				FreeSlab(pSlab);
+				pSlab = pNextSlab;
+			}
+		}
+	}
+	ZeroMemory(m_arrBins, sizeof(m_arrBins));
+	TrimSlabs();
+}
+
+/**
+ * @param dwReservedSize - size of memory kept by the allocator when it's empty.
+ * @return true if memory was reserved.
+ */
+BOOL CSlabAllocator::SetReservedSize(DWORD dwReservedSize)
+{
+	m_dwReservedSize = dwReservedSize;
+	DWORD dwNumReservedSlabs = GetNumReservedSlabs();
+	while (m_dwNumSlabs < dwNumReservedSlabs)
+	{
+		CSlab* pSlab = (CSlab*)VirtualAlloc(NULL, SLAB_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (pSlab == NULL)
+			return FALSE;
+		pSlab->m_pNextSlab = m_pFreeSlabs;
+		m_pFreeSlabs = pSlab;
+		++m_dwNumFreeSlabs;
+		++m_dwNumSlabs;
+	}
+	TrimSlabs();
+	return TRUE;
+}
@@ -0,0 +1,180 @@
+/*
+ * This is a part of the BugTrap package.
+ * Copyright (c) 2005-2009 IntelleSoft.
+ * All rights reserved.
+ *
+ * Description: Slab allocator for small variable-size blocks.
+ * Author: Maksim Pyatkovskiy.
+ *
+ * This source code is only intended as a supplement to the
+ * BugTrap package reference and related electronic documentation
+ * provided with the product. See these sources for detailed
+ * information regarding the BugTrap package.
+ */
+
+#pragma once
+
+/**
+ * @brief Slab allocator for small variable-size blocks.
+ * Blocks are carved from large slabs allocated directly from the system,
+ * so frequent allocations don't fragment process heap. Released blocks are
+ * kept in per slab free lists; slab is returned to the pool as soon as all its
+ * blocks are released and the pool is trimmed down to the reserved size.
+ */
+class CSlabAllocator
+{
+public:
+	/// Initialize the object.
+	CSlabAllocator(void);
+	/// Destroy the object.
+	~CSlabAllocator(void);
+	/// Allocate memory block.
+	PVOID Allocate(DWORD dwSize);
+	/// Release memory block.
+	void Free(PVOID pBlock);
+	/// Release all memory blocks at once.
+	void FreeAll(void);
+	/// Get size of pre-reserved memory.
+	DWORD GetReservedSize(void) const;
+	/// Set size of pre-reserved memory.
+	BOOL SetReservedSize(DWORD dwReservedSize);
+
+private:
+	/// Protects the class from being accidentally copied.
+	CSlabAllocator(const CSlabAllocator& rAllocator);
+	/// Protects the class from being accidentally copied.
+	CSlabAllocator& operator=(const CSlabAllocator& rAllocator);
+
+	/// Allocator parameters.
+	enum
+	{
+		/// Size of memory slab.
+		SLAB_SIZE = 64 * 1024,
+		/// Size of slab header.
+		SLAB_HEADER_SIZE = 64,
+		/// Size of block header.
+		BLOCK_HEADER_SIZE = 8,
+		/// Number of size classes.
+		NUM_SIZE_CLASSES = 17,
+		/// Size class of blocks allocated from the heap.
+		LARGE_SIZE_CLASS = NUM_SIZE_CLASSES
+	};
+
+	/// Free memory block.
+	struct CFreeBlock
+	{
+		/// Next free block of the same slab.
+		CFreeBlock* m_pNextBlock;
+	};
+
+	/// Memory slab.
+	struct CSlab
+	{
+		/// Previous slab in the list.
+		CSlab* m_pPrevSlab;
+		/// Next slab in the list.
+		CSlab* m_pNextSlab;
+		/// List of free blocks.
+		CFreeBlock* m_pFreeList;
+		/// Beginning of unused space.
+		PBYTE m_pbCarvePos;
+		/// Number of allocated blocks.
+		DWORD m_dwNumBlocks;
+		/// Slab size class.
+		DWORD m_dwSizeClass;
+	};
+
+	/// Header of memory block.
+	struct CBlockHeader
+	{
+		/// Block size class.
+		DWORD m_dwSizeClass;
+	};
+
+	/// Large memory block allocated from the heap.
+	struct CLargeBlock
+	{
+		/// Previous large block.
+		CLargeBlock* m_pPrevBlock;
+		/// Next large block.
+		CLargeBlock* m_pNextBlock;
+	};
+
+	/// Slabs of the same size class.
+	struct CBin
+	{
+		/// Slabs that have free blocks or unused space.
+		CSlab* m_pAvailSlabs;
+		/// Slabs without free blocks.
+		CSlab* m_pFullSlabs;
+	};
+
+	/// Find size class for the block.
+	static DWORD GetSizeClass(DWORD dwBlockSize);
+	/// Get number of slabs for the reserved size.
+	DWORD GetNumReservedSlabs(void) const;
+	/// Get slab from the pool or from the system.
+	CSlab* AllocSlab(DWORD dwSizeClass);
+	/// Return slab to the pool.
+	void FreeSlab(CSlab* pSlab);
+	/// Return extra slabs to the system.
+	void TrimSlabs(void);
+	/// Add slab to the list.
+	static void LinkSlab(CSlab*& pSlabList, CSlab* pSlab);
+	/// Remove slab from the list.
+	static void UnlinkSlab(CSlab*& pSlabList, CSlab* pSlab);
+	/// Return true if slab can't give more blocks.
+	BOOL IsSlabFull(const CSlab* pSlab) const;
+	/// Find slab that contains the block.
+	static CSlab* GetBlockSlab(PBYTE pbBlock);
+
+	/// Sizes of size classes.
+	static const DWORD m_arrSizeClasses[NUM_SIZE_CLASSES];
+	/// Size class bins.
+	CBin m_arrBins[NUM_SIZE_CLASSES];
+	/// Slabs ready for use.
+	CSlab* m_pFreeSlabs;
+	/// Number of slabs in the pool.
+	DWORD m_dwNumFreeSlabs;
+	/// Total number of slabs.
+	DWORD m_dwNumSlabs;
+	/// List of large blocks.
+	CLargeBlock* m_pLargeBlocks;
+	/// Size of pre-reserved memory.
+	DWORD m_dwReservedSize;
+};
+
+/**
+ * @return size of pre-reserved memory.
+ */
+inline DWORD CSlabAllocator::GetReservedSize(void) const
+{
+	return m_dwReservedSize;
+}
+
+/**
+ * @return number of slabs for the reserved size.
+ */
+inline DWORD CSlabAllocator::GetNumReservedSlabs(void) const
+{
+	return (m_dwReservedSize + SLAB_SIZE - 1) / SLAB_SIZE;
+}
+
+/**
+ * @param pSlab - memory slab.
+ * @return true if slab can't give more blocks.
+ */
+inline BOOL CSlabAllocator::IsSlabFull(const CSlab* pSlab) const
+{
+	return (pSlab->m_pFreeList == NULL && (DWORD)((PBYTE)pSlab + SLAB_SIZE - pSlab->m_pbCarvePos) < m_arrSizeClasses[pSlab->m_dwSizeClass]);
+}
+
+/**
+ * @param pbBlock - block address.
+ * @return slab that contains the block.
+ */
+inline CSlabAllocator::CSlab* CSlabAllocator::GetBlockSlab(PBYTE pbBlock)
+{
+	// VirtualAlloc() returns addresses aligned on 64K allocation granularity, so slabs are aligned on their size.
+	return (CSlab*)((UINT_PTR)pbBlock & ~(UINT_PTR)(SLAB_SIZE - 1));
+}
@@ -21,6 +21,7 @@
 #include "Globals.h"
 #include "MemStream.h"
 #include "FileStream.h"
+#include "FlightRecorder.h"
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
@@ -2964,6 +2965,120 @@ BOOL CSymEngine::AddFileToArchive(zipFile hZipFile, PCTSTR pszFilePath, PCTSTR p
 	return bResult;
 }
 
+/**
+ * @param hZipFile - zip archive handle.
+ * @param pszFilePath - name of added gzip file.
+ * @param pszFileName - name of uncompressed file stored in archive.
+ * @return true if file was successfully added.
+ */
+BOOL CSymEngine::AddCompressedFileToArchive(zipFile hZipFile, PCTSTR pszFilePath, PCTSTR pszFileName)
+{
+	HANDLE hFile = CreateFile(pszFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return TRUE; // ignore missing files
+	// Both gzip and zip files keep raw deflate data, so it's copied as is.
+	BYTE arrHeader[sizeof(g_arrGZipHeader)], arrTrailer[8];
+	DWORD dwFileSize = GetFileSize(hFile, NULL), dwProcessedNumber;
+	if (dwFileSize == INVALID_FILE_SIZE || dwFileSize < sizeof(arrHeader) + sizeof(arrTrailer) ||
+		! ReadFile(hFile, arrHeader, sizeof(arrHeader), &dwProcessedNumber, NULL) ||
+		dwProcessedNumber != sizeof(arrHeader) ||
+		memcmp(arrHeader, g_arrGZipHeader, sizeof(arrHeader)) != 0 ||
+		SetFilePointer(hFile, -(LONG)sizeof(arrTrailer), NULL, FILE_END) == INVALID_SET_FILE_POINTER ||
+		! ReadFile(hFile, arrTrailer, sizeof(arrTrailer), &dwProcessedNumber, NULL) ||
+		dwProcessedNumber != sizeof(arrTrailer) ||
+		SetFilePointer(hFile, sizeof(arrHeader), NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER)
+	{
+		CloseHandle(hFile);
+		return AddFileToArchive(hZipFile, pszFilePath, PathFindFileName(pszFilePath));
+	}
+	uLong ulCrc32 = 0, ulFileSize = 0;
+	for (int iByte = 3; iByte >= 0; --iByte)
+	{
+		ulCrc32 = (ulCrc32 << 8) | arrTrailer[iByte];
+		ulFileSize = (ulFileSize << 8) | arrTrailer[iByte + 4];
+	}
+	PCSTR pszFileNameA;
+#ifdef _UNICODE
+	CHAR szFileNameA[MAX_PATH];
+	WideCharToMultiByte(CP_ACP, 0, pszFileName, -1, szFileNameA, countof(szFileNameA), NULL, NULL);
+	pszFileNameA = szFileNameA;
+#else
+	pszFileNameA = pszFileName;
+#endif
+	BOOL bResult = FALSE;
+	DWORD dwDataSize = dwFileSize - sizeof(arrHeader) - sizeof(arrTrailer);
+	DWORD dwBufferSize = max(min(dwDataSize, g_dwMaxBufferSize), (DWORD)1);
+	PBYTE pFileBuffer = new BYTE[dwBufferSize];
+	if (pFileBuffer)
+	{
+		if (zipOpenNewFileInZip2(hZipFile, pszFileNameA, NULL, NULL, 0, NULL, 0, NULL, Z_DEFLATED, Z_BEST_COMPRESSION, 1) == Z_OK)
+		{
+			bResult = TRUE;
+			while (dwDataSize > 0)
+			{
+				bResult = ReadFile(hFile, pFileBuffer, min(dwDataSize, dwBufferSize), &dwProcessedNumber, NULL);
+				if (! bResult || dwProcessedNumber == 0)
+					break;
+				bResult = zipWriteInFileInZip(hZipFile, pFileBuffer, dwProcessedNumber) == Z_OK;
+				if (! bResult)
+					break;
+				dwDataSize -= dwProcessedNumber;
+			}
+			if (zipCloseFileInZipRaw(hZipFile, ulFileSize, ulCrc32) != Z_OK)
+				bResult = FALSE;
+		}
+		delete[] pFileBuffer;
+	}
+	CloseHandle(hFile);
+	return bResult;
+}
+
+/**
+ * @param hZipFile - zip archive handle.
+ * @param pszLogFileName - log file name.
+ * @return true if log segments were successfully added.
+ */
+BOOL CSymEngine::AddLogSegmentsToArchive(zipFile hZipFile, PCTSTR pszLogFileName)
+{
+	TCHAR szFolderPath[MAX_PATH];
+	_tcscpy_s(szFolderPath, countof(szFolderPath), pszLogFileName);
+	PathRemoveFileSpec(szFolderPath);
+	TCHAR szFindFileTemplate[MAX_PATH];
+	GetLogSegmentTemplate(szFindFileTemplate, pszLogFileName);
+	WIN32_FIND_DATA FindData;
+	HANDLE hFindFile = FindFirstFile(szFindFileTemplate, &FindData);
+	if (hFindFile == INVALID_HANDLE_VALUE)
+		return TRUE;
+	BOOL bResult = TRUE;
+	do
+	{
+		DWORD dwSegmentNumber;
+		BOOL bCompressed;
+		if (! ParseLogSegmentFileName(FindData.cFileName, pszLogFileName, dwSegmentNumber, bCompressed))
+			continue;
+		TCHAR szFilePath[MAX_PATH];
+		PathCombine(szFilePath, szFolderPath, FindData.cFileName);
+		if (bCompressed)
+		{
+			TCHAR szFileName[MAX_PATH];
+			_tcscpy_s(szFileName, countof(szFileName), FindData.cFileName);
+			PathRemoveExtension(szFileName);
+			bResult = AddCompressedFileToArchive(hZipFile, szFilePath, szFileName);
+		}
+		else
+		{
+			// Segment that is being compressed right now is taken from the finished archive.
+			TCHAR szArchiveFilePath[MAX_PATH];
+			_stprintf_s(szArchiveFilePath, countof(szArchiveFilePath), _T("%s.gz"), szFilePath);
+			if (GetFileAttributes(szArchiveFilePath) == INVALID_FILE_ATTRIBUTES)
+				bResult = AddFileToArchive(hZipFile, szFilePath, FindData.cFileName);
+		}
+	}
+	while (bResult && FindNextFile(hFindFile, &FindData));
+	FindClose(hFindFile);
+	return bResult;
+}
+
 /**
  * @param pszFileName - dump file name.
  * @return true if crash information has been written successfully.
@@ -3029,6 +3144,14 @@ BOOL CSymEngine::WriteReportFiles(PCTSTR pszFolderName, CEnumProcess* pEnumProce
 			return FALSE;
 	}
 
+	if (! g_FlightRecorder.IsEmpty())
+	{
+		TCHAR szFullTimelineFileName[MAX_PATH];
+		PathCombine(szFullTimelineFileName, pszFolderName, _T("flightrec.txt"));
+		if (! g_FlightRecorder.WriteTimeline(szFullTimelineFileName))
+			return FALSE;
+	}
+
 	return TRUE;
 }
 
@@ -3083,7 +3206,8 @@ BOOL CSymEngine::ArchiveReportFiles(PCTSTR pszReportFolder, PCTSTR pszArchiveFil
 			PCTSTR pszFilePath = pLogLink->GetLogFileName();
 			PCTSTR pszFileName = PathFindFileName(pszFilePath);
 			_ASSERTE(pszFileName != NULL);
-			bResult = AddFileToArchive(hZipFile, pszFilePath, pszFileName);
+			bResult = AddFileToArchive(hZipFile, pszFilePath, pszFileName) &&
+			          AddLogSegmentsToArchive(hZipFile, pszFilePath);
 			if (! bResult)
 				break;
 		}
@@ -432,6 +432,10 @@ private:
 	static void SafeCopy(PVOID pDestination, PVOID pSource, DWORD dwSize);
 	/// Add new file to zip archive.
 	static BOOL AddFileToArchive(zipFile hZipFile, PCTSTR pszFilePath, PCTSTR pszFileName);
+	/// Add gzip compressed file to zip archive without recompression.
+	static BOOL AddCompressedFileToArchive(zipFile hZipFile, PCTSTR pszFilePath, PCTSTR pszFileName);
+	/// Add closed log segments to zip archive.
+	static BOOL AddLogSegmentsToArchive(zipFile hZipFile, PCTSTR pszLogFileName);
 	/// Adjust exception stack frame according to C++ exception.
 	BOOL AdjustExceptionStackFrame(void);
 	/// Inittialize stack from the thread/exception context.
@@ -21,6 +21,73 @@
 #define new DEBUG_NEW
 #endif
 
+/**
+ * @brief Check if machine word contains CR or LF byte.
+ * @param uWord - machine word.
+ * @return true if some byte of the word is a line break.
+ */
+static inline BOOL HasLineBreak(UINT_PTR uWord)
+{
+	const UINT_PTR uLowBits = (UINT_PTR)-1 / 0xFF;
+	const UINT_PTR uHighBits = uLowBits * 0x80;
+	UINT_PTR uCrBytes = uWord ^ (uLowBits * '\r');
+	UINT_PTR uLfBytes = uWord ^ (uLowBits * '\n');
+	// Non-zero result means that some byte of the word is zero.
+	return ((((uCrBytes - uLowBits) & ~uCrBytes) | ((uLfBytes - uLowBits) & ~uLfBytes)) & uHighBits) != 0;
+}
+
+/**
+ * @brief Find the first line break in the buffer.
+ * @param pbPosition - beginning of the buffer.
+ * @param pbEnd - end of the buffer.
+ * @return pointer to line break or end of the buffer.
+ */
+static const BYTE* FindNextLineBreak(const BYTE* pbPosition, const BYTE* pbEnd)
+{
+	while (pbPosition < pbEnd && ((UINT_PTR)pbPosition & (sizeof(UINT_PTR) - 1)) != 0)
+	{
+		if (*pbPosition == '\r' || *pbPosition == '\n')
+			return pbPosition;
+		++pbPosition;
+	}
+	// Words without line breaks are skipped at once.
+	while ((size_t)(pbEnd - pbPosition) >= sizeof(UINT_PTR) && ! HasLineBreak(*(const UINT_PTR*)pbPosition))
+		pbPosition += sizeof(UINT_PTR);
+	while (pbPosition < pbEnd)
+	{
+		if (*pbPosition == '\r' || *pbPosition == '\n')
+			return pbPosition;
+		++pbPosition;
+	}
+	return pbEnd;
+}
+
+/**
+ * @brief Find the last line break in the buffer.
+ * @param pbStart - beginning of the buffer.
+ * @param pbPosition - end of the buffer.
+ * @return pointer to line break or NULL.
+ */
+static const BYTE* FindPrevLineBreak(const BYTE* pbStart, const BYTE* pbPosition)
+{
+	while (pbPosition > pbStart && ((UINT_PTR)pbPosition & (sizeof(UINT_PTR) - 1)) != 0)
+	{
+		--pbPosition;
+		if (*pbPosition == '\r' || *pbPosition == '\n')
+			return pbPosition;
+	}
+	// Words without line breaks are skipped at once.
+	while ((size_t)(pbPosition - pbStart) >= sizeof(UINT_PTR) && ! HasLineBreak(*((const UINT_PTR*)pbPosition - 1)))
+		pbPosition -= sizeof(UINT_PTR);
+	while (pbPosition > pbStart)
+	{
+		--pbPosition;
+		if (*pbPosition == '\r' || *pbPosition == '\n')
+			return pbPosition;
+	}
+	return NULL;
+}
+
 /**
  * @return true if the log was loaded successfully.
  */
@@ -34,83 +101,30 @@ BOOL CTextLogFile::LoadEntries(void)
 	HANDLE hFile = CreateFile(pszLogFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hFile != INVALID_HANDLE_VALUE)
 	{
-		DWORD dwFileSize = (DWORD)GetFileSize(hFile, NULL);
-		if (dwFileSize == 0)
+		DWORD dwFileSizeHigh = 0;
+		DWORD dwFileSize = GetFileSize(hFile, &dwFileSizeHigh);
+		if (dwFileSize == 0 && dwFileSizeHigh == 0)
 		{
 			// ignore empty files
 			CloseHandle(hFile);
 			return TRUE;
 		}
-		DWORD dwBufferSize = min(dwFileSize, g_dwMaxBufferSize);
-		PBYTE pFileBuffer = new BYTE[dwBufferSize];
-		if (pFileBuffer)
+		if (dwFileSize >= sizeof(g_arrUTF8Preamble) && dwFileSize != INVALID_FILE_SIZE && dwFileSizeHigh == 0)
 		{
-			BYTE arrUTF8Preamble[sizeof(g_arrUTF8Preamble)];
-			DWORD dwWritten = 0;
-			if (ReadFile(hFile, arrUTF8Preamble, sizeof(arrUTF8Preamble), &dwWritten, NULL) &&
-				dwWritten == sizeof(arrUTF8Preamble) && memcmp(arrUTF8Preamble, g_arrUTF8Preamble, sizeof(arrUTF8Preamble)) == 0)
+			HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (hMapping != NULL)
 			{
-				bResult = TRUE;
-				DWORD dwCurrentPos = 0, dwLineStart = 0;
-				for (;;)
+				const BYTE* pbData = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+				if (pbData != NULL)
 				{
-					dwWritten = 0;
-					DWORD dwFreeSize = dwBufferSize - dwCurrentPos;
-					if (! ReadFile(hFile, pFileBuffer + dwCurrentPos, dwFreeSize, &dwWritten, NULL))
-						goto end;
-					BOOL bEndOfFile = dwWritten < dwFreeSize;
-					dwWritten += dwCurrentPos;
-					dwCurrentPos = 0;
-					if (dwWritten == 0)
-						goto end;
-					for (;;)
-					{
-						if (dwCurrentPos >= dwWritten && ! bEndOfFile)
-						{
-							if (dwLineStart > 0)
-							{
-								dwCurrentPos -= dwLineStart;
-								MoveMemory(pFileBuffer, pFileBuffer + dwLineStart, dwCurrentPos);
-								dwLineStart = 0;
-							}
-							else
-							{
-								dwBufferSize *= 2;
-								PBYTE pNewFileBuffer = new BYTE[dwBufferSize];
-								if (! pNewFileBuffer)
-								{
-									bResult = FALSE;
-									goto end;
-								}
-								CopyMemory(pNewFileBuffer, pFileBuffer, dwCurrentPos);
-								delete[] pFileBuffer;
-								pFileBuffer = pNewFileBuffer;
-							}
-							break;
-						}
-						if (dwCurrentPos < dwWritten ? pFileBuffer[dwCurrentPos] == '\r' || pFileBuffer[dwCurrentPos] == '\n' : bEndOfFile)
-						{
-							if (dwLineStart < dwCurrentPos && ! AddToTail(pFileBuffer + dwLineStart, dwCurrentPos - dwLineStart, true))
-							{
-								bResult = FALSE;
-								goto end;
-							}
-							if (dwCurrentPos == dwWritten) // bEndOfFile == TRUE, see condition above
-							{
-								bResult = TRUE;
-								goto end;
-							}
-							dwLineStart = dwCurrentPos + 1;
-						}
-						++dwCurrentPos;
-					}
+					bResult = SafeParseMappedEntries(pbData, dwFileSize);
+					UnmapViewOfFile(pbData);
 				}
+				CloseHandle(hMapping);
 			}
-end:
-			if (! bResult)
-				FreeEntries();
-			delete[] pFileBuffer;
 		}
+		if (! bResult)
+			FreeEntries();
 		CloseHandle(hFile);
 	}
 	else
@@ -132,48 +146,299 @@ end:
 	return bResult;
 }
 
+/**
+ * @param pbData - contents of the log file.
+ * @param dwDataSize - size of the log file.
+ * @return true if the log was parsed successfully.
+ */
+BOOL CTextLogFile::SafeParseMappedEntries(const BYTE* pbData, DWORD dwDataSize)
+{
+	BOOL bResult = FALSE;
+	__try
+	{
+		bResult = ParseMappedEntries(pbData, dwDataSize);
+	}
+	// Mapped file may become unavailable while it's being read.
+	__except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		bResult = FALSE;
+	}
+	return bResult;
+}
+
+/**
+ * @param pbData - contents of the log file.
+ * @param dwDataSize - size of the log file.
+ * @return true if the log was parsed successfully.
+ */
+BOOL CTextLogFile::ParseMappedEntries(const BYTE* pbData, DWORD dwDataSize)
+{
+	if (dwDataSize < sizeof(g_arrUTF8Preamble) || memcmp(pbData, g_arrUTF8Preamble, sizeof(g_arrUTF8Preamble)) != 0)
+		return FALSE;
+	const BYTE* pbEnd = pbData + dwDataSize;
+	pbData += sizeof(g_arrUTF8Preamble);
+	const BYTE* pbFirstLine = pbData;
+	DWORD dwLogSizeInEntries = GetLogSizeInEntries();
+	// Compressed entries occupy less memory, so size limit can't be applied in advance.
+	DWORD dwLogSizeInBytes = (GetLogFlags() & BTLF_COMPRESSMEMORY) == 0 ? GetLogSizeInBytes() : MAXDWORD;
+	if (dwLogSizeInEntries != MAXDWORD || dwLogSizeInBytes != MAXDWORD)
+	{
+		// Lines are counted from the end, older lines would be evicted right after they are added.
+		DWORD dwNumEntries = GetNumEntries();
+		DWORD dwNumBytes = GetNumBytes();
+		const BYTE* pbLineEnd = pbEnd;
+		for (;;)
+		{
+			const BYTE* pbLineBreak = FindPrevLineBreak(pbData, pbLineEnd);
+			const BYTE* pbLineStart = pbLineBreak != NULL ? pbLineBreak + 1 : pbData;
+			if (pbLineStart < pbLineEnd)
+			{
+				DWORD dwEntrySize = (DWORD)(pbLineEnd - pbLineStart) + 2;
+				if (dwNumEntries >= dwLogSizeInEntries ||
+					dwNumBytes > dwLogSizeInBytes || dwEntrySize > dwLogSizeInBytes - dwNumBytes)
+				{
+					break;
+				}
+				++dwNumEntries;
+				dwNumBytes += dwEntrySize;
+			}
+			pbFirstLine = pbLineStart;
+			if (pbLineBreak == NULL)
+				break;
+			pbLineEnd = pbLineBreak;
+		}
+	}
+	const BYTE* pbLineStart = pbFirstLine;
+	while (pbLineStart < pbEnd)
+	{
+		const BYTE* pbLineBreak = FindNextLineBreak(pbLineStart, pbEnd);
+		// Empty lines are skipped, so entries erased by incremental save are ignored.
+		if (pbLineStart < pbLineBreak)
+		{
+			DWORD dwLineLength = (DWORD)(pbLineBreak - pbLineStart);
+			BUGTRAP_LOGLEVEL eLogLevel;
+			ULONGLONG ullTime;
+			CLogIndex::ParseEntryPrefix((PCSTR)pbLineStart, dwLineLength, eLogLevel, ullTime);
+			if (! AddToTail(eLogLevel, ullTime, pbLineStart, dwLineLength, true))
+				return FALSE;
+		}
+		if (pbLineBreak == pbEnd)
+			break;
+		pbLineStart = pbLineBreak + 1;
+	}
+	return TRUE;
+}
+
 /**
  * @param bCrash - true if crash has occurred.
  * @return true if the log was saved successfully.
  */
-BOOL CTextLogFile::SaveEntries(BOOL /*bCrash*/)
+BOOL CTextLogFile::SaveEntries(BOOL bCrash)
 {
 #ifdef _DEBUG
 	DWORD dwStartTime = GetTickCount();
 #endif
+	BOOL bHistoryLoaded = FinishDeferredLoad(TRUE, ! bCrash);
+	FlushRepeatedEntry();
+	BOOL bResult = FALSE;
+	if (! bHistoryLoaded)
+	{
+		// Log of previous session that wasn't loaded is never truncated.
+		bResult = AppendToHistory();
+	}
+	else
+	{
+		// Crash log is always compacted because it's attached to the report.
+		if ((GetLogFlags() & BTLF_INCREMENTALSAVE) != 0 && ! bCrash && ! IsRewriteRequired())
+		{
+			DWORD dwNumStaleBytes = m_dwNumStaleBytes + GetNumEvictedBytes();
+			if (dwNumStaleBytes <= max(GetNumBytes(), (DWORD)COMPACTION_THRESHOLD))
+				bResult = AppendEntries();
+		}
+		if (! bResult)
+			bResult = RewriteEntries();
+	}
+#ifdef _DEBUG
+	DWORD dwEndTime = GetTickCount();
+	TCHAR szMessage[128];
+	_stprintf_s(szMessage, countof(szMessage), _T("CTextLogFile::SaveEntries(): %lu entries, %lu bytes, %lu milliseconds\r\n"), GetNumEntries(), GetNumBytes(), dwEndTime - dwStartTime);
+	OutputDebugString(szMessage);
+#endif
+	return bResult;
+}
+
+/**
+ * @return true if the log was saved successfully.
+ */
+BOOL CTextLogFile::RewriteEntries(void)
+{
 	PCTSTR pszLogFileName = GetLogFileName();
 	HANDLE hFile = CreateFile(pszLogFileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hFile == INVALID_HANDLE_VALUE)
 		return FALSE;
 	DWORD dwWritten;
 	WriteFile(hFile, g_arrUTF8Preamble, sizeof(g_arrUTF8Preamble), &dwWritten, NULL);
-	CLogEntry* pLogEntry = GetFirstEntry();
+	const BYTE* arrSegments[2];
+	DWORD arrSegmentSizes[2];
+	if (! HasPackedEntries() && GetDataSegments(arrSegments, arrSegmentSizes))
+	{
+		// Entries are stored back to back in the ring buffer.
+		for (DWORD dwSegment = 0; dwSegment < countof(arrSegments); ++dwSegment)
+		{
+			if (arrSegmentSizes[dwSegment] > 0)
+				WriteFile(hFile, arrSegments[dwSegment], arrSegmentSizes[dwSegment], &dwWritten, NULL);
+		}
+	}
+	else
+	{
+		CLogEntry* pLogEntry = GetFirstEntry();
+		while (pLogEntry)
+		{
+			WriteEntryData(hFile, pLogEntry);
+			pLogEntry = pLogEntry->m_pNextEntry;
+		}
+	}
+	CloseHandle(hFile);
+	m_dwSavedFileSize = GetNumBytes();
+	m_dwNumStaleBytes = 0;
+	MarkEntriesSaved();
+	return TRUE;
+}
+
+/**
+ * @return true if new entries were appended to the log file.
+ */
+BOOL CTextLogFile::AppendEntries(void)
+{
+	PCTSTR pszLogFileName = GetLogFileName();
+	HANDLE hFile = CreateFile(pszLogFileName, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL bResult = FALSE;
+	// File might be changed by somebody else.
+	if (GetFileSize(hFile, NULL) == m_dwSavedFileSize &&
+		EraseEvictedEntries(hFile) &&
+		WriteNewEntries(hFile))
+	{
+		MarkEntriesSaved();
+		bResult = TRUE;
+	}
+	CloseHandle(hFile);
+	return bResult;
+}
+
+/**
+ * @return true if new entries were appended after entries of previous session.
+ */
+BOOL CTextLogFile::AppendToHistory(void)
+{
+	PCTSTR pszLogFileName = GetLogFileName();
+	HANDLE hFile = CreateFile(pszLogFileName, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL bResult = FALSE;
+	DWORD dwFileSize = GetFileSize(hFile, NULL);
+	if (dwFileSize != INVALID_FILE_SIZE)
+	{
+		DWORD dwWritten;
+		if (dwFileSize == 0 && WriteFile(hFile, g_arrUTF8Preamble, sizeof(g_arrUTF8Preamble), &dwWritten, NULL))
+			dwFileSize = sizeof(g_arrUTF8Preamble);
+		// Evicted entries aren't erased because the file doesn't start with entries of this log.
+		m_dwSavedFileSize = dwFileSize;
+		if (WriteNewEntries(hFile))
+		{
+			MarkEntriesSaved();
+			bResult = TRUE;
+		}
+	}
+	CloseHandle(hFile);
+	return bResult;
+}
+
+/**
+ * @param hFile - log file handle.
+ * @return true if evicted entries were erased.
+ */
+BOOL CTextLogFile::EraseEvictedEntries(HANDLE hFile)
+{
+	DWORD dwNumEvictedBytes = GetNumEvictedBytes();
+	if (dwNumEvictedBytes == 0)
+		return TRUE;
+	// Blank lines are skipped by LoadEntries(), so evicted entries are erased in place.
+	BYTE arrBlankLines[256];
+	for (DWORD dwBlankPos = 0; dwBlankPos < countof(arrBlankLines); ++dwBlankPos)
+		arrBlankLines[dwBlankPos] = (dwBlankPos & 1) ? '\n' : '\r';
+	SetFilePointer(hFile, sizeof(g_arrUTF8Preamble) + m_dwNumStaleBytes, NULL, FILE_BEGIN);
+	DWORD dwBlankSize = dwNumEvictedBytes;
+	while (dwBlankSize > 0)
+	{
+		DWORD dwChunkSize = min(dwBlankSize, (DWORD)sizeof(arrBlankLines)), dwWritten;
+		if (! WriteFile(hFile, arrBlankLines, dwChunkSize, &dwWritten, NULL))
+			return FALSE;
+		dwBlankSize -= dwChunkSize;
+	}
+	m_dwNumStaleBytes += dwNumEvictedBytes;
+	return TRUE;
+}
+
+/**
+ * @param hFile - log file handle.
+ * @return true if new entries were written.
+ */
+BOOL CTextLogFile::WriteNewEntries(HANDLE hFile)
+{
+	DWORD dwNumNewEntries = GetNumEntries() - GetNumSavedEntries();
+	if (dwNumNewEntries == 0)
+		return TRUE;
+	// Walk back from the tail, new entries are usually few.
+	CLogEntry* pLogEntry = GetLastEntry();
+	for (;;)
+	{
+		DWORD dwNumNodeEntries = GetNumNodeEntries(pLogEntry);
+		// Compressed block can't be written partially.
+		if (dwNumNodeEntries > dwNumNewEntries)
+			return FALSE;
+		dwNumNewEntries -= dwNumNodeEntries;
+		if (dwNumNewEntries == 0)
+			break;
+		pLogEntry = pLogEntry->m_pPrevEntry;
+	}
+	SetFilePointer(hFile, m_dwSavedFileSize, NULL, FILE_BEGIN);
 	while (pLogEntry)
 	{
-		CTextLogEntry* pTextLogEntry = (CTextLogEntry*)pLogEntry;
-		WriteFile(hFile, pTextLogEntry->m_pbData, pTextLogEntry->m_dwSize, &dwWritten, NULL);
+		if (! WriteEntryData(hFile, pLogEntry))
+			return FALSE;
+		m_dwSavedFileSize += pLogEntry->m_dwSize;
 		pLogEntry = pLogEntry->m_pNextEntry;
 	}
-#ifdef _DEBUG
-	DWORD dwEndTime = GetTickCount();
-	TCHAR szMessage[128];
-	_stprintf_s(szMessage, countof(szMessage), _T("CTextLogFile::SaveEntries(): %lu entries, %lu bytes, %lu milliseconds\r\n"), GetNumEntries(), GetNumBytes(), dwEndTime - dwStartTime);
-	OutputDebugString(szMessage);
-#endif
-	CloseHandle(hFile);
 	return TRUE;
 }
 
+/**
+ * @param hFile - log file handle.
+ * @param pLogEntry - log entry or block of compressed entries.
+ * @return true if entry data was written.
+ */
+BOOL CTextLogFile::WriteEntryData(HANDLE hFile, const CLogEntry* pLogEntry)
+{
+	const BYTE* pbData = GetEntryData(pLogEntry);
+	if (pbData == NULL)
+		return FALSE;
+	DWORD dwWritten;
+	return WriteFile(hFile, pbData, pLogEntry->m_dwSize, &dwWritten, NULL);
+}
+
 /**
  * @param pbData - entry data.
  * @param dwSize - data size.
  * @param bAddCrLf - true if CR/LF must be added.
+ * @param eEntryMode - entry mode.
  * @return pointer to the new entry.
  */
-CTextLogFile::CTextLogEntry* CTextLogFile::AllocLogEntry(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
+CInMemLogFile::CLogEntry* CTextLogFile::AllocLogEntry(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf, ENTRY_MODE eEntryMode)
 {
 	DWORD dwFullSize = bAddCrLf ? dwSize + 2 : dwSize;
-	CTextLogEntry* pLogEntry = (CTextLogEntry*)new BYTE[sizeof(CTextLogEntry) + dwFullSize];
+	CLogEntry* pLogEntry = AllocEntry(dwFullSize, eEntryMode);
 	if (pLogEntry)
 	{
 		pLogEntry->m_dwSize = dwFullSize;
@@ -189,17 +454,19 @@ CTextLogFile::CTextLogEntry* CTextLogFile::AllocLogEntry(const BYTE* pbData, DWO
 }
 
 /**
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
  * @param pbData - entry data.
  * @param dwSize - data size.
  * @param bAddCrLf - true if CR/LF must be added.
  * @return true if entry was added.
  */
-BOOL CTextLogFile::AddToHead(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
+BOOL CTextLogFile::AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
 {
-	CTextLogEntry* pLogEntry = AllocLogEntry(pbData, dwSize, bAddCrLf);
+	CLogEntry* pLogEntry = AllocLogEntry(pbData, dwSize, bAddCrLf, EM_INSERT);
 	if (pLogEntry)
 	{
-		CInMemLogFile::AddToHead(pLogEntry);
+		CInMemLogFile::AddToHead(pLogEntry, eLogLevel, ullTime);
 		return TRUE;
 	}
 	else
@@ -207,17 +474,19 @@ BOOL CTextLogFile::AddToHead(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
 }
 
 /**
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
  * @param pbData - entry data.
  * @param dwSize - data size.
  * @param bAddCrLf - true if CR/LF must be added.
  * @return true if entry was added.
  */
-BOOL CTextLogFile::AddToTail(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
+BOOL CTextLogFile::AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
 {
-	CTextLogEntry* pLogEntry = AllocLogEntry(pbData, dwSize, bAddCrLf);
+	CLogEntry* pLogEntry = AllocLogEntry(pbData, dwSize, bAddCrLf, EM_APPEND);
 	if (pLogEntry)
 	{
-		CInMemLogFile::AddToTail(pLogEntry);
+		CInMemLogFile::AddToTail(pLogEntry, eLogLevel, ullTime);
 		return TRUE;
 	}
 	else
@@ -225,31 +494,67 @@ BOOL CTextLogFile::AddToTail(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf)
 }
 
 /**
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
  * @param bAddCrLf - true if CR/LF must be added.
  * @return true if entry was added.
  */
-BOOL CTextLogFile::AddToHead(BOOL bAddCrLf)
+BOOL CTextLogFile::AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, BOOL bAddCrLf)
 {
 	const BYTE* pBuffer = m_MemStream.GetBuffer();
 	if (pBuffer == NULL)
 		return FALSE;
 	DWORD dwLength = (DWORD)m_MemStream.GetLength();
 	_ASSERTE(dwLength > 0);
-	return AddToHead(pBuffer, dwLength, bAddCrLf);
+	return AddToHead(eLogLevel, ullTime, pBuffer, dwLength, bAddCrLf);
 }
 
 /**
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
  * @param bAddCrLf - true if CR/LF must be added.
  * @return true if entry was added.
  */
-BOOL CTextLogFile::AddToTail(BOOL bAddCrLf)
+BOOL CTextLogFile::AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, BOOL bAddCrLf)
 {
 	const BYTE* pBuffer = m_MemStream.GetBuffer();
 	if (pBuffer == NULL)
 		return FALSE;
 	DWORD dwLength = (DWORD)m_MemStream.GetLength();
 	_ASSERTE(dwLength > 0);
-	return AddToTail(pBuffer, dwLength, bAddCrLf);
+	return AddToTail(eLogLevel, ullTime, pBuffer, dwLength, bAddCrLf);
+}
+
+void CTextLogFile::FlushRepeatedEntry(void)
+{
+	ENTRY_MODE eEntryMode;
+	BUGTRAP_LOGLEVEL eLogLevel;
+	ULONGLONG ullTime;
+	CLogEntry* pLogEntry = GetRepeatedEntry(eEntryMode, eLogLevel, ullTime);
+	if (pLogEntry == NULL)
+	{
+		ResetRepeatedEntry();
+		return;
+	}
+	TCHAR szSummary[96];
+	FormatRepeatSummary(szSummary, countof(szSummary));
+	ResetRepeatedEntry();
+	// Merged entry is re-encoded with the summary inserted before trailing CR/LF.
+	_ASSERTE(pLogEntry->m_dwSize >= 2);
+	m_EncStream.Reset();
+	m_EncStream.WriteBytes(pLogEntry->m_pbData, pLogEntry->m_dwSize - 2);
+	m_EncStream.WriteUTF8Bin(szSummary);
+	m_EncStream.WriteAscii("\r\n");
+	if (eEntryMode == EM_APPEND)
+	{
+		DeleteTail();
+		AddToTail(eLogLevel, ullTime, FALSE);
+	}
+	else
+	{
+		DeleteHead();
+		AddToHead(eLogLevel, ullTime, FALSE);
+	}
 }
 
 /**
@@ -257,31 +562,138 @@ BOOL CTextLogFile::AddToTail(BOOL bAddCrLf)
  * @param eEntryMode - entry mode.
  * @param rcsConsoleAccess - provides synchronous access to the console.
  * @param pszEntry - log entry text.
+ * @param ullTime - entry time or 0 for the current time.
  * @return true if operation was completed successfully.
  */
-BOOL CTextLogFile::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry)
+BOOL CTextLogFile::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime)
 {
 	BOOL bResult = TRUE;
-	BUGTRAP_LOGLEVEL eLogFileLevel = GetLogLevel();
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
 	if (eLogLevel <= eLogFileLevel)
 	{
-		SYSTEMTIME st;
-		GetLocalTime(&st);
-		if (! WriteLogEntryToConsole(eLogLevel, &st, rcsConsoleAccess, pszEntry))
-			FillEntryText(eLogLevel, &st, pszEntry);
+		if (ullTime == 0)
+			ullTime = g_LogClock.GetLocalTime();
+		const BYTE* pbKey = NULL;
+		DWORD dwKeySize = 0;
+		BOOL bCoalesce = IsCoalescingEnabled() && GetCoalescingKey(pszEntry, pbKey, dwKeySize);
+		if (bCoalesce && CoalesceEntry(eLogLevel, eEntryMode, pbKey, dwKeySize, ullTime))
+		{
+			WriteLogEntryToConsole(eLogLevel, ullTime, rcsConsoleAccess, pszEntry);
+			return TRUE;
+		}
+		FlushRepeatedEntry();
+		if (! WriteLogEntryToConsole(eLogLevel, ullTime, rcsConsoleAccess, pszEntry))
+			FillEntryText(eLogLevel, ullTime, pszEntry);
 		EncodeEntryText();
+		BOOL bAdded = FALSE;
+		switch (eEntryMode)
+		{
+		case EM_APPEND:
+			bAdded = AddToTail(eLogLevel, ullTime, FALSE);
+			break;
+		case EM_INSERT:
+			bAdded = AddToHead(eLogLevel, ullTime, FALSE);
+			break;
+		default:
+			_ASSERT(FALSE);
+			bResult = FALSE;
+		}
+		if (bAdded && bCoalesce)
+			SetRepeatedEntry(eLogLevel, eEntryMode, pbKey, dwKeySize, ullTime);
+	}
+	return bResult;
+}
+
+/**
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ * @return true if operation was completed successfully.
+ */
+BOOL CTextLogFile::WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength)
+{
+	// Console echo needs decoded entry text.
+	if (GetLogEchoMode() != BTLE_NONE)
+		return CLogFile::WriteLogEntryUTF8(eLogLevel, eEntryMode, rcsConsoleAccess, pszEntry, dwLength);
+	BOOL bResult = TRUE;
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel <= eLogFileLevel)
+	{
+		ULONGLONG ullTime = g_LogClock.GetLocalTime();
+		BOOL bCoalesce = IsCoalescingEnabled();
+		if (bCoalesce && CoalesceEntry(eLogLevel, eEntryMode, (const BYTE*)pszEntry, dwLength, ullTime))
+			return TRUE;
+		FlushRepeatedEntry();
+		FillEntryPrefix(eLogLevel, ullTime);
+		EncodeEntryText(pszEntry, dwLength);
+		BOOL bAdded = FALSE;
 		switch (eEntryMode)
 		{
 		case EM_APPEND:
-			AddToTail(FALSE);
+			bAdded = AddToTail(eLogLevel, ullTime, FALSE);
 			break;
 		case EM_INSERT:
-			AddToHead(FALSE);
+			bAdded = AddToHead(eLogLevel, ullTime, FALSE);
 			break;
 		default:
 			_ASSERT(FALSE);
 			bResult = FALSE;
 		}
+		if (bAdded && bCoalesce)
+			SetRepeatedEntry(eLogLevel, eEntryMode, (const BYTE*)pszEntry, dwLength, ullTime);
+	}
+	return bResult;
+}
+
+/**
+ * @param rScratch - scratch buffers of calling thread.
+ * @param eLogLevel - log level number.
+ * @param eEntryMode - entry mode.
+ * @param rcsConsoleAccess - provides synchronous access to the console.
+ * @return true if operation was completed successfully.
+ */
+BOOL CTextLogFile::WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess)
+{
+	if (! rScratch.m_bEncoded)
+		return CInMemLogFile::WritePreparedEntry(rScratch, eLogLevel, eEntryMode, rcsConsoleAccess);
+	// Level might have been changed after the entry was prepared.
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
+	if (eLogLevel > eLogFileLevel)
+		return TRUE;
+	const BYTE* pbKey = rScratch.m_pbEntryText;
+	DWORD dwKeySize = rScratch.m_dwEntryTextSize;
+	BOOL bCoalesce = IsCoalescingEnabled() && (pbKey != NULL || GetCoalescingKey(rScratch.m_pszEntry, pbKey, dwKeySize));
+	if (bCoalesce && CoalesceEntry(eLogLevel, eEntryMode, pbKey, dwKeySize, rScratch.m_ullTime))
+	{
+		EchoPreparedEntry(rScratch, eLogLevel, rcsConsoleAccess);
+		return TRUE;
+	}
+	FlushRepeatedEntry();
+	const BYTE* pBuffer = rScratch.m_MemStream.GetBuffer();
+	if (pBuffer == NULL)
+		return FALSE;
+	DWORD dwLength = (DWORD)rScratch.m_MemStream.GetLength();
+	_ASSERTE(dwLength > 0);
+	BOOL bResult = TRUE, bAdded = FALSE;
+	switch (eEntryMode)
+	{
+	case EM_APPEND:
+		bAdded = AddToTail(eLogLevel, rScratch.m_ullTime, pBuffer, dwLength, FALSE);
+		break;
+	case EM_INSERT:
+		bAdded = AddToHead(eLogLevel, rScratch.m_ullTime, pBuffer, dwLength, FALSE);
+		break;
+	default:
+		_ASSERT(FALSE);
+		bResult = FALSE;
+	}
+	if (bAdded)
+	{
+		if (bCoalesce)
+			SetRepeatedEntry(eLogLevel, eEntryMode, pbKey, dwKeySize, rScratch.m_ullTime);
+		EchoPreparedEntry(rScratch, eLogLevel, rcsConsoleAccess);
 	}
 	return bResult;
 }
@@ -32,7 +32,11 @@ public:
 	/// Save entries into disk.
 	virtual BOOL SaveEntries(BOOL bCrash);
 	/// Add new log entry.
-	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry);
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0);
+	/// Add new log entry encoded in UTF-8.
+	virtual BOOL WriteLogEntryUTF8(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCSTR pszEntry, DWORD dwLength);
+	/// Add log entry prepared before the log was locked.
+	virtual BOOL WritePreparedEntry(CLogScratch& rScratch, BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess);
 
 private:
 	/// Protects the class from being accidentally copied.
@@ -40,39 +44,70 @@ private:
 	/// Protects the class from being accidentally copied.
 	CTextLogFile& operator=(const CTextLogFile& rLogFile);
 
-	/// Log entry data.
-	struct CTextLogEntry : public CInMemLogFile::CLogEntry
+	/// Incremental save parameters.
+	enum
 	{
-#pragma warning(push)
-#pragma warning(disable : 4200) // nonstandard extension used : zero-sized array in struct/union
-		/// Data buffer.
-		BYTE m_pbData[0];
-#pragma warning(pop)
+		/// Minimal size of erased entries that causes log compaction.
+		COMPACTION_THRESHOLD = 64 * 1024
 	};
 
 	/// Get default log file extension.
 	virtual PCTSTR GetLogFileExtension(void) const;
+	/// Create empty log of the same format.
+	virtual CInMemLogFile* CreateHistoryLog(void) const;
+	/// Return true if entry data may be compressed.
+	virtual BOOL CanPackEntries(void) const;
+	/// Get text of entry data for query callback.
+	virtual void GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView);
+	/// Return true if entries may be rendered and encoded before the log is locked.
+	virtual BOOL CanEncodeEntries(void) const;
+	/// Parse mapped file and recover from I/O errors.
+	BOOL SafeParseMappedEntries(const BYTE* pbData, DWORD dwDataSize);
+	/// Add lines of mapped file that won't be evicted by log size limits.
+	BOOL ParseMappedEntries(const BYTE* pbData, DWORD dwDataSize);
+	/// Write entry data to the file.
+	BOOL WriteEntryData(HANDLE hFile, const CLogEntry* pLogEntry);
+	/// Write all entries to the new file.
+	BOOL RewriteEntries(void);
+	/// Append new entries to the existing file.
+	BOOL AppendEntries(void);
+	/// Append new entries to the file that keeps log of previous session.
+	BOOL AppendToHistory(void);
+	/// Replace evicted entries by blank lines.
+	BOOL EraseEvictedEntries(HANDLE hFile);
+	/// Write entries added since the last save.
+	BOOL WriteNewEntries(HANDLE hFile);
 	/// Allocate log entry.
-	CTextLogEntry* AllocLogEntry(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf);
+	CLogEntry* AllocLogEntry(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf, ENTRY_MODE eEntryMode);
 	/// Add log entry to the head.
-	BOOL AddToHead(BOOL bAddCrLf);
+	BOOL AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, BOOL bAddCrLf);
 	/// Add log entry to the tail.
-	BOOL AddToTail(BOOL bAddCrLf);
+	BOOL AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, BOOL bAddCrLf);
 	/// Add log entry to the head.
-	BOOL AddToHead(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf);
+	BOOL AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf);
 	/// Add log entry to the tail.
-	BOOL AddToTail(const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf);
+	BOOL AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const BYTE* pbData, DWORD dwSize, BOOL bAddCrLf);
+	/// Append summary of repeated entries to the merged entry.
+	void FlushRepeatedEntry(void);
 	/// Encode entry text.
 	void EncodeEntryText(void);
+	/// Encode entry prefix followed by UTF-8 text.
+	void EncodeEntryText(PCSTR pszEntry, DWORD dwLength);
 
 	/// Encoder object pre-allocated for the log.
 	CUTF8EncStream m_EncStream;
 	/// Pre-allocated buffer for encoded log entry text.
 	CMemStream m_MemStream;
+	/// Size of the log file after the last save.
+	DWORD m_dwSavedFileSize;
+	/// Size of erased entries at the beginning of the log file.
+	DWORD m_dwNumStaleBytes;
 };
 
 inline CTextLogFile::CTextLogFile(void) : CInMemLogFile(sizeof(g_arrUTF8Preamble)), m_MemStream(1024), m_EncStream(&m_MemStream)
 {
+	m_dwSavedFileSize = 0;
+	m_dwNumStaleBytes = 0;
 }
 
 /**
@@ -83,9 +118,62 @@ inline PCTSTR CTextLogFile::GetLogFileExtension(void) const
 	return _T(".txt");
 }
 
+/**
+ * @return pointer to the new log object.
+ */
+inline CInMemLogFile* CTextLogFile::CreateHistoryLog(void) const
+{
+	return new CTextLogFile;
+}
+
+/**
+ * @return true if entry data may be compressed.
+ */
+inline BOOL CTextLogFile::CanPackEntries(void) const
+{
+	// Entry data is written to the file as is.
+	return TRUE;
+}
+
+/**
+ * @return true if entries may be rendered and encoded before the log is locked.
+ */
+inline BOOL CTextLogFile::CanEncodeEntries(void) const
+{
+	return TRUE;
+}
+
 inline void CTextLogFile::EncodeEntryText(void)
 {
 	m_EncStream.Reset();
 	PCTSTR pszEntry = GetEntryText();
 	m_EncStream.WriteUTF8Bin(pszEntry);
 }
+
+/**
+ * @param pszEntry - log entry text encoded in UTF-8.
+ * @param dwLength - text length in bytes.
+ */
+inline void CTextLogFile::EncodeEntryText(PCSTR pszEntry, DWORD dwLength)
+{
+	m_EncStream.Reset();
+	PCTSTR pszEntryPrefix = GetEntryText();
+	m_EncStream.WriteUTF8Bin(pszEntryPrefix);
+	m_EncStream.WriteBytes((const BYTE*)pszEntry, dwLength);
+	m_EncStream.WriteAscii("\r\n");
+}
+
+/**
+ * @param pbData - entry data.
+ * @param dwSize - size of entry data.
+ * @param rEntryView - view that receives entry text.
+ */
+inline void CTextLogFile::GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView)
+{
+	// Line break isn't a part of entry text.
+	if (dwSize >= 2 && pbData[dwSize - 2] == '\r' && pbData[dwSize - 1] == '\n')
+		dwSize -= 2;
+	rEntryView.pEntryText = pbData;
+	rEntryView.dwEntryTextSize = dwSize;
+	rEntryView.bUTF8Text = TRUE;
+}
@@ -43,6 +43,146 @@ void CXmlLogFile::CPtrLogRecord::Reset(void)
 	m_pszEntryText = _T("");
 }
 
+/**
+ * @brief Skip white spaces and match the tag written by CXmlWriter.
+ * @param pbPosition - current position in the file.
+ * @param pbEnd - end of the file.
+ * @param pszTag - expected tag.
+ * @return position after the tag or NULL if tag doesn't match.
+ */
+static const BYTE* MatchXmlTag(const BYTE* pbPosition, const BYTE* pbEnd, PCSTR pszTag)
+{
+	while (pbPosition < pbEnd && IsSpace(*pbPosition))
+		++pbPosition;
+	size_t nTagLength = strlen(pszTag);
+	if ((size_t)(pbEnd - pbPosition) < nTagLength || memcmp(pbPosition, pszTag, nTagLength) != 0)
+		return NULL;
+	return pbPosition + nTagLength;
+}
+
+/**
+ * @brief Decode element text the same way as CXmlReader does.
+ * @param pbText - beginning of element text.
+ * @param pbTextEnd - end of element text.
+ * @param rBytes - buffer for unescaped text.
+ * @param rText - decoded text.
+ * @return false if text uses XML features unsupported by fast loader.
+ */
+static BOOL DecodeXmlText(const BYTE* pbText, const BYTE* pbTextEnd, CDynamicBuffer<BYTE>& rBytes, CDynamicBuffer<TCHAR>& rText)
+{
+	static const struct
+	{
+		PCSTR m_pszName;
+		BYTE m_bChar;
+	}
+	arrEntities[] =
+	{
+		{ "lt;",   '<' },
+		{ "gt;",   '>' },
+		{ "amp;",  '&' },
+		{ "quot;", '\"' },
+		{ "apos;", '\'' }
+	};
+	// Reader strips surrounding white spaces.
+	while (pbText < pbTextEnd && IsSpace(*pbText))
+		++pbText;
+	while (pbTextEnd > pbText && IsSpace(pbTextEnd[-1]))
+		--pbTextEnd;
+	DWORD dwNumBytes = (DWORD)(pbTextEnd - pbText);
+	if (memchr(pbText, '&', dwNumBytes) != NULL || memchr(pbText, '\r', dwNumBytes) != NULL)
+	{
+		if (! rBytes.SetSize(dwNumBytes))
+			return FALSE;
+		PBYTE pbOutput = rBytes.GetData();
+		DWORD dwOutputPos = 0;
+		BYTE bLastLn = '\0';
+		while (pbText < pbTextEnd)
+		{
+			BYTE bChar = *pbText++;
+			if (bChar == '\r' || bChar == '\n')
+			{
+				// Line breaks are merged like in CXmlReader.
+				BOOL bSkipChar = bLastLn != '\0' && bChar != bLastLn;
+				bLastLn = bChar;
+				if (! bSkipChar)
+					pbOutput[dwOutputPos++] = '\n';
+				continue;
+			}
+			bLastLn = '\0';
+			if (bChar == '&')
+			{
+				int iEntityPos;
+				for (iEntityPos = 0; iEntityPos < countof(arrEntities); ++iEntityPos)
+				{
+					PCSTR pszName = arrEntities[iEntityPos].m_pszName;
+					size_t nNameLength = strlen(pszName);
+					if ((size_t)(pbTextEnd - pbText) >= nNameLength && memcmp(pbText, pszName, nNameLength) == 0)
+					{
+						pbText += nNameLength;
+						bChar = arrEntities[iEntityPos].m_bChar;
+						break;
+					}
+				}
+				// Numeric and custom entities are left to the reader.
+				if (iEntityPos == countof(arrEntities))
+					return FALSE;
+			}
+			pbOutput[dwOutputPos++] = bChar;
+		}
+		pbText = pbOutput;
+		dwNumBytes = dwOutputPos;
+	}
+	// UTF-8 text never has less bytes than characters.
+	if (! rText.SetSize(dwNumBytes + 1))
+		return FALSE;
+	PTSTR pszText = rText.GetData();
+	DWORD dwCharPos = 0;
+	for (DWORD dwBytePos = 0; dwBytePos < dwNumBytes; )
+	{
+		BYTE bChar = pbText[dwBytePos];
+		if (bChar < 0x80)
+		{
+			pszText[dwCharPos++] = (TCHAR)bChar;
+			++dwBytePos;
+		}
+		else
+		{
+			TCHAR arrChar[2];
+			size_t nCharSize;
+			size_t nNumBytesInChar = UTF8DecodeChar(pbText + dwBytePos, dwNumBytes - dwBytePos, arrChar, nCharSize);
+			if (nNumBytesInChar == 0 || nCharSize > nNumBytesInChar)
+				return FALSE;
+			dwBytePos += (DWORD)nNumBytesInChar;
+			for (size_t nCharPos = 0; nCharPos < nCharSize; ++nCharPos)
+				pszText[dwCharPos++] = arrChar[nCharPos];
+		}
+	}
+	pszText[dwCharPos] = _T('\0');
+	return TRUE;
+}
+
+/**
+ * @brief Read element that contains text only.
+ * @param pbPosition - current position in the file.
+ * @param pbEnd - end of the file.
+ * @param pszStartTag - element start tag.
+ * @param pszEndTag - element end tag.
+ * @param rBytes - buffer for unescaped text.
+ * @param rText - decoded text.
+ * @return position after the element or NULL if element can't be read by fast loader.
+ */
+static const BYTE* ReadXmlElement(const BYTE* pbPosition, const BYTE* pbEnd, PCSTR pszStartTag, PCSTR pszEndTag, CDynamicBuffer<BYTE>& rBytes, CDynamicBuffer<TCHAR>& rText)
+{
+	pbPosition = MatchXmlTag(pbPosition, pbEnd, pszStartTag);
+	if (pbPosition == NULL)
+		return NULL;
+	// Text doesn't have unescaped '<', so the end tag is found by plain memory search.
+	const BYTE* pbTextEnd = (const BYTE*)memchr(pbPosition, '<', pbEnd - pbPosition);
+	if (pbTextEnd == NULL || ! DecodeXmlText(pbPosition, pbTextEnd, rBytes, rText))
+		return NULL;
+	return MatchXmlTag(pbTextEnd, pbEnd, pszEndTag);
+}
+
 /**
  * @return true if the log was loaded successfully.
  */
@@ -51,6 +191,22 @@ BOOL CXmlLogFile::LoadEntries(void)
 #ifdef _DEBUG
 	DWORD dwStartTime = GetTickCount();
 #endif
+	// General XML parser handles files that were not produced by SaveEntries().
+	BOOL bResult = LoadMappedEntries() || ReadEntries();
+#ifdef _DEBUG
+	DWORD dwEndTime = GetTickCount();
+	TCHAR szMessage[128];
+	_stprintf_s(szMessage, countof(szMessage), _T("CXmlLogFile::LoadEntries(): %lu entries, %lu bytes, %lu milliseconds\r\n"), GetNumEntries(), GetNumBytes(), dwEndTime - dwStartTime);
+	OutputDebugString(szMessage);
+#endif
+	return bResult;
+}
+
+/**
+ * @return true if the log was loaded successfully.
+ */
+BOOL CXmlLogFile::ReadEntries(void)
+{
 	BOOL bResult = FALSE;
 	PCTSTR pszLogFileName = GetLogFileName();
 	CFileStream FileStream;
@@ -140,7 +296,7 @@ BOOL CXmlLogFile::LoadEntries(void)
 					}
 				}
 
-				if (! AddToTail(LogRecord))
+				if (! AddLoadedEntry(LogRecord))
 					goto end;
 				iResult = XmlReader.GotoNextElementEnd(XmlNode, 0);
 				if (iResult <= 0)
@@ -162,24 +318,141 @@ end:
 			bResult = TRUE; // ignore missing files
 		}
 	}
-#ifdef _DEBUG
-	DWORD dwEndTime = GetTickCount();
-	TCHAR szMessage[128];
-	_stprintf_s(szMessage, countof(szMessage), _T("CXmlLogFile::LoadEntries(): %lu entries, %lu bytes, %lu milliseconds\r\n"), GetNumEntries(), GetNumBytes(), dwEndTime - dwStartTime);
-	OutputDebugString(szMessage);
-#endif
 	return bResult;
 }
 
+/**
+ * @return true if the log was loaded by fast loader.
+ */
+BOOL CXmlLogFile::LoadMappedEntries(void)
+{
+	HANDLE hFile = CreateFile(GetLogFileName(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL bResult = FALSE;
+	DWORD dwFileSizeHigh = 0;
+	DWORD dwFileSize = GetFileSize(hFile, &dwFileSizeHigh);
+	// Empty files can't be mapped, they are handled by the reader.
+	if (dwFileSize != 0 && dwFileSize != INVALID_FILE_SIZE && dwFileSizeHigh == 0)
+	{
+		HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping != NULL)
+		{
+			const BYTE* pbData = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+			if (pbData != NULL)
+			{
+				CLoadBuffers Buffers;
+				bResult = SafeParseMappedEntries(pbData, dwFileSize, Buffers);
+				UnmapViewOfFile(pbData);
+			}
+			CloseHandle(hMapping);
+		}
+	}
+	CloseHandle(hFile);
+	if (! bResult)
+		FreeEntries();
+	return bResult;
+}
+
+/**
+ * @param pbData - contents of the log file.
+ * @param dwDataSize - size of the log file.
+ * @param rBuffers - decoding buffers.
+ * @return true if the log was parsed successfully.
+ */
+BOOL CXmlLogFile::SafeParseMappedEntries(const BYTE* pbData, DWORD dwDataSize, CLoadBuffers& rBuffers)
+{
+	BOOL bResult = FALSE;
+	__try
+	{
+		bResult = ParseMappedEntries(pbData, dwDataSize, rBuffers);
+	}
+	// Mapped file may become unavailable while it's being read.
+	__except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+	{
+		bResult = FALSE;
+	}
+	return bResult;
+}
+
+/**
+ * @param pbData - contents of the log file.
+ * @param dwDataSize - size of the log file.
+ * @param rBuffers - decoding buffers.
+ * @return true if the log has exactly the layout produced by SaveEntries().
+ */
+BOOL CXmlLogFile::ParseMappedEntries(const BYTE* pbData, DWORD dwDataSize, CLoadBuffers& rBuffers)
+{
+	const BYTE* pbEnd = pbData + dwDataSize;
+	const BYTE* pbPosition = pbData;
+	if (dwDataSize >= 3 && pbData[0] == 0xEF && pbData[1] == 0xBB && pbData[2] == 0xBF)
+		pbPosition += 3;
+	pbPosition = MatchXmlTag(pbPosition, pbEnd, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
+	if (pbPosition == NULL)
+		return FALSE;
+	const BYTE* pbNext = MatchXmlTag(pbPosition, pbEnd, "<log/>");
+	if (pbNext == NULL)
+	{
+		pbPosition = MatchXmlTag(pbPosition, pbEnd, "<log>");
+		if (pbPosition == NULL)
+			return FALSE;
+		CPtrLogRecord LogRecord;
+		for (;;)
+		{
+			pbNext = MatchXmlTag(pbPosition, pbEnd, "</log>");
+			if (pbNext != NULL)
+				break;
+			pbPosition = MatchXmlTag(pbPosition, pbEnd, "<entry>");
+			if (pbPosition == NULL)
+				return FALSE;
+			pbPosition = ReadXmlElement(pbPosition, pbEnd, "<level>", "</level>", rBuffers.m_Bytes, rBuffers.m_LogLevel);
+			if (pbPosition == NULL)
+				return FALSE;
+			pbPosition = ReadXmlElement(pbPosition, pbEnd, "<time>", "</time>", rBuffers.m_Bytes, rBuffers.m_TimeStatistics);
+			if (pbPosition == NULL)
+				return FALSE;
+			// enforce constraint: log level and time statistics are required fields
+			if (*rBuffers.m_LogLevel.GetData() == _T('\0') || *rBuffers.m_TimeStatistics.GetData() == _T('\0'))
+				return FALSE;
+			LogRecord.Reset();
+			LogRecord.SetLogLevel(rBuffers.m_LogLevel.GetData());
+			LogRecord.SetTimeStatistics(rBuffers.m_TimeStatistics.GetData());
+			// entry text is optional field
+			pbNext = MatchXmlTag(pbPosition, pbEnd, "<text/>");
+			if (pbNext == NULL)
+			{
+				pbPosition = ReadXmlElement(pbPosition, pbEnd, "<text>", "</text>", rBuffers.m_Bytes, rBuffers.m_EntryText);
+				if (pbPosition == NULL)
+					return FALSE;
+				LogRecord.SetEntryText(rBuffers.m_EntryText.GetData());
+			}
+			else
+				pbPosition = pbNext;
+			pbPosition = MatchXmlTag(pbPosition, pbEnd, "</entry>");
+			if (pbPosition == NULL)
+				return FALSE;
+			if (! AddLoadedEntry(LogRecord))
+				return FALSE;
+		}
+	}
+	while (pbNext < pbEnd && IsSpace(*pbNext))
+		++pbNext;
+	return (pbNext == pbEnd);
+}
+
 /**
  * @param bCrash - true if crash has occurred.
  * @return true if the log was saved successfully.
  */
-BOOL CXmlLogFile::SaveEntries(BOOL /*bCrash*/)
+BOOL CXmlLogFile::SaveEntries(BOOL bCrash)
 {
 #ifdef _DEBUG
 	DWORD dwStartTime = GetTickCount();
 #endif
+	// Log of previous session that wasn't loaded is left intact.
+	if (! FinishDeferredLoad(TRUE, ! bCrash))
+		return FALSE;
+	FlushRepeatedEntry();
 	PCTSTR pszLogFileName = GetLogFileName();
 	CFileStream FileStream(1024);
 	if (! FileStream.Open(pszLogFileName, CREATE_ALWAYS, GENERIC_WRITE))
@@ -191,8 +464,7 @@ BOOL CXmlLogFile::SaveEntries(BOOL /*bCrash*/)
 	CLogEntry* pLogEntry = GetFirstEntry();
 	while (pLogEntry)
 	{
-		CXmlLogEntry* pXmlLogEntry = (CXmlLogEntry*)pLogEntry;
-		PTCHAR pchPointer = pXmlLogEntry->m_pchData;
+		PTCHAR pchPointer = (PTCHAR)pLogEntry->m_pbData;
 		_ASSERTE(pchPointer != NULL);
 		PCTSTR pszLogLevel = pchPointer;
 		pchPointer += _tcslen(pchPointer) + 1;
@@ -220,9 +492,10 @@ BOOL CXmlLogFile::SaveEntries(BOOL /*bCrash*/)
 
 /**
  * @param rLogRecord - reference the log record.
+ * @param eEntryMode - entry mode.
  * @return pointer to the new entry.
  */
-CXmlLogFile::CXmlLogEntry* CXmlLogFile::AllocLogEntry(const CBaseLogRecord& rLogRecord)
+CInMemLogFile::CLogEntry* CXmlLogFile::AllocLogEntry(const CBaseLogRecord& rLogRecord, ENTRY_MODE eEntryMode)
 {
 	PCTSTR pszLogLevel = rLogRecord.GetLogLevel();
 	DWORD dwLogLevelSize = rLogRecord.GetLogLevelLength() + 1;
@@ -231,10 +504,10 @@ CXmlLogFile::CXmlLogEntry* CXmlLogFile::AllocLogEntry(const CBaseLogRecord& rLog
 	PCTSTR pszEntryText = rLogRecord.GetEntryText();
 	DWORD dwEntryTextSize = rLogRecord.GetEntryTextLength() + 1;
 	DWORD dwLogRecordSize = dwLogLevelSize + dwTimeStatisticsSize + dwEntryTextSize + 1;
-	CXmlLogEntry* pLogEntry = (CXmlLogEntry*)new BYTE[sizeof(CXmlLogEntry) + dwLogRecordSize * sizeof(TCHAR)];
+	CLogEntry* pLogEntry = AllocEntry(dwLogRecordSize * sizeof(TCHAR), eEntryMode);
 	if (pLogEntry)
 	{
-		PTCHAR pchPointer = pLogEntry->m_pchData;
+		PTCHAR pchPointer = (PTCHAR)pLogEntry->m_pbData;
 		_ASSERTE(pchPointer != NULL);
 
 		_tcscpy_s(pchPointer, dwLogLevelSize, pszLogLevel);
@@ -261,15 +534,17 @@ CXmlLogFile::CXmlLogEntry* CXmlLogFile::AllocLogEntry(const CBaseLogRecord& rLog
 }
 
 /**
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
 * @param rLogRecord - reference the log record.
  * @return true if entry was added.
  */
-BOOL CXmlLogFile::AddToHead(const CBaseLogRecord& rLogRecord)
+BOOL CXmlLogFile::AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const CBaseLogRecord& rLogRecord)
 {
-	CXmlLogEntry* pLogEntry = AllocLogEntry(rLogRecord);
+	CLogEntry* pLogEntry = AllocLogEntry(rLogRecord, EM_INSERT);
 	if (pLogEntry)
 	{
-		CInMemLogFile::AddToHead(pLogEntry);
+		CInMemLogFile::AddToHead(pLogEntry, eLogLevel, ullTime);
 		return TRUE;
 	}
 	else
@@ -277,56 +552,119 @@ BOOL CXmlLogFile::AddToHead(const CBaseLogRecord& rLogRecord)
 }
 
 /**
+ * @param eLogLevel - log level number.
+ * @param ullTime - entry time.
 * @param rLogRecord - reference the log record.
  * @return true if entry was added.
  */
-BOOL CXmlLogFile::AddToTail(const CBaseLogRecord& rLogRecord)
+BOOL CXmlLogFile::AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const CBaseLogRecord& rLogRecord)
 {
-	CXmlLogEntry* pLogEntry = AllocLogEntry(rLogRecord);
+	CLogEntry* pLogEntry = AllocLogEntry(rLogRecord, EM_APPEND);
 	if (pLogEntry)
 	{
-		CInMemLogFile::AddToTail(pLogEntry);
+		CInMemLogFile::AddToTail(pLogEntry, eLogLevel, ullTime);
 		return TRUE;
 	}
 	else
 		return FALSE;
 }
 
+/**
+ * @param rLogRecord - reference the log record.
+ * @return true if entry was added.
+ */
+BOOL CXmlLogFile::AddLoadedEntry(const CBaseLogRecord& rLogRecord)
+{
+	// Entries that can't be parsed are kept, but they don't match level and time filters.
+	BUGTRAP_LOGLEVEL eLogLevel;
+	if (! CLogCategories::ParseLogLevel(rLogRecord.GetLogLevel(), rLogRecord.GetLogLevelLength(), eLogLevel))
+		eLogLevel = BTLL_NONE;
+	ULONGLONG ullTime;
+	if (! CLogIndex::ParseTimeStamp(rLogRecord.GetTimeStatistics(), rLogRecord.GetTimeStatisticsLength(), ullTime))
+		ullTime = 0;
+	return AddToTail(eLogLevel, ullTime, rLogRecord);
+}
+
+void CXmlLogFile::FlushRepeatedEntry(void)
+{
+	ENTRY_MODE eEntryMode;
+	BUGTRAP_LOGLEVEL eLogLevel;
+	ULONGLONG ullTime;
+	CLogEntry* pLogEntry = GetRepeatedEntry(eEntryMode, eLogLevel, ullTime);
+	if (pLogEntry == NULL)
+	{
+		ResetRepeatedEntry();
+		return;
+	}
+	TCHAR szSummary[96];
+	FormatRepeatSummary(szSummary, countof(szSummary));
+	ResetRepeatedEntry();
+	// Merged entry is copied before it's released.
+	PCTSTR pchPointer = (PCTSTR)pLogEntry->m_pbData;
+	_ASSERTE(pchPointer != NULL);
+	CStrLogRecord LogRecord;
+	LogRecord.SetLogLevel(pchPointer);
+	pchPointer += _tcslen(pchPointer) + 1;
+	LogRecord.SetTimeStatistics(pchPointer);
+	pchPointer += _tcslen(pchPointer) + 1;
+	CStrStream strEntryText(pchPointer);
+	strEntryText << szSummary;
+	LogRecord.SetEntryText(strEntryText);
+	if (eEntryMode == EM_APPEND)
+	{
+		DeleteTail();
+		AddToTail(eLogLevel, ullTime, LogRecord);
+	}
+	else
+	{
+		DeleteHead();
+		AddToHead(eLogLevel, ullTime, LogRecord);
+	}
+}
+
 /**
  * @param eLogLevel - log level number.
  * @param eEntryMode - entry mode.
  * @param rcsConsoleAccess - provides synchronous access to the console.
  * @param pszEntry - log entry text.
+ * @param ullTime - entry time or 0 for the current time.
  * @return true if operation was completed successfully.
  */
-BOOL CXmlLogFile::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry)
+BOOL CXmlLogFile::WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime)
 {
 	BOOL bResult = TRUE;
-	BUGTRAP_LOGLEVEL eLogFileLevel = GetLogLevel();
+	BUGTRAP_LOGLEVEL eLogFileLevel = GetMaxLogLevel();
 	if (eLogLevel <= eLogFileLevel)
 	{
-		SYSTEMTIME st;
-		GetLocalTime(&st);
-		WriteLogEntryToConsole(eLogLevel, &st, rcsConsoleAccess, pszEntry);
+		if (ullTime == 0)
+			ullTime = g_LogClock.GetLocalTime();
+		WriteLogEntryToConsole(eLogLevel, ullTime, rcsConsoleAccess, pszEntry);
+		const BYTE* pbKey = NULL;
+		DWORD dwKeySize = 0;
+		BOOL bCoalesce = IsCoalescingEnabled() && GetCoalescingKey(pszEntry, pbKey, dwKeySize);
+		if (bCoalesce && CoalesceEntry(eLogLevel, eEntryMode, pbKey, dwKeySize, ullTime))
+			return TRUE;
+		FlushRepeatedEntry();
 		PCTSTR pszLogLevelPrefix = GetLogLevelPrefix(eLogLevel);
-		TCHAR szTimeStatistics[32];
-		GetTimeStatistics(&st, szTimeStatistics, countof(szTimeStatistics));
 		CPtrLogRecord LogRecord;
 		LogRecord.SetLogLevel(pszLogLevelPrefix);
-		LogRecord.SetTimeStatistics(szTimeStatistics);
+		LogRecord.SetTimeStatistics(GetTimeStamp(ullTime));
 		LogRecord.SetEntryText(pszEntry);
+		BOOL bAdded = FALSE;
 		switch (eEntryMode)
 		{
 		case EM_APPEND:
-			AddToTail(LogRecord);
+			bAdded = AddToTail(eLogLevel, ullTime, LogRecord);
 			break;
 		case EM_INSERT:
-			AddToHead(LogRecord);
+			bAdded = AddToHead(eLogLevel, ullTime, LogRecord);
 			break;
 		default:
 			_ASSERT(FALSE);
 			bResult = FALSE;
 		}
+		if (bAdded && bCoalesce)
+			SetRepeatedEntry(eLogLevel, eEntryMode, pbKey, dwKeySize, ullTime);
 	}
 	return bResult;
 }
@@ -29,7 +29,7 @@ public:
 	/// Save entries into disk.
 	virtual BOOL SaveEntries(BOOL bCrash);
 	/// Add new log entry.
-	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry);
+	virtual BOOL WriteLogEntry(BUGTRAP_LOGLEVEL eLogLevel, ENTRY_MODE eEntryMode, CRITICAL_SECTION& rcsConsoleAccess, PCTSTR pszEntry, ULONGLONG ullTime = 0);
 
 private:
 	/// Protects the class from being accidentally copied.
@@ -37,16 +37,6 @@ private:
 	/// Protects the class from being accidentally copied.
 	CXmlLogFile& operator=(const CXmlLogFile& rLogFile);
 
-	/// Log entry data.
-	struct CXmlLogEntry : public CInMemLogFile::CLogEntry
-	{
-#pragma warning(push)
-#pragma warning(disable : 4200) // nonstandard extension used : zero-sized array in struct/union
-		/// Data buffer.
-		TCHAR m_pchData[0];
-#pragma warning(pop)
-	};
-
 	/// Base log record.
 	class CBaseLogRecord
 	{
@@ -165,14 +155,43 @@ private:
 		PCTSTR m_pszEntryText;
 	};
 
+	/// Buffers used by fast loader.
+	struct CLoadBuffers
+	{
+		/// Unescaped UTF-8 text.
+		CDynamicBuffer<BYTE> m_Bytes;
+		/// Log level.
+		CDynamicBuffer<TCHAR> m_LogLevel;
+		/// Time statistics.
+		CDynamicBuffer<TCHAR> m_TimeStatistics;
+		/// Log entry text.
+		CDynamicBuffer<TCHAR> m_EntryText;
+	};
+
 	/// Get default log file extension.
 	virtual PCTSTR GetLogFileExtension(void) const;
+	/// Create empty log of the same format.
+	virtual CInMemLogFile* CreateHistoryLog(void) const;
+	/// Get text of entry data for query callback.
+	virtual void GetEntryView(const BYTE* pbData, DWORD dwSize, BUGTRAP_LOGENTRYVIEW& rEntryView);
+	/// Load entries written by SaveEntries() from memory mapped file.
+	BOOL LoadMappedEntries(void);
+	/// Parse mapped file and recover from I/O errors.
+	BOOL SafeParseMappedEntries(const BYTE* pbData, DWORD dwDataSize, CLoadBuffers& rBuffers);
+	/// Parse mapped file without general XML parser.
+	BOOL ParseMappedEntries(const BYTE* pbData, DWORD dwDataSize, CLoadBuffers& rBuffers);
+	/// Load entries using general XML parser.
+	BOOL ReadEntries(void);
 	/// Allocate log entry.
-	CXmlLogEntry* AllocLogEntry(const CBaseLogRecord& rLogRecord);
+	CLogEntry* AllocLogEntry(const CBaseLogRecord& rLogRecord, ENTRY_MODE eEntryMode);
 	/// Add log entry to the head.
-	BOOL AddToHead(const CBaseLogRecord& rLogRecord);
+	BOOL AddToHead(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const CBaseLogRecord& rLogRecord);
 	/// Add log entry to the tail.
-	BOOL AddToTail(const CBaseLogRecord& rLogRecord);
+	BOOL AddToTail(BUGTRAP_LOGLEVEL eLogLevel, ULONGLONG ullTime, const CBaseLogRecord& rLogRecord);
+	/// Add entry loaded from the log file.
+	BOOL AddLoadedEntry(const CBaseLogRecord& rLogRecord);
+	/// Append summary of repeated entries to the merged entry.
+	void FlushRepeatedEntry(void);
 };
 
 inline CXmlLogFile::CXmlLogFile(void) :
@@ -189,3 +208,27 @@ inline PCTSTR CXmlLogFile::GetLogFileExtension(void) const
 {
 	return _T(".xml");
 }
+
+/**
+ * @return pointer to the new log object.
+ */
+inline CInMemLogFile* CXmlLogFile::CreateHistoryLog(void) const
+{
+	return new CXmlLogFile;
+}
+
+/**
+ * @param pbData - entry data.
+ * @param dwSize - size of entry data.
+ * @param rEntryView - view that receives entry text.
+ */
+inline void CXmlLogFile::GetEntryView(const BYTE* pbData, DWORD /*dwSize*/, BUGTRAP_LOGENTRYVIEW& rEntryView)
+{
+	// Entry data keeps level, time and text strings.
+	PCTSTR pchPointer = (PCTSTR)pbData;
+	pchPointer += _tcslen(pchPointer) + 1;
+	pchPointer += _tcslen(pchPointer) + 1;
+	rEntryView.pEntryText = pchPointer;
+	rEntryView.dwEntryTextSize = (DWORD)(_tcslen(pchPointer) * sizeof(TCHAR));
+	rEntryView.bUTF8Text = FALSE;
+}
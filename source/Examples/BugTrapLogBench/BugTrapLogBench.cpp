@@ -0,0 +1,468 @@
+// BugTrapLogBench.cpp : Defines the entry point for the console application.
+//
+
+#include "stdafx.h"
+
+#define DEFAULT_MAX_THREADS  8
+#define DEFAULT_NUM_MESSAGES 20000
+
+enum BENCH_METHOD
+{
+	BM_APPLOGENTRY,
+	BM_APPLOGENTRYF,
+	BM_BTTRACE
+};
+
+static const BUGTRAP_LOGFORMAT g_arrLogFormats[] = { BTLF_XML, BTLF_TEXT, BTLF_STREAM, BTLF_MMAP, BTLF_BINARY };
+static const PCTSTR g_arrLogFormatNames[] = { _T("XML"), _T("TEXT"), _T("STREAM"), _T("MMAP"), _T("BINARY") };
+static const PCTSTR g_arrMethodNames[] = { _T("BT_AppLogEntry"), _T("BT_AppLogEntryF"), _T("BTTrace") };
+static const DWORD g_arrLogSizes[] = { 1000, 10000, 100000 };
+
+typedef LPVOID (WINAPI *PFHEAPALLOC)(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes);
+typedef LPVOID (WINAPI *PFHEAPREALLOC)(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes);
+typedef void* (__cdecl *PFMALLOC)(size_t nSize);
+typedef void* (__cdecl *PFCALLOC)(size_t nCount, size_t nSize);
+typedef void* (__cdecl *PFREALLOC)(void* pMemory, size_t nSize);
+
+BTTrace g_Log;
+INT_PTR g_iLogHandle;
+BENCH_METHOD g_eMethod;
+DWORD g_dwNumMessages = DEFAULT_NUM_MESSAGES;
+LONGLONG* g_pllSamples;
+HANDLE g_hThreadsReadyEvent;
+LARGE_INTEGER g_liFrequency;
+PFHEAPALLOC g_pfnHeapAlloc;
+PFHEAPREALLOC g_pfnHeapReAlloc;
+PFMALLOC g_pfnMalloc;
+PFCALLOC g_pfnCalloc;
+PFREALLOC g_pfnRealloc;
+PFMALLOC g_pfnNew;
+volatile LONG g_nNumAllocations;
+
+static LPVOID WINAPI CountingHeapAlloc(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
+{
+	InterlockedIncrement(&g_nNumAllocations);
+	return g_pfnHeapAlloc(hHeap, dwFlags, dwBytes);
+}
+
+static LPVOID WINAPI CountingHeapReAlloc(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes)
+{
+	InterlockedIncrement(&g_nNumAllocations);
+	return g_pfnHeapReAlloc(hHeap, dwFlags, lpMem, dwBytes);
+}
+
+static void* __cdecl CountingMalloc(size_t nSize)
+{
+	InterlockedIncrement(&g_nNumAllocations);
+	return g_pfnMalloc(nSize);
+}
+
+static void* __cdecl CountingCalloc(size_t nCount, size_t nSize)
+{
+	InterlockedIncrement(&g_nNumAllocations);
+	return g_pfnCalloc(nCount, nSize);
+}
+
+static void* __cdecl CountingRealloc(void* pMemory, size_t nSize)
+{
+	InterlockedIncrement(&g_nNumAllocations);
+	return g_pfnRealloc(pMemory, nSize);
+}
+
+static void* __cdecl CountingNew(size_t nSize)
+{
+	InterlockedIncrement(&g_nNumAllocations);
+	return g_pfnNew(nSize);
+}
+
+// Replace function pointer in the import table of the module.
+static DWORD PatchImport(HMODULE hModule, PVOID pfnOriginal, PVOID pfnReplacement)
+{
+	PIMAGE_DOS_HEADER pDosHeader = (PIMAGE_DOS_HEADER)hModule;
+	PIMAGE_NT_HEADERS pNtHeaders = (PIMAGE_NT_HEADERS)((PBYTE)hModule + pDosHeader->e_lfanew);
+	DWORD dwImportRva = pNtHeaders->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress;
+	if (dwImportRva == 0)
+		return 0;
+	DWORD dwNumPatches = 0;
+	PIMAGE_IMPORT_DESCRIPTOR pImportDesc = (PIMAGE_IMPORT_DESCRIPTOR)((PBYTE)hModule + dwImportRva);
+	for (; pImportDesc->Name != 0; ++pImportDesc)
+	{
+		PIMAGE_THUNK_DATA pThunk = (PIMAGE_THUNK_DATA)((PBYTE)hModule + pImportDesc->FirstThunk);
+		for (; pThunk->u1.Function != 0; ++pThunk)
+		{
+			if ((PVOID)pThunk->u1.Function != pfnOriginal)
+				continue;
+			DWORD dwProtect;
+			if (VirtualProtect(&pThunk->u1.Function, sizeof(pThunk->u1.Function), PAGE_READWRITE, &dwProtect))
+			{
+				pThunk->u1.Function = (ULONG_PTR)pfnReplacement;
+				VirtualProtect(&pThunk->u1.Function, sizeof(pThunk->u1.Function), dwProtect, &dwProtect);
+				++dwNumPatches;
+			}
+		}
+	}
+	return dwNumPatches;
+}
+
+// Check if the module is shared CRT library: msvcrXX.dll, msvcrt.dll or ucrtbase.dll.
+static BOOL IsCrtModule(PCTSTR pszModuleName)
+{
+	return (_tcsnicmp(pszModuleName, _T("msvcr"), 5) == 0 || _tcsnicmp(pszModuleName, _T("ucrtbase"), 8) == 0);
+}
+
+// Patch CRT allocation functions imported by BugTrap module from shared CRT library.
+static DWORD HookCrtAllocations(HMODULE hBugTrapModule, HMODULE hCrtModule)
+{
+	PFMALLOC pfnMalloc = (PFMALLOC)GetProcAddress(hCrtModule, "malloc");
+	PFCALLOC pfnCalloc = (PFCALLOC)GetProcAddress(hCrtModule, "calloc");
+	PFREALLOC pfnRealloc = (PFREALLOC)GetProcAddress(hCrtModule, "realloc");
+#ifdef _WIN64
+	PFMALLOC pfnNew = (PFMALLOC)GetProcAddress(hCrtModule, "??2@YAPEAX_K@Z");
+#else
+	PFMALLOC pfnNew = (PFMALLOC)GetProcAddress(hCrtModule, "??2@YAPAXI@Z");
+#endif
+	DWORD dwNumPatches = 0;
+	// Newer CRT libraries don't export operator new, it calls imported malloc().
+	if (pfnMalloc != NULL && PatchImport(hBugTrapModule, pfnMalloc, CountingMalloc) > 0)
+	{
+		g_pfnMalloc = pfnMalloc;
+		++dwNumPatches;
+	}
+	if (pfnCalloc != NULL && PatchImport(hBugTrapModule, pfnCalloc, CountingCalloc) > 0)
+	{
+		g_pfnCalloc = pfnCalloc;
+		++dwNumPatches;
+	}
+	if (pfnRealloc != NULL && PatchImport(hBugTrapModule, pfnRealloc, CountingRealloc) > 0)
+	{
+		g_pfnRealloc = pfnRealloc;
+		++dwNumPatches;
+	}
+	if (pfnNew != NULL && PatchImport(hBugTrapModule, pfnNew, CountingNew) > 0)
+	{
+		g_pfnNew = pfnNew;
+		++dwNumPatches;
+	}
+	return dwNumPatches;
+}
+
+static void UnhookCrtAllocations(HMODULE hBugTrapModule)
+{
+	if (g_pfnMalloc != NULL)
+		PatchImport(hBugTrapModule, CountingMalloc, g_pfnMalloc);
+	if (g_pfnCalloc != NULL)
+		PatchImport(hBugTrapModule, CountingCalloc, g_pfnCalloc);
+	if (g_pfnRealloc != NULL)
+		PatchImport(hBugTrapModule, CountingRealloc, g_pfnRealloc);
+	if (g_pfnNew != NULL)
+		PatchImport(hBugTrapModule, CountingNew, g_pfnNew);
+}
+
+// Only import table of BugTrap module is patched, so allocations made by the
+// benchmark or by shared CRT on its own behalf are never counted. Static CRT
+// of BugTrap module imports HeapAlloc(), DLL build imports malloc() and friends.
+static BOOL HookAllocations(BOOL bInstall)
+{
+	HMODULE hBugTrapModule;
+	if (! GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+			(PCTSTR)&BT_AppLogEntry, &hBugTrapModule))
+		return FALSE;
+	HMODULE hKernelModule = GetModuleHandle(_T("kernel32.dll"));
+	g_pfnHeapAlloc = (PFHEAPALLOC)GetProcAddress(hKernelModule, "HeapAlloc");
+	g_pfnHeapReAlloc = (PFHEAPREALLOC)GetProcAddress(hKernelModule, "HeapReAlloc");
+	if (g_pfnHeapAlloc == NULL || g_pfnHeapReAlloc == NULL)
+		return FALSE;
+	if (! bInstall)
+	{
+		PatchImport(hBugTrapModule, CountingHeapAlloc, g_pfnHeapAlloc);
+		PatchImport(hBugTrapModule, CountingHeapReAlloc, g_pfnHeapReAlloc);
+		UnhookCrtAllocations(hBugTrapModule);
+		return TRUE;
+	}
+	DWORD dwNumPatches = PatchImport(hBugTrapModule, g_pfnHeapAlloc, CountingHeapAlloc);
+	dwNumPatches += PatchImport(hBugTrapModule, g_pfnHeapReAlloc, CountingHeapReAlloc);
+	HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, GetCurrentProcessId());
+	if (hSnapshot != INVALID_HANDLE_VALUE)
+	{
+		MODULEENTRY32 ModuleEntry;
+		ModuleEntry.dwSize = sizeof(ModuleEntry);
+		for (BOOL bMore = Module32First(hSnapshot, &ModuleEntry); bMore; bMore = Module32Next(hSnapshot, &ModuleEntry))
+		{
+			if (IsCrtModule(ModuleEntry.szModule))
+				dwNumPatches += HookCrtAllocations(hBugTrapModule, ModuleEntry.hModule);
+		}
+		CloseHandle(hSnapshot);
+	}
+	return (dwNumPatches > 0);
+}
+
+static int __cdecl CompareSamples(const void* pSample1, const void* pSample2)
+{
+	LONGLONG llSample1 = *(const LONGLONG*)pSample1;
+	LONGLONG llSample2 = *(const LONGLONG*)pSample2;
+	return (llSample1 < llSample2 ? -1 : llSample1 > llSample2 ? 1 : 0);
+}
+
+// Get sample that corresponds to the percentile multiplied by 10.
+static double GetPercentile(const LONGLONG* pllSortedSamples, DWORD dwNumSamples, DWORD dwPermille)
+{
+	DWORD dwSampleIndex = (DWORD)(((ULONGLONG)(dwNumSamples - 1) * dwPermille) / 1000);
+	return (double)pllSortedSamples[dwSampleIndex] * 1000000.0 / (double)g_liFrequency.QuadPart;
+}
+
+static double GetElapsedTime(const LARGE_INTEGER& liStart, const LARGE_INTEGER& liEnd)
+{
+	return (double)(liEnd.QuadPart - liStart.QuadPart) * 1000.0 / (double)g_liFrequency.QuadPart;
+}
+
+static void GetLogFileName(DWORD dwFormatIndex, PCTSTR pszSuffix, PTSTR pszLogFileName)
+{
+	TCHAR szLogFilePath[MAX_PATH];
+	GetModuleFileName(NULL, szLogFilePath, ARRAYSIZE(szLogFilePath));
+	PathRemoveFileSpec(szLogFilePath);
+	TCHAR szFileName[MAX_PATH];
+	_stprintf_s(szFileName, ARRAYSIZE(szFileName), _T("bench_%s%s.%s"),
+		g_arrLogFormatNames[dwFormatIndex],
+		pszSuffix,
+		g_arrLogFormats[dwFormatIndex] == BTLF_XML ? _T("xml") : _T("log"));
+	PathCombine(pszLogFileName, szLogFilePath, szFileName);
+}
+
+static UINT CALLBACK ThreadFunc(PVOID pParam)
+{
+	DWORD dwThreadIndex = (DWORD)(DWORD_PTR)pParam;
+	LONGLONG* pllSamples = g_pllSamples + dwThreadIndex * g_dwNumMessages;
+
+	WaitForSingleObject(g_hThreadsReadyEvent, INFINITE);
+
+	for (DWORD dwIteration = 0; dwIteration < g_dwNumMessages; ++dwIteration)
+	{
+		LARGE_INTEGER liStart, liEnd;
+		QueryPerformanceCounter(&liStart);
+		switch (g_eMethod)
+		{
+		case BM_APPLOGENTRY:
+			BT_AppLogEntry(g_iLogHandle, BTLL_INFO, _T("Benchmark entry with constant text of typical length"));
+			break;
+		case BM_APPLOGENTRYF:
+			BT_AppLogEntryF(g_iLogHandle, BTLL_INFO, _T("Thread %lu: iteration %lu of %lu"), dwThreadIndex, dwIteration, g_dwNumMessages);
+			break;
+		case BM_BTTRACE:
+			BTTRACE_INFO(g_Log, _T("Thread %lu: iteration %lu of %lu"), dwThreadIndex, dwIteration, g_dwNumMessages);
+			break;
+		}
+		QueryPerformanceCounter(&liEnd);
+		pllSamples[dwIteration] = liEnd.QuadPart - liStart.QuadPart;
+	}
+	return 0;
+}
+
+static BOOL RunThroughputTest(PCTSTR pszLogFormatName, BENCH_METHOD eMethod, DWORD dwNumThreads, BOOL bCountAllocations)
+{
+	g_eMethod = eMethod;
+	g_Log.Clear();
+
+	g_hThreadsReadyEvent = CreateEvent(NULL, TRUE, FALSE, NULL); // non-signaled, manual-reset event
+	HANDLE arrThreads[MAXIMUM_WAIT_OBJECTS];
+	DWORD dwNumStartedThreads = 0;
+	while (dwNumStartedThreads < dwNumThreads)
+	{
+		HANDLE hThread = (HANDLE)_beginthreadex(NULL, 0, ThreadFunc, (PVOID)(DWORD_PTR)dwNumStartedThreads, 0, NULL);
+		if (hThread == NULL)
+			break;
+		arrThreads[dwNumStartedThreads++] = hThread;
+	}
+
+	InterlockedExchange(&g_nNumAllocations, 0);
+	LARGE_INTEGER liStart, liEnd;
+	QueryPerformanceCounter(&liStart);
+	SetEvent(g_hThreadsReadyEvent);
+	WaitForMultipleObjects(dwNumStartedThreads, arrThreads, TRUE, INFINITE);
+	QueryPerformanceCounter(&liEnd);
+	LONG nNumAllocations = InterlockedExchange(&g_nNumAllocations, 0);
+
+	for (DWORD dwThreadIndex = 0; dwThreadIndex < dwNumStartedThreads; ++dwThreadIndex)
+		CloseHandle(arrThreads[dwThreadIndex]);
+	CloseHandle(g_hThreadsReadyEvent);
+	if (dwNumStartedThreads != dwNumThreads)
+	{
+		_tprintf(_T("ERROR: can't start %lu threads.\n"), dwNumThreads);
+		return FALSE;
+	}
+
+	DWORD dwNumSamples = dwNumThreads * g_dwNumMessages;
+	qsort(g_pllSamples, dwNumSamples, sizeof(*g_pllSamples), CompareSamples);
+	double dElapsedTime = GetElapsedTime(liStart, liEnd);
+
+	_tprintf(_T("%-7s %-16s %3lu %12.0f %9.2f %9.2f %9.2f"),
+		pszLogFormatName,
+		g_arrMethodNames[eMethod],
+		dwNumThreads,
+		dElapsedTime > 0 ? dwNumSamples * 1000.0 / dElapsedTime : 0.0,
+		GetPercentile(g_pllSamples, dwNumSamples, 500),
+		GetPercentile(g_pllSamples, dwNumSamples, 990),
+		GetPercentile(g_pllSamples, dwNumSamples, 999));
+	if (bCountAllocations)
+		_tprintf(_T(" %9.2f\n"), (double)nNumAllocations / dwNumSamples);
+	else
+		_tprintf(_T(" %9s\n"), _T("n/a"));
+	return TRUE;
+}
+
+static BOOL TestThroughput(DWORD dwMaxThreads, BOOL bCountAllocations)
+{
+	_tprintf(
+		_T("THROUGHPUT AND LATENCY\n")
+		_T("Latency is measured in microseconds per call\n")
+		_T("\n")
+		_T("%-7s %-16s %3s %12s %9s %9s %9s %9s\n"),
+		_T("Format"), _T("Method"), _T("Thr"), _T("Entries/s"), _T("p50"), _T("p99"), _T("p999"), _T("Allocs"));
+
+	for (DWORD dwFormatIndex = 0; dwFormatIndex < ARRAYSIZE(g_arrLogFormats); ++dwFormatIndex)
+	{
+		TCHAR szLogFileName[MAX_PATH];
+		GetLogFileName(dwFormatIndex, _T(""), szLogFileName);
+		if (! g_Log.Open(szLogFileName, g_arrLogFormats[dwFormatIndex]))
+		{
+			_tprintf(_T("ERROR: can't open or create log file \"%s\".\n"), szLogFileName);
+			return FALSE;
+		}
+		g_Log.SetLogFlags(BTLF_SHOWTIMESTAMP | BTLF_SHOWLOGLEVEL);
+		g_iLogHandle = g_Log.GetHandle();
+
+		for (int nMethod = BM_APPLOGENTRY; nMethod <= BM_BTTRACE; ++nMethod)
+		{
+			for (DWORD dwNumThreads = 1; dwNumThreads <= dwMaxThreads; dwNumThreads *= 2)
+			{
+				if (! RunThroughputTest(g_arrLogFormatNames[dwFormatIndex], (BENCH_METHOD)nMethod, dwNumThreads, bCountAllocations))
+				{
+					g_Log.Close();
+					return FALSE;
+				}
+			}
+		}
+
+		g_Log.Clear();
+		g_Log.Close();
+		DeleteFile(szLogFileName);
+	}
+
+	_tprintf(_T("\n"));
+	return TRUE;
+}
+
+static BOOL RunLoadSaveTest(DWORD dwFormatIndex, DWORD dwNumEntries)
+{
+	BUGTRAP_LOGFORMAT eLogFormat = g_arrLogFormats[dwFormatIndex];
+	TCHAR szLogFileName[MAX_PATH];
+	GetLogFileName(dwFormatIndex, _T("_io"), szLogFileName);
+	DeleteFile(szLogFileName);
+
+	INT_PTR iHandle = BT_OpenLogFile(szLogFileName, eLogFormat);
+	if (iHandle == NULL)
+	{
+		_tprintf(_T("ERROR: can't open or create log file \"%s\".\n"), szLogFileName);
+		return FALSE;
+	}
+	BT_SetLogFlags(iHandle, BTLF_SHOWTIMESTAMP | BTLF_SHOWLOGLEVEL);
+	if (eLogFormat == BTLF_MMAP)
+		BT_SetLogSizeInBytes(iHandle, dwNumEntries * 128);
+	for (DWORD dwEntry = 0; dwEntry < dwNumEntries; ++dwEntry)
+		BT_AppLogEntryF(iHandle, BTLL_INFO, _T("Entry %lu of %lu"), dwEntry, dwNumEntries);
+
+	// SaveEntries() of cached logs writes all entries to the file.
+	LARGE_INTEGER liStart, liEnd;
+	QueryPerformanceCounter(&liStart);
+	BT_FlushLogFile(iHandle);
+	QueryPerformanceCounter(&liEnd);
+	double dSaveTime = GetElapsedTime(liStart, liEnd);
+	BT_CloseLogFile(iHandle);
+
+	WIN32_FILE_ATTRIBUTE_DATA FileData;
+	ULONGLONG ullFileSize = 0;
+	if (GetFileAttributesEx(szLogFileName, GetFileExInfoStandard, &FileData))
+		ullFileSize = ((ULONGLONG)FileData.nFileSizeHigh << 32) | FileData.nFileSizeLow;
+
+	// LoadEntries() parses existing file when the log is opened.
+	QueryPerformanceCounter(&liStart);
+	iHandle = BT_OpenLogFile(szLogFileName, eLogFormat);
+	QueryPerformanceCounter(&liEnd);
+	double dLoadTime = GetElapsedTime(liStart, liEnd);
+	if (iHandle != NULL)
+	{
+		BT_ClearLog(iHandle);
+		BT_CloseLogFile(iHandle);
+	}
+	DeleteFile(szLogFileName);
+
+	_tprintf(_T("%-7s %8lu %12I64u %10.2f %10.2f\n"),
+		g_arrLogFormatNames[dwFormatIndex],
+		dwNumEntries,
+		ullFileSize,
+		dSaveTime,
+		dLoadTime);
+	return TRUE;
+}
+
+static BOOL TestLoadSave(void)
+{
+	_tprintf(
+		_T("LOAD AND SAVE\n")
+		_T("Time is measured in milliseconds\n")
+		_T("\n")
+		_T("%-7s %8s %12s %10s %10s\n"),
+		_T("Format"), _T("Entries"), _T("Bytes"), _T("Save"), _T("Load"));
+
+	for (DWORD dwFormatIndex = 0; dwFormatIndex < ARRAYSIZE(g_arrLogFormats); ++dwFormatIndex)
+	{
+		for (DWORD dwSizeIndex = 0; dwSizeIndex < ARRAYSIZE(g_arrLogSizes); ++dwSizeIndex)
+		{
+			if (! RunLoadSaveTest(dwFormatIndex, g_arrLogSizes[dwSizeIndex]))
+				return FALSE;
+		}
+	}
+
+	_tprintf(_T("\n"));
+	return TRUE;
+}
+
+int _tmain(int argc, TCHAR* argv[])
+{
+	DWORD dwMaxThreads = DEFAULT_MAX_THREADS;
+	if (argc > 1)
+		dwMaxThreads = _tcstoul(argv[1], NULL, 10);
+	if (argc > 2)
+		g_dwNumMessages = _tcstoul(argv[2], NULL, 10);
+	if (dwMaxThreads == 0 || dwMaxThreads > MAXIMUM_WAIT_OBJECTS || g_dwNumMessages == 0)
+	{
+		_tprintf(_T("Usage: BugTrapLogBench [max threads (1-%d)] [messages per thread]\n"), MAXIMUM_WAIT_OBJECTS);
+		return 1;
+	}
+
+	QueryPerformanceFrequency(&g_liFrequency);
+	g_pllSamples = (LONGLONG*)malloc(dwMaxThreads * g_dwNumMessages * sizeof(*g_pllSamples));
+	if (g_pllSamples == NULL)
+	{
+		_tprintf(_T("ERROR: not enough memory for %lu latency samples.\n"), dwMaxThreads * g_dwNumMessages);
+		return 1;
+	}
+
+	_tprintf(
+		_T("LOG BENCHMARK\n")
+		_T("Maximum number of simultaneous threads: %lu\n")
+		_T("Number of messages per thread:          %lu\n")
+		_T("\n"),
+		dwMaxThreads,
+		g_dwNumMessages);
+
+	// Allocations aren't counted if BugTrap imports neither HeapAlloc() nor CRT allocation functions.
+	BOOL bCountAllocations = HookAllocations(TRUE);
+	BOOL bResult = TestThroughput(dwMaxThreads, bCountAllocations);
+	if (bCountAllocations)
+		HookAllocations(FALSE);
+	if (bResult)
+		bResult = TestLoadSave();
+
+	free(g_pllSamples);
+	return (bResult ? 0 : 1);
+}